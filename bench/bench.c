@@ -0,0 +1,408 @@
+/*============================================================================
+
+    bench.c
+
+    Throughput and latency benchmark for the INA219 "class". Each of the
+    ways of getting readings out of the INA219 is run in a tight loop
+    for a fixed time, and the program prints, for each one, the number
+    of readings per second, percentiles of the time taken by each call,
+    and the number of heap allocations per reading.
+
+    By default the benchmark runs on the simulated INA219 (see
+    transport_sim.c), so it can be run on any Linux machine, e.g., as
+    part of a CI build; the -d switch selects any other device
+    specification, including a real /dev/i2c-N. On the simulator, the
+    figures for the register-reading paths are mostly the cost of the
+    library itself; add "latency=US" to the specification to include
+    some bus time. The acquire paths are paced by the simulated
+    conversion time, so they measure how closely the library tracks
+    conversions, rather than how fast it is.
+
+    Finally, the batch conversion kernels in convert.c are timed on a
+    block of raw samples, and their results checked against the scalar
+    reference.
+
+    Heap allocations are counted by wrapping malloc(), calloc() and
+    realloc(), which relies on glibc's __libc_ versions of these
+    functions.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <time.h>
+#include "defs.h"
+#include "ina219.h"
+
+#define DEFAULT_SPEC "sim:current=-500,ripple=20,noise=5"
+#define DEFAULT_ADDR 0x40
+#define DEFAULT_TIME_MS 1000
+#define MAX_CALLS 2000000
+#define CONVERT_SAMPLES 1000000
+
+// Battery settings, as in main.c. They don't affect the timing.
+#define SHUNT_MILLIOHMS 100
+#define BATTERY_VOLTAGE_0_PERCENT 6000
+#define BATTERY_VOLTAGE_100_PERCENT 8260
+#define BATTERY_CAPACITY 2400
+#define MIN_CHARGING_CURRENT 10
+
+// A path is one way of getting a reading. It returns FALSE if the
+//  reading failed.
+typedef BOOL (*BenchFn) (INA219 *ina219);
+
+typedef struct _BenchPath
+  {
+  const char *name;
+  BenchFn fn;
+  BOOL configure; // Run ina219_configure() first, with the mode below
+  INA219Mode mode;
+  } BenchPath;
+
+static _Atomic long allocations;
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *p, size_t size);
+
+/*============================================================================
+
+  malloc, calloc, realloc
+
+============================================================================*/
+void *malloc (size_t size)
+  {
+  atomic_fetch_add_explicit (&allocations, 1, memory_order_relaxed);
+  return __libc_malloc (size);
+  }
+
+void *calloc (size_t n, size_t size)
+  {
+  atomic_fetch_add_explicit (&allocations, 1, memory_order_relaxed);
+  return __libc_calloc (n, size);
+  }
+
+void *realloc (void *p, size_t size)
+  {
+  atomic_fetch_add_explicit (&allocations, 1, memory_order_relaxed);
+  return __libc_realloc (p, size);
+  }
+
+/*============================================================================
+
+  The paths
+
+============================================================================*/
+static BOOL bench_get_status (INA219 *ina219)
+  {
+  INA219ChargeStatus status;
+  int mv, percent, mA, minutes;
+  return ina219_get_status (ina219, &status, &mv, &percent, &mA, &minutes,
+    NULL);
+  }
+
+static BOOL bench_get_raw (INA219 *ina219)
+  {
+  int16_t shunt_reg;
+  uint16_t bus_reg;
+  return ina219_get_raw (ina219, &shunt_reg, &bus_reg, NULL);
+  }
+
+static BOOL bench_get_voltages (INA219 *ina219)
+  {
+  int bus_mv, shunt_mv;
+  return ina219_get_bus_voltage (ina219, &bus_mv, NULL)
+    && ina219_get_shunt_voltage (ina219, &shunt_mv, NULL);
+  }
+
+static BOOL bench_get_current_power (INA219 *ina219)
+  {
+  int mA, mW;
+  return ina219_get_current (ina219, &mA, NULL)
+    && ina219_get_power (ina219, &mW, NULL);
+  }
+
+static BOOL bench_sample (INA219 *ina219)
+  {
+  INA219Sample sample;
+  return ina219_sample (ina219, &sample, NULL);
+  }
+
+static BOOL bench_acquire (INA219 *ina219)
+  {
+  INA219Sample sample;
+  return ina219_acquire (ina219, &sample, NULL);
+  }
+
+static const BenchPath paths[] =
+  {
+  { "get_status", bench_get_status, FALSE, 0 },
+  { "get_raw", bench_get_raw, FALSE, 0 },
+  { "get_bus/shunt_voltage", bench_get_voltages, FALSE, 0 },
+  { "sample", bench_sample, FALSE, 0 },
+  { "get_status (calibrated)", bench_get_status, TRUE,
+      INA219_MODE_SHUNT_BUS_CONTINUOUS },
+  { "get_current/power", bench_get_current_power, TRUE,
+      INA219_MODE_SHUNT_BUS_CONTINUOUS },
+  { "acquire (continuous)", bench_acquire, TRUE,
+      INA219_MODE_SHUNT_BUS_CONTINUOUS },
+  { "acquire (triggered)", bench_acquire, TRUE,
+      INA219_MODE_SHUNT_BUS_TRIGGERED },
+  };
+
+/*============================================================================
+
+  now_ns
+
+============================================================================*/
+static uint64_t now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  compare_u32
+
+============================================================================*/
+static int compare_u32 (const void *a, const void *b)
+  {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+  }
+
+/*============================================================================
+
+  run_path
+
+  Returns FALSE if the INA219 could not be set up for this path.
+
+============================================================================*/
+static BOOL run_path (const BenchPath *path, const char *spec, int addr,
+       int time_ms, uint32_t *latencies)
+  {
+  BOOL ret = FALSE;
+  char *error = NULL;
+  INA219 *ina219 = ina219_create (spec, addr, SHUNT_MILLIOHMS,
+    BATTERY_VOLTAGE_0_PERCENT, BATTERY_VOLTAGE_100_PERCENT,
+    BATTERY_CAPACITY, MIN_CHARGING_CURRENT);
+  if (ina219_init (ina219, &error))
+    {
+    ret = TRUE;
+    if (path->configure)
+      {
+      // The fastest conversions, so the acquire paths finish quickly
+      INA219Config config;
+      ina219_config_default (&config);
+      config.bus_adc = INA219_ADC_9BIT;
+      config.shunt_adc = INA219_ADC_9BIT;
+      config.mode = path->mode;
+      ret = ina219_configure (ina219, &config, &error);
+      }
+    }
+
+  if (ret)
+    {
+    int calls = 0, failures = 0;
+    long allocs_before = atomic_load (&allocations);
+    uint64_t start = now_ns ();
+    uint64_t end = start + time_ms * 1000000ULL;
+    uint64_t t = start;
+    while (t < end && calls < MAX_CALLS)
+      {
+      if (!path->fn (ina219)) failures++;
+      uint64_t t2 = now_ns ();
+      latencies[calls++] = (uint32_t)(t2 - t);
+      t = t2;
+      }
+    long allocs = atomic_load (&allocations) - allocs_before;
+
+    qsort (latencies, calls, sizeof (uint32_t), compare_u32);
+    printf ("%-24s %10.0f %8.2f %8.2f %8.2f %9.2f %7.2f %8d\n",
+      path->name, calls * 1e9 / (t - start),
+      latencies[calls * 50 / 100] / 1000.0,
+      latencies[calls * 90 / 100] / 1000.0,
+      latencies[calls * 99 / 100] / 1000.0,
+      latencies[calls - 1] / 1000.0,
+      (double)allocs / calls, failures);
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", path->name, error);
+    free (error);
+    }
+  ina219_destroy (ina219);
+  return ret;
+  }
+
+/*============================================================================
+
+  time_convert
+
+  Convert the samples repeatedly for time_ms, and return the number of
+  samples converted per second.
+
+============================================================================*/
+static double time_convert (void (*convert) (const INA219Converter *,
+       const int16_t *, const uint16_t *, size_t, const INA219Converted *),
+       const INA219Converter *conv, const int16_t *shunt_regs,
+       const uint16_t *bus_regs, const INA219Converted *out, int time_ms)
+  {
+  uint64_t start = now_ns ();
+  uint64_t end = start + time_ms * 1000000ULL;
+  uint64_t t = start;
+  long samples = 0;
+  while (t < end)
+    {
+    convert (conv, shunt_regs, bus_regs, CONVERT_SAMPLES, out);
+    samples += CONVERT_SAMPLES;
+    t = now_ns ();
+    }
+  return samples * 1e9 / (t - start);
+  }
+
+/*============================================================================
+
+  run_convert
+
+  Returns FALSE if the batch kernel doesn't give the same results as
+  the scalar one.
+
+============================================================================*/
+static BOOL run_convert (int time_ms)
+  {
+  INA219Converter conv;
+  ina219_converter_init (&conv, SHUNT_MILLIOHMS, BATTERY_VOLTAGE_0_PERCENT,
+    BATTERY_VOLTAGE_100_PERCENT, NULL);
+  int16_t *shunt_regs = malloc (CONVERT_SAMPLES * sizeof (int16_t));
+  uint16_t *bus_regs = malloc (CONVERT_SAMPLES * sizeof (uint16_t));
+  int32_t *results[2][5];
+  INA219Converted out[2];
+  for (int k = 0; k < 2; k++)
+    {
+    for (int j = 0; j < 5; j++)
+      results[k][j] = malloc (CONVERT_SAMPLES * sizeof (int32_t));
+    out[k].bus_mv = results[k][0];
+    out[k].shunt_uv = results[k][1];
+    out[k].current_ua = results[k][2];
+    out[k].percent = results[k][3];
+    out[k].power_mw = results[k][4];
+    }
+  // Every shunt value, and bus values covering the whole register
+  uint32_t x = 2463534242U;
+  for (int i = 0; i < CONVERT_SAMPLES; i++)
+    {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    shunt_regs[i] = (int16_t)i;
+    bus_regs[i] = (uint16_t)x;
+    }
+
+  ina219_convert_batch_scalar (&conv, shunt_regs, bus_regs,
+    CONVERT_SAMPLES, &out[0]);
+  ina219_convert_batch (&conv, shunt_regs, bus_regs, CONVERT_SAMPLES,
+    &out[1]);
+  BOOL same = TRUE;
+  for (int j = 0; j < 5; j++)
+    same = same && memcmp (results[0][j], results[1][j],
+      CONVERT_SAMPLES * sizeof (int32_t)) == 0;
+
+  double scalar = time_convert (ina219_convert_batch_scalar, &conv,
+    shunt_regs, bus_regs, &out[0], time_ms);
+  double batch = time_convert (ina219_convert_batch, &conv,
+    shunt_regs, bus_regs, &out[1], time_ms);
+  printf ("\n%-24s %12s %10s\n", "conversion", "samples/s", "ns/sample");
+  printf ("%-24s %12.0f %10.2f\n", "scalar", scalar, 1e9 / scalar);
+  printf ("%-24s %12.0f %10.2f\n", ina219_convert_kernel (), batch,
+    1e9 / batch);
+  printf ("Batch results %s the scalar results\n",
+    same ? "match" : "DO NOT MATCH");
+
+  for (int k = 0; k < 2; k++)
+    for (int j = 0; j < 5; j++)
+      free (results[k][j]);
+  free (shunt_regs);
+  free (bus_regs);
+  return same;
+  }
+
+/*============================================================================
+
+  usage
+
+============================================================================*/
+static void usage (const char *argv0)
+  {
+  printf ("Usage: %s [options]\n", argv0);
+  printf ("  -a, --address=ADDR      I2C address, default 0x%02X\n",
+    DEFAULT_ADDR);
+  printf ("  -d, --device=SPEC       device specification, default\n");
+  printf ("                          %s\n", DEFAULT_SPEC);
+  printf ("  -h, --help              show this message\n");
+  printf ("  -t, --time=MS           time to run each path, default %d\n",
+    DEFAULT_TIME_MS);
+  }
+
+/*============================================================================
+
+  main
+
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  static const struct option long_options[] =
+    {
+    { "address", required_argument, NULL, 'a' },
+    { "device", required_argument, NULL, 'd' },
+    { "help", no_argument, NULL, 'h' },
+    { "time", required_argument, NULL, 't' },
+    { NULL, 0, NULL, 0 }
+    };
+
+  const char *spec = DEFAULT_SPEC;
+  int addr = DEFAULT_ADDR;
+  int time_ms = DEFAULT_TIME_MS;
+  int opt;
+  while ((opt = getopt_long (argc, argv, "a:d:ht:", long_options, NULL))
+           != -1)
+    {
+    switch (opt)
+      {
+      case 'a': addr = (int)strtol (optarg, NULL, 0); break;
+      case 'd': spec = optarg; break;
+      case 'h': usage (argv[0]); return 0;
+      case 't': time_ms = atoi (optarg); break;
+      default: usage (argv[0]); return 1;
+      }
+    }
+  if (time_ms <= 0)
+    {
+    fprintf (stderr, "%s: time must be positive\n", argv[0]);
+    return 1;
+    }
+
+  uint32_t *latencies = malloc (MAX_CALLS * sizeof (uint32_t));
+  printf ("Device %s, address 0x%02X, %d ms per path\n\n", spec, addr,
+    time_ms);
+  printf ("%-24s %10s %8s %8s %8s %9s %7s %8s\n", "path", "calls/s",
+    "p50 us", "p90 us", "p99 us", "max us", "allocs", "failures");
+  BOOL ok = TRUE;
+  for (size_t i = 0; i < sizeof (paths) / sizeof (paths[0]); i++)
+    ok = run_path (&paths[i], spec, addr, time_ms, latencies) && ok;
+  free (latencies);
+  ok = run_convert (time_ms) && ok;
+  return ok ? 0 : 1;
+  }
+
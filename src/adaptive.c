@@ -0,0 +1,419 @@
+/*==========================================================================
+
+    adaptive.c
+
+    Implementation of the "methods" in adaptive.h
+
+    The thread waits in poll() on two descriptors: the timerfd, and an
+    eventfd that _stop() writes to, so that stopping doesn't have to
+    wait for the next deadline, however far off it is.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "defs.h"
+#include "ina219.h"
+#include "ring.h"
+#include "adaptive.h"
+#include "stats.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+// Defaults for adaptive_config_default()
+#define DEFAULT_CURRENT_STEP_MA 20
+#define DEFAULT_STEADY_SAMPLES 5
+
+typedef struct _AdaptiveDevice
+  {
+  INA219 *ina219;
+  SampleRing *ring;
+  int level; // The interval is min_interval_ms << level
+  int steady; // Steady readings since the last change of level
+  BOOL have_last;
+  int last_ua;
+  INA219ChargeStatus last_status;
+  long long deadline; // CLOCK_MONOTONIC, ns
+  _Atomic int interval_ms; // For _get_interval_ms()
+  } AdaptiveDevice;
+
+struct _AdaptiveSampler
+  {
+  AdaptiveConfig config;
+  int max_level;
+  AdaptiveDevice *devices;
+  int ndevices;
+  pthread_t thread;
+  BOOL running;
+  int timer_fd;
+  int stop_fd;
+  long long start_ns; // All deadlines are multiples of an interval from here
+  _Atomic uint64_t samples;
+  _Atomic uint64_t failures;
+  _Atomic uint64_t wakeups;
+  pthread_mutex_t error_mutex;
+  INA219Error last_error;
+  };
+
+/*============================================================================
+
+  adaptive_config_default
+
+============================================================================*/
+void adaptive_config_default (AdaptiveConfig *config, int min_interval_ms,
+       int max_interval_ms)
+  {
+  config->min_interval_ms = min_interval_ms;
+  config->max_interval_ms = max_interval_ms;
+  config->current_step_mA = DEFAULT_CURRENT_STEP_MA;
+  config->steady_samples = DEFAULT_STEADY_SAMPLES;
+  config->slack_ms = min_interval_ms / 4;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_create
+
+============================================================================*/
+AdaptiveSampler *adaptive_sampler_create (const AdaptiveConfig *config)
+  {
+  AdaptiveSampler *self = malloc (sizeof (AdaptiveSampler));
+  memset (self, 0, sizeof (AdaptiveSampler));
+  self->config = *config;
+  if (self->config.min_interval_ms < 1) self->config.min_interval_ms = 1;
+  if (self->config.steady_samples < 1) self->config.steady_samples = 1;
+  if (self->config.slack_ms < 0) self->config.slack_ms = 0;
+  while ((long long)self->config.min_interval_ms << (self->max_level + 1)
+       <= self->config.max_interval_ms && self->max_level < 20)
+    self->max_level++;
+  self->timer_fd = -1;
+  self->stop_fd = -1;
+  pthread_mutex_init (&self->error_mutex, NULL);
+  return self;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_destroy
+
+============================================================================*/
+void adaptive_sampler_destroy (AdaptiveSampler *self)
+  {
+  if (self)
+    {
+    adaptive_sampler_stop (self);
+    pthread_mutex_destroy (&self->error_mutex);
+    free (self->devices);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  adaptive_sampler_add
+
+============================================================================*/
+int adaptive_sampler_add (AdaptiveSampler *self, INA219 *ina219,
+      SampleRing *ring)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->devices = realloc (self->devices,
+    (self->ndevices + 1) * sizeof (AdaptiveDevice));
+  AdaptiveDevice *d = &self->devices[self->ndevices];
+  memset (d, 0, sizeof (AdaptiveDevice));
+  d->ina219 = ina219;
+  d->ring = ring;
+  d->interval_ms = self->config.min_interval_ms;
+  return self->ndevices++;
+  }
+
+/*============================================================================
+
+  adaptive_now_ns
+
+============================================================================*/
+static long long adaptive_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  adaptive_next_deadline
+
+  The first multiple of interval_ns, counted from start_ns, that is
+  after "after".
+
+============================================================================*/
+static long long adaptive_next_deadline (const AdaptiveSampler *self,
+      long long interval_ns, long long after)
+  {
+  return self->start_ns + ((after - self->start_ns) / interval_ns + 1)
+    * interval_ns;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_adapt
+
+  Choose the interval for a device, based on its latest sample.
+
+============================================================================*/
+static void adaptive_sampler_adapt (AdaptiveSampler *self,
+      AdaptiveDevice *d, const INA219Sample *sample)
+  {
+  INA219ChargeStatus charge_status;
+  int mV, percent_charged, battery_current_mA, minutes;
+  ina219_status_from_raw (d->ina219, sample->shunt_reg, sample->bus_reg,
+    &charge_status, &mV, &percent_charged, &battery_current_mA, &minutes);
+  int ua = ina219_current_ua_from_raw (d->ina219, sample->shunt_reg);
+
+  int step_ua = self->config.current_step_mA * 1000;
+  if (d->have_last && (abs (ua - d->last_ua) >= step_ua
+       || charge_status != d->last_status))
+    {
+    d->level = 0;
+    d->steady = 0;
+    }
+  else if (++d->steady >= self->config.steady_samples)
+    {
+    if (d->level < self->max_level) d->level++;
+    d->steady = 0;
+    }
+  d->last_ua = ua;
+  d->last_status = charge_status;
+  d->have_last = TRUE;
+  atomic_store (&d->interval_ms, self->config.min_interval_ms << d->level);
+  }
+
+/*============================================================================
+
+  adaptive_sampler_service
+
+  Read one device that is due, and work out its next deadline.
+
+============================================================================*/
+static void adaptive_sampler_service (AdaptiveSampler *self,
+      AdaptiveDevice *d, long long now)
+  {
+  INA219Sample sample;
+  INA219Error e;
+  INA219ReadResult r = ina219_sample_resilient_e (d->ina219, FALSE, 
+    &sample, &e);
+  if (r == INA219_READ_OK)
+    {
+    sample_ring_write (d->ring, &sample);
+    atomic_fetch_add (&self->samples, 1);
+    adaptive_sampler_adapt (self, d, &sample);
+    }
+  else if (r == INA219_READ_BACKOFF)
+    {
+    // The device is being left alone for now; its deadlines carry on
+    INA219_STATS_MISSED (1);
+    }
+  else
+    {
+    if (r == INA219_READ_GAP) sample_ring_write (d->ring, &sample);
+    // Don't measure a change in current across the gap
+    d->have_last = FALSE;
+    pthread_mutex_lock (&self->error_mutex);
+    self->last_error = e;
+    pthread_mutex_unlock (&self->error_mutex);
+    atomic_fetch_add (&self->failures, 1);
+    }
+
+  long long interval_ns =
+    ((long long)self->config.min_interval_ms << d->level) * NSEC_PER_MSEC;
+  // The deadline may still be (just) in the future, if it was brought
+  //  forward to coalesce with another device
+  long long after = d->deadline > now ? d->deadline : now;
+  long long next = adaptive_next_deadline (self, interval_ns, after);
+  if (now - d->deadline >= interval_ns)
+    {
+    INA219_STATS_MISSED ((now - d->deadline) / interval_ns);
+    }
+  d->deadline = next;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_thread
+
+============================================================================*/
+static void *adaptive_sampler_thread (void *arg)
+  {
+  AdaptiveSampler *self = arg;
+  long long slack_ns = (long long)self->config.slack_ms * NSEC_PER_MSEC;
+  self->start_ns = adaptive_now_ns ();
+  for (int i = 0; i < self->ndevices; i++)
+    self->devices[i].deadline = self->start_ns;
+
+  for (;;)
+    {
+    long long earliest = self->devices[0].deadline;
+    for (int i = 1; i < self->ndevices; i++)
+      if (self->devices[i].deadline < earliest)
+        earliest = self->devices[i].deadline;
+
+    struct itimerspec its;
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = earliest / NSEC_PER_SEC;
+    its.it_value.tv_nsec = earliest % NSEC_PER_SEC;
+    // A zero it_value would disarm the timer
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+      its.it_value.tv_nsec = 1;
+    timerfd_settime (self->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    struct pollfd fds[2];
+    fds[0].fd = self->timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = self->stop_fd;
+    fds[1].events = POLLIN;
+    if (poll (fds, 2, -1) < 0) continue; // EINTR
+    if (fds[1].revents) break;
+    if (!fds[0].revents) continue;
+
+    uint64_t expirations;
+    if (read (self->timer_fd, &expirations, sizeof (expirations)) < 0)
+      continue;
+    atomic_fetch_add (&self->wakeups, 1);
+    long long now = adaptive_now_ns ();
+    INA219_STATS_RECORD (INA219_HIST_LATENESS, now - earliest);
+
+    for (int i = 0; i < self->ndevices; i++)
+      {
+      AdaptiveDevice *d = &self->devices[i];
+      if (d->deadline <= now + slack_ns)
+        adaptive_sampler_service (self, d, now);
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_start
+
+============================================================================*/
+BOOL adaptive_sampler_start (AdaptiveSampler *self, char **error)
+  {
+  assert (self != NULL);
+  if (self->running) return TRUE;
+  if (self->ndevices == 0)
+    {
+    if (error) asprintf (error, "No devices to sample");
+    return FALSE;
+    }
+
+  self->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+  self->stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (self->timer_fd < 0 || self->stop_fd < 0)
+    {
+    if (error) asprintf (error, "Can't create timer: %s", strerror (errno));
+    }
+  else
+    {
+    for (int i = 0; i < self->ndevices; i++)
+      {
+      AdaptiveDevice *d = &self->devices[i];
+      d->level = 0;
+      d->steady = 0;
+      d->have_last = FALSE;
+      d->interval_ms = self->config.min_interval_ms;
+      }
+    int err = pthread_create (&self->thread, NULL, adaptive_sampler_thread,
+      self);
+    if (err == 0)
+      {
+      self->running = TRUE;
+      return TRUE;
+      }
+    if (error) asprintf (error, "Can't start sampling thread: %s",
+      strerror (err));
+    }
+
+  if (self->timer_fd >= 0) close (self->timer_fd);
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->timer_fd = self->stop_fd = -1;
+  return FALSE;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_stop
+
+============================================================================*/
+void adaptive_sampler_stop (AdaptiveSampler *self)
+  {
+  assert (self != NULL);
+  if (!self->running) return;
+  uint64_t one = 1;
+  if (write (self->stop_fd, &one, sizeof (one)) < 0)
+    perror ("eventfd");
+  pthread_join (self->thread, NULL);
+  close (self->timer_fd);
+  close (self->stop_fd);
+  self->timer_fd = self->stop_fd = -1;
+  self->running = FALSE;
+  }
+
+/*============================================================================
+
+  adaptive_sampler_get_counts
+
+============================================================================*/
+void adaptive_sampler_get_counts (const AdaptiveSampler *self,
+       uint64_t *samples, uint64_t *failures, uint64_t *wakeups)
+  {
+  AdaptiveSampler *s = (AdaptiveSampler *)self;
+  if (samples) *samples = atomic_load (&s->samples);
+  if (failures) *failures = atomic_load (&s->failures);
+  if (wakeups) *wakeups = atomic_load (&s->wakeups);
+  }
+
+/*============================================================================
+
+  adaptive_sampler_get_interval_ms
+
+============================================================================*/
+int adaptive_sampler_get_interval_ms (const AdaptiveSampler *self,
+      int device)
+  {
+  assert (device >= 0 && device < self->ndevices);
+  AdaptiveDevice *d = &self->devices[device];
+  return atomic_load (&d->interval_ms);
+  }
+
+/*============================================================================
+
+  adaptive_sampler_get_last_error
+
+============================================================================*/
+BOOL adaptive_sampler_get_last_error (const AdaptiveSampler *self,
+       INA219Error *e)
+  {
+  AdaptiveSampler *s = (AdaptiveSampler *)self;
+  if (atomic_load (&s->failures) == 0) return FALSE;
+  pthread_mutex_lock (&s->error_mutex);
+  *e = s->last_error;
+  pthread_mutex_unlock (&s->error_mutex);
+  return TRUE;
+  }
+
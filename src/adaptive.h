@@ -0,0 +1,109 @@
+/*============================================================================
+
+  adaptive.h
+
+  The AdaptiveSampler "class" is like Sampler (see sampler.h), except
+  that it varies the sampling rate to suit what the battery is doing,
+  and can sample several devices from one thread.
+
+  Each device starts at the fastest rate. After a run of steady
+  readings, its interval doubles, and so on, up to the slowest rate.
+  As soon as the current changes by more than a threshold between two
+  readings, or the charge status (as classified by ina219_status_from_raw())
+  changes, the device goes back to the fastest rate. So an idle battery
+  is looked at only occasionally, but a change of load is followed
+  closely.
+
+  The intervals are always the fastest interval times a power of two,
+  and deadlines fall on multiples of the interval, counted from when
+  the sampler was started. So every deadline of a slow device is also
+  a deadline of any faster one, and the thread wakes only once for all
+  the devices that are due. Deadlines that fall within a small slack
+  of a wake-up are brought forward to it, too.
+
+  The thread sleeps on a timerfd, armed with absolute CLOCK_MONOTONIC
+  deadlines, so the time taken to read the devices does not make the
+  schedule drift.
+
+  The usual call sequence is
+
+    AdaptiveSampler *sampler = adaptive_sampler_create (&config);
+    adaptive_sampler_add (sampler, ina219, ring);
+    ...
+    adaptive_sampler_start (sampler, ...);
+    ... consumers read from the rings ...
+    adaptive_sampler_stop (sampler);
+    adaptive_sampler_destroy (sampler);
+
+  As with Sampler, the INA219s must have been initialized, and must not
+  be used by any other thread while the sampler is running.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+#include "ring.h"
+
+typedef struct _AdaptiveConfig
+  {
+  // Fastest and slowest sampling intervals. The slowest is rounded
+  //  down to the fastest times a power of two
+  int min_interval_ms;
+  int max_interval_ms;
+  // A change in current of at least this much, between two readings,
+  //  goes back to the fastest rate
+  int current_step_mA;
+  // Number of steady readings after which the interval doubles
+  int steady_samples;
+  // Deadlines this close to a wake-up are brought forward to it
+  int slack_ms;
+  } AdaptiveConfig;
+
+struct _AdaptiveSampler;
+typedef struct _AdaptiveSampler AdaptiveSampler;
+
+BEGIN_DECLS
+
+/** Fill in *config with defaults for the given fastest and slowest
+    intervals. */
+void       adaptive_config_default (AdaptiveConfig *config,
+             int min_interval_ms, int max_interval_ms);
+
+/** Create a sampler, with no devices. */
+AdaptiveSampler *adaptive_sampler_create (const AdaptiveConfig *config);
+
+/** Free the sampler, stopping it first if necessary. The devices and
+    rings belong to the caller. */
+void       adaptive_sampler_destroy (AdaptiveSampler *self);
+
+/** Add a device, whose samples will be written to "ring". Devices can
+    only be added while the sampler is stopped. Returns the index of
+    the device. */
+int        adaptive_sampler_add (AdaptiveSampler *self, INA219 *ina219,
+             SampleRing *ring);
+
+/** Start the sampling thread. */
+BOOL       adaptive_sampler_start (AdaptiveSampler *self, char **error);
+
+/** Stop the sampling thread, and wait for it to finish. */
+void       adaptive_sampler_stop (AdaptiveSampler *self);
+
+/** Get the number of samples taken, failed reads, and times the thread
+    woke up, since the sampler was started. Any argument may be NULL. */
+void       adaptive_sampler_get_counts (const AdaptiveSampler *self,
+             uint64_t *samples, uint64_t *failures, uint64_t *wakeups);
+
+/** Get the current sampling interval of a device, in milliseconds. */
+int        adaptive_sampler_get_interval_ms (const AdaptiveSampler *self,
+             int device);
+
+/** Get the details of the most recent failed read. Returns FALSE if no
+    read has failed. */
+BOOL       adaptive_sampler_get_last_error (const AdaptiveSampler *self,
+             INA219Error *e);
+
+END_DECLS
+
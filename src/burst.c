@@ -0,0 +1,421 @@
+/*==========================================================================
+
+    burst.c
+
+    Implementation of the "methods" in burst.h
+
+    The arena holds pretrigger + samples readings, and is written as a
+    ring from the start. Before the trigger it just keeps going round;
+    after the trigger, the thread takes "samples" more readings (counting
+    the one that triggered), so the arena ends up holding those, and as
+    many earlier ones as fit. Nothing is moved until the capture is over,
+    when _get() works out where each reading is.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "ina219.h"
+#include "burst.h"
+
+// Waits longer than this are slept, less the same again, and the rest
+//  is spun, because a sleep can overshoot by tens of microseconds
+#define SPIN_NS 200000ULL
+
+struct _BurstCapture
+  {
+  BurstConfig config;
+  BurstSample *arena;
+  size_t arena_bytes;
+  int size; // In readings
+  BOOL locked;
+  BOOL realtime;
+  _Atomic BOOL abort;
+  // Set up by _run() for the thread
+  INA219 *ina219;
+  uint64_t period_ns;
+  // Results of the capture
+  uint64_t taken; // Total readings, including those overwritten
+  uint64_t trigger_taken; // Readings taken before the trigger
+  BOOL triggered;
+  BOOL timed_out;
+  BOOL failed;
+  INA219Error error;
+  };
+
+/*============================================================================
+
+  burst_now_ns
+
+============================================================================*/
+static uint64_t burst_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  burst_config_default
+
+============================================================================*/
+void burst_config_default (BurstConfig *config, int samples)
+  {
+  memset (config, 0, sizeof (BurstConfig));
+  config->samples = samples;
+  config->trigger = BURST_TRIGGER_NONE;
+  config->adc = INA219_ADC_9BIT;
+  config->pga = INA219_PGA_320MV;
+  }
+
+/*============================================================================
+
+  burst_capture_create
+
+============================================================================*/
+BurstCapture *burst_capture_create (const BurstConfig *config,
+                char **error)
+  {
+  if (config->samples < 1 || config->pretrigger < 0)
+    {
+    if (error) asprintf (error, "Bad number of samples for a burst");
+    return NULL;
+    }
+  int size = config->samples
+    + (config->trigger == BURST_TRIGGER_NONE ? 0 : config->pretrigger);
+  size_t bytes = (size_t)size * sizeof (BurstSample);
+  // MAP_POPULATE faults the pages in now, rather than during the burst
+  void *arena = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (arena == MAP_FAILED)
+    {
+    if (error) asprintf (error, "Can't allocate %zu bytes for a burst: %s",
+      bytes, strerror (errno));
+    return NULL;
+    }
+
+  BurstCapture *self = malloc (sizeof (BurstCapture));
+  memset (self, 0, sizeof (BurstCapture));
+  self->config = *config;
+  self->arena = arena;
+  self->arena_bytes = bytes;
+  self->size = size;
+  self->locked = (mlock (arena, bytes) == 0);
+  return self;
+  }
+
+/*============================================================================
+
+  burst_capture_destroy
+
+============================================================================*/
+void burst_capture_destroy (BurstCapture *self)
+  {
+  if (self)
+    {
+    if (self->locked) munlock (self->arena, self->arena_bytes);
+    munmap (self->arena, self->arena_bytes);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  burst_capture_abort
+
+============================================================================*/
+void burst_capture_abort (BurstCapture *self)
+  {
+  atomic_store (&self->abort, TRUE);
+  }
+
+/*============================================================================
+
+  burst_is_trigger
+
+============================================================================*/
+static BOOL burst_is_trigger (const BurstConfig *config, int last_ua,
+      int ua)
+  {
+  if (config->trigger == BURST_TRIGGER_RISING)
+    return last_ua < config->trigger_ua && ua >= config->trigger_ua;
+  return last_ua > config->trigger_ua && ua <= config->trigger_ua;
+  }
+
+/*============================================================================
+
+  burst_thread
+
+  The capture loop. Nothing in here allocates, or does I/O other than
+  the register reads.
+
+============================================================================*/
+static void *burst_thread (void *arg)
+  {
+  BurstCapture *self = arg;
+  const BurstConfig *config = &self->config;
+  BOOL waiting = (config->trigger != BURST_TRIGGER_NONE);
+  int remaining = config->samples;
+  BOOL have_last = FALSE;
+  int last_ua = 0;
+  int pos = 0;
+  uint64_t next = burst_now_ns ();
+  uint64_t give_up = config->timeout_ms > 0 ?
+    next + (uint64_t)config->timeout_ms * 1000000ULL : 0;
+
+  while (!atomic_load_explicit (&self->abort, memory_order_relaxed))
+    {
+    uint64_t now = burst_now_ns ();
+    if (now < next)
+      {
+      if (next - now > SPIN_NS)
+        {
+        struct timespec ts;
+        uint64_t wake = next - SPIN_NS;
+        ts.tv_sec = wake / 1000000000ULL;
+        ts.tv_nsec = wake % 1000000000ULL;
+        clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+      continue;
+      }
+
+    int16_t shunt_reg;
+    if (!ina219_get_shunt_raw_e (self->ina219, &shunt_reg, &self->error))
+      {
+      self->failed = TRUE;
+      break;
+      }
+    BurstSample *s = &self->arena[pos];
+    s->time_ns = now;
+    s->shunt_reg = shunt_reg;
+    if (++pos == self->size) pos = 0;
+    self->taken++;
+
+    if (waiting)
+      {
+      int ua = ina219_current_ua_from_raw (self->ina219, shunt_reg);
+      if (have_last && burst_is_trigger (config, last_ua, ua))
+        {
+        waiting = FALSE;
+        self->triggered = TRUE;
+        self->trigger_taken = self->taken - 1;
+        }
+      else if (give_up && now >= give_up)
+        {
+        self->timed_out = TRUE;
+        break;
+        }
+      last_ua = ua;
+      have_last = TRUE;
+      }
+    if (!waiting && --remaining == 0) break;
+
+    // If a read took longer than a conversion, go straight on to the
+    //  next one, rather than trying to catch up
+    next += self->period_ns;
+    if (next < now) next = now;
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  burst_capture_start_thread
+
+  Start the capture thread with SCHED_FIFO if we can, or normally if
+  we're not allowed to.
+
+============================================================================*/
+static int burst_capture_start_thread (BurstCapture *self, pthread_t *thread)
+  {
+  self->realtime = FALSE;
+  if (self->config.priority > 0)
+    {
+    pthread_attr_t attr;
+    struct sched_param param;
+    memset (&param, 0, sizeof (param));
+    param.sched_priority = self->config.priority;
+    pthread_attr_init (&attr);
+    pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+    pthread_attr_setschedparam (&attr, &param);
+    int err = pthread_create (thread, &attr, burst_thread, self);
+    pthread_attr_destroy (&attr);
+    if (err == 0)
+      {
+      self->realtime = TRUE;
+      return 0;
+      }
+    if (err != EPERM && err != EINVAL) return err;
+    }
+  return pthread_create (thread, NULL, burst_thread, self);
+  }
+
+/*============================================================================
+
+  burst_capture_run
+
+============================================================================*/
+BOOL burst_capture_run (BurstCapture *self, INA219 *ina219, char **error)
+  {
+  assert (self != NULL);
+  INA219Config saved, config;
+  // If the chip hasn't been configured, this is its power-on
+  //  configuration, which is what it has to go back to
+  ina219_get_config (ina219, &saved);
+  config = saved;
+  config.mode = INA219_MODE_SHUNT_CONTINUOUS;
+  config.shunt_adc = self->config.adc;
+  config.pga = self->config.pga;
+
+  char message[256];
+  INA219Error e;
+  if (!ina219_configure_e (ina219, &config, &e))
+    {
+    ina219_error_format (&e, message, sizeof (message));
+    if (error) asprintf (error, "%s", message);
+    return FALSE;
+    }
+
+  self->ina219 = ina219;
+  self->period_ns = (uint64_t)ina219_get_conversion_time_us (ina219) * 1000;
+  self->taken = 0;
+  self->trigger_taken = 0;
+  self->triggered = (self->config.trigger == BURST_TRIGGER_NONE);
+  self->timed_out = FALSE;
+  self->failed = FALSE;
+  atomic_store (&self->abort, FALSE);
+
+  BOOL ret = FALSE;
+  pthread_t thread;
+  int err = burst_capture_start_thread (self, &thread);
+  if (err == 0)
+    {
+    pthread_join (thread, NULL);
+    if (self->failed)
+      {
+      ina219_error_format (&self->error, message, sizeof (message));
+      if (error) asprintf (error, "%s", message);
+      }
+    else if (self->timed_out)
+      {
+      if (error) asprintf (error, "Timed out waiting for the trigger");
+      }
+    else
+      ret = TRUE;
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't start capture thread: %s",
+      strerror (err));
+    }
+
+  if (!ina219_configure_e (ina219, &saved, &e) && ret)
+    {
+    ina219_error_format (&e, message, sizeof (message));
+    if (error) asprintf (error, "Can't restore settings: %s", message);
+    ret = FALSE;
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  burst_capture_get_count
+
+============================================================================*/
+int burst_capture_get_count (const BurstCapture *self)
+  {
+  return self->taken < (uint64_t)self->size ? (int)self->taken : self->size;
+  }
+
+/*============================================================================
+
+  burst_capture_get
+
+============================================================================*/
+const BurstSample *burst_capture_get (const BurstCapture *self, int i)
+  {
+  assert (i >= 0 && i < burst_capture_get_count (self));
+  // Once the arena has wrapped, the oldest reading is the one that
+  //  would have been overwritten next
+  int oldest = self->taken <= (uint64_t)self->size ? 0 :
+    (int)(self->taken % self->size);
+  return &self->arena[(oldest + i) % self->size];
+  }
+
+/*============================================================================
+
+  burst_capture_get_trigger
+
+============================================================================*/
+int burst_capture_get_trigger (const BurstCapture *self)
+  {
+  if (!self->triggered || self->taken == 0) return -1;
+  uint64_t dropped = self->taken - burst_capture_get_count (self);
+  return (int)(self->trigger_taken - dropped);
+  }
+
+/*============================================================================
+
+  burst_capture_is_locked
+
+============================================================================*/
+BOOL burst_capture_is_locked (const BurstCapture *self)
+  {
+  return self->locked;
+  }
+
+/*============================================================================
+
+  burst_capture_is_realtime
+
+============================================================================*/
+BOOL burst_capture_is_realtime (const BurstCapture *self)
+  {
+  return self->realtime;
+  }
+
+/*============================================================================
+
+  burst_capture_write_csv
+
+============================================================================*/
+BOOL burst_capture_write_csv (const BurstCapture *self,
+       const INA219 *ina219, FILE *f, char **error)
+  {
+  int n = burst_capture_get_count (self);
+  int trigger = burst_capture_get_trigger (self);
+  uint64_t zero = 0;
+  if (n > 0) zero = burst_capture_get (self, trigger >= 0 ? trigger : 0)
+    ->time_ns;
+  fprintf (f, "time_us,shunt_reg,current_ua\n");
+  for (int i = 0; i < n; i++)
+    {
+    const BurstSample *s = burst_capture_get (self, i);
+    fprintf (f, "%.3f,%d,%d\n",
+      ((int64_t)(s->time_ns - zero)) / 1000.0, s->shunt_reg,
+      ina219_current_ua_from_raw (ina219, s->shunt_reg));
+    }
+  if (fflush (f) != 0 || ferror (f))
+    {
+    if (error) asprintf (error, "Can't write burst: %s", strerror (errno));
+    return FALSE;
+    }
+  return TRUE;
+  }
+
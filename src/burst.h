@@ -0,0 +1,132 @@
+/*============================================================================
+
+  burst.h
+
+  The BurstCapture "class" takes a burst of shunt readings as fast as
+  the INA219 can convert them -- one every 84us at 9-bit resolution --
+  for looking at inrush currents and brown-outs, which are over long
+  before a normal sampler would notice them.
+
+  For the burst, the chip is set to convert the shunt voltage alone,
+  continuously, at the resolution given in the BurstConfig (normally
+  9 bits), and each reading is a single register read. The readings
+  go into an arena that is allocated and locked into memory when the
+  capture is created, so that the capture thread doesn't allocate,
+  take page faults, or do any I/O other than the bus transactions.
+  The thread runs with SCHED_FIFO priority, if the process is allowed
+  to have it, and waits for each conversion by spinning on the clock,
+  since sleeping for less than a conversion time is not reliable.
+
+  A capture can start at once, or wait for the current to cross a
+  trigger level. While it waits, readings go round the arena as a
+  ring, so when the trigger comes the readings just before it are
+  kept, as well as those after it.
+
+  When the capture is finished, the chip is put back to its previous
+  settings (note that this always programs the calibration register,
+  as ina219_configure() does).
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "ina219.h"
+
+typedef enum _BurstTrigger
+  {
+  // Start capturing at once
+  BURST_TRIGGER_NONE = 0,
+  // Start when the current rises to the trigger level or above
+  BURST_TRIGGER_RISING,
+  // Start when the current falls to the trigger level or below
+  BURST_TRIGGER_FALLING
+  } BurstTrigger;
+
+typedef struct _BurstConfig
+  {
+  // Number of readings to take from the trigger on
+  int samples;
+  // Number of readings to keep from before the trigger
+  int pretrigger;
+  BurstTrigger trigger;
+  // The current at which to trigger, in uA. Positive is charging
+  int trigger_ua;
+  // Give up waiting for the trigger after this long; 0 to wait until
+  //  _abort() is called
+  int timeout_ms;
+  // ADC resolution for the shunt readings, and PGA range
+  INA219Adc adc;
+  INA219Pga pga;
+  // SCHED_FIFO priority for the capture thread, or 0 to leave it at
+  //  the normal priority
+  int priority;
+  } BurstConfig;
+
+// One reading: the time, in nanoseconds from CLOCK_MONOTONIC, and the
+//  raw shunt register
+typedef struct _BurstSample
+  {
+  uint64_t time_ns;
+  int16_t shunt_reg;
+  } BurstSample;
+
+struct _BurstCapture;
+typedef struct _BurstCapture BurstCapture;
+
+BEGIN_DECLS
+
+/** Fill in *config with defaults: an untriggered burst of the given
+    number of readings, at 9-bit resolution and the widest PGA range. */
+void          burst_config_default (BurstConfig *config, int samples);
+
+/** Create a capture, allocating its arena. If the arena can't be
+    locked into memory (because of RLIMIT_MEMLOCK, usually), the
+    capture still works, but may be interrupted by page faults;
+    _is_locked() says which. */
+BurstCapture *burst_capture_create (const BurstConfig *config,
+                char **error);
+
+/** Free the capture and its arena. */
+void          burst_capture_destroy (BurstCapture *self);
+
+/** Configure the chip, take the burst in a new thread, and restore
+    the chip's settings -- its power-on settings, if it hadn't been
+    configured. Blocks until the burst is complete, has timed out
+    or been aborted, or a read fails. Returns FALSE on failure, or if
+    the trigger timed out; readings taken up to that point can still
+    be fetched. The INA219 must be initialized, and must not be used
+    by any other thread while this runs. */
+BOOL          burst_capture_run (BurstCapture *self, INA219 *ina219,
+                char **error);
+
+/** Stop a running capture. This is safe to call from a signal
+    handler. */
+void          burst_capture_abort (BurstCapture *self);
+
+/** Get the number of readings held, in time order. */
+int           burst_capture_get_count (const BurstCapture *self);
+
+/** Get a reading, 0 being the oldest. */
+const BurstSample *burst_capture_get (const BurstCapture *self, int i);
+
+/** Get the index of the reading that triggered the capture, or -1 if
+    the trigger never came. */
+int           burst_capture_get_trigger (const BurstCapture *self);
+
+/** TRUE if the arena was locked into memory. */
+BOOL          burst_capture_is_locked (const BurstCapture *self);
+
+/** TRUE if the capture thread got SCHED_FIFO priority. */
+BOOL          burst_capture_is_realtime (const BurstCapture *self);
+
+/** Write the readings as CSV: time in microseconds from the trigger
+    (or the first reading), the raw shunt register, and the current in
+    uA, worked out using the INA219's shunt resistance. */
+BOOL          burst_capture_write_csv (const BurstCapture *self,
+                const INA219 *ina219, FILE *f, char **error);
+
+END_DECLS
+
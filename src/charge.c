@@ -0,0 +1,286 @@
+/*==========================================================================
+
+    charge.c
+
+    Implementation of the "methods" in charge.h
+
+    Charge is held in microcoulombs (uA-seconds), as a 64-bit fixed-point
+    number with 16 fractional bits. That gives a range of over 30,000
+    amp-hours, and a resolution far finer than any single sample can
+    contribute, so rounding errors don't build up however often we
+    sample. The current is integrated using the trapezium rule, that is,
+    by assuming that it changed linearly between samples.
+
+    The smoothed current is an exponential moving average whose weight
+    depends on the time since the last sample, so the time constant is
+    the same whatever the sampling rate. The weight is worked out in
+    microseconds, and the remainder of each division is carried over
+    to the next sample, so that at sub-millisecond intervals, where
+    each step is a tiny fraction of the difference, the steps still
+    add up.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include "defs.h"
+#include "ina219.h"
+#include "charge.h"
+
+// Number of fractional bits in the charge accumulator
+#define CHARGE_FRAC_BITS 16
+#define CHARGE_ONE ((int64_t)1 << CHARGE_FRAC_BITS)
+
+// Number of fractional bits in the smoothed current
+#define CURRENT_FRAC_BITS 8
+
+// Microcoulombs in one mA-hour
+#define UC_PER_MAH 3600000LL
+
+// If two samples are further apart than this, we don't try to
+//  integrate across the gap -- we have no idea what happened in it
+#define MAX_GAP_NS (300LL * 1000000000LL)
+
+// Smoothed currents smaller than this (in uA) don't give meaningful
+//  times to full or empty
+#define MIN_TIME_CURRENT_UA 1000
+
+// Header line in the saved state file
+#define STATE_MAGIC "ina219-charge 1"
+
+struct _ChargeCounter
+  {
+  int64_t capacity; // Fixed-point uC
+  int64_t charge; // Fixed-point uC
+  int64_t smoothed_ua; // Fixed-point uA, CURRENT_FRAC_BITS
+  int64_t smoothing_us;
+  int64_t smoothing_rem; // Remainder of the last smoothing step
+  int64_t smoothing_div; // ... and the divisor it was left by
+  int full_percent; // Voltage-based charge that counts as full
+  BOOL seeded; // TRUE once we have a starting value for charge
+  BOOL have_last; // TRUE once there's a previous sample to integrate from
+  BOOL have_smoothed; // TRUE once smoothed_ua has a starting value
+  uint64_t last_time_ns;
+  int last_ua;
+  };
+
+/*============================================================================
+
+  charge_counter_create
+
+============================================================================*/
+ChargeCounter *charge_counter_create (int battery_capacity, 
+                 int full_percent, int smoothing_s)
+  {
+  ChargeCounter *self = malloc (sizeof (ChargeCounter));
+  memset (self, 0, sizeof (ChargeCounter));
+  self->capacity = battery_capacity * UC_PER_MAH * CHARGE_ONE;
+  self->smoothing_us = (smoothing_s > 0 ? smoothing_s : 1) * 1000000LL;
+  self->full_percent = full_percent;
+  return self;
+  }
+
+/*============================================================================
+
+  charge_counter_destroy
+
+============================================================================*/
+void charge_counter_destroy (ChargeCounter *self)
+  {
+  if (self) free (self);
+  }
+
+/*============================================================================
+
+  charge_counter_update
+
+============================================================================*/
+void charge_counter_update (ChargeCounter *self, uint64_t time_ns,
+       int current_ua, int voltage_percent)
+  {
+  assert (self != NULL);
+  if (!self->seeded)
+    {
+    self->charge = self->capacity / 100 * voltage_percent;
+    self->seeded = TRUE;
+    }
+
+  if (!self->have_smoothed)
+    {
+    self->smoothed_ua = (int64_t)current_ua * (1 << CURRENT_FRAC_BITS);
+    self->have_smoothed = TRUE;
+    }
+
+  if (self->have_last && time_ns > self->last_time_ns)
+    {
+    int64_t dt_ns = time_ns - self->last_time_ns;
+    if (dt_ns <= MAX_GAP_NS)
+      {
+      // Trapezium rule. The product is in uA-microseconds, that is
+      //  picocoulombs, and can't overflow for any sane current and
+      //  gap. It's split into whole and fractional microcoulombs
+      //  before scaling, so the fixed-point conversion can't overflow
+      //  either.
+      int64_t dt_us = dt_ns / 1000;
+      int64_t pc = ((int64_t)self->last_ua + current_ua) * dt_us / 2;
+      self->charge += (pc / 1000000) * CHARGE_ONE
+        + (pc % 1000000) * CHARGE_ONE / 1000000;
+
+      // The weight is dt / (smoothing + dt). The difference is divided
+      //  before it is multiplied, and only the part left over is 
+      //  multiplied first, so nothing can overflow, however small the
+      //  shunt or long the gap. If the divisor has changed since the 
+      //  last step, the carried remainder is scaled to the new one
+      int64_t target = (int64_t)current_ua * (1 << CURRENT_FRAC_BITS);
+      int64_t diff = target - self->smoothed_ua;
+      int64_t div = self->smoothing_us + dt_us;
+      int64_t rem = self->smoothing_rem;
+      if (self->smoothing_div && self->smoothing_div != div)
+        rem = rem * div / self->smoothing_div;
+      int64_t part = diff % div * dt_us + rem;
+      self->smoothed_ua += diff / div * dt_us + part / div;
+      self->smoothing_rem = part % div;
+      self->smoothing_div = div;
+      }
+    }
+  self->last_time_ns = time_ns;
+  self->last_ua = current_ua;
+  self->have_last = TRUE;
+
+  // Re-anchor at the ends of the range, where the voltage is a
+  //  reliable guide to charge
+  if (voltage_percent >= self->full_percent && current_ua >= 0)
+    self->charge = self->capacity;
+  else if (voltage_percent <= 0 && current_ua <= 0)
+    self->charge = 0;
+
+  if (self->charge > self->capacity) self->charge = self->capacity;
+  if (self->charge < 0) self->charge = 0;
+  }
+
+/*============================================================================
+
+  charge_counter_get
+
+============================================================================*/
+void charge_counter_get (const ChargeCounter *self, int *percent_charged,
+       int *minutes, int *smoothed_mA)
+  {
+  assert (self != NULL);
+  int64_t ua = self->smoothed_ua / (1 << CURRENT_FRAC_BITS);
+  if (percent_charged)
+    *percent_charged = self->capacity > 0 ?
+      (int)(self->charge / (self->capacity / 100)) : 0;
+  if (smoothed_mA) *smoothed_mA = (int)(ua / 1000);
+  if (minutes)
+    {
+    // Charge in whole uC divided by current in uA gives seconds
+    if (ua >= MIN_TIME_CURRENT_UA)
+      *minutes = (int)((self->capacity - self->charge)
+        / CHARGE_ONE / ua / 60);
+    else if (ua <= -MIN_TIME_CURRENT_UA)
+      *minutes = (int)(self->charge / CHARGE_ONE / -ua / 60);
+    else
+      *minutes = -1;
+    }
+  }
+
+/*============================================================================
+
+  charge_counter_get_mah
+
+============================================================================*/
+int charge_counter_get_mah (const ChargeCounter *self)
+  {
+  return (int)(self->charge / CHARGE_ONE / UC_PER_MAH);
+  }
+
+/*============================================================================
+
+  charge_counter_save
+
+  Write the state to a temporary file, then rename it over the real
+  one, so a crash part-way through can't leave a truncated state.
+
+============================================================================*/
+BOOL charge_counter_save (const ChargeCounter *self, const char *filename,
+       char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  char *tmp = NULL;
+  asprintf (&tmp, "%s.tmp", filename);
+  FILE *f = fopen (tmp, "w");
+  if (f)
+    {
+    fprintf (f, "%s\n%lld\n%lld\n", STATE_MAGIC, (long long)self->charge,
+      (long long)self->smoothed_ua);
+    BOOL ok = (fflush (f) == 0 && fsync (fileno (f)) == 0);
+    fclose (f);
+    if (ok && rename (tmp, filename) == 0)
+      ret = TRUE;
+    else
+      {
+      if (error) asprintf (error, "Can't write %s: %s", filename,
+        strerror (errno));
+      unlink (tmp);
+      }
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't write %s: %s", tmp, strerror (errno));
+    }
+  free (tmp);
+  return ret;
+  }
+
+/*============================================================================
+
+  charge_counter_load
+
+============================================================================*/
+BOOL charge_counter_load (ChargeCounter *self, const char *filename,
+       char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  FILE *f = fopen (filename, "r");
+  if (f)
+    {
+    char magic[32];
+    long long charge, smoothed_ua;
+    if (fgets (magic, sizeof (magic), f)
+         && strncmp (magic, STATE_MAGIC, strlen (STATE_MAGIC)) == 0
+         && fscanf (f, "%lld %lld", &charge, &smoothed_ua) == 2)
+      {
+      self->charge = charge;
+      if (self->charge > self->capacity) self->charge = self->capacity;
+      if (self->charge < 0) self->charge = 0;
+      self->smoothed_ua = smoothed_ua;
+      self->have_smoothed = TRUE;
+      self->seeded = TRUE;
+      // Don't integrate from whatever sample came before the load
+      self->have_last = FALSE;
+      ret = TRUE;
+      }
+    else
+      {
+      if (error) asprintf (error, "%s is not a charge state file", filename);
+      }
+    fclose (f);
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    }
+  return ret;
+  }
+
@@ -0,0 +1,77 @@
+/*============================================================================
+
+  charge.h
+
+  The ChargeCounter "class" estimates the state of charge of a battery
+  by "coulomb counting" -- that is, by integrating the current over
+  time -- rather than from the battery voltage. Voltage is a poor guide
+  to charge for most battery chemistries, and an instantaneous current
+  reading is a poor guide to the time remaining. The counter keeps a
+  running total of charge, and an exponentially smoothed current, and
+  works out the percentage charge and time to full or empty from those.
+
+  Integration drifts, however carefully it is done, so the counter is
+  re-anchored to the voltage-based estimate, but only at the two points
+  where that estimate is trustworthy: when the battery is fully charged,
+  and when it is empty.
+
+  Each call to _update() takes constant time, and the state is small
+  enough to be saved to a file, so that a restart doesn't lose it.
+
+  All times are in nanoseconds from CLOCK_MONOTONIC, as in INA219Sample.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+struct _ChargeCounter;
+typedef struct _ChargeCounter ChargeCounter;
+
+BEGIN_DECLS
+
+/** Create a counter for a battery with the given capacity in mA-hours.
+    full_percent is the voltage-based charge at or above which the 
+    battery is taken to be full -- the full_percent of the battery's
+    INA219Battery. smoothing_s is the time constant, in seconds, of the
+    current smoothing filter. */
+ChargeCounter *charge_counter_create (int battery_capacity,
+                 int full_percent, int smoothing_s);
+
+/** Free the counter. */
+void           charge_counter_destroy (ChargeCounter *self);
+
+/** Add a reading of current (in uA, +ve for charging) taken at
+    time_ns. voltage_percent is the voltage-based charge estimate for
+    the same moment, as worked out by ina219_status_from_raw(); it is
+    used to seed the counter on the first reading (unless a saved state
+    was loaded), and to re-anchor it at full and empty. */
+void           charge_counter_update (ChargeCounter *self, uint64_t time_ns,
+                 int current_ua, int voltage_percent);
+
+/** Get the estimated charge, as a percentage of capacity, and the time
+    in minutes to full charge (if charging) or empty (if discharging),
+    based on the smoothed current. minutes is -1 if the smoothed
+    current is too small to give a meaningful figure. Any argument may
+    be NULL. */
+void           charge_counter_get (const ChargeCounter *self,
+                 int *percent_charged, int *minutes, int *smoothed_mA);
+
+/** Get the estimated remaining charge in mA-hours. */
+int            charge_counter_get_mah (const ChargeCounter *self);
+
+/** Save the state to a file. The file is replaced atomically. */
+BOOL           charge_counter_save (const ChargeCounter *self,
+                 const char *filename, char **error);
+
+/** Load the state from a file written by _save(). Nothing is
+    integrated across the gap between saving and loading, since there
+    is no way to know what the current was. */
+BOOL           charge_counter_load (ChargeCounter *self,
+                 const char *filename, char **error);
+
+END_DECLS
+
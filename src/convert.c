@@ -0,0 +1,452 @@
+/*==========================================================================
+
+    convert.c
+
+    Implementation of the "methods" in convert.h
+
+    Vector units have no integer division, so the kernels divide by
+    multiplying by a precomputed reciprocal, and shifting. For a
+    divisor d, with 2^(s-1) < d <= 2^s, we use
+
+      m = ceil (2^(30+s) / d)
+      x / d = (x * m) >> (30 + s)
+
+    which is exact for every 0 <= x < 2^30: m * d exceeds 2^(30+s) by
+    less than d, so x * m / 2^(30+s) exceeds x / d by less than
+    x / 2^(30+s) < 1/d, which is never enough to reach the next whole
+    number. m is at most 2^31, so it fits in 32 bits, and the product
+    fits in 64. Negative numerators are divided as their magnitude, and
+    the sign put back afterwards, which truncates towards zero, as C
+    does.
+
+    Every numerator is less than 2^30 in magnitude:
+
+      shunt_reg * 10000          <= 32768 * 10000
+      bus_mv * shunt_reg         <= 32764 * 32768
+      100 * (bus_mv - v0)        <= 100 * 32767
+
+    The first two products fit into 32 bits, so the kernels can form
+    them with 32-bit (or, on SSE2, 16 x 16-bit) multiplies.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+#include "defs.h"
+#include "convert.h"
+
+// The numerators of all the divisions are less than 2^NUMERATOR_BITS
+#define NUMERATOR_BITS 30
+
+// Bus voltages are 15-bit values, in mV
+#define MAX_BUS_MV 32767
+
+/*============================================================================
+
+  convert_reciprocal
+
+  Work out the multiplier and shift that divide by d. See the top of
+  this file.
+
+============================================================================*/
+static void convert_reciprocal (uint32_t d, uint32_t *mul, int *shift)
+  {
+  int s = 0;
+  while ((1ULL << s) < d) s++;
+  *shift = NUMERATOR_BITS + s;
+  *mul = (uint32_t)(((1ULL << *shift) + d - 1) / d);
+  }
+
+/*============================================================================
+
+  ina219_converter_init
+
+============================================================================*/
+BOOL ina219_converter_init (INA219Converter *self, int shunt_milliohms,
+       int voltage_0_percent, int voltage_100_percent, char **error)
+  {
+  BOOL ret = FALSE;
+  if (shunt_milliohms <= 0 || shunt_milliohms > INT32_MAX / 100)
+    {
+    if (error) asprintf (error, "Shunt resistance out of range: %d mohm",
+      shunt_milliohms);
+    }
+  else if (voltage_0_percent < 0 || voltage_100_percent > MAX_BUS_MV
+        || voltage_100_percent <= voltage_0_percent)
+    {
+    if (error) asprintf (error, "Battery voltage range out of range: "
+      "%d-%d mV", voltage_0_percent, voltage_100_percent);
+    }
+  else
+    {
+    memset (self, 0, sizeof (INA219Converter));
+    self->shunt_milliohms = shunt_milliohms;
+    self->voltage_0_percent = voltage_0_percent;
+    self->voltage_100_percent = voltage_100_percent;
+    convert_reciprocal (shunt_milliohms, &self->current_mul,
+      &self->current_shift);
+    convert_reciprocal (voltage_100_percent - voltage_0_percent,
+      &self->percent_mul, &self->percent_shift);
+    convert_reciprocal (100 * shunt_milliohms, &self->power_mul,
+      &self->power_shift);
+    ret = TRUE;
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  convert_scalar
+
+  Convert samples from 'from' to 'to'. This is the reference, and also
+  does the samples left over at the end of a batch by the vector
+  kernels.
+
+============================================================================*/
+static void convert_scalar (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t from,
+       size_t to, const INA219Converted *out)
+  {
+  int v0 = self->voltage_0_percent;
+  int v100 = self->voltage_100_percent;
+  for (size_t i = from; i < to; i++)
+    {
+    int shunt = shunt_regs[i];
+    int mv = (bus_regs[i] & 0xFFF8) >> 1;
+    if (out->bus_mv) out->bus_mv[i] = mv;
+    if (out->shunt_uv) out->shunt_uv[i] = shunt * 10;
+    if (out->current_ua)
+      out->current_ua[i] = shunt * 10000 / self->shunt_milliohms;
+    if (out->percent)
+      {
+      int percent = 100 * (mv - v0) / (v100 - v0);
+      if (percent > 100) percent = 100;
+      if (percent < 0) percent = 0;
+      out->percent[i] = percent;
+      }
+    if (out->power_mw)
+      out->power_mw[i] = mv * shunt / (100 * self->shunt_milliohms);
+    }
+  }
+
+/*============================================================================
+
+  ina219_convert_batch_scalar
+
+============================================================================*/
+void ina219_convert_batch_scalar (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t n,
+       const INA219Converted *out)
+  {
+  convert_scalar (self, shunt_regs, bus_regs, 0, n, out);
+  }
+
+#ifdef HAVE_X86
+
+/*============================================================================
+
+  div_sse2
+
+  Divide four signed 32-bit values by multiplying by mul and shifting.
+  _mm_mul_epu32 multiplies only the even lanes, so the odd lanes are
+  shifted down and done separately.
+
+============================================================================*/
+__attribute__((target("sse2")))
+static inline __m128i div_sse2 (__m128i x, __m128i mul, __m128i shift)
+  {
+  __m128i sign = _mm_srai_epi32 (x, 31);
+  __m128i a = _mm_sub_epi32 (_mm_xor_si128 (x, sign), sign);
+  __m128i even = _mm_srl_epi64 (_mm_mul_epu32 (a, mul), shift);
+  __m128i odd = _mm_srl_epi64 (_mm_mul_epu32 (_mm_srli_epi64 (a, 32), mul),
+    shift);
+  __m128i q = _mm_or_si128 (even, _mm_slli_epi64 (odd, 32));
+  return _mm_sub_epi32 (_mm_xor_si128 (q, sign), sign);
+  }
+
+/*============================================================================
+
+  mul_sse2
+
+  Multiply eight signed 16-bit values, giving eight 32-bit products,
+  the first four in *lo and the rest in *hi.
+
+============================================================================*/
+__attribute__((target("sse2")))
+static inline void mul_sse2 (__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+  {
+  __m128i l = _mm_mullo_epi16 (a, b);
+  __m128i h = _mm_mulhi_epi16 (a, b);
+  *lo = _mm_unpacklo_epi16 (l, h);
+  *hi = _mm_unpackhi_epi16 (l, h);
+  }
+
+/*============================================================================
+
+  store_sse2
+
+============================================================================*/
+__attribute__((target("sse2")))
+static inline void store_sse2 (int32_t *p, __m128i lo, __m128i hi)
+  {
+  _mm_storeu_si128 ((__m128i *)p, lo);
+  _mm_storeu_si128 ((__m128i *)(p + 4), hi);
+  }
+
+/*============================================================================
+
+  convert_sse2
+
+  Eight samples at a time. SSE2 has no 32-bit multiply or min/max, but
+  all the inputs are 16-bit values, so we can do those in 16 bits and
+  widen the products.
+
+============================================================================*/
+__attribute__((target("sse2")))
+static void convert_sse2 (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t n,
+       const INA219Converted *out)
+  {
+  const __m128i mask = _mm_set1_epi16 ((short)0xFFF8);
+  const __m128i ten = _mm_set1_epi16 (10);
+  const __m128i ten_thousand = _mm_set1_epi16 (10000);
+  const __m128i hundred = _mm_set1_epi16 (100);
+  const __m128i v0 = _mm_set1_epi16 ((short)self->voltage_0_percent);
+  const __m128i v100 = _mm_set1_epi16 ((short)self->voltage_100_percent);
+  const __m128i current_mul = _mm_set1_epi32 ((int)self->current_mul);
+  const __m128i current_shift = _mm_cvtsi32_si128 (self->current_shift);
+  const __m128i percent_mul = _mm_set1_epi32 ((int)self->percent_mul);
+  const __m128i percent_shift = _mm_cvtsi32_si128 (self->percent_shift);
+  const __m128i power_mul = _mm_set1_epi32 ((int)self->power_mul);
+  const __m128i power_shift = _mm_cvtsi32_si128 (self->power_shift);
+  const __m128i zero = _mm_setzero_si128 ();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+    __m128i shunt = _mm_loadu_si128 ((const __m128i *)(shunt_regs + i));
+    __m128i bus = _mm_loadu_si128 ((const __m128i *)(bus_regs + i));
+    __m128i mv = _mm_srli_epi16 (_mm_and_si128 (bus, mask), 1);
+    __m128i lo, hi;
+    if (out->bus_mv)
+      store_sse2 (out->bus_mv + i, _mm_unpacklo_epi16 (mv, zero),
+        _mm_unpackhi_epi16 (mv, zero));
+    if (out->shunt_uv)
+      {
+      mul_sse2 (shunt, ten, &lo, &hi);
+      store_sse2 (out->shunt_uv + i, lo, hi);
+      }
+    if (out->current_ua)
+      {
+      mul_sse2 (shunt, ten_thousand, &lo, &hi);
+      store_sse2 (out->current_ua + i,
+        div_sse2 (lo, current_mul, current_shift),
+        div_sse2 (hi, current_mul, current_shift));
+      }
+    if (out->percent)
+      {
+      __m128i v = _mm_min_epi16 (_mm_max_epi16 (mv, v0), v100);
+      mul_sse2 (_mm_sub_epi16 (v, v0), hundred, &lo, &hi);
+      store_sse2 (out->percent + i,
+        div_sse2 (lo, percent_mul, percent_shift),
+        div_sse2 (hi, percent_mul, percent_shift));
+      }
+    if (out->power_mw)
+      {
+      mul_sse2 (mv, shunt, &lo, &hi);
+      store_sse2 (out->power_mw + i,
+        div_sse2 (lo, power_mul, power_shift),
+        div_sse2 (hi, power_mul, power_shift));
+      }
+    }
+  convert_scalar (self, shunt_regs, bus_regs, i, n, out);
+  }
+
+/*============================================================================
+
+  div_avx2
+
+============================================================================*/
+__attribute__((target("avx2")))
+static inline __m256i div_avx2 (__m256i x, __m256i mul, __m128i shift)
+  {
+  __m256i a = _mm256_abs_epi32 (x);
+  __m256i even = _mm256_srl_epi64 (_mm256_mul_epu32 (a, mul), shift);
+  __m256i odd = _mm256_srl_epi64 (_mm256_mul_epu32 (
+    _mm256_srli_epi64 (a, 32), mul), shift);
+  __m256i q = _mm256_or_si256 (even, _mm256_slli_epi64 (odd, 32));
+  return _mm256_sign_epi32 (q, x);
+  }
+
+/*============================================================================
+
+  convert_avx2
+
+  Eight samples at a time, widened to 32 bits as they are loaded.
+
+============================================================================*/
+__attribute__((target("avx2")))
+static void convert_avx2 (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t n,
+       const INA219Converted *out)
+  {
+  const __m256i mask = _mm256_set1_epi32 (0xFFF8);
+  const __m256i ten = _mm256_set1_epi32 (10);
+  const __m256i ten_thousand = _mm256_set1_epi32 (10000);
+  const __m256i hundred = _mm256_set1_epi32 (100);
+  const __m256i v0 = _mm256_set1_epi32 (self->voltage_0_percent);
+  const __m256i v100 = _mm256_set1_epi32 (self->voltage_100_percent);
+  const __m256i current_mul = _mm256_set1_epi32 ((int)self->current_mul);
+  const __m128i current_shift = _mm_cvtsi32_si128 (self->current_shift);
+  const __m256i percent_mul = _mm256_set1_epi32 ((int)self->percent_mul);
+  const __m128i percent_shift = _mm_cvtsi32_si128 (self->percent_shift);
+  const __m256i power_mul = _mm256_set1_epi32 ((int)self->power_mul);
+  const __m128i power_shift = _mm_cvtsi32_si128 (self->power_shift);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+    __m256i shunt = _mm256_cvtepi16_epi32 (
+      _mm_loadu_si128 ((const __m128i *)(shunt_regs + i)));
+    __m256i bus = _mm256_cvtepu16_epi32 (
+      _mm_loadu_si128 ((const __m128i *)(bus_regs + i)));
+    __m256i mv = _mm256_srli_epi32 (_mm256_and_si256 (bus, mask), 1);
+    if (out->bus_mv)
+      _mm256_storeu_si256 ((__m256i *)(out->bus_mv + i), mv);
+    if (out->shunt_uv)
+      _mm256_storeu_si256 ((__m256i *)(out->shunt_uv + i),
+        _mm256_mullo_epi32 (shunt, ten));
+    if (out->current_ua)
+      _mm256_storeu_si256 ((__m256i *)(out->current_ua + i),
+        div_avx2 (_mm256_mullo_epi32 (shunt, ten_thousand), current_mul,
+          current_shift));
+    if (out->percent)
+      {
+      __m256i v = _mm256_min_epi32 (_mm256_max_epi32 (mv, v0), v100);
+      _mm256_storeu_si256 ((__m256i *)(out->percent + i),
+        div_avx2 (_mm256_mullo_epi32 (_mm256_sub_epi32 (v, v0), hundred),
+          percent_mul, percent_shift));
+      }
+    if (out->power_mw)
+      _mm256_storeu_si256 ((__m256i *)(out->power_mw + i),
+        div_avx2 (_mm256_mullo_epi32 (mv, shunt), power_mul, power_shift));
+    }
+  convert_scalar (self, shunt_regs, bus_regs, i, n, out);
+  }
+
+#endif // HAVE_X86
+
+#ifdef HAVE_NEON
+
+/*============================================================================
+
+  div_neon
+
+============================================================================*/
+static inline int32x4_t div_neon (int32x4_t x, uint32_t mul, int64x2_t shift)
+  {
+  uint32x4_t a = vreinterpretq_u32_s32 (vabsq_s32 (x));
+  uint64x2_t lo = vshlq_u64 (vmull_n_u32 (vget_low_u32 (a), mul), shift);
+  uint64x2_t hi = vshlq_u64 (vmull_n_u32 (vget_high_u32 (a), mul), shift);
+  int32x4_t q = vreinterpretq_s32_u32 (vcombine_u32 (vmovn_u64 (lo),
+    vmovn_u64 (hi)));
+  int32x4_t sign = vshrq_n_s32 (x, 31);
+  return vsubq_s32 (veorq_s32 (q, sign), sign);
+  }
+
+/*============================================================================
+
+  convert_neon
+
+  Four samples at a time. The shifts are negative, because NEON has
+  only a variable left shift.
+
+============================================================================*/
+static void convert_neon (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t n,
+       const INA219Converted *out)
+  {
+  const int32x4_t v0 = vdupq_n_s32 (self->voltage_0_percent);
+  const int32x4_t v100 = vdupq_n_s32 (self->voltage_100_percent);
+  const int64x2_t current_shift = vdupq_n_s64 (-self->current_shift);
+  const int64x2_t percent_shift = vdupq_n_s64 (-self->percent_shift);
+  const int64x2_t power_shift = vdupq_n_s64 (-self->power_shift);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+    int32x4_t shunt = vmovl_s16 (vld1_s16 (shunt_regs + i));
+    uint32x4_t bus = vmovl_u16 (vld1_u16 (bus_regs + i));
+    int32x4_t mv = vreinterpretq_s32_u32 (vshrq_n_u32 (
+      vandq_u32 (bus, vdupq_n_u32 (0xFFF8)), 1));
+    if (out->bus_mv) vst1q_s32 (out->bus_mv + i, mv);
+    if (out->shunt_uv) vst1q_s32 (out->shunt_uv + i, vmulq_n_s32 (shunt, 10));
+    if (out->current_ua)
+      vst1q_s32 (out->current_ua + i, div_neon (vmulq_n_s32 (shunt, 10000),
+        self->current_mul, current_shift));
+    if (out->percent)
+      {
+      int32x4_t v = vminq_s32 (vmaxq_s32 (mv, v0), v100);
+      vst1q_s32 (out->percent + i, div_neon (
+        vmulq_n_s32 (vsubq_s32 (v, v0), 100), self->percent_mul,
+        percent_shift));
+      }
+    if (out->power_mw)
+      vst1q_s32 (out->power_mw + i, div_neon (vmulq_s32 (mv, shunt),
+        self->power_mul, power_shift));
+    }
+  convert_scalar (self, shunt_regs, bus_regs, i, n, out);
+  }
+
+#endif // HAVE_NEON
+
+/*============================================================================
+
+  ina219_convert_batch
+
+============================================================================*/
+void ina219_convert_batch (const INA219Converter *self,
+       const int16_t *shunt_regs, const uint16_t *bus_regs, size_t n,
+       const INA219Converted *out)
+  {
+#if defined(HAVE_X86)
+  if (__builtin_cpu_supports ("avx2"))
+    convert_avx2 (self, shunt_regs, bus_regs, n, out);
+  else if (__builtin_cpu_supports ("sse2"))
+    convert_sse2 (self, shunt_regs, bus_regs, n, out);
+  else
+    convert_scalar (self, shunt_regs, bus_regs, 0, n, out);
+#elif defined(HAVE_NEON)
+  convert_neon (self, shunt_regs, bus_regs, n, out);
+#else
+  convert_scalar (self, shunt_regs, bus_regs, 0, n, out);
+#endif
+  }
+
+/*============================================================================
+
+  ina219_convert_kernel
+
+============================================================================*/
+const char *ina219_convert_kernel (void)
+  {
+#if defined(HAVE_X86)
+  if (__builtin_cpu_supports ("avx2")) return "avx2";
+  if (__builtin_cpu_supports ("sse2")) return "sse2";
+  return "scalar";
+#elif defined(HAVE_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+  }
+
@@ -0,0 +1,93 @@
+/*============================================================================
+
+  convert.h
+
+  Batch conversion of raw INA219 register values -- as collected by
+  burst captures, or read back from a sample log -- into engineering
+  units. The shunt and bus registers are passed as two arrays, and the
+  results are written to separate arrays, one per quantity, so that
+  the conversion can be done several samples at a time with SIMD
+  instructions: SSE2 or AVX2 on x86, NEON on ARM.
+
+  All the arithmetic is integer arithmetic, and the vector kernels give
+  exactly the same results as ina219_convert_batch_scalar(), which is
+  written in plain C, and which does the same sums as the rest of the
+  library:
+
+    bus_mv      (bus_reg & 0xFFF8) >> 1, as ina219_get_bus_voltage()
+    shunt_uv    shunt_reg * 10 -- not truncated to whole millivolts,
+                as ina219_get_shunt_voltage() is
+    current_ua  shunt_reg * 10000 / shunt_milliohms, as
+                ina219_current_ua_from_raw()
+    percent     the battery charge estimated from the voltage, 0-100,
+                as ina219_get_status()
+    power_mw    bus_mv * shunt_reg / (100 * shunt_milliohms), that is,
+                the product of the voltage and the current, in mW,
+                worked out from the shunt register rather than from
+                the (already truncated) current
+
+  Divisions truncate towards zero, as C division does.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The settings needed to convert a batch, with some values precomputed
+//  by ina219_converter_init(). Treat the contents as private.
+typedef struct _INA219Converter
+  {
+  int shunt_milliohms;
+  int voltage_0_percent;
+  int voltage_100_percent;
+  // Multipliers and shifts that replace division in the vector kernels
+  uint32_t current_mul;
+  int current_shift;
+  uint32_t percent_mul;
+  int percent_shift;
+  uint32_t power_mul;
+  int power_shift;
+  } INA219Converter;
+
+// Where to put the results of a conversion. Each array must have room
+//  for as many values as there are samples in the batch; any of them
+//  can be NULL, if that quantity isn't wanted.
+typedef struct _INA219Converted
+  {
+  int32_t *bus_mv;
+  int32_t *shunt_uv;
+  int32_t *current_ua;
+  int32_t *percent;
+  int32_t *power_mw;
+  } INA219Converted;
+
+BEGIN_DECLS
+
+/** Set up a converter for a shunt resistance and a battery voltage
+    range. Fails if the values are out of range: the voltages must lie
+    between 0 and 32767 mV, the 100% voltage must be larger than the 0%
+    voltage, and the shunt resistance must be positive. */
+BOOL        ina219_converter_init (INA219Converter *self,
+              int shunt_milliohms, int voltage_0_percent,
+              int voltage_100_percent, char **error);
+
+/** Convert n samples, using the fastest kernel that the CPU supports. */
+void        ina219_convert_batch (const INA219Converter *self,
+              const int16_t *shunt_regs, const uint16_t *bus_regs,
+              size_t n, const INA219Converted *out);
+
+/** Convert n samples one at a time, in plain C. This is the reference
+    for the vector kernels, and gives the same results. */
+void        ina219_convert_batch_scalar (const INA219Converter *self,
+              const int16_t *shunt_regs, const uint16_t *bus_regs,
+              size_t n, const INA219Converted *out);
+
+/** The name of the kernel that ina219_convert_batch() uses on this
+    CPU: "avx2", "sse2", "neon", or "scalar". */
+const char *ina219_convert_kernel (void);
+
+END_DECLS
+
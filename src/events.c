@@ -0,0 +1,549 @@
+/*==========================================================================
+
+    events.c
+
+    Implementation of the "methods" in events.h
+
+    The queue, and the state that _update() keeps, are protected by one
+    mutex, because the GPIO thread raises events too. The eventfd is
+    written when an event is queued and drained when the last one is
+    taken, both with the mutex held, so it is readable exactly when the
+    queue is not empty.
+
+    Hook commands are started with a double fork, so the program never
+    has to wait for them or reap them. Everything the child needs is
+    built before the fork, because only async-signal-safe calls are
+    allowed in the child of a multi-threaded process.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/gpio.h>
+#include "defs.h"
+#include "ina219.h"
+#include "events.h"
+
+#define NSEC_PER_MSEC 1000000LL
+
+// Number of variables that a hook gets, on top of the environment
+#define HOOK_VARS 10
+
+extern char **environ;
+
+// The state of one threshold
+typedef struct _ThresholdState
+  {
+  EventThreshold threshold;
+  char name[16];
+  BOOL tripped;
+  BOOL pending; // The condition for changing state has started to hold
+  uint64_t pending_since;
+  } ThresholdState;
+
+struct _EventEngine
+  {
+  uint64_t debounce_ns;
+  int full_percent; // As in INA219Battery
+  int full_hysteresis_percent;
+  ThresholdState thresholds[EVENT_MAX_THRESHOLDS];
+  int nthresholds;
+  char *hook;
+
+  pthread_mutex_t mutex;
+  int event_fd;
+  BatteryEvent queue[EVENT_QUEUE_SIZE];
+  int head; // Oldest event
+  int count;
+  uint64_t dropped;
+
+  // The status as last reported, and a different one that has been
+  //  seen, but not yet for the debounce time
+  BOOL started;
+  INA219ChargeStatus status;
+  BOOL status_pending;
+  INA219ChargeStatus pending_status;
+  uint64_t pending_since;
+  BatteryEvent last; // The latest readings
+
+  // GPIO watching
+  int gpio_fd;
+  int gpio_line;
+  int stop_fd;
+  pthread_t gpio_thread;
+  BOOL gpio_running;
+  };
+
+/*============================================================================
+
+  battery_event_type_name
+
+============================================================================*/
+const char *battery_event_type_name (BatteryEventType type)
+  {
+  switch (type)
+    {
+    case BATTERY_EVENT_STATUS: return "status";
+    case BATTERY_EVENT_BELOW: return "below";
+    case BATTERY_EVENT_ABOVE: return "above";
+    case BATTERY_EVENT_PIN: return "pin";
+    }
+  return "unknown";
+  }
+
+/*============================================================================
+
+  event_status_name
+
+============================================================================*/
+static const char *event_status_name (INA219ChargeStatus charge_status)
+  {
+  return charge_status == INA219_FULLY_CHARGED ? "full" :
+    charge_status == INA219_CHARGING ? "charging" : "discharging";
+  }
+
+/*============================================================================
+
+  event_engine_create
+
+============================================================================*/
+EventEngine *event_engine_create (int debounce_ms, int full_percent,
+               int full_hysteresis_percent, char **error)
+  {
+  int fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+    {
+    if (error) asprintf (error, "Can't create eventfd: %s",
+      strerror (errno));
+    return NULL;
+    }
+  EventEngine *self = malloc (sizeof (EventEngine));
+  memset (self, 0, sizeof (EventEngine));
+  self->debounce_ns = debounce_ms > 0 ?
+    (uint64_t)debounce_ms * NSEC_PER_MSEC : 0;
+  self->full_percent = full_percent;
+  self->full_hysteresis_percent = full_hysteresis_percent > 0 ?
+    full_hysteresis_percent : 0;
+  self->event_fd = fd;
+  self->gpio_fd = -1;
+  self->stop_fd = -1;
+  pthread_mutex_init (&self->mutex, NULL);
+  return self;
+  }
+
+/*============================================================================
+
+  event_engine_destroy
+
+============================================================================*/
+void event_engine_destroy (EventEngine *self)
+  {
+  if (self)
+    {
+    if (self->gpio_running)
+      {
+      uint64_t one = 1;
+      if (write (self->stop_fd, &one, sizeof (one)) < 0)
+        perror ("eventfd");
+      pthread_join (self->gpio_thread, NULL);
+      }
+    if (self->gpio_fd >= 0) close (self->gpio_fd);
+    if (self->stop_fd >= 0) close (self->stop_fd);
+    close (self->event_fd);
+    pthread_mutex_destroy (&self->mutex);
+    free (self->hook);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  event_engine_add_threshold
+
+============================================================================*/
+int event_engine_add_threshold (EventEngine *self,
+      const EventThreshold *threshold)
+  {
+  assert (self != NULL);
+  if (self->nthresholds == EVENT_MAX_THRESHOLDS) return -1;
+  ThresholdState *t = &self->thresholds[self->nthresholds];
+  memset (t, 0, sizeof (ThresholdState));
+  t->threshold = *threshold;
+  snprintf (t->name, sizeof (t->name), "%s",
+    threshold->name ? threshold->name : "");
+  t->threshold.name = t->name;
+  return self->nthresholds++;
+  }
+
+/*============================================================================
+
+  event_engine_get_threshold_name
+
+============================================================================*/
+const char *event_engine_get_threshold_name (const EventEngine *self,
+              int threshold)
+  {
+  assert (threshold >= 0 && threshold < self->nthresholds);
+  return self->thresholds[threshold].name;
+  }
+
+/*============================================================================
+
+  event_engine_set_hook
+
+============================================================================*/
+void event_engine_set_hook (EventEngine *self, const char *command)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->mutex);
+  free (self->hook);
+  self->hook = command ? strdup (command) : NULL;
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+/*============================================================================
+
+  event_engine_run_hook
+
+  Start the hook command for an event, without waiting for it. Called
+  with the mutex held, so the hook can't change under us.
+
+============================================================================*/
+static void event_engine_run_hook (const EventEngine *self,
+      const BatteryEvent *event)
+  {
+  int nenv = 0;
+  while (environ[nenv]) nenv++;
+  char **env = malloc ((nenv + HOOK_VARS + 1) * sizeof (char *));
+  memcpy (env, environ, nenv * sizeof (char *));
+  int n = nenv;
+  asprintf (&env[n++], "INA219_EVENT=%s",
+    battery_event_type_name (event->type));
+  asprintf (&env[n++], "INA219_STATUS=%s",
+    event_status_name (event->status));
+  asprintf (&env[n++], "INA219_PREVIOUS_STATUS=%s",
+    event_status_name (event->previous_status));
+  asprintf (&env[n++], "INA219_VOLTAGE_MV=%d", event->mv);
+  asprintf (&env[n++], "INA219_PERCENT=%d", event->percent_charged);
+  asprintf (&env[n++], "INA219_CURRENT_MA=%d", event->battery_current_mA);
+  asprintf (&env[n++], "INA219_MINUTES=%d", event->minutes);
+  if (event->type == BATTERY_EVENT_PIN)
+    {
+    asprintf (&env[n++], "INA219_LINE=%d", event->line);
+    asprintf (&env[n++], "INA219_EDGE=%s",
+      event->rising ? "rising" : "falling");
+    }
+  else if (event->type != BATTERY_EVENT_STATUS)
+    {
+    asprintf (&env[n++], "INA219_THRESHOLD=%s",
+      self->thresholds[event->threshold].name);
+    }
+  env[n] = NULL;
+  char *const argv[] = { "sh", "-c", self->hook, NULL };
+
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+    // The intermediate child exits at once, so the command is
+    //  inherited by init, which reaps it
+    if (fork () == 0)
+      {
+      execve ("/bin/sh", argv, env);
+      _exit (127);
+      }
+    _exit (0);
+    }
+  if (pid > 0) waitpid (pid, NULL, 0);
+
+  for (int i = nenv; i < n; i++) free (env[i]);
+  free (env);
+  }
+
+/*============================================================================
+
+  event_engine_post
+
+  Queue an event, and run the hook. Called with the mutex held.
+
+============================================================================*/
+static void event_engine_post (EventEngine *self, const BatteryEvent *event)
+  {
+  if (self->count == EVENT_QUEUE_SIZE)
+    {
+    self->head = (self->head + 1) % EVENT_QUEUE_SIZE;
+    self->count--;
+    self->dropped++;
+    }
+  self->queue[(self->head + self->count) % EVENT_QUEUE_SIZE] = *event;
+  self->count++;
+  uint64_t one = 1;
+  if (write (self->event_fd, &one, sizeof (one)) < 0)
+    perror ("eventfd");
+  if (self->hook) event_engine_run_hook (self, event);
+  }
+
+/*============================================================================
+
+  event_engine_debounce
+
+  Returns TRUE if "condition" has held for the debounce time. *pending
+  and *since track when it started to hold.
+
+============================================================================*/
+static BOOL event_engine_debounce (const EventEngine *self, BOOL condition,
+      BOOL *pending, uint64_t *since, uint64_t time_ns)
+  {
+  if (!condition)
+    {
+    *pending = FALSE;
+    return FALSE;
+    }
+  if (!*pending)
+    {
+    *pending = TRUE;
+    *since = time_ns;
+    }
+  if (time_ns - *since >= self->debounce_ns)
+    {
+    *pending = FALSE;
+    return TRUE;
+    }
+  return FALSE;
+  }
+
+/*============================================================================
+
+  event_engine_update
+
+============================================================================*/
+void event_engine_update (EventEngine *self, uint64_t time_ns,
+       INA219ChargeStatus charge_status, int mv, int percent_charged,
+       int battery_current_mA, int minutes)
+  {
+  assert (self != NULL);
+  pthread_mutex_lock (&self->mutex);
+
+  BatteryEvent *e = &self->last;
+  e->time_ns = time_ns;
+  e->mv = mv;
+  e->percent_charged = percent_charged;
+  e->battery_current_mA = battery_current_mA;
+  e->minutes = minutes;
+
+  if (!self->started)
+    {
+    // Nothing to compare the first reading with
+    self->status = charge_status;
+    self->started = TRUE;
+    }
+
+  // Hold on to full charge until the charge has fallen a little
+  INA219ChargeStatus status = charge_status;
+  if (self->status == INA219_FULLY_CHARGED && percent_charged
+       >= self->full_percent - self->full_hysteresis_percent)
+    status = INA219_FULLY_CHARGED;
+
+  if (status != self->status)
+    {
+    if (self->status_pending && self->pending_status != status)
+      self->status_pending = FALSE;
+    self->pending_status = status;
+    if (event_engine_debounce (self, TRUE, &self->status_pending,
+         &self->pending_since, time_ns))
+      {
+      e->type = BATTERY_EVENT_STATUS;
+      e->previous_status = self->status;
+      e->status = status;
+      self->status = status;
+      event_engine_post (self, e);
+      }
+    }
+  else
+    self->status_pending = FALSE;
+
+  e->status = e->previous_status = self->status;
+  for (int i = 0; i < self->nthresholds; i++)
+    {
+    ThresholdState *t = &self->thresholds[i];
+    const EventThreshold *th = &t->threshold;
+    int value = th->quantity == EVENT_VOLTAGE ? mv :
+      th->quantity == EVENT_CURRENT ? battery_current_mA : percent_charged;
+    BOOL condition;
+    if (t->tripped)
+      condition = value >= th->level + th->hysteresis;
+    else
+      condition = value < th->level && (!th->discharging_only
+        || self->status == INA219_DISCHARGING);
+    if (event_engine_debounce (self, condition, &t->pending,
+         &t->pending_since, time_ns))
+      {
+      t->tripped = !t->tripped;
+      e->type = t->tripped ? BATTERY_EVENT_BELOW : BATTERY_EVENT_ABOVE;
+      e->threshold = i;
+      event_engine_post (self, e);
+      }
+    }
+
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+/*============================================================================
+
+  event_engine_read
+
+============================================================================*/
+BOOL event_engine_read (EventEngine *self, BatteryEvent *event)
+  {
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  pthread_mutex_lock (&self->mutex);
+  if (self->count > 0)
+    {
+    *event = self->queue[self->head];
+    self->head = (self->head + 1) % EVENT_QUEUE_SIZE;
+    self->count--;
+    ret = TRUE;
+    }
+  if (self->count == 0)
+    {
+    uint64_t n;
+    if (read (self->event_fd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+      perror ("eventfd");
+    }
+  pthread_mutex_unlock (&self->mutex);
+  return ret;
+  }
+
+/*============================================================================
+
+  event_engine_get_fd
+
+============================================================================*/
+int event_engine_get_fd (const EventEngine *self)
+  {
+  return self->event_fd;
+  }
+
+/*============================================================================
+
+  event_engine_get_dropped
+
+============================================================================*/
+uint64_t event_engine_get_dropped (const EventEngine *self)
+  {
+  EventEngine *e = (EventEngine *)self;
+  pthread_mutex_lock (&e->mutex);
+  uint64_t dropped = e->dropped;
+  pthread_mutex_unlock (&e->mutex);
+  return dropped;
+  }
+
+/*============================================================================
+
+  event_engine_gpio_thread
+
+============================================================================*/
+static void *event_engine_gpio_thread (void *arg)
+  {
+  EventEngine *self = arg;
+  for (;;)
+    {
+    struct pollfd fds[2];
+    fds[0].fd = self->gpio_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = self->stop_fd;
+    fds[1].events = POLLIN;
+    if (poll (fds, 2, -1) < 0) continue; // EINTR
+    if (fds[1].revents) break;
+    if (!fds[0].revents) continue;
+
+    struct gpioevent_data data;
+    if (read (self->gpio_fd, &data, sizeof (data)) != sizeof (data))
+      continue;
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    pthread_mutex_lock (&self->mutex);
+    BatteryEvent e = self->last;
+    e.type = BATTERY_EVENT_PIN;
+    e.time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e.status = e.previous_status = self->status;
+    e.line = self->gpio_line;
+    e.rising = (data.id == GPIOEVENT_EVENT_RISING_EDGE);
+    event_engine_post (self, &e);
+    pthread_mutex_unlock (&self->mutex);
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  event_engine_watch_gpio
+
+============================================================================*/
+BOOL event_engine_watch_gpio (EventEngine *self, const char *chip,
+       int line, char **error)
+  {
+  assert (self != NULL);
+  if (self->gpio_running)
+    {
+    if (error) asprintf (error, "Already watching a GPIO line");
+    return FALSE;
+    }
+  int chip_fd = open (chip, O_RDONLY | O_CLOEXEC);
+  if (chip_fd < 0)
+    {
+    if (error) asprintf (error, "Can't open %s: %s", chip,
+      strerror (errno));
+    return FALSE;
+    }
+
+  struct gpioevent_request req;
+  memset (&req, 0, sizeof (req));
+  req.lineoffset = line;
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+  snprintf (req.consumer_label, sizeof (req.consumer_label), "ina219");
+  int ret = ioctl (chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+  int err = errno;
+  close (chip_fd);
+  if (ret < 0)
+    {
+    if (error) asprintf (error, "Can't watch %s line %d: %s", chip, line,
+      strerror (err));
+    return FALSE;
+    }
+
+  self->gpio_fd = req.fd;
+  self->gpio_line = line;
+  self->stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (self->stop_fd >= 0 && (err = pthread_create (&self->gpio_thread,
+       NULL, event_engine_gpio_thread, self)) == 0)
+    {
+    self->gpio_running = TRUE;
+    return TRUE;
+    }
+
+  if (self->stop_fd < 0) err = errno;
+  if (error) asprintf (error, "Can't start GPIO thread: %s",
+    strerror (err));
+  close (self->gpio_fd);
+  if (self->stop_fd >= 0) close (self->stop_fd);
+  self->gpio_fd = self->stop_fd = -1;
+  return FALSE;
+  }
+
@@ -0,0 +1,170 @@
+/*============================================================================
+
+  events.h
+
+  The EventEngine "class" turns a stream of battery readings into a
+  stream of events -- the charge status changed, the charge fell below
+  a threshold, and so on -- so that programs that only care about
+  those don't have to keep reading the status and comparing it with
+  the last one.
+
+  Each condition has to hold for a debounce time before its event is
+  raised, so a reading or two that happen to be on the other side of a
+  threshold don't produce a pair of events. Thresholds also have
+  hysteresis: having fallen below its level, a threshold is only
+  re-armed when the value rises some way above it. The charge status
+  gets the same treatment around full charge, where the status from
+  ina219_status_from_raw() otherwise flips between "full" and
+  "charging" as the voltage wobbles around the battery's full_percent:
+  once full has been reported, the status stays full until the charge
+  falls some way below that.
+
+  Events are queued in the engine. The engine has a file descriptor
+  (an eventfd) that is readable while the queue is not empty, so
+  clients can wait for events with poll() or epoll, alongside anything
+  else they wait for, and then take them with event_engine_read().
+  The engine can also run a shell command for each event, with the
+  details in environment variables (see event_engine_set_hook()).
+
+  The INA219 itself has no alert output, but a GPIO line -- the
+  "power good" output of a charger, say, or the alert pin of another
+  chip -- can be watched too, using the kernel's GPIO character
+  device. Each edge on the line is an event.
+
+  Readings are passed to the engine with event_engine_update(); it
+  does no I/O on the INA219 itself.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+// The most thresholds that an engine can have
+#define EVENT_MAX_THRESHOLDS 8
+
+// The most events that are queued. When the queue is full, the oldest
+//  event is dropped
+#define EVENT_QUEUE_SIZE 64
+
+typedef enum _BatteryEventType
+  {
+  // The charge status changed
+  BATTERY_EVENT_STATUS = 0,
+  // A value fell below a threshold
+  BATTERY_EVENT_BELOW,
+  // A value rose back above a threshold, plus its hysteresis
+  BATTERY_EVENT_ABOVE,
+  // An edge on a GPIO line
+  BATTERY_EVENT_PIN
+  } BatteryEventType;
+
+// The quantities that a threshold can be set on
+typedef enum _EventQuantity
+  {
+  EVENT_PERCENT = 0, // Percent charged
+  EVENT_VOLTAGE, // Battery voltage, mV
+  EVENT_CURRENT // Battery current, mA; positive is charging
+  } EventQuantity;
+
+typedef struct _EventThreshold
+  {
+  // Used only to tell thresholds apart in the hook's environment. At
+  //  most 15 characters are kept
+  const char *name;
+  EventQuantity quantity;
+  int level;
+  // How far above the level the value has to rise to re-arm
+  int hysteresis;
+  // If TRUE, the threshold only trips while discharging, as for a
+  //  low-battery warning
+  BOOL discharging_only;
+  } EventThreshold;
+
+typedef struct _BatteryEvent
+  {
+  BatteryEventType type;
+  uint64_t time_ns; // CLOCK_MONOTONIC
+  // The index of the threshold, for _BELOW and _ABOVE
+  int threshold;
+  // For _STATUS, the new and old status; otherwise both are the
+  //  current status
+  INA219ChargeStatus status;
+  INA219ChargeStatus previous_status;
+  // The readings at the time of the event, as from
+  //  ina219_status_from_raw(). For _PIN, the last readings
+  int mv;
+  int percent_charged;
+  int battery_current_mA;
+  int minutes;
+  // For _PIN, the line and which way it went
+  int line;
+  BOOL rising;
+  } BatteryEvent;
+
+struct _EventEngine;
+typedef struct _EventEngine EventEngine;
+
+BEGIN_DECLS
+
+/** Create an engine. A condition must hold for debounce_ms before its
+    event is raised. full_percent is the charge at which the battery
+    is full -- the full_percent of its INA219Battery, so that events
+    agree with the status they are worked out from. Once the battery
+    has been reported as full, it stays full until the charge falls
+    full_hysteresis_percent below full_percent. */
+EventEngine *event_engine_create (int debounce_ms, int full_percent,
+               int full_hysteresis_percent, char **error);
+
+/** Free the engine, and stop watching any GPIO line. */
+void       event_engine_destroy (EventEngine *self);
+
+/** Add a threshold. Returns its index, or -1 if there are already
+    EVENT_MAX_THRESHOLDS. Thresholds should be added before the first
+    update. */
+int        event_engine_add_threshold (EventEngine *self,
+             const EventThreshold *threshold);
+
+/** Watch a line of a GPIO chip (e.g., "/dev/gpiochip0") for edges,
+    in a background thread. Only one line can be watched. */
+BOOL       event_engine_watch_gpio (EventEngine *self, const char *chip,
+             int line, char **error);
+
+/** Run a command with /bin/sh for every event. The command runs in the
+    background, with these environment variables set: INA219_EVENT
+    (status, below, above or pin), INA219_STATUS, INA219_PREVIOUS_STATUS
+    (full, charging or discharging), INA219_VOLTAGE_MV, INA219_PERCENT,
+    INA219_CURRENT_MA, INA219_MINUTES, and INA219_THRESHOLD (the name
+    of the threshold) or INA219_LINE and INA219_EDGE (rising or
+    falling). NULL stops running a command. The string is copied. */
+void       event_engine_set_hook (EventEngine *self, const char *command);
+
+/** Pass a reading to the engine, as worked out by
+    ina219_status_from_raw() or _from_values(). */
+void       event_engine_update (EventEngine *self, uint64_t time_ns,
+             INA219ChargeStatus charge_status, int mv, int percent_charged,
+             int battery_current_mA, int minutes);
+
+/** Get a file descriptor that is readable while there are events
+    queued. Don't read from it; use event_engine_read(). */
+int        event_engine_get_fd (const EventEngine *self);
+
+/** Take the oldest event from the queue. Returns FALSE if there are
+    none. This never blocks. */
+BOOL       event_engine_read (EventEngine *self, BatteryEvent *event);
+
+/** Get the number of events that were dropped because the queue was
+    full. */
+uint64_t   event_engine_get_dropped (const EventEngine *self);
+
+/** Get the name of a threshold, as given to _add_threshold(). */
+const char *event_engine_get_threshold_name (const EventEngine *self,
+             int threshold);
+
+/** Get the name of an event type, as used in INA219_EVENT. */
+const char *battery_event_type_name (BatteryEventType type);
+
+END_DECLS
+
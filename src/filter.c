@@ -0,0 +1,466 @@
+/*==========================================================================
+
+    filter.c
+
+    Implementation of the "methods" in filter.h
+
+    The EMA is held in fixed point, in the same way as the smoothed
+    current in charge.c, with the remainder of each step carried over,
+    so that it doesn't stick short of the input when the steps are
+    small. The windowed filters keep the last N readings twice: in a
+    ring, in arrival order, so we know which one to drop, and in a
+    sorted array, which is kept sorted by moving at most N entries on
+    each update. The median is then read straight from the middle of
+    the array, and the trimmed mean from a running sum of the middle
+    part, which is adjusted for the reading that left and the one that
+    arrived, rather than added up again. The Kalman filter is in
+    floating point --
+    with only a handful of operations per reading, there's no point
+    doing anything else.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include "defs.h"
+#include "filter.h"
+
+// Number of fractional bits in the EMA
+#define EMA_FRAC_BITS 8
+
+// Defaults for the settings that a specification leaves out
+#define DEFAULT_TIME_CONSTANT_MS 10000
+#define DEFAULT_WINDOW 15
+#define DEFAULT_TRIM_PERCENT 20
+#define DEFAULT_VOLTAGE_NOISE_MV 8
+#define DEFAULT_VOLTAGE_DRIFT_MV 1
+#define DEFAULT_CURRENT_NOISE_UA 5000
+#define DEFAULT_CURRENT_DRIFT_UA 1000
+
+// The state for one of the two quantities being filtered
+typedef struct _FilterChannel
+  {
+  int raw;
+  int value; // The latest filtered value
+  int64_t ema; // Fixed-point, EMA_FRAC_BITS
+  int64_t ema_rem; // Remainder of the last EMA step
+  int64_t ema_div; // ... and the divisor it was left by
+  int64_t trimmed_sum; // Sum of the untrimmed part of sorted[]
+  double estimate, variance; // Kalman
+  double noise_var, drift_var; // Kalman settings, squared
+  int ring[FILTER_MAX_WINDOW]; // Arrival order; oldest at ring_next
+  int sorted[FILTER_MAX_WINDOW];
+  } FilterChannel;
+
+struct _SampleFilter
+  {
+  FilterConfig config;
+  int count; // Readings in the window, up to config.window
+  int ring_next;
+  BOOL started;
+  uint64_t last_time_ns;
+  FilterChannel voltage;
+  FilterChannel current;
+  };
+
+/*============================================================================
+
+  filter_parse_numbers
+
+  Parse a comma-separated list of up to max integers. Returns the number
+  found, or -1 if there's anything else in the list.
+
+============================================================================*/
+static int filter_parse_numbers (const char *s, int *values, int max)
+  {
+  int n = 0;
+  while (*s)
+    {
+    char *end;
+    long v = strtol (s, &end, 10);
+    if (end == s || n == max) return -1;
+    values[n++] = (int)v;
+    if (*end == ',' && end[1]) end++;
+    else if (*end) return -1;
+    s = end;
+    }
+  return n;
+  }
+
+/*============================================================================
+
+  sample_filter_parse
+
+============================================================================*/
+BOOL sample_filter_parse (const char *spec, FilterConfig *config,
+       char **error)
+  {
+  memset (config, 0, sizeof (FilterConfig));
+  config->time_constant_ms = DEFAULT_TIME_CONSTANT_MS;
+  config->window = DEFAULT_WINDOW;
+  config->trim_percent = DEFAULT_TRIM_PERCENT;
+  config->voltage_noise_mv = DEFAULT_VOLTAGE_NOISE_MV;
+  config->voltage_drift_mv = DEFAULT_VOLTAGE_DRIFT_MV;
+  config->current_noise_ua = DEFAULT_CURRENT_NOISE_UA;
+  config->current_drift_ua = DEFAULT_CURRENT_DRIFT_UA;
+
+  char name[16];
+  const char *colon = strchr (spec, ':');
+  size_t len = colon ? (size_t)(colon - spec) : strlen (spec);
+  if (len >= sizeof (name)) len = sizeof (name) - 1;
+  memcpy (name, spec, len);
+  name[len] = 0;
+  int v[4];
+  int n = colon ? filter_parse_numbers (colon + 1, v, 4) : 0;
+
+  BOOL ok = FALSE;
+  if (strcmp (name, "none") == 0)
+    {
+    config->type = FILTER_NONE;
+    ok = (n == 0);
+    }
+  else if (strcmp (name, "ema") == 0)
+    {
+    config->type = FILTER_EMA;
+    if (n == 1) config->time_constant_ms = v[0];
+    ok = (n == 0 || n == 1);
+    }
+  else if (strcmp (name, "median") == 0)
+    {
+    config->type = FILTER_MEDIAN;
+    if (n == 1) config->window = v[0];
+    ok = (n == 0 || n == 1);
+    }
+  else if (strcmp (name, "trimmed") == 0)
+    {
+    config->type = FILTER_TRIMMED_MEAN;
+    if (n >= 1) config->window = v[0];
+    if (n == 2) config->trim_percent = v[1];
+    ok = (n >= 0 && n <= 2);
+    }
+  else if (strcmp (name, "kalman") == 0)
+    {
+    config->type = FILTER_KALMAN;
+    if (n >= 2)
+      {
+      config->voltage_noise_mv = v[0];
+      config->current_noise_ua = v[1];
+      }
+    if (n == 4)
+      {
+      config->voltage_drift_mv = v[2];
+      config->current_drift_ua = v[3];
+      }
+    ok = (n == 0 || n == 2 || n == 4);
+    }
+  else
+    {
+    if (error) asprintf (error, "Unknown filter: %s", spec);
+    return FALSE;
+    }
+
+  if (!ok)
+    {
+    if (error) asprintf (error, "Bad filter settings: %s", spec);
+    }
+  return ok;
+  }
+
+/*============================================================================
+
+  sample_filter_create
+
+============================================================================*/
+SampleFilter *sample_filter_create (const FilterConfig *config,
+                char **error)
+  {
+  const char *bad = NULL;
+  switch (config->type)
+    {
+    case FILTER_NONE:
+      break;
+    case FILTER_EMA:
+      if (config->time_constant_ms <= 0) bad = "time constant";
+      break;
+    case FILTER_TRIMMED_MEAN:
+      if (config->trim_percent < 0 || config->trim_percent > 49)
+        bad = "trim percentage";
+      // Fall through
+    case FILTER_MEDIAN:
+      if (config->window < 1 || config->window > FILTER_MAX_WINDOW)
+        bad = "window";
+      break;
+    case FILTER_KALMAN:
+      if (config->voltage_noise_mv <= 0 || config->current_noise_ua <= 0
+           || config->voltage_drift_mv < 0 || config->current_drift_ua < 0)
+        bad = "noise setting";
+      break;
+    default:
+      bad = "type";
+    }
+  if (bad)
+    {
+    if (error) asprintf (error, "Bad filter %s", bad);
+    return NULL;
+    }
+
+  SampleFilter *self = malloc (sizeof (SampleFilter));
+  memset (self, 0, sizeof (SampleFilter));
+  self->config = *config;
+  double v = config->voltage_noise_mv, i = config->current_noise_ua;
+  self->voltage.noise_var = v * v;
+  self->current.noise_var = i * i;
+  v = config->voltage_drift_mv;
+  i = config->current_drift_ua;
+  self->voltage.drift_var = v * v;
+  self->current.drift_var = i * i;
+  return self;
+  }
+
+/*============================================================================
+
+  sample_filter_destroy
+
+============================================================================*/
+void sample_filter_destroy (SampleFilter *self)
+  {
+  if (self) free (self);
+  }
+
+/*============================================================================
+
+  sample_filter_reset
+
+============================================================================*/
+void sample_filter_reset (SampleFilter *self)
+  {
+  assert (self != NULL);
+  self->count = 0;
+  self->ring_next = 0;
+  self->started = FALSE;
+  self->voltage.raw = self->voltage.value = 0;
+  self->current.raw = self->current.value = 0;
+  }
+
+/*============================================================================
+
+  filter_lower_bound
+
+  The index of the first entry in sorted[0..n-1] that is not less than
+  value.
+
+============================================================================*/
+static int filter_lower_bound (const int *sorted, int n, int value)
+  {
+  int lo = 0, hi = n;
+  while (lo < hi)
+    {
+    int mid = (lo + hi) / 2;
+    if (sorted[mid] < value) lo = mid + 1;
+    else hi = mid;
+    }
+  return lo;
+  }
+
+/*============================================================================
+
+  filter_trimmed_adjust
+
+  Adjust the sum of sorted[trim .. n-trim-1] for the reading at index
+  "old" being taken out, and "value" going in at index "pos" of the
+  result. Only the entries between the two indices move, each by one
+  place, so within the summed range the changes cancel out, except at
+  its ends. Called before sorted[] is changed.
+
+============================================================================*/
+static void filter_trimmed_adjust (FilterChannel *c, int n, int trim,
+      int old, int pos, int value)
+  {
+  const int *a = c->sorted;
+  int lo = trim, hi = n - trim - 1;
+  if (pos >= old)
+    {
+    // The entries after "old", up to "pos", move down
+    int first = old > lo ? old : lo, last = pos < hi ? pos : hi;
+    if (first <= last)
+      c->trimmed_sum += (last == pos ? value : a[last + 1]) - a[first];
+    }
+  else
+    {
+    // The entries from "pos", up to "old", move up
+    int first = pos > lo ? pos : lo, last = old < hi ? old : hi;
+    if (first <= last)
+      c->trimmed_sum += (first == pos ? value : a[first - 1]) - a[last];
+    }
+  }
+
+/*============================================================================
+
+  filter_window_update
+
+  Replace the oldest reading in the window (if it's full) with a new
+  one, keeping the sorted copy sorted, and the trimmed sum up to date.
+  Until the window is full, the number trimmed changes as it fills, so
+  the sum is just worked out again.
+
+============================================================================*/
+static void filter_window_update (FilterChannel *c, int count, int full,
+      int slot, int value, int trim_percent)
+  {
+  int n = count;
+  int pos = filter_lower_bound (c->sorted, n, value);
+  if (full)
+    {
+    int old = filter_lower_bound (c->sorted, n, c->ring[slot]);
+    // Where the new reading goes, once the old one is out
+    if (old < pos) pos--;
+    filter_trimmed_adjust (c, n, n * trim_percent / 100, old, pos, value);
+    memmove (&c->sorted[old], &c->sorted[old + 1],
+      (n - old - 1) * sizeof (int));
+    n--;
+    }
+  memmove (&c->sorted[pos + 1], &c->sorted[pos], (n - pos) * sizeof (int));
+  c->sorted[pos] = value;
+  c->ring[slot] = value;
+  if (!full)
+    {
+    n++;
+    int trim = n * trim_percent / 100;
+    c->trimmed_sum = 0;
+    for (int i = trim; i < n - trim; i++) c->trimmed_sum += c->sorted[i];
+    }
+  }
+
+/*============================================================================
+
+  filter_channel_update
+
+============================================================================*/
+static void filter_channel_update (SampleFilter *self, FilterChannel *c,
+      int value, int64_t dt_us, BOOL full, int slot)
+  {
+  const FilterConfig *config = &self->config;
+  c->raw = value;
+  if (!self->started)
+    {
+    // Start everything from the first reading, rather than from zero
+    c->ema = (int64_t)value * (1 << EMA_FRAC_BITS);
+    c->ema_rem = c->ema_div = 0;
+    c->estimate = value;
+    c->variance = c->noise_var;
+    }
+
+  switch (config->type)
+    {
+    case FILTER_NONE:
+      c->value = value;
+      break;
+
+    case FILTER_EMA:
+      {
+      // As for the smoothed current in charge.c: divide before
+      //  multiplying, and carry the remainder
+      int64_t target = (int64_t)value * (1 << EMA_FRAC_BITS);
+      int64_t diff = target - c->ema;
+      int64_t div = (int64_t)config->time_constant_ms * 1000 + dt_us;
+      int64_t rem = c->ema_rem;
+      if (c->ema_div && c->ema_div != div) rem = rem * div / c->ema_div;
+      int64_t part = diff % div * dt_us + rem;
+      c->ema += diff / div * dt_us + part / div;
+      c->ema_rem = part % div;
+      c->ema_div = div;
+      c->value = (int)(c->ema / (1 << EMA_FRAC_BITS));
+      }
+      break;
+
+    case FILTER_MEDIAN:
+    case FILTER_TRIMMED_MEAN:
+      {
+      int n = self->count;
+      filter_window_update (c, n, full, slot, value,
+        config->type == FILTER_TRIMMED_MEAN ? config->trim_percent : 0);
+      if (!full) n++;
+      if (config->type == FILTER_MEDIAN)
+        {
+        c->value = (n & 1) ? c->sorted[n / 2]
+          : (int)(((int64_t)c->sorted[n / 2 - 1] + c->sorted[n / 2]) / 2);
+        }
+      else
+        {
+        int trim = n * config->trim_percent / 100;
+        c->value = (int)(c->trimmed_sum / (n - 2 * trim));
+        }
+      }
+      break;
+
+    case FILTER_KALMAN:
+      {
+      // Predict: the true value may have wandered since the last
+      //  reading. Then correct, weighting the new reading by how
+      //  uncertain the prediction is, compared to the reading
+      c->variance += c->drift_var * (dt_us / 1e6);
+      double gain = c->variance / (c->variance + c->noise_var);
+      c->estimate += gain * (value - c->estimate);
+      c->variance *= 1 - gain;
+      c->value = (int)(c->estimate + (c->estimate >= 0 ? 0.5 : -0.5));
+      }
+      break;
+    }
+  }
+
+/*============================================================================
+
+  sample_filter_update
+
+============================================================================*/
+void sample_filter_update (SampleFilter *self, uint64_t time_ns, int mv,
+       int current_ua)
+  {
+  assert (self != NULL);
+  int64_t dt_us = 0;
+  if (self->started && time_ns > self->last_time_ns)
+    dt_us = (int64_t)(time_ns - self->last_time_ns) / 1000;
+  BOOL full = (self->count == self->config.window);
+  int slot = self->ring_next;
+  filter_channel_update (self, &self->voltage, mv, dt_us, full, slot);
+  filter_channel_update (self, &self->current, current_ua, dt_us, full,
+    slot);
+  if (self->config.window > 0)
+    {
+    if (!full) self->count++;
+    self->ring_next = (slot + 1) % self->config.window;
+    }
+  self->last_time_ns = time_ns;
+  self->started = TRUE;
+  }
+
+/*============================================================================
+
+  sample_filter_get
+
+============================================================================*/
+void sample_filter_get (const SampleFilter *self, int *mv, int *current_ua)
+  {
+  if (mv) *mv = self->voltage.value;
+  if (current_ua) *current_ua = self->current.value;
+  }
+
+/*============================================================================
+
+  sample_filter_get_raw
+
+============================================================================*/
+void sample_filter_get_raw (const SampleFilter *self, int *mv,
+       int *current_ua)
+  {
+  if (mv) *mv = self->voltage.raw;
+  if (current_ua) *current_ua = self->current.raw;
+  }
+
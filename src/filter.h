@@ -0,0 +1,112 @@
+/*============================================================================
+
+  filter.h
+
+  The SampleFilter "class" smooths a stream of battery voltage and
+  current readings, so that figures worked out from them -- above all
+  the time to full or empty, which divides by the current -- don't
+  swing wildly with every momentary change in load. With a filter in
+  place, the INA219 can be sampled fast enough to catch transients,
+  and still give stable status figures.
+
+  The filters are:
+
+  - EMA: an exponential moving average with a time constant, rather
+    than a fixed weight, so it behaves the same at any sampling rate.
+  - Median: the median of the last N readings. Ignores spikes
+    completely, as long as they last for less than half the window.
+  - Trimmed mean: the mean of the last N readings, after dropping a
+    percentage of the highest and lowest.
+  - Kalman: a scalar Kalman filter for each of voltage and current,
+    modelling each as a random walk measured with noise. It follows
+    slow changes closely, and the noise settings say how much to trust
+    each new reading.
+
+  Voltage and current are filtered separately, with the same settings.
+  Each update takes constant time (bounded by FILTER_MAX_WINDOW for the
+  windowed filters), and the filter does no allocation after it is
+  created. Both the latest raw readings and the filtered values can be
+  read back.
+
+  All times are in nanoseconds from CLOCK_MONOTONIC, as in INA219Sample.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+
+// The largest window for the median and trimmed-mean filters
+#define FILTER_MAX_WINDOW 64
+
+typedef enum _FilterType
+  {
+  FILTER_NONE = 0,
+  FILTER_EMA,
+  FILTER_MEDIAN,
+  FILTER_TRIMMED_MEAN,
+  FILTER_KALMAN
+  } FilterType;
+
+// Filter settings. Only the ones for the chosen type are used.
+typedef struct _FilterConfig
+  {
+  FilterType type;
+  // EMA: time constant in milliseconds
+  int time_constant_ms;
+  // Median and trimmed mean: number of readings, 1-FILTER_MAX_WINDOW
+  int window;
+  // Trimmed mean: percentage of readings dropped from each end, 0-49
+  int trim_percent;
+  // Kalman: standard deviation of the measurement noise, and of the
+  //  change in the true value over one second
+  int voltage_noise_mv;
+  int voltage_drift_mv;
+  int current_noise_ua;
+  int current_drift_ua;
+  } FilterConfig;
+
+struct _SampleFilter;
+typedef struct _SampleFilter SampleFilter;
+
+BEGIN_DECLS
+
+/** Fill in *config from a specification of the form
+
+      none
+      ema[:TIME_CONSTANT_MS]
+      median[:WINDOW]
+      trimmed[:WINDOW[,PERCENT]]
+      kalman[:VOLTAGE_NOISE_MV,CURRENT_NOISE_UA[,VOLTAGE_DRIFT_MV,
+        CURRENT_DRIFT_UA]]
+
+    Anything left out gets a default. */
+BOOL          sample_filter_parse (const char *spec, FilterConfig *config,
+                char **error);
+
+/** Create a filter. Fails if the settings are out of range. */
+SampleFilter *sample_filter_create (const FilterConfig *config,
+                char **error);
+
+/** Free the filter. */
+void          sample_filter_destroy (SampleFilter *self);
+
+/** Forget all readings. */
+void          sample_filter_reset (SampleFilter *self);
+
+/** Add a reading: voltage in mV, and current in uA. */
+void          sample_filter_update (SampleFilter *self, uint64_t time_ns,
+                int mv, int current_ua);
+
+/** Get the filtered voltage and current. Until the first reading,
+    both are zero. Either argument may be NULL. */
+void          sample_filter_get (const SampleFilter *self, int *mv,
+                int *current_ua);
+
+/** Get the most recent raw reading. Either argument may be NULL. */
+void          sample_filter_get_raw (const SampleFilter *self, int *mv,
+                int *current_ua);
+
+END_DECLS
+
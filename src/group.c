@@ -0,0 +1,440 @@
+/*==========================================================================
+
+    group.c
+
+    Implementation of the "methods" in group.h
+
+    Workers hand their results to ina219_group_publish(), which collects
+    them in a "pending" snapshot under a mutex. The mutex is only held
+    for a few memory copies, never across any I/O, so the workers don't
+    hold each other up in any measurable way. When all the buses have
+    contributed to the pending cycle, it is copied to the published
+    snapshot.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "defs.h"
+#include "ina219.h"
+#include "group.h"
+#include "stats.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+// The addresses that the INA219's A0 and A1 pins can select. See table
+//  1, page 14 of the datasheet
+#define MIN_ADDR 0x40
+#define MAX_ADDR 0x4F
+
+typedef struct _GroupBus GroupBus;
+
+// One device in the group
+typedef struct _GroupChannel
+  {
+  INA219 *ina219;
+  char *i2c_dev;
+  } GroupChannel;
+
+// One I2C bus, and the worker thread that samples it
+struct _GroupBus
+  {
+  INA219Group *group;
+  char *i2c_dev;
+  INA219Transport *transport; // Shared by all the devices on this bus
+  int *channels; // Indices into group->channels
+  int nchannels;
+  pthread_t thread;
+  INA219GroupReading *results; // One per channel on this bus
+  };
+
+struct _INA219Group
+  {
+  GroupChannel *channels;
+  int nchannels;
+  GroupBus *buses;
+  int nbuses;
+  BOOL running;
+  _Atomic BOOL stop;
+  long long interval_ns;
+  long long start_ns; // Deadline of cycle 1
+  pthread_mutex_t mutex; // Protects everything below
+  INA219GroupReading *pending;
+  uint64_t pending_cycle;
+  int pending_done; // Number of buses that have finished pending_cycle
+  INA219GroupReading *published;
+  uint64_t published_cycle;
+  };
+
+/*============================================================================
+
+  ina219_group_create
+
+============================================================================*/
+INA219Group *ina219_group_create (void)
+  {
+  INA219Group *self = malloc (sizeof (INA219Group));
+  memset (self, 0, sizeof (INA219Group));
+  pthread_mutex_init (&self->mutex, NULL);
+  return self;
+  }
+
+/*============================================================================
+
+  ina219_group_destroy
+
+============================================================================*/
+void ina219_group_destroy (INA219Group *self)
+  {
+  if (self)
+    {
+    ina219_group_stop (self);
+    for (int i = 0; i < self->nchannels; i++)
+      {
+      ina219_destroy (self->channels[i].ina219);
+      free (self->channels[i].i2c_dev);
+      }
+    free (self->channels);
+    pthread_mutex_destroy (&self->mutex);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  ina219_group_add
+
+============================================================================*/
+int ina219_group_add (INA219Group *self, const char *i2c_dev, int i2c_addr,
+      int shunt_milliohms, int battery_voltage_0_percent,
+      int battery_voltage_100_percent, int battery_capacity,
+      int min_charging_current)
+  {
+  assert (self != NULL);
+  assert (!self->running);
+  self->channels = realloc (self->channels,
+    (self->nchannels + 1) * sizeof (GroupChannel));
+  GroupChannel *channel = &self->channels[self->nchannels];
+  channel->ina219 = ina219_create (i2c_dev, i2c_addr, shunt_milliohms,
+    battery_voltage_0_percent, battery_voltage_100_percent,
+    battery_capacity, min_charging_current);
+  channel->i2c_dev = strdup (i2c_dev);
+  return self->nchannels++;
+  }
+
+/*============================================================================
+
+  ina219_group_load
+
+============================================================================*/
+BOOL ina219_group_load (INA219Group *self, const char *filename,
+       char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = TRUE;
+  FILE *f = fopen (filename, "r");
+  if (f)
+    {
+    char line[256];
+    int lineno = 0;
+    while (ret && fgets (line, sizeof (line), f))
+      {
+      lineno++;
+      char *p = line;
+      while (*p == ' ' || *p == '\t') p++;
+      if (*p == '#' || *p == '\n' || *p == 0) continue;
+      char dev[128];
+      int addr, shunt, v0, v100, capacity, min_current;
+      if (sscanf (p, "%127s %i %d %d %d %d %d", dev, &addr, &shunt, &v0,
+           &v100, &capacity, &min_current) != 7 || shunt <= 0 || v100 <= v0)
+        {
+        if (error) asprintf (error, "%s: line %d: bad device entry",
+          filename, lineno);
+        ret = FALSE;
+        }
+      else if (addr < MIN_ADDR || addr > MAX_ADDR)
+        {
+        if (error) asprintf (error, "%s: line %d: address 0x%02x is not "
+          "an INA219 address (0x%02x-0x%02x)", filename, lineno, addr,
+          MIN_ADDR, MAX_ADDR);
+        ret = FALSE;
+        }
+      else
+        {
+        ina219_group_add (self, dev, addr, shunt, v0, v100, capacity,
+          min_current);
+        }
+      }
+    fclose (f);
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    ret = FALSE;
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_group_count
+
+============================================================================*/
+int ina219_group_count (const INA219Group *self)
+  {
+  return self->nchannels;
+  }
+
+/*============================================================================
+
+  ina219_group_get_device
+
+============================================================================*/
+INA219 *ina219_group_get_device (const INA219Group *self, int channel)
+  {
+  assert (channel >= 0 && channel < self->nchannels);
+  return self->channels[channel].ina219;
+  }
+
+/*============================================================================
+
+  ina219_group_publish
+
+  Called by a worker when it has finished a cycle.
+
+============================================================================*/
+static void ina219_group_publish (INA219Group *self, const GroupBus *bus,
+       uint64_t cycle)
+  {
+  pthread_mutex_lock (&self->mutex);
+  if (cycle > self->pending_cycle)
+    {
+    // First bus to finish this cycle. Anything left over from an
+    //  earlier cycle was incomplete, and is thrown away
+    self->pending_cycle = cycle;
+    self->pending_done = 0;
+    }
+  if (cycle == self->pending_cycle)
+    {
+    for (int i = 0; i < bus->nchannels; i++)
+      self->pending[bus->channels[i]] = bus->results[i];
+    if (++self->pending_done == self->nbuses)
+      {
+      memcpy (self->published, self->pending,
+        self->nchannels * sizeof (INA219GroupReading));
+      self->published_cycle = cycle;
+      }
+    }
+  // else this bus is so late that other buses have moved on -- drop it
+  pthread_mutex_unlock (&self->mutex);
+  }
+
+/*============================================================================
+
+  ina219_group_worker
+
+============================================================================*/
+static void *ina219_group_worker (void *arg)
+  {
+  GroupBus *bus = arg;
+  INA219Group *self = bus->group;
+  uint64_t cycle = 1;
+
+  while (!atomic_load (&self->stop))
+    {
+    long long deadline = self->start_ns + (cycle - 1) * self->interval_ns;
+    struct timespec ts;
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+        == EINTR)
+      ;
+    if (atomic_load (&self->stop)) break;
+    INA219_STATS_RECORD (INA219_HIST_LATENESS,
+      ina219_stats_now () - deadline);
+
+    for (int i = 0; i < bus->nchannels; i++)
+      {
+      INA219 *ina219 = self->channels[bus->channels[i]].ina219;
+      // A device that is backing off after a failure is skipped
+      //  without any bus traffic, so it doesn't hold up the others
+      bus->results[i].valid = ina219_sample_resilient_e (ina219, FALSE,
+        &bus->results[i].sample, &bus->results[i].error)
+        == INA219_READ_OK;
+      }
+    ina219_group_publish (self, bus, cycle);
+
+    // Move on to the next cycle whose deadline is still in the future,
+    //  so that a stall on this bus doesn't make it fire a burst of
+    //  readings to catch up
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    long long now = (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    cycle++;
+    if (self->start_ns + (long long)(cycle - 1) * self->interval_ns <= now)
+      {
+      uint64_t next = (now - self->start_ns) / self->interval_ns + 2;
+      INA219_STATS_MISSED (next - cycle);
+      cycle = next;
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  ina219_group_close_buses
+
+============================================================================*/
+static void ina219_group_close_buses (INA219Group *self)
+  {
+  for (int i = 0; i < self->nchannels; i++)
+    ina219_uninit (self->channels[i].ina219);
+  for (int i = 0; i < self->nbuses; i++)
+    {
+    GroupBus *bus = &self->buses[i];
+    ina219_transport_close (bus->transport);
+    free (bus->i2c_dev);
+    free (bus->channels);
+    free (bus->results);
+    }
+  free (self->buses);
+  self->buses = NULL;
+  self->nbuses = 0;
+  free (self->pending);
+  free (self->published);
+  self->pending = self->published = NULL;
+  }
+
+/*============================================================================
+
+  ina219_group_start
+
+============================================================================*/
+BOOL ina219_group_start (INA219Group *self, int interval_ms, char **error)
+  {
+  assert (self != NULL);
+  if (self->running) return TRUE;
+  BOOL ret = TRUE;
+
+  // Work out which buses we need, and which channels are on each
+  self->buses = calloc (self->nchannels, sizeof (GroupBus));
+  self->nbuses = 0;
+  for (int i = 0; i < self->nchannels; i++)
+    {
+    GroupBus *bus = NULL;
+    for (int j = 0; j < self->nbuses && !bus; j++)
+      if (strcmp (self->buses[j].i2c_dev, self->channels[i].i2c_dev) == 0)
+        bus = &self->buses[j];
+    if (!bus)
+      {
+      bus = &self->buses[self->nbuses++];
+      bus->group = self;
+      bus->i2c_dev = strdup (self->channels[i].i2c_dev);
+      bus->channels = calloc (self->nchannels, sizeof (int));
+      bus->results = calloc (self->nchannels, sizeof (INA219GroupReading));
+      }
+    bus->channels[bus->nchannels++] = i;
+    }
+
+  for (int i = 0; i < self->nbuses && ret; i++)
+    {
+    GroupBus *bus = &self->buses[i];
+    bus->transport = ina219_transport_open (bus->i2c_dev, error);
+    if (!bus->transport) ret = FALSE;
+    for (int j = 0; j < bus->nchannels && ret; j++)
+      ret = ina219_init_transport (self->channels[bus->channels[j]].ina219,
+        bus->transport, error);
+    }
+
+  if (ret)
+    {
+    self->pending = calloc (self->nchannels, sizeof (INA219GroupReading));
+    self->published = calloc (self->nchannels,
+      sizeof (INA219GroupReading));
+    self->pending_cycle = 0;
+    self->pending_done = 0;
+    self->published_cycle = 0;
+    self->interval_ns = (long long)(interval_ms > 0 ? interval_ms : 1)
+      * 1000000LL;
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    self->start_ns = (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    atomic_store (&self->stop, FALSE);
+
+    int started = 0;
+    for (int i = 0; i < self->nbuses && ret; i++)
+      {
+      int err = pthread_create (&self->buses[i].thread, NULL,
+        ina219_group_worker, &self->buses[i]);
+      if (err == 0)
+        started++;
+      else
+        {
+        if (error) asprintf (error, "Can't start sampling thread: %s",
+          strerror (err));
+        ret = FALSE;
+        }
+      }
+    if (!ret)
+      {
+      atomic_store (&self->stop, TRUE);
+      for (int i = 0; i < started; i++)
+        pthread_join (self->buses[i].thread, NULL);
+      }
+    }
+
+  if (ret)
+    self->running = TRUE;
+  else
+    ina219_group_close_buses (self);
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_group_stop
+
+============================================================================*/
+void ina219_group_stop (INA219Group *self)
+  {
+  assert (self != NULL);
+  if (!self->running) return;
+  atomic_store (&self->stop, TRUE);
+  for (int i = 0; i < self->nbuses; i++)
+    pthread_join (self->buses[i].thread, NULL);
+  ina219_group_close_buses (self);
+  self->running = FALSE;
+  }
+
+/*============================================================================
+
+  ina219_group_get_snapshot
+
+============================================================================*/
+uint64_t ina219_group_get_snapshot (const INA219Group *self,
+           INA219GroupReading *readings)
+  {
+  INA219Group *group = (INA219Group *)self; // For the mutex
+  uint64_t cycle = 0;
+  pthread_mutex_lock (&group->mutex);
+  if (group->running && group->published_cycle > 0)
+    {
+    memcpy (readings, group->published,
+      group->nchannels * sizeof (INA219GroupReading));
+    cycle = group->published_cycle;
+    }
+  pthread_mutex_unlock (&group->mutex);
+  return cycle;
+  }
+
@@ -0,0 +1,107 @@
+/*============================================================================
+
+  group.h
+
+  The INA219Group "class" samples a number of INA219 devices, which may
+  be spread across several I2C buses. One worker thread is started for
+  each bus, so different buses are sampled in parallel, while devices
+  on the same bus are read one after the other. Each bus is opened only
+  once, and its transport is shared by all the devices on it.
+
+  All the workers sample on the same schedule of absolute deadlines, so
+  cycle N on one bus is taken at (very nearly) the same time as cycle N
+  on all the others. When every bus has finished a cycle, the results
+  are published as a single snapshot. A snapshot therefore never mixes
+  readings from different cycles. If a bus falls behind, the cycles it
+  missed are not published at all.
+
+  The usual call sequence is
+
+    INA219Group *group = ina219_group_create ();
+    ina219_group_add (group, "/dev/i2c-1", 0x40, ...);
+    ...
+    if (ina219_group_start (group, interval_ms, &error))
+      {
+      ... ina219_group_get_snapshot (group, readings); ...
+      ina219_group_stop (group);
+      }
+    ina219_group_destroy (group);
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+struct _INA219Group;
+typedef struct _INA219Group INA219Group;
+
+// One channel's entry in a snapshot. "valid" is FALSE if the device
+//  could not be read in this cycle, and "error" then says why. Devices
+//  are read with ina219_sample_resilient_e(), so a device that has
+//  stopped answering stays invalid, without being read, until its 
+//  backoff is over; it is then probed and reconfigured. The bus itself
+//  is not reopened, as the other devices on it are still using it.
+typedef struct _INA219GroupReading
+  {
+  INA219Sample sample;
+  BOOL valid;
+  INA219Error error;
+  } INA219GroupReading;
+
+BEGIN_DECLS
+
+/** Create an empty group. */
+INA219Group *ina219_group_create (void);
+
+/** Stop the group if necessary, and free it and all its devices. */
+void         ina219_group_destroy (INA219Group *self);
+
+/** Add a device. The arguments are the same as for ina219_create().
+    Returns the channel number, which is the index of this device's
+    reading in a snapshot. Channels must all be added before _start(). */
+int          ina219_group_add (INA219Group *self, const char *i2c_dev,
+               int i2c_addr, int shunt_milliohms,
+               int battery_voltage_0_percent,
+               int battery_voltage_100_percent, int battery_capacity,
+               int min_charging_current);
+
+/** Add devices from a file, one per line, in the form
+
+      i2c_dev address shunt_mohm 0%_mV 100%_mV capacity_mAh min_mA
+
+    for example,
+
+      /dev/i2c-1 0x42 100 6000 8260 2400 10
+
+    Blank lines, and lines starting with #, are ignored. An address
+    outside the INA219's range, 0x40 to 0x4F, is an error. */
+BOOL         ina219_group_load (INA219Group *self, const char *filename,
+               char **error);
+
+/** Get the number of channels in the group. */
+int          ina219_group_count (const INA219Group *self);
+
+/** Get the INA219 object for a channel. This can be used with
+    ina219_status_from_raw() to interpret a snapshot, but must not
+    be used for I/O while the group is running. */
+INA219      *ina219_group_get_device (const INA219Group *self, int channel);
+
+/** Open the buses, and start one sampling thread per bus. */
+BOOL         ina219_group_start (INA219Group *self, int interval_ms,
+               char **error);
+
+/** Stop the sampling threads, and close the buses. */
+void         ina219_group_stop (INA219Group *self);
+
+/** Copy the most recent complete snapshot into "readings", which must
+    have space for _count() entries. Returns the cycle number of the
+    snapshot, which increases by one for each sampling interval, or
+    zero if no cycle has been completed yet. */
+uint64_t     ina219_group_get_snapshot (const INA219Group *self,
+               INA219GroupReading *readings);
+
+END_DECLS
+
@@ -0,0 +1,419 @@
+/*==========================================================================
+
+    history.c
+
+    Implementation of the "methods" in history.h
+
+    The file is a header, followed by each tier in turn. A tier is a
+    table of the period (time / resolution) that each slot holds, then
+    one array of buckets for each metric. All the offsets are worked
+    out when the file is created, and kept in the header, so a reader
+    doesn't need to know how they were arrived at.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "history.h"
+
+#define FILE_MAGIC "INA219RR"
+#define FILE_VERSION 1
+
+// An empty slot has this period, which no real time maps to
+#define NO_PERIOD INT64_MIN
+
+static const HistoryTier default_tiers[] =
+  {
+  { 1, 3600 }, // An hour of seconds
+  { 60, 10080 }, // A week of minutes
+  { 3600, 8784 } // A (leap) year of hours
+  };
+
+typedef struct _TierHeader
+  {
+  int32_t resolution_s;
+  int32_t slots;
+  uint64_t periods_offset; // int64_t[slots]
+  uint64_t buckets_offset[HISTORY_METRICS]; // HistoryBucket[slots] each
+  } TierHeader;
+
+typedef struct _FileHeader
+  {
+  char magic[8];
+  uint32_t version;
+  uint32_t ntiers;
+  int64_t latest; // Time of the most recent reading
+  TierHeader tiers[HISTORY_MAX_TIERS];
+  } FileHeader;
+
+typedef struct _HistoryBucket
+  {
+  int32_t min;
+  int32_t max;
+  int32_t last;
+  uint32_t count;
+  int64_t sum;
+  } HistoryBucket;
+
+// Pointers into the mapping for one tier
+typedef struct _TierMap
+  {
+  int resolution_s;
+  int slots;
+  int64_t *periods;
+  HistoryBucket *buckets[HISTORY_METRICS];
+  } TierMap;
+
+struct _HistoryStore
+  {
+  int fd;
+  BYTE *map;
+  size_t map_size;
+  FileHeader *header;
+  TierMap tiers[HISTORY_MAX_TIERS];
+  int ntiers;
+  };
+
+/*============================================================================
+
+  history_period
+
+  The period that a time falls in, rounding towards minus infinity.
+
+============================================================================*/
+static inline int64_t history_period (int64_t t, int resolution_s)
+  {
+  int64_t p = t / resolution_s;
+  if (t < 0 && p * resolution_s != t) p--;
+  return p;
+  }
+
+/*============================================================================
+
+  history_layout
+
+  Work out the offsets of the tiers in a new file, and its size.
+
+============================================================================*/
+static size_t history_layout (FileHeader *h, const HistoryTier *tiers,
+      int ntiers)
+  {
+  size_t offset = sizeof (FileHeader);
+  h->ntiers = ntiers;
+  for (int i = 0; i < ntiers; i++)
+    {
+    TierHeader *t = &h->tiers[i];
+    t->resolution_s = tiers[i].resolution_s;
+    t->slots = tiers[i].slots;
+    t->periods_offset = offset;
+    offset += (size_t)t->slots * sizeof (int64_t);
+    for (int m = 0; m < HISTORY_METRICS; m++)
+      {
+      t->buckets_offset[m] = offset;
+      offset += (size_t)t->slots * sizeof (HistoryBucket);
+      }
+    }
+  return offset;
+  }
+
+/*============================================================================
+
+  history_store_attach
+
+  Set up the tier pointers from the header of a mapped file. Fails if
+  the header doesn't describe a file of this size.
+
+============================================================================*/
+static BOOL history_store_attach (HistoryStore *self)
+  {
+  const FileHeader *h = self->header;
+  if (h->ntiers < 1 || h->ntiers > HISTORY_MAX_TIERS) return FALSE;
+  self->ntiers = h->ntiers;
+  for (int i = 0; i < self->ntiers; i++)
+    {
+    const TierHeader *th = &h->tiers[i];
+    TierMap *t = &self->tiers[i];
+    if (th->resolution_s < 1 || th->slots < 1) return FALSE;
+    size_t bytes = (size_t)th->slots * sizeof (HistoryBucket);
+    if (th->periods_offset + (size_t)th->slots * sizeof (int64_t)
+         > self->map_size)
+      return FALSE;
+    t->resolution_s = th->resolution_s;
+    t->slots = th->slots;
+    t->periods = (int64_t *)(self->map + th->periods_offset);
+    for (int m = 0; m < HISTORY_METRICS; m++)
+      {
+      if (th->buckets_offset[m] + bytes > self->map_size) return FALSE;
+      t->buckets[m] = (HistoryBucket *)(self->map + th->buckets_offset[m]);
+      }
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  history_store_open
+
+============================================================================*/
+HistoryStore *history_store_open (const char *filename,
+                const HistoryTier *tiers, int ntiers, BOOL read_only,
+                char **error)
+  {
+  if (!tiers)
+    {
+    tiers = default_tiers;
+    ntiers = sizeof (default_tiers) / sizeof (default_tiers[0]);
+    }
+  if (ntiers < 1 || ntiers > HISTORY_MAX_TIERS)
+    {
+    if (error) asprintf (error, "A history needs 1 to %d tiers",
+      HISTORY_MAX_TIERS);
+    return NULL;
+    }
+
+  HistoryStore *self = malloc (sizeof (HistoryStore));
+  memset (self, 0, sizeof (HistoryStore));
+  BOOL ok = FALSE;
+  self->fd = open (filename, read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  if (self->fd >= 0)
+    {
+    struct stat sb;
+    fstat (self->fd, &sb);
+    BOOL created = FALSE;
+    FileHeader h;
+    if (sb.st_size == 0 && !read_only)
+      {
+      // New file -- lay it out, and size it
+      memset (&h, 0, sizeof (h));
+      self->map_size = history_layout (&h, tiers, ntiers);
+      if (ftruncate (self->fd, self->map_size) == 0)
+        created = TRUE;
+      else if (error)
+        asprintf (error, "Can't extend %s: %s", filename, strerror (errno));
+      }
+    else if (pread (self->fd, &h, sizeof (h), 0) == sizeof (h)
+           && memcmp (h.magic, FILE_MAGIC, 8) == 0
+           && h.version == FILE_VERSION)
+      {
+      self->map_size = sb.st_size;
+      }
+    else
+      {
+      if (error) asprintf (error, "%s is not a history file", filename);
+      }
+
+    if (self->map_size > 0)
+      {
+      void *map = mmap (NULL, self->map_size,
+        read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED,
+        self->fd, 0);
+      if (map != MAP_FAILED)
+        {
+        self->map = map;
+        self->header = (FileHeader *)map;
+        if (created)
+          {
+          *self->header = h;
+          memcpy (self->header->magic, FILE_MAGIC, 8);
+          self->header->version = FILE_VERSION;
+          self->header->latest = 0;
+          }
+        ok = history_store_attach (self);
+        if (created && ok)
+          {
+          for (int i = 0; i < self->ntiers; i++)
+            for (int s = 0; s < self->tiers[i].slots; s++)
+              self->tiers[i].periods[s] = NO_PERIOD;
+          }
+        if (!ok && error)
+          asprintf (error, "%s is damaged", filename);
+        }
+      else
+        {
+        self->map_size = 0;
+        if (error) asprintf (error, "Can't map %s: %s", filename,
+          strerror (errno));
+        }
+      }
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    }
+
+  if (!ok)
+    {
+    history_store_close (self);
+    self = NULL;
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  history_store_close
+
+============================================================================*/
+void history_store_close (HistoryStore *self)
+  {
+  if (self)
+    {
+    if (self->map)
+      {
+      msync (self->map, self->map_size, MS_SYNC);
+      munmap (self->map, self->map_size);
+      }
+    if (self->fd >= 0) close (self->fd);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  history_store_sync
+
+============================================================================*/
+void history_store_sync (HistoryStore *self)
+  {
+  assert (self != NULL);
+  msync (self->map, self->map_size, MS_ASYNC);
+  }
+
+/*============================================================================
+
+  history_bucket_add
+
+============================================================================*/
+static inline void history_bucket_add (HistoryBucket *b, BOOL fresh,
+      int value)
+  {
+  if (fresh)
+    {
+    b->min = b->max = b->last = value;
+    b->count = 1;
+    b->sum = value;
+    return;
+    }
+  if (value < b->min) b->min = value;
+  if (value > b->max) b->max = value;
+  b->last = value;
+  b->count++;
+  b->sum += value;
+  }
+
+/*============================================================================
+
+  history_store_add
+
+============================================================================*/
+void history_store_add (HistoryStore *self, time_t time, int mv,
+       int current_ua)
+  {
+  assert (self != NULL);
+  int values[HISTORY_METRICS];
+  values[HISTORY_VOLTAGE] = mv;
+  values[HISTORY_CURRENT] = current_ua;
+  values[HISTORY_POWER] = (int)((int64_t)mv * current_ua / 1000000);
+
+  for (int i = 0; i < self->ntiers; i++)
+    {
+    TierMap *t = &self->tiers[i];
+    int64_t period = history_period (time, t->resolution_s);
+    int slot = (int)(((period % t->slots) + t->slots) % t->slots);
+    BOOL fresh = FALSE;
+    if (t->periods[slot] != period)
+      {
+      // The slot holds an older period, or is empty. Unless it holds a
+      //  newer one, in which case this reading is too old to keep
+      if (t->periods[slot] != NO_PERIOD && t->periods[slot] > period)
+        continue;
+      t->periods[slot] = period;
+      fresh = TRUE;
+      }
+    for (int m = 0; m < HISTORY_METRICS; m++)
+      history_bucket_add (&t->buckets[m][slot], fresh, values[m]);
+    }
+  if (time > self->header->latest) self->header->latest = time;
+  }
+
+/*============================================================================
+
+  history_store_get_latest
+
+============================================================================*/
+time_t history_store_get_latest (const HistoryStore *self)
+  {
+  return (time_t)self->header->latest;
+  }
+
+/*============================================================================
+
+  history_store_query
+
+============================================================================*/
+BOOL history_store_query (const HistoryStore *self, HistoryMetric metric,
+       time_t from, time_t to, HistoryStats *stats)
+  {
+  assert (self != NULL);
+  assert (metric >= 0 && metric < HISTORY_METRICS);
+  memset (stats, 0, sizeof (HistoryStats));
+  if (to <= from) return FALSE;
+
+  // The finest tier whose oldest bucket is no later than the start of
+  //  the window; or the coarsest, if none goes back that far
+  int64_t latest = self->header->latest;
+  const TierMap *t = &self->tiers[self->ntiers - 1];
+  for (int i = 0; i < self->ntiers; i++)
+    {
+    const TierMap *c = &self->tiers[i];
+    int64_t oldest = (history_period (latest, c->resolution_s)
+      - c->slots + 1) * c->resolution_s;
+    if (oldest <= from)
+      {
+      t = c;
+      break;
+      }
+    }
+  stats->resolution_s = t->resolution_s;
+
+  int64_t first = history_period (from, t->resolution_s);
+  int64_t last = history_period (to - 1, t->resolution_s);
+  // No point looking at more periods than there are slots
+  if (last - first >= t->slots) first = last - t->slots + 1;
+
+  const HistoryBucket *buckets = t->buckets[metric];
+  int64_t sum = 0;
+  int64_t last_period = NO_PERIOD;
+  for (int64_t p = first; p <= last; p++)
+    {
+    int slot = (int)(((p % t->slots) + t->slots) % t->slots);
+    if (t->periods[slot] != p) continue;
+    const HistoryBucket *b = &buckets[slot];
+    if (b->count == 0) continue;
+    if (stats->count == 0 || b->min < stats->min) stats->min = b->min;
+    if (stats->count == 0 || b->max > stats->max) stats->max = b->max;
+    stats->count += b->count;
+    sum += b->sum;
+    if (p > last_period)
+      {
+      last_period = p;
+      stats->last = b->last;
+      }
+    }
+  if (stats->count == 0) return FALSE;
+  stats->mean = (double)sum / stats->count;
+  return TRUE;
+  }
+
@@ -0,0 +1,108 @@
+/*============================================================================
+
+  history.h
+
+  The HistoryStore "class" keeps a summary of battery voltage, current,
+  and power over time, at several resolutions, in a file of fixed
+  size -- a round-robin database, in effect. With the default tiers,
+  it holds one-second buckets for an hour, one-minute buckets for a
+  week, and one-hour buckets for a year, in about 1.8Mb, so questions
+  like "what was the peak current yesterday?" can be answered on the
+  device, without any external database.
+
+  Each bucket holds the minimum, maximum, sum, and count of the
+  readings that fell into it, and the last one. Every reading updates
+  one bucket in each tier, so there is no separate consolidation step.
+  Each tier is a ring of buckets: a bucket is reused when its time
+  comes round again, and a table of the period each bucket currently
+  holds tells stale buckets from current ones.
+
+  The file is mapped into memory, and laid out with the buckets of
+  each tier and metric in one contiguous array, so a query is a
+  straight scan through memory. A query over a time window uses only
+  the finest tier that still reaches back to the start of the window,
+  so it never looks at more buckets than one tier holds: a year-long
+  query reads a few thousand hourly buckets.
+
+  Times are whole seconds of wall-clock (Unix) time, so that the
+  history makes sense across restarts. Buckets are aligned to
+  multiples of their resolution, so a query window is effectively
+  widened to whole buckets at each end.
+
+  A store can be read by one program while another writes it, but a
+  reader may see a bucket that is half-way through being updated.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// The most tiers that a store can have
+#define HISTORY_MAX_TIERS 8
+
+// The quantities that are recorded
+typedef enum _HistoryMetric
+  {
+  HISTORY_VOLTAGE = 0, // mV
+  HISTORY_CURRENT, // uA, positive when charging
+  HISTORY_POWER, // mW, positive when charging
+  HISTORY_METRICS
+  } HistoryMetric;
+
+// One tier: buckets of resolution_s seconds, and how many of them
+typedef struct _HistoryTier
+  {
+  int resolution_s;
+  int slots;
+  } HistoryTier;
+
+// The summary of a metric over a time window
+typedef struct _HistoryStats
+  {
+  uint64_t count; // Number of readings; zero if there were none
+  int min;
+  int max;
+  int last;
+  double mean;
+  int resolution_s; // Resolution of the tier that was used
+  } HistoryStats;
+
+struct _HistoryStore;
+typedef struct _HistoryStore HistoryStore;
+
+BEGIN_DECLS
+
+/** Open a store, creating it if it doesn't exist. A new store gets the
+    given tiers, which must be in order of increasing resolution, or
+    the defaults if tiers is NULL. An existing store keeps the tiers it
+    was created with. If read_only is TRUE, the file must exist, and
+    _add() must not be called. */
+HistoryStore *history_store_open (const char *filename,
+                const HistoryTier *tiers, int ntiers, BOOL read_only,
+                char **error);
+
+/** Flush and close the store. */
+void          history_store_close (HistoryStore *self);
+
+/** Add a reading. Readings older than the most recent one are added
+    to whatever buckets still cover their times. */
+void          history_store_add (HistoryStore *self, time_t time,
+                int mv, int current_ua);
+
+/** Summarize a metric over the window [from, to). Returns FALSE if
+    there were no readings in the window. */
+BOOL          history_store_query (const HistoryStore *self,
+                HistoryMetric metric, time_t from, time_t to,
+                HistoryStats *stats);
+
+/** Get the time of the most recent reading, or 0 if there are none. */
+time_t        history_store_get_latest (const HistoryStore *self);
+
+/** Ask the kernel to start writing changes to the file. */
+void          history_store_sync (HistoryStore *self);
+
+END_DECLS
+
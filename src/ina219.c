@@ -18,20 +18,51 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
 #include <sys/time.h>
-#include <linux/i2c.h>
-#include <linux/i2c-dev.h>
+#include <time.h>
 #include "defs.h" 
 #include "ina219.h" 
+#include "transport.h" 
+#include "stats.h" 
 
-// INA219 registers that are used by this implementation.
-// See page 18 of the datasheet for others
+// INA219 registers. See page 18 of the datasheet
+// Configuration
+#define CONFIG_REG  0
 // Shunt voltage
-#define SHUNT_REG 1
+#define SHUNT_REG   1
 // Bus voltage
-#define BUS_REG   2
+#define BUS_REG     2
+// Power -- only meaningful after calibration
+#define POWER_REG   3
+// Current -- only meaningful after calibration
+#define CURRENT_REG 4
+// Calibration
+#define CALIB_REG   5
+
+// The largest number of registers that can be read in one transaction
+//  by ina219_read_registers()
+#define MAX_BATCH 6
+#if MAX_BATCH > INA219_TRANSPORT_MAX_BATCH
+#error MAX_BATCH is larger than transports support
+#endif
+
+// Layout of the configuration register. See page 19 of the datasheet
+#define CONFIG_RESET      0x8000
+#define CONFIG_BRNG_SHIFT 13
+#define CONFIG_PG_SHIFT   11
+#define CONFIG_BADC_SHIFT 7
+#define CONFIG_SADC_SHIFT 3
+#define CONFIG_MODE_SHIFT 0
+// Bit 2 of the mode selects continuous conversion
+#define MODE_CONTINUOUS   4
+
+// The longest we will wait for a conversion beyond its expected
+//  completion time, before deciding that the chip has stopped converting
+#define CONVERSION_TIMEOUT_NS 20000000LL
+
+// While a device is backing off, ina219_sample_resilient_e() with 
+//  wait TRUE sleeps for no longer than this at a time
+#define BACKOFF_NAP_NS 100000000ULL
 
 // INA219 structure -- stores all internal data related to this
 //  INA219 instance
@@ -39,15 +70,204 @@ struct _INA219
   {
   char *i2c_dev; // E.g., /dev/i2c-1
   int i2c_addr;  // E.g., 0x43
-  int fd; // For the /dev/i2c-N device
+  INA219Transport *transport; // Carries the register reads and writes
+  BOOL owns_transport; // FALSE if supplied by ina219_init_transport()
   // The following are battery and system properties passed by the caller.
-  int shunt_milliohms; 
-  int battery_voltage_0_percent;
-  int battery_voltage_100_percent;
-  int battery_capacity;
-  int min_charging_current;
+  INA219Battery battery;
+  // The following are set by ina219_configure()
+  BOOL configured;
+  INA219Config config;
+  int current_lsb_ua; // Value of one bit in the current register, in uA
+  uint16_t calibration;
+  // Used by ina219_acquire() -- the CLOCK_MONOTONIC time at which the 
+  //  next conversion is expected to be complete
+  uint64_t next_conversion_ns;
+  // Used by ina219_sample_resilient_e()
+  INA219Recovery recovery;
+  BOOL failing; // Between a failed read and a successful one
+  int recoveries_failed; // In a row, in this outage
+  int backoff_ms; // The wait before the next recovery attempt, unjittered
+  uint64_t recover_at_ns; // CLOCK_MONOTONIC
+  unsigned int jitter_seed;
+  INA219Error outage_error; // The failure that started the outage
   };
 
+/*============================================================================
+
+  ina219_error_set
+
+  Fill in the caller's INA219Error, if it supplied one.
+
+============================================================================*/
+static void ina219_error_set (const INA219 *self, INA219Error *e, 
+       INA219Op op, int reg, int code, int attempts)
+  {
+  if (e)
+    {
+    e->code = code;
+    e->op = op;
+    e->reg = reg;
+    e->attempts = attempts;
+    e->addr = self->i2c_addr;
+    e->device = self->i2c_dev;
+    }
+  }
+
+/*============================================================================
+
+  ina219_error_string
+
+  Used by the char** wrappers: if ok is FALSE, set *error to an 
+  allocated copy of the message for *e. Returns ok.
+
+============================================================================*/
+static BOOL ina219_error_string (BOOL ok, const INA219Error *e, 
+       char **error)
+  {
+  if (!ok && error)
+    {
+    char buf[256];
+    ina219_error_format (e, buf, sizeof (buf));
+    *error = strdup (buf);
+    }
+  return ok;
+  }
+
+/*============================================================================
+
+  ina219_error_format
+
+============================================================================*/
+int ina219_error_format (const INA219Error *e, char *buf, size_t size)
+  {
+  static const char *reg_names[6] = 
+    {
+    "configuration", "shunt voltage", "bus voltage", "power", "current",
+    "calibration"
+    };
+  char reason[128];
+  // GNU strerror_r() may return a static string rather than fill in 
+  //  the buffer, but either way it doesn't allocate
+  const char *why = strerror_r (e->code, reason, sizeof (reason));
+  const char *device = e->device ? e->device : "I2C device";
+  char reg[32] = "";
+  if (e->reg >= 0 && e->reg < 6) 
+    snprintf (reg, sizeof (reg), " %s register", reg_names[e->reg]);
+  char attempts[32] = "";
+  if (e->attempts > 1) 
+    snprintf (attempts, sizeof (attempts), " (%d attempts)", e->attempts);
+
+  switch (e->op)
+    {
+    case INA219_OP_NONE:
+      return snprintf (buf, size, "No error");
+    case INA219_OP_OPEN:
+      return snprintf (buf, size, "Can't open I2C device %s: %s", 
+        device, why);
+    case INA219_OP_PROBE:
+      return snprintf (buf, size, "Can't initialize I2C device %s "
+        "at 0x%02x: %s", device, e->addr, why);
+    case INA219_OP_READ:
+      return snprintf (buf, size, "Failed to read%s of %s at 0x%02x%s: %s",
+        reg, device, e->addr, attempts, why);
+    case INA219_OP_WRITE:
+      return snprintf (buf, size, "Failed to write%s of %s at 0x%02x%s: "
+        "%s", reg, device, e->addr, attempts, why);
+    case INA219_OP_CONVERT:
+      if (e->code == EINVAL)
+        return snprintf (buf, size, "INA219 is not configured to convert");
+      return snprintf (buf, size, "Timed out waiting for INA219 "
+        "conversion%s", attempts);
+    case INA219_OP_CALIBRATION:
+      return snprintf (buf, size, "The%s is not calibrated", reg);
+    }
+  return snprintf (buf, size, "%s", why);
+  }
+
+/*============================================================================
+
+  ina219_error_transient
+
+  Whether a transport error is one that may not happen again if the
+  operation is repeated straight away. ENXIO and EREMOTEIO are what
+  i2c-dev reports when the device doesn't acknowledge; EAGAIN and 
+  ETIMEDOUT when the adapter lost arbitration or the bus was held.
+  Errors like EBUSY and ENODEV won't go away on their own.
+
+============================================================================*/
+static BOOL ina219_error_transient (int err)
+  {
+  return err == EREMOTEIO || err == ENXIO || err == EAGAIN 
+    || err == ETIMEDOUT || err == EIO;
+  }
+
+/*============================================================================
+
+  ina219_read_registers
+
+  Read up to MAX_BATCH registers in one transport operation. With the
+  i2c-dev transport this is a single I2C_RDWR call, so the readings are
+  taken as close together in time as the bus allows. A failure is 
+  reported against the first register. Transient failures are retried 
+  at once, up to recovery.retries times.
+
+============================================================================*/
+static BOOL ina219_read_registers (const INA219 *self, const BYTE *regs,
+       uint16_t *values, int n, INA219Error *e)
+  {
+  assert (self != NULL);
+  assert (self->transport != NULL); // Don't allow this before _init()
+  assert (n > 0 && n <= MAX_BATCH);
+  int attempts = 0;
+  int err;
+  do
+    {
+    if (attempts++ > 0)
+      {
+      INA219_STATS_RETRY (regs[0]);
+      }
+    INA219_STATS_START (start);
+    err = ina219_transport_read_registers (self->transport, 
+      self->i2c_addr, regs, values, n);
+    INA219_STATS_STOP (INA219_HIST_READ, start);
+    INA219_STATS_REGISTERS (regs, n, FALSE, err == 0);
+    } while (err != 0 && attempts <= self->recovery.retries 
+        && ina219_error_transient (err));
+  if (err == 0) return TRUE;
+  ina219_error_set (self, e, INA219_OP_READ, regs[0], err, attempts);
+  return FALSE;
+  }
+
+/*============================================================================
+
+  ina219_register_write_16
+
+============================================================================*/
+static BOOL ina219_register_write_16 (const INA219 *self, BYTE reg, 
+       uint16_t data, INA219Error *e)
+  {
+  assert (self != NULL);
+  assert (self->transport != NULL);
+  int attempts = 0;
+  int err;
+  do
+    {
+    if (attempts++ > 0)
+      {
+      INA219_STATS_RETRY (reg);
+      }
+    INA219_STATS_START (start);
+    err = ina219_transport_write_register (self->transport, 
+      self->i2c_addr, reg, data);
+    INA219_STATS_STOP (INA219_HIST_WRITE, start);
+    INA219_STATS_REGISTERS (&reg, 1, TRUE, err == 0);
+    } while (err != 0 && attempts <= self->recovery.retries 
+        && ina219_error_transient (err));
+  if (err == 0) return TRUE;
+  ina219_error_set (self, e, INA219_OP_WRITE, reg, err, attempts);
+  return FALSE;
+  }
+
 /*============================================================================
 
   ina219_register_read_16
@@ -63,86 +283,587 @@ struct _INA219
   into this choice -- it just reduces the amount of ugly casting in 
   other parts of the code.
 
-  This method can fail, but it's highly unlikely if _init() suceeded.  
+  How the pointer write and the data read get to the device is up to
+  the transport (see transport.h).
+
+  This method can fail, even if _init() suceeded -- see 
+  ina219_read_registers() for the retries.
 
 ============================================================================*/
 static BOOL ina219_register_read_16 (const INA219 *self, BYTE reg, 
-       int16_t *data, char **error)
+       int16_t *data, INA219Error *e)
+  {
+  uint16_t value;
+  BOOL ret = ina219_read_registers (self, &reg, &value, 1, e);
+  if (ret) *data = (int16_t)value;
+  return ret;
+  } 
+
+/*============================================================================
+
+  ina219_get_raw_e
+
+============================================================================*/
+BOOL ina219_get_raw_e (const INA219 *self, int16_t *shunt_reg, 
+       uint16_t *bus_reg, INA219Error *e)
+  {
+  static const BYTE regs[2] = { SHUNT_REG, BUS_REG };
+  uint16_t values[2];
+  BOOL ret = ina219_read_registers (self, regs, values, 2, e);
+  if (ret)
+    {
+    *shunt_reg = (int16_t)values[0];
+    *bus_reg = values[1];
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_get_shunt_raw_e
+
+============================================================================*/
+BOOL ina219_get_shunt_raw_e (const INA219 *self, int16_t *shunt_reg, 
+       INA219Error *e)
+  {
+  return ina219_register_read_16 (self, SHUNT_REG, shunt_reg, e);
+  }
+
+/*============================================================================
+
+  ina219_get_raw
+
+============================================================================*/
+BOOL ina219_get_raw (const INA219 *self, int16_t *shunt_reg, 
+       uint16_t *bus_reg, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_raw_e (self, shunt_reg, bus_reg, 
+    &e), &e, error);
+  }
+
+/*============================================================================
+
+  ina219_sample_e
+
+  Take a timestamped raw reading. The timestamp is taken from 
+  CLOCK_MONOTONIC just before the bus transaction starts.
+
+============================================================================*/
+BOOL ina219_sample_e (const INA219 *self, INA219Sample *sample, 
+       INA219Error *e)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  sample->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  return ina219_get_raw_e (self, &sample->shunt_reg, &sample->bus_reg, e);
+  }
+
+/*============================================================================
+
+  ina219_sample
+
+============================================================================*/
+BOOL ina219_sample (const INA219 *self, INA219Sample *sample, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_sample_e (self, sample, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_bus_reg_to_mv
+
+============================================================================*/
+static int ina219_bus_reg_to_mv (uint16_t regval)
+  {
+  // This arcane-looking math follows from the fact that the bus voltage
+  //  is in units of 4mV, but shifted up three bits. The bottom three
+  //  bits have other meanings, not related to the voltage. We mask
+  //  off the bottom three bits, to get the voltage as a multiple of 8
+  //  mV (because of the original three-bit shift), then shift down one
+  //  bit to get the final result in mV. 
+  // See page 23 of the datasheet
+  return (regval & 0xFFF8 ) >> 1;
+  }
+
+/*============================================================================
+
+  ina219_shunt_reg_to_mv
+
+============================================================================*/
+static int ina219_shunt_reg_to_mv (int16_t regval)
+  {
+  // The shunt register reads units of 10uV. To get mV we must divide
+  //   by 100 (that is, multiply by 10 and divide by 1000)
+  // See page 20 of the datasheet
+  return regval / 100;
+  }
+
+/*============================================================================
+
+  ina219_current_ua_from_raw
+
+============================================================================*/
+int ina219_current_ua_from_raw (const INA219 *self, int16_t shunt_reg)
+  {
+  // The shunt register is in units of 10uV, so the current in uA is
+  //  10 * regval / R, with R in ohms, or 10000 * regval / R in milliohms.
+  //  The largest intermediate value is about 3.3e8, which fits in an int
+  return shunt_reg * 10000 / self->battery.shunt_milliohms;
+  }
+
+/*============================================================================
+
+  ina219_get_converter
+
+============================================================================*/
+BOOL ina219_get_converter (const INA219 *self, INA219Converter *conv,
+       char **error)
+  {
+  return ina219_converter_init (conv, self->battery.shunt_milliohms,
+    self->battery.battery_voltage_0_percent, 
+    self->battery.battery_voltage_100_percent, error);
+  }
+
+/*============================================================================
+
+  ina219_get_bus_voltage_e
+
+============================================================================*/
+BOOL ina219_get_bus_voltage_e (const INA219 *self, int *mv, INA219Error *e)
+  {
+  BOOL ret = FALSE;
+  int16_t regval;
+  if (ina219_register_read_16 (self, BUS_REG, (int16_t*) &regval, e))
+    {
+    *mv = ina219_bus_reg_to_mv ((uint16_t)regval);
+    ret = TRUE;
+    }
+
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_get_bus_voltage
+
+============================================================================*/
+BOOL ina219_get_bus_voltage (const INA219 *self, int *mv, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_bus_voltage_e (self, mv, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_get_shunt_voltage_e
+
+============================================================================*/
+BOOL ina219_get_shunt_voltage_e (const INA219 *self, int *mv, INA219Error *e)
+  {
+  BOOL ret = FALSE;
+  int16_t regval;
+  if (ina219_register_read_16 (self, SHUNT_REG, (int16_t*) &regval, e))
+    {
+    *mv = ina219_shunt_reg_to_mv (regval);
+    ret = TRUE;
+    }
+
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_get_shunt_voltage
+
+============================================================================*/
+BOOL ina219_get_shunt_voltage (const INA219 *self, int *mv, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_shunt_voltage_e (self, mv, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_config_default
+
+  Fill in the chip's power-on defaults: 32V bus range, +/-320mV shunt
+  range, single 12-bit conversions, continuous shunt and bus
+  measurement. See page 19 of the datasheet.
+
+============================================================================*/
+void ina219_config_default (INA219Config *config)
+  {
+  config->bus_range = INA219_BUS_32V;
+  config->pga = INA219_PGA_320MV;
+  config->bus_adc = INA219_ADC_12BIT;
+  config->shunt_adc = INA219_ADC_12BIT;
+  config->mode = INA219_MODE_SHUNT_BUS_CONTINUOUS;
+  }
+
+/*============================================================================
+
+  ina219_adc_from_samples
+
+============================================================================*/
+INA219Adc ina219_adc_from_samples (int samples)
+  {
+  // Averaging settings run from 2 samples (9) to 128 samples (15).
+  //  Anything else gets a single 12-bit conversion.
+  INA219Adc adc = INA219_ADC_12BIT;
+  int setting = INA219_ADC_2_SAMPLES;
+  for (int n = 2; n <= 128 && n <= samples; n <<= 1, setting++)
+    adc = setting;
+  return adc;
+  }
+
+/*============================================================================
+
+  ina219_adc_time_us
+
+  Conversion time for one ADC setting. See table 5, page 27 of the
+  datasheet. Settings 4-7 are the same as 0-3, and 8 is another way
+  of saying 12-bit.
+
+============================================================================*/
+static int ina219_adc_time_us (INA219Adc adc)
+  {
+  static const int times[16] =
+    {
+    84, 148, 276, 532, 84, 148, 276, 532,
+    532, 1060, 2130, 4260, 8510, 17020, 34050, 68100
+    };
+  return times[adc & 0x0F];
+  }
+
+/*============================================================================
+
+  ina219_get_config
+
+============================================================================*/
+BOOL ina219_get_config (const INA219 *self, INA219Config *config)
+  {
+  if (self->configured)
+    *config = self->config;
+  else
+    ina219_config_default (config);
+  return self->configured;
+  }
+
+/*============================================================================
+
+  ina219_get_conversion_time_us
+
+============================================================================*/
+int ina219_get_conversion_time_us (const INA219 *self)
+  {
+  INA219Config def;
+  const INA219Config *config = &self->config;
+  if (!self->configured)
+    {
+    ina219_config_default (&def);
+    config = &def;
+    }
+  // The chip converts the shunt voltage first, then the bus voltage,
+  //  unless one of them is disabled by the mode setting
+  int us = 0;
+  if (config->mode & 1) us += ina219_adc_time_us (config->shunt_adc);
+  if (config->mode & 2) us += ina219_adc_time_us (config->bus_adc);
+  return us;
+  }
+
+/*============================================================================
+
+  ina219_calibrate
+
+  Work out the calibration register value, from the shunt resistance
+  and the PGA range. The current LSB is chosen to be the smallest whole
+  number of microamps that lets the largest measurable current fit
+  into the 15-bit (plus sign) current register. Then, from page 12
+  of the datasheet,
+
+    Cal = 0.04096 / (Current_LSB * R_shunt)
+
+  which, with the LSB in uA and the resistance in milliohms, is
+
+    Cal = 40960000 / (Current_LSB_uA * R_shunt_mohm)
+
+  The power register LSB is always 20 times the current LSB.
+
+============================================================================*/
+static void ina219_calibrate (INA219 *self)
+  {
+  int full_scale_mv = 40 << self->config.pga;
+  int64_t max_ua = (int64_t)full_scale_mv * 1000000 
+    / self->battery.shunt_milliohms;
+  int64_t lsb = (max_ua + 32767) / 32768;
+  if (lsb < 1) lsb = 1;
+  // With a very small LSB the calibration value can overflow 16 bits.
+  //  Trading resolution for range is the only thing we can do
+  while (40960000LL / (lsb * self->battery.shunt_milliohms) > 0xFFFE) 
+    lsb++;
+  self->current_lsb_ua = (int)lsb;
+  // Bit 0 of the calibration register is not used, and always reads zero
+  self->calibration = (uint16_t)(40960000LL /
+    (lsb * self->battery.shunt_milliohms)) & 0xFFFE;
+  }
+
+/*============================================================================
+
+  ina219_config_value
+
+  Pack the configuration into the layout of the configuration register.
+
+============================================================================*/
+static uint16_t ina219_config_value (const INA219Config *config)
+  {
+  return (config->bus_range << CONFIG_BRNG_SHIFT)
+    | (config->pga << CONFIG_PG_SHIFT)
+    | (config->bus_adc << CONFIG_BADC_SHIFT)
+    | (config->shunt_adc << CONFIG_SADC_SHIFT)
+    | (config->mode << CONFIG_MODE_SHIFT);
+  }
+
+/*============================================================================
+
+  ina219_configure_e
+
+  Program the configuration register, then the calibration register.
+
+============================================================================*/
+BOOL ina219_configure_e (INA219 *self, const INA219Config *config,
+       INA219Error *e)
   {
   assert (self != NULL);
-  assert (self->fd >= 0); // Don't allow this to be called before _init()
+  assert (config != NULL);
   BOOL ret = FALSE;
-  BYTE buff[2];
-  buff[0] = reg;
-  // Write the register number to the bus
-  if (write (self->fd, &buff, 1))
-    {
-    // Then read the two-byte result
-    if (read (self->fd, buff, 2) == 2)
-      {      
-      *data = (buff[0] << 8 ) | buff[1];
+  uint16_t value = ina219_config_value (config);
+  ina219_transport_forget (self->transport, self->i2c_addr);
+  if (ina219_register_write_16 (self, CONFIG_REG, value, e))
+    {
+    self->config = *config;
+    self->next_conversion_ns = 0;
+    ina219_calibrate (self);
+    if (ina219_register_write_16 (self, CALIB_REG, self->calibration, e))
+      {
+      self->configured = TRUE;
       ret = TRUE;
       }
-    else
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_configure
+
+============================================================================*/
+BOOL ina219_configure (INA219 *self, const INA219Config *config,
+       char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_configure_e (self, config, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_now_ns
+
+============================================================================*/
+static uint64_t ina219_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  ina219_sleep_until
+
+============================================================================*/
+static void ina219_sleep_until (uint64_t when_ns)
+  {
+  struct timespec ts;
+  ts.tv_sec = when_ns / 1000000000ULL;
+  ts.tv_nsec = when_ns % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) 
+      == EINTR)
+    ;
+  }
+
+/*============================================================================
+
+  ina219_acquire
+
+  Wait for a new conversion, and read it exactly once. 
+
+  In triggered mode, writing the configuration register starts a
+  conversion. In continuous mode, the chip converts all the time, and
+  we work out when the next conversion is due from the time the last
+  one was seen. Either way, we sleep until the conversion should be
+  complete, and then read the bus, shunt, and power registers in one 
+  transaction. The CNVR bit in the bus register says whether the 
+  conversion has completed since the power register was last read, and
+  reading the power register clears it again. If CNVR is not set
+  (because our clock and the chip's have drifted apart a little), we
+  poll at short intervals until it is.
+
+  See page 23 of the datasheet for the CNVR and OVF bits.
+
+============================================================================*/
+BOOL ina219_acquire_e (INA219 *self, INA219Sample *sample, INA219Error *e)
+  {
+  assert (self != NULL);
+  INA219Config config;
+  if (self->configured)
+    config = self->config;
+  else
+    ina219_config_default (&config);
+
+  if (config.mode == INA219_MODE_POWER_DOWN 
+       || config.mode == INA219_MODE_ADC_OFF)
+    {
+    ina219_error_set (self, e, INA219_OP_CONVERT, CONFIG_REG, EINVAL, 1);
+    return FALSE;
+    }
+
+  uint64_t conversion_ns = 
+    (uint64_t)ina219_get_conversion_time_us (self) * 1000;
+
+  if ((config.mode & MODE_CONTINUOUS) == 0)
+    {
+    // Triggered mode: rewriting the configuration starts a conversion
+    if (!ina219_register_write_16 (self, CONFIG_REG, 
+         ina219_config_value (&config), e))
+      return FALSE;
+    self->next_conversion_ns = ina219_now_ns () + conversion_ns;
+    }
+
+  if (self->next_conversion_ns > ina219_now_ns ()) 
+    ina219_sleep_until (self->next_conversion_ns);
+
+  // Poll at 1/8 of the conversion time, but not so fast that we hog the
+  //  bus when conversions are very quick
+  uint64_t poll_ns = conversion_ns / 8;
+  if (poll_ns < 50000) poll_ns = 50000;
+  uint64_t give_up = ina219_now_ns () + conversion_ns 
+    + CONVERSION_TIMEOUT_NS;
+
+  static const BYTE regs[3] = { BUS_REG, SHUNT_REG, POWER_REG };
+  for (int polls = 1;; polls++)
+    {
+    uint16_t values[3];
+    uint64_t now = ina219_now_ns ();
+    if (!ina219_read_registers (self, regs, values, 3, e))
+      return FALSE;
+    if (values[0] & INA219_BUS_CNVR)
+      {
+      sample->time_ns = now;
+      sample->bus_reg = values[0];
+      sample->shunt_reg = (int16_t)values[1];
+      if (config.mode & MODE_CONTINUOUS)
+        self->next_conversion_ns = now + conversion_ns;
+      return TRUE;
+      }
+    if (now >= give_up)
       {
-      if (error) asprintf (error, "Failed to read I2C device: %s\n", 
-        strerror (errno));
+      ina219_error_set (self, e, INA219_OP_CONVERT, BUS_REG, ETIMEDOUT,
+        polls);
+      return FALSE;
       }
+    ina219_sleep_until (now + poll_ns);
     }
-  else
-    {
-    if (error) asprintf (error, "Failed to write I2C device: %s\n", 
-      strerror (errno));
-    }
-  return ret;
-  } 
+  }
 
 /*============================================================================
 
-  ina219_get_bus_voltage
+  ina219_acquire
 
 ============================================================================*/
-BOOL ina219_get_bus_voltage (const INA219 *self, int *mv, char **error)
+BOOL ina219_acquire (INA219 *self, INA219Sample *sample, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_acquire_e (self, sample, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_get_current_e
+
+============================================================================*/
+BOOL ina219_get_current_e (const INA219 *self, int *mA, INA219Error *e)
   {
   BOOL ret = FALSE;
   int16_t regval;
-  if (ina219_register_read_16 (self, BUS_REG, (int16_t*) &regval, error))
-    {
-    // This arcane-looking math follows from the fact that the bus voltage
-    //  is in units of 4mV, but shifted up three bits. The bottom three
-    //  bits have other meanings, not related to the voltage. We mask
-    //  off the bottom three bits, to get the voltage as a multiple of 8
-    //  mV (because of the original three-bit shift), then shift down one
-    //  bit to get the final result in mV. 
-    // See page 23 of the datasheet
-    *mv = (regval & 0xFFF8 ) >> 1;
+  if (!self->configured)
+    {
+    ina219_error_set (self, e, INA219_OP_CALIBRATION, CURRENT_REG, ENODATA,
+      0);
+    }
+  else if (ina219_register_read_16 (self, CURRENT_REG, &regval, e))
+    {
+    *mA = regval * self->current_lsb_ua / 1000;
     ret = TRUE;
     }
-
   return ret;
   }
 
 /*============================================================================
 
-  ina219_get_shunt_voltage
+  ina219_get_current
 
 ============================================================================*/
-BOOL ina219_get_shunt_voltage (const INA219 *self, int *mv, char **error)
+BOOL ina219_get_current (const INA219 *self, int *mA, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_current_e (self, mA, &e), &e, 
+    error);
+  }
+
+/*============================================================================
+
+  ina219_get_power_e
+
+============================================================================*/
+BOOL ina219_get_power_e (const INA219 *self, int *mW, INA219Error *e)
   {
   BOOL ret = FALSE;
   int16_t regval;
-  if (ina219_register_read_16 (self, SHUNT_REG, (int16_t*) &regval, error))
+  if (!self->configured)
+    {
+    ina219_error_set (self, e, INA219_OP_CALIBRATION, POWER_REG, ENODATA,
+      0);
+    }
+  else if (ina219_register_read_16 (self, POWER_REG, &regval, e))
     {
-    // The shunt register reads units of 10uV. To get mV we must divide
-    //   by 100 (that is, multiply by 10 and divide by 1000)
-    // See page 20 of the datasheet
-    *mv = regval / 100;
+    // The power register is unsigned, and its LSB is 20 times the
+    //  current LSB
+    *mW = (int)((int64_t)(uint16_t)regval * 20 * self->current_lsb_ua
+      / 1000);
     ret = TRUE;
     }
-
   return ret;
   }
 
+/*============================================================================
+
+  ina219_get_power
+
+============================================================================*/
+BOOL ina219_get_power (const INA219 *self, int *mW, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_power_e (self, mW, &e), &e, 
+    error);
+  }
+
 /*============================================================================
 
   ina219_create
@@ -157,15 +878,37 @@ INA219 *ina219_create (const char *i2c_dev, int i2c_addr,
   memset (self, 0, sizeof (INA219));
   self->i2c_dev = strdup (i2c_dev);
   self->i2c_addr = i2c_addr;
-  self->fd = -1;
-  self->shunt_milliohms = shunt_milliohms;
-  self->battery_voltage_0_percent = battery_voltage_0_percent;
-  self->battery_voltage_100_percent = battery_voltage_100_percent;
-  self->battery_capacity = battery_capacity;
-  self->min_charging_current = min_charging_current;
+  self->battery.shunt_milliohms = shunt_milliohms;
+  self->battery.battery_voltage_0_percent = battery_voltage_0_percent;
+  self->battery.battery_voltage_100_percent = battery_voltage_100_percent;
+  self->battery.battery_capacity = battery_capacity;
+  self->battery.min_charging_current = min_charging_current;
+  self->battery.full_percent = INA_FULL_PERCENT;
+  ina219_recovery_default (&self->recovery);
+  self->jitter_seed = (unsigned int)(ina219_now_ns () ^ i2c_addr);
   return self;
   }
 
+/*============================================================================
+
+  ina219_set_soc_curve
+
+============================================================================*/
+void ina219_set_soc_curve (INA219 *self, const SocCurve *curve)
+  {
+  self->battery.soc_curve = curve;
+  }
+
+/*============================================================================
+
+  ina219_get_battery
+
+============================================================================*/
+void ina219_get_battery (const INA219 *self, INA219Battery *battery)
+  {
+  *battery = self->battery;
+  }
+
 /*============================================================================
   ina219_destroy
 ============================================================================*/
@@ -179,146 +922,525 @@ void ina219_destroy (INA219 *self)
     }
   }
 
+/*============================================================================
+
+  ina219_attach
+
+  Check that the device can be used at its address on an open transport,
+  and start using the transport if so.
+
+============================================================================*/
+static BOOL ina219_attach (INA219 *self, INA219Transport *transport,
+       BOOL owns_transport, INA219Error *e)
+  {
+  int err = ina219_transport_probe (transport, self->i2c_addr);
+  if (err == 0)
+    {
+    self->transport = transport;
+    self->owns_transport = owns_transport;
+    return TRUE;
+    }
+  ina219_error_set (self, e, INA219_OP_PROBE, -1, err, 1);
+  return FALSE;
+  }
+
+/*============================================================================
+
+  ina219_init_e
+
+  Open a transport for the device specification that was supplied when
+  this object was created -- usually /dev/i2c-N -- and check that the
+  device can be used at the slave address.
+
+============================================================================*/
+BOOL ina219_init_e (INA219 *self, INA219Error *e)
+  {
+  assert (self != NULL);
+  ina219_uninit (self);
+  errno = 0;
+  INA219Transport *transport = ina219_transport_open (self->i2c_dev, NULL);
+  if (!transport)
+    {
+    // Transports that reject a specification don't necessarily set 
+    //  errno
+    ina219_error_set (self, e, INA219_OP_OPEN, -1, 
+      errno ? errno : EINVAL, 1);
+    return FALSE;
+    }
+  if (!ina219_attach (self, transport, TRUE, e))
+    {
+    ina219_transport_close (transport);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
 /*============================================================================
 
   ina219_init
 
-  Store the file descriptor for the /dev/i2c-N device, and use an 
-  ioctl() to set the bus slave address.
+  The same as ina219_init_e(), except that a transport that can't be
+  opened gets to explain why in its own words -- e.g., which simulator
+  option was wrong.
 
 ============================================================================*/
 BOOL ina219_init (INA219 *self, char **error)
   {
   assert (self != NULL);
-  error = error;
-  BOOL ret = FALSE;
-  self->fd = open (self->i2c_dev, O_RDWR);
-  if (self->fd >= 0)
+  ina219_uninit (self);
+  INA219Transport *transport = ina219_transport_open (self->i2c_dev, error);
+  if (!transport) return FALSE;
+  INA219Error e;
+  if (!ina219_attach (self, transport, TRUE, &e))
+    {
+    ina219_transport_close (transport);
+    return ina219_error_string (FALSE, &e, error);
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  ina219_init_transport_e
+
+  Use a transport that the caller has already opened, and which may be
+  shared with other INA219 objects on the same bus.
+
+============================================================================*/
+BOOL ina219_init_transport_e (INA219 *self, INA219Transport *transport,
+       INA219Error *e)
+  {
+  assert (self != NULL);
+  if (!transport)
+    {
+    ina219_error_set (self, e, INA219_OP_OPEN, -1, EINVAL, 0);
+    return FALSE;
+    }
+  ina219_uninit (self);
+  return ina219_attach (self, transport, FALSE, e);
+  }
+
+/*============================================================================
+
+  ina219_init_transport
+
+============================================================================*/
+BOOL ina219_init_transport (INA219 *self, INA219Transport *transport,
+       char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_init_transport_e (self, transport, 
+    &e), &e, error);
+  }
+
+/*============================================================================
+  ina219_uninit
+============================================================================*/
+void ina219_uninit (INA219 *self)
+  {
+  assert (self != NULL);
+  if (self->transport && self->owns_transport) 
+    ina219_transport_close (self->transport);
+  self->transport = NULL;
+  self->owns_transport = FALSE;
+  }
+
+/*============================================================================
+
+  ina219_recovery_default
+
+============================================================================*/
+void ina219_recovery_default (INA219Recovery *recovery)
+  {
+  memset (recovery, 0, sizeof (INA219Recovery));
+  recovery->retries = 2;
+  recovery->backoff_min_ms = 100;
+  recovery->backoff_max_ms = 30000;
+  recovery->hook_after = 3;
+  }
+
+/*============================================================================
+
+  ina219_set_recovery
+
+============================================================================*/
+void ina219_set_recovery (INA219 *self, const INA219Recovery *recovery)
+  {
+  assert (self != NULL);
+  self->recovery = *recovery;
+  if (self->recovery.retries < 0) self->recovery.retries = 0;
+  if (self->recovery.backoff_min_ms < 1) self->recovery.backoff_min_ms = 1;
+  if (self->recovery.backoff_max_ms < self->recovery.backoff_min_ms)
+    self->recovery.backoff_max_ms = self->recovery.backoff_min_ms;
+  }
+
+/*============================================================================
+
+  ina219_recover_e
+
+  A new transport is only swapped in once the device answers through
+  it, so a failed attempt leaves things as they were, and the next 
+  attempt can try again. Reopening /dev/i2c-N is what helps when the
+  adapter has been reset, or its driver reloaded, underneath us.
+
+============================================================================*/
+BOOL ina219_recover_e (INA219 *self, INA219Error *e)
+  {
+  assert (self != NULL);
+  if (self->owns_transport || !self->transport)
     {
-    // Set the I2C slave address that was supplied when this
-    //   object was created
-    if (ioctl (self->fd, I2C_SLAVE, self->i2c_addr) >= 0)
+    errno = 0;
+    INA219Transport *transport = ina219_transport_open (self->i2c_dev, 
+      NULL);
+    if (!transport)
       {
-      ret = TRUE;
+      ina219_error_set (self, e, INA219_OP_OPEN, -1, 
+        errno ? errno : EINVAL, 1);
+      return FALSE;
       }
-    else
+    INA219Transport *old = self->transport;
+    BOOL owned = self->owns_transport;
+    if (!ina219_attach (self, transport, TRUE, e))
       {
-      asprintf (error, "Can't intialize I2C device: %s", strerror (errno));
+      ina219_transport_close (transport);
+      return FALSE;
       }
+    if (old && owned) ina219_transport_close (old);
     }
   else
     {
-    asprintf (error, "Can't open I2C device: %s", strerror (errno));
+    int err = ina219_transport_probe (self->transport, self->i2c_addr);
+    if (err != 0)
+      {
+      ina219_error_set (self, e, INA219_OP_PROBE, -1, err, 1);
+      return FALSE;
+      }
+    // The device may have been reset, and a shared transport wouldn't
+    //  know it
+    ina219_transport_forget (self->transport, self->i2c_addr);
     }
-  return ret;
+
+  if (self->configured)
+    {
+    INA219Config config = self->config;
+    return ina219_configure_e (self, &config, e);
+    }
+  return TRUE;
   }
 
 /*============================================================================
-  ina219_uninit
+
+  ina219_backoff_start
+
+  Schedule the next recovery attempt, and double the wait for the one
+  after. The wait is randomized between half and all of its nominal 
+  length ("equal jitter"), so that it still grows steadily, but 
+  several devices that failed at the same moment -- because they are
+  on the same bus, say -- spread their attempts out.
+
 ============================================================================*/
-void ina219_uninit (INA219 *self)
+static void ina219_backoff_start (INA219 *self, uint64_t now)
   {
-  assert (self != NULL);
-  if (self->fd >= 0) close (self->fd);
-  self->fd = -1;
+  const INA219Recovery *r = &self->recovery;
+  if (self->backoff_ms < r->backoff_min_ms) 
+    self->backoff_ms = r->backoff_min_ms;
+  int half = self->backoff_ms / 2;
+  int wait_ms = half + rand_r (&self->jitter_seed) % (half + 1);
+  if (wait_ms < 1) wait_ms = 1;
+  self->recover_at_ns = now + (uint64_t)wait_ms * 1000000;
+  if (self->backoff_ms > r->backoff_max_ms / 2)
+    self->backoff_ms = r->backoff_max_ms;
+  else
+    self->backoff_ms *= 2;
   }
 
 /*============================================================================
 
-  ina219_get_status
+  ina219_recovery_failed
 
-  Work out the overall charge status, using the bus voltage, shunt voltage,
-  and the properties of the battery.
+  Count a failed attempt to recover, call the bus hook if it is time, 
+  and back off again.
 
 ============================================================================*/
-BOOL ina219_get_status (const INA219 *self, INA219ChargeStatus *charge_status, 
-      int *battery_voltage_mv, int *percent_charged, 
-      int *battery_current_mA, int *minutes, char **error)
+static void ina219_recovery_failed (INA219 *self)
   {
-  BOOL ret = FALSE;
-  int mv = 0;
-  if (ina219_get_bus_voltage (self, &mv, error))
+  const INA219Recovery *r = &self->recovery;
+  self->recoveries_failed++;
+  if (r->bus_hook && r->hook_after > 0 
+       && self->recoveries_failed % r->hook_after == 0)
+    r->bus_hook (r->hook_arg, self->i2c_dev, self->i2c_addr,
+      self->recoveries_failed);
+  ina219_backoff_start (self, ina219_now_ns ());
+  }
+
+/*============================================================================
+
+  ina219_sample_resilient_e
+
+============================================================================*/
+INA219ReadResult ina219_sample_resilient_e (INA219 *self, BOOL wait,
+       INA219Sample *sample, INA219Error *e)
+  {
+  assert (self != NULL);
+  uint64_t now = ina219_now_ns ();
+  if (self->failing)
     {
-    *battery_voltage_mv = mv;
+    if (now < self->recover_at_ns && wait)
+      {
+      uint64_t nap = self->recover_at_ns - now;
+      if (nap > BACKOFF_NAP_NS) nap = BACKOFF_NAP_NS;
+      ina219_sleep_until (now + nap);
+      now = ina219_now_ns ();
+      }
+    if (now < self->recover_at_ns)
+      {
+      if (e) *e = self->outage_error;
+      return INA219_READ_BACKOFF;
+      }
+    if (!ina219_recover_e (self, e))
+      {
+      ina219_recovery_failed (self);
+      return INA219_READ_FAILED;
+      }
+    }
+
+  BOOL ok = wait ? ina219_acquire_e (self, sample, e) 
+    : ina219_sample_e (self, sample, e);
+  if (ok)
+    {
+    self->failing = FALSE;
+    self->recoveries_failed = 0;
+    self->backoff_ms = 0;
+    return INA219_READ_OK;
+    }
+
+  if (self->failing)
+    {
+    // Recovered, but the read still failed -- the outage goes on
+    ina219_recovery_failed (self);
+    return INA219_READ_FAILED;
+    }
+
+  self->failing = TRUE;
+  if (e) self->outage_error = *e;
+  else ina219_error_set (self, &self->outage_error, INA219_OP_READ, -1,
+    EIO, 1);
+  ina219_backoff_start (self, ina219_now_ns ());
+  sample->time_ns = now;
+  sample->shunt_reg = 0;
+  sample->bus_reg = INA219_BUS_GAP;
+  return INA219_READ_GAP;
+  }
+
+/*============================================================================
+
+  ina219_battery_status
+
+  Work out the overall charge status from the battery voltage and 
+  current, using the properties of the battery. This does no I/O.
+
+============================================================================*/
+void ina219_battery_status (const INA219Battery *battery, int mv, int mA,
+      INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+      int *percent_charged, int *battery_current_mA, int *minutes)
+  {
+  *battery_voltage_mv = mv;
 
-    // Work out the percentage charge. The user has specified the full-charge
-    //  and no-charge voltages, and the battery voltage is assumed to lie
-    //  in this range. If the voltage is half-way between no-charge and
-    //  full-charge, we take the charge level to be 50%. The no-charge
-    //  voltage won't be zero, because the powered device will have stopped
-    //  working long before that point is reached. However, we limit the
-    //  reported charge to "0%", just in case of odd circumstances.  
+  // Work out the percentage charge. The user has specified the full-charge
+  //  and no-charge voltages, and the battery voltage is assumed to lie
+  //  in this range. If the voltage is half-way between no-charge and
+  //  full-charge, we take the charge level to be 50%. The no-charge
+  //  voltage won't be zero, because the powered device will have stopped
+  //  working long before that point is reached. However, we limit the
+  //  reported charge to "0%", just in case of odd circumstances.  
 
-    // There is, of course, no way to measure the charge status of most 
-    //  batteries _except_ in terms of voltage.
+  // There is, of course, no way to measure the charge status of most 
+  //  batteries _except_ in terms of voltage.
 
-    *percent_charged = 100 * (mv - self->battery_voltage_0_percent) / 
-        (self->battery_voltage_100_percent - self->battery_voltage_0_percent);
+  // If the caller has supplied a measured curve, all this is done by a
+  //  table lookup instead
+
+  if (battery->soc_curve)
+    {
+    *percent_charged = soc_curve_percent (battery->soc_curve, mv, mA);
+    }
+  else
+    {
+    *percent_charged = 100 * (mv - battery->battery_voltage_0_percent) / 
+      (battery->battery_voltage_100_percent 
+        - battery->battery_voltage_0_percent);
     if (*percent_charged > 100) *percent_charged = 100;
     if (*percent_charged < 0) *percent_charged = 0;
+    }
+
+  *battery_current_mA = mA;
+
+  // Don't try work out whether the battery is charging or discharging
+  //  if the voltage is very close to the maximum. In practice, the
+  //  voltage will oscillate around the maximum value, and the current
+  //  will reverse direction. There's no point reporting that. A small
+  //  charging current also means that the charger has finished -- but
+  //  a discharge current, however large, does not
+  if (*percent_charged >= battery->full_percent || 
+         (mA >= 0 && mA < battery->min_charging_current))
+    {
+    *charge_status = INA219_FULLY_CHARGED;
+    }
+  else
+    {
+    // Note that the INA219 is normally connecting in such a way that
+    //  a positive current means the battery is charging. However, it's
+    //  not inevitable, and it may be necessary to reverse the logic
+    //  below.
+    if (mA > 0)
+      *charge_status = INA219_CHARGING;
+    else
+      *charge_status = INA219_DISCHARGING;
+    }
 
-    if (ina219_get_shunt_voltage (self, &mv, error))
+  if (*charge_status == INA219_FULLY_CHARGED)
+    *minutes = 0;
+  else
+    {
+    // There's really now way to work out the time to full charge
+    //  or discharge, just based on the voltage and current. Neither 
+    //  batteries nor charging circuits behave linearly enough. A
+    //  serious effort to report these times will have to be based on
+    //  characterizing the voltage/time relationship for a specific
+    //  battery and charger. Here we do the (poor) best we can, given
+    //  the limited information available.
+
+    if (mA >= 0)
       {
-      ret = TRUE;
+      int remaining_capacity = (100 - *percent_charged) * 
+            battery->battery_capacity / 100; 
+      int sec = 3600 * remaining_capacity / (double) mA; 
+      *minutes = sec / 60;
+      }
+    else
+      {
+      int remaining_capacity = *percent_charged * 
+            battery->battery_capacity / 100; 
+      int sec = 3600 * remaining_capacity / (double) -mA; 
+      *minutes = sec / 60;
+      }
+    }
+  }
+
+/*============================================================================
+
+  ina219_battery_status_from_raw
+
+============================================================================*/
+void ina219_battery_status_from_raw (const INA219Battery *battery, 
+      int16_t shunt_reg, uint16_t bus_reg, 
+      INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+      int *percent_charged, int *battery_current_mA, int *minutes)
+  {
+  // Calculate the battery current as shunt voltage divided by shunt
+  //  resistance. Note that working in milli-units allows us to do
+  //  all the following math in integers.
+  int mA = ina219_shunt_reg_to_mv (shunt_reg) * 1000 
+    / battery->shunt_milliohms;
+  ina219_battery_status (battery, ina219_bus_reg_to_mv (bus_reg), mA,
+    charge_status, battery_voltage_mv, percent_charged, battery_current_mA,
+    minutes);
+  }
+
+/*============================================================================
+
+  ina219_status_from_raw
+
+  Work out the overall charge status from a pair of raw register values,
+  using the properties of the battery. This does no I/O, so it can be
+  used on samples that were collected earlier.
+
+============================================================================*/
+void ina219_status_from_raw (const INA219 *self, int16_t shunt_reg,
+      uint16_t bus_reg, INA219ChargeStatus *charge_status, 
+      int *battery_voltage_mv, int *percent_charged, 
+      int *battery_current_mA, int *minutes)
+  {
+  ina219_battery_status_from_raw (&self->battery, shunt_reg, bus_reg,
+    charge_status, battery_voltage_mv, percent_charged, battery_current_mA,
+    minutes);
+  }
+
+/*============================================================================
 
-      // Calculate the battery current as shunt voltage divided by shunt
-      //  resistance. Note that working in milli-units allows us to do
-      //  all the following math in integers.
-      int mA = mv * 1000 / self->shunt_milliohms;
-      *battery_current_mA = mA;
-
-      // Don't try work out whether the battery is charging or discharging
-      //  if the voltage is very close to the maximum. In practice, the
-      //  voltage will oscillate around the maximum value, and the current
-      //  will reverse direction. There's no point reporting that.  
-      if (*percent_charged >= INA_FULL_PERCENT || 
-             mA < self->min_charging_current)
-        {
-        *charge_status = INA219_FULLY_CHARGED;
-        }
-      else
-        {
-        // Note that the INA219 is normally connecting in such a way that
-        //  a positive current means the battery is charging. However, it's
-        //  not inevitable, and it may be necessary to reverse the logic
-        //  below.
-        if (mA > 0)
-          *charge_status = INA219_CHARGING;
-        else
-          *charge_status = INA219_DISCHARGING;
-        }
-
-      if (*charge_status == INA219_FULLY_CHARGED)
-        *minutes = 0;
-      else
-        {
-        // There's really now way to work out the time to full charge
-        //  or discharge, just based on the voltage and current. Neither 
-        //  batteries nor charging circuits behave linearly enough. A
-        //  serious effort to report these times will have to be based on
-        //  characterizing the voltage/time relationship for a specific
-        //  battery and charger. Here we do the (poor) best we can, given
-        //  the limited information available.
-
-        if (mA >= 0)
-          {
-          int remaining_capacity = (100 - *percent_charged) * 
-                self->battery_capacity / 100; 
-	  int sec = 3600 * remaining_capacity / (double) mA; 
-          *minutes = sec / 60;
-          }
-        else
-          {
-          int remaining_capacity = *percent_charged * 
-                self->battery_capacity / 100; 
-	  int sec = 3600 * remaining_capacity / (double) -mA; 
-          *minutes = sec / 60;
-          }
-	}
+  ina219_status_from_values
+
+============================================================================*/
+void ina219_status_from_values (const INA219 *self, int mv, int mA,
+      INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+      int *percent_charged, int *battery_current_mA, int *minutes)
+  {
+  ina219_battery_status (&self->battery, mv, mA, charge_status, 
+    battery_voltage_mv, percent_charged, battery_current_mA, minutes);
+  }
+
+/*============================================================================
+
+  ina219_get_status_e
+
+  Work out the overall charge status, using the bus voltage, shunt voltage,
+  and the properties of the battery. If the chip has been configured
+  and calibrated, the current is read from the current register, 
+  rather than being worked out from the shunt voltage.
+
+============================================================================*/
+BOOL ina219_get_status_e (const INA219 *self, 
+      INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+      int *percent_charged, int *battery_current_mA, int *minutes, 
+      INA219Error *e)
+  {
+  BOOL ret = FALSE;
+  INA219_STATS_START (start);
+  if (self->configured)
+    {
+    // The chip has been calibrated, so it can do the current calculation
+    //  itself, from averaged readings if so configured
+    static const BYTE regs[2] = { BUS_REG, CURRENT_REG };
+    uint16_t values[2];
+    if (ina219_read_registers (self, regs, values, 2, e))
+      {
+      int mA = (int16_t)values[1] * self->current_lsb_ua / 1000;
+      ina219_battery_status (&self->battery, 
+        ina219_bus_reg_to_mv (values[0]), mA, charge_status, 
+        battery_voltage_mv, percent_charged, battery_current_mA, minutes);
+      ret = TRUE;
+      }
+    }
+  else
+    {
+    int16_t shunt_reg;
+    uint16_t bus_reg;
+    // Both registers are read in one transaction, so the voltage and 
+    //  current figures refer to (very nearly) the same instant
+    if (ina219_get_raw_e (self, &shunt_reg, &bus_reg, e))
+      {
+      ina219_status_from_raw (self, shunt_reg, bus_reg, charge_status,
+        battery_voltage_mv, percent_charged, battery_current_mA, minutes);
+      ret = TRUE;
       }
     }
 
+  INA219_STATS_STOP (INA219_HIST_STATUS, start);
   return ret;
   }
 
+/*============================================================================
+
+  ina219_get_status
+
+============================================================================*/
+BOOL ina219_get_status (const INA219 *self, INA219ChargeStatus *charge_status, 
+      int *battery_voltage_mv, int *percent_charged, 
+      int *battery_current_mA, int *minutes, char **error)
+  {
+  INA219Error e;
+  return ina219_error_string (ina219_get_status_e (self, charge_status, 
+    battery_voltage_mv, percent_charged, battery_current_mA, minutes, &e),
+    &e, error);
+  }
 
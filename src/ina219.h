@@ -27,17 +27,41 @@
   curve for a specific battery and charger by measurement, and ignore 
   the calculated times completely.
 
+  By default, the charge percentage is worked out by assuming that it
+  rises in a straight line from the 0% voltage to the 100% voltage. 
+  Few batteries behave like that; a measured curve can be supplied 
+  using ina219_set_soc_curve() (see soc.h).
+
   All methods that return a BOOL return TRUE for success. All methods that
   take a char** set te caller's char* to a descriptive message on failure,
   if the caller initializes the argument to non-null. The caller must free
   this error message eventually.
 
-  Althought most of the "methods" in this "class" return success/failure
-  status and error message, it's highly unlikely that _init() will succeed
-  and anything else will fail. Even if the wrong device is at the specified
-  I2C address, the data acquisition will still produce results -- they will
-  just be meaningless results. Really, the only way for _init() to succeed
-  and anything else to fail would be to unplug the I2C bus at runtime.
+  The methods that do I/O also have an _e variant, which instead fills in
+  an INA219Error supplied by the caller. These never allocate memory,
+  whether they succeed or fail, so they are the ones to use in a 
+  sampling loop. ina219_error_format() turns an INA219Error into a 
+  message, in a buffer supplied by the caller. The char** methods are
+  just wrappers around the _e methods.
+
+  The methods that take a const INA219 * -- the readings, and
+  _get_status() -- can be called on one object from any number of
+  threads at once: each register transaction is made with the lock of
+  the bus's transport held (see transport.h). The methods that take
+  a plain INA219 *, such as _configure() and _acquire(), change the
+  object, and must not be called while any other method is running
+  on it.
+
+  Even if the wrong device is at the specified I2C address, the data
+  acquisition will still produce results -- they will just be 
+  meaningless results. But on a real board, reads do fail after _init()
+  has succeeded: a marginal bus gives the odd NACK or timeout, and a
+  brown-out or a loose connector can take the chip away for seconds at
+  a time, and reset its configuration when it comes back. So every 
+  register read and write is retried a few times (see INA219Recovery)
+  before it is reported as a failure, and a program that samples for
+  a long time should use ina219_sample_resilient_e(), which rides out
+  longer outages without holding up the caller.
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -45,7 +69,13 @@
   ==========================================================================*/
 #pragma once
 
-struct INA219;
+#include <stdint.h>
+#include <stddef.h>
+#include "transport.h"
+#include "convert.h"
+#include "soc.h"
+
+struct _INA219;
 typedef struct _INA219 INA219;
 
 // The percentage of the maximum voltage above which we will assume
@@ -66,6 +96,190 @@ typedef enum _INA219ChargeStatus
   INA219_DISCHARGING = 2
   } INA219ChargeStatus;
 
+// Bus voltage range -- bit 13 of the configuration register
+typedef enum _INA219BusRange
+  {
+  INA219_BUS_16V = 0,
+  INA219_BUS_32V = 1
+  } INA219BusRange;
+
+// Shunt voltage range, set by the programmable gain amplifier -- bits 
+//  11-12 of the configuration register
+typedef enum _INA219Pga
+  {
+  INA219_PGA_40MV = 0,
+  INA219_PGA_80MV = 1,
+  INA219_PGA_160MV = 2,
+  INA219_PGA_320MV = 3
+  } INA219Pga;
+
+// ADC resolution, or number of 12-bit samples averaged, for the bus and
+//  shunt ADCs. Averaged samples take proportionally longer to convert:
+//  from 84us for a single 9-bit sample to 68ms for 128 samples.
+typedef enum _INA219Adc
+  {
+  INA219_ADC_9BIT = 0,
+  INA219_ADC_10BIT = 1,
+  INA219_ADC_11BIT = 2,
+  INA219_ADC_12BIT = 3,
+  INA219_ADC_2_SAMPLES = 9,
+  INA219_ADC_4_SAMPLES = 10,
+  INA219_ADC_8_SAMPLES = 11,
+  INA219_ADC_16_SAMPLES = 12,
+  INA219_ADC_32_SAMPLES = 13,
+  INA219_ADC_64_SAMPLES = 14,
+  INA219_ADC_128_SAMPLES = 15
+  } INA219Adc;
+
+// Operating mode -- bits 0-2 of the configuration register. Bit 0
+//  enables the shunt conversion, bit 1 the bus conversion, and bit 2
+//  makes conversion continuous, rather than triggered.
+typedef enum _INA219Mode
+  {
+  INA219_MODE_POWER_DOWN = 0,
+  INA219_MODE_SHUNT_TRIGGERED = 1,
+  INA219_MODE_BUS_TRIGGERED = 2,
+  INA219_MODE_SHUNT_BUS_TRIGGERED = 3,
+  INA219_MODE_ADC_OFF = 4,
+  INA219_MODE_SHUNT_CONTINUOUS = 5,
+  INA219_MODE_BUS_CONTINUOUS = 6,
+  INA219_MODE_SHUNT_BUS_CONTINUOUS = 7
+  } INA219Mode;
+
+// INA219Config holds the settings written to the configuration register
+//  by ina219_configure(). 
+typedef struct _INA219Config
+  {
+  INA219BusRange bus_range;
+  INA219Pga pga;
+  INA219Adc bus_adc;
+  INA219Adc shunt_adc;
+  INA219Mode mode;
+  } INA219Config;
+
+// Flags in the low bits of the raw bus voltage register. CNVR is set
+//  when a conversion has completed, and cleared when the power register
+//  is read. OVF is set when the current or power calculation overflowed,
+//  which usually means that the shunt voltage is outside the PGA range.
+#define INA219_BUS_CNVR 0x0002
+#define INA219_BUS_OVF  0x0001
+// Bit 2 of the bus voltage register always reads as zero on the chip,
+//  so ina219_sample_resilient_e() sets it to mark a sample that stands
+//  for a missed reading, rather than a real one
+#define INA219_BUS_GAP  0x0004
+#define INA219_SAMPLE_IS_GAP(s) (((s)->bus_reg & INA219_BUS_GAP) != 0)
+
+// INA219Sample is one timestamped pair of raw register readings, as 
+//  collected by ina219_sample(). The time is in nanoseconds from 
+//  CLOCK_MONOTONIC. Samples are small and fixed-size, so they can be 
+//  queued, logged, and replayed, and the status worked out later using
+//  ina219_status_from_raw().
+typedef struct _INA219Sample
+  {
+  uint64_t time_ns;
+  int16_t shunt_reg;
+  uint16_t bus_reg;
+  } INA219Sample;
+
+// INA219Battery holds the battery and circuit properties that the charge
+//  status is worked out from. Every INA219 object has one, filled in from
+//  the arguments to ina219_create(); ina219_battery_status() works out 
+//  the status from one without an INA219 object at all, which is what 
+//  replaying recorded samples with different settings needs.
+typedef struct _INA219Battery
+  {
+  int shunt_milliohms;
+  int battery_voltage_0_percent; // mV
+  int battery_voltage_100_percent; // mV
+  int battery_capacity; // mA-hours
+  // A charging current below this (mA) is taken to mean that the 
+  //  charger has finished
+  int min_charging_current;
+  // Charge (percent) at or above which the battery is fully charged;
+  //  INA_FULL_PERCENT unless changed
+  int full_percent;
+  const SocCurve *soc_curve; // May be NULL, for a straight line
+  } INA219Battery;
+
+// The operation that failed, as reported in an INA219Error
+typedef enum _INA219Op
+  {
+  INA219_OP_NONE = 0,
+  // Opening the transport
+  INA219_OP_OPEN,
+  // Checking that the device can be used at its address
+  INA219_OP_PROBE,
+  // Reading registers
+  INA219_OP_READ,
+  // Writing a register
+  INA219_OP_WRITE,
+  // Waiting for a conversion -- code is EINVAL if the chip is not set
+  //  to convert, or ETIMEDOUT if it stopped converting
+  INA219_OP_CONVERT,
+  // Reading the current or power register before _configure() -- code
+  //  is ENODATA
+  INA219_OP_CALIBRATION
+  } INA219Op;
+
+// INA219Error describes a failure, in storage supplied by the caller.
+//  "device" points at the device specification held by the INA219 
+//  object, so it is only valid as long as that object is. 
+typedef struct _INA219Error
+  {
+  int code; // An errno value; zero if nothing has failed
+  INA219Op op;
+  int reg; // The register involved, or -1
+  int attempts; // How many times the operation was tried
+  int addr; // I2C address of the device
+  const char *device;
+  } INA219Error;
+
+// Called by ina219_sample_resilient_e() when the device has been 
+//  unreachable for a while, with the number of recovery attempts that
+//  have failed in a row. This is the place to do something about the
+//  bus itself -- clock out a stuck SDA line, power-cycle the sensor, or
+//  reload the I2C adapter's driver. It is called in the sampling 
+//  thread, so it should not block
+typedef void (*INA219BusHook) (void *arg, const char *device, int addr,
+               int failures);
+
+// INA219Recovery says how hard to try when reads fail. See
+//  ina219_set_recovery()
+typedef struct _INA219Recovery
+  {
+  // Number of times a failed register read or write is repeated at 
+  //  once, before it is reported. Only errors that can be transient
+  //  (NACK, timeout, I/O error) are retried
+  int retries;
+  // After that, ina219_sample_resilient_e() waits before trying to 
+  //  recover. The wait starts at backoff_min_ms, doubles after each 
+  //  failed attempt up to backoff_max_ms, and is randomized by up to
+  //  half, so that devices that failed together don't retry together
+  int backoff_min_ms;
+  int backoff_max_ms;
+  // The bus hook is called after this many failed recovery attempts in
+  //  a row, and after every this many more. Zero for never
+  int hook_after;
+  INA219BusHook bus_hook; // May be NULL
+  void *hook_arg;
+  } INA219Recovery;
+
+// What ina219_sample_resilient_e() did
+typedef enum _INA219ReadResult
+  {
+  // The sample is a real reading
+  INA219_READ_OK = 0,
+  // The read failed, and the sample is a gap marker (INA219_BUS_GAP)
+  //  for the time it should have been taken; *e says why. This is 
+  //  reported once, at the start of an outage
+  INA219_READ_GAP,
+  // The device is waiting out its backoff, and nothing was read. *e
+  //  holds the failure that started the outage
+  INA219_READ_BACKOFF,
+  // An attempt to recover, at the end of a backoff, failed
+  INA219_READ_FAILED
+  } INA219ReadResult;
+
 BEGIN_DECLS
 
 /** Create a INA219 instance, specifying the interface and battery
@@ -75,23 +289,130 @@ INA219     *ina219_create (const char *i2c_dev, int i2c_addr,
                int battery_voltage_100_percent, int battery_capacity,
                int min_charging_current);
 
+/** Use a voltage-to-charge curve, rather than a straight line between
+    the 0% and 100% voltages, to work out the percentage charge in 
+    _get_status() and _status_from_raw(). The curve is not copied, and
+    must outlive this object. NULL goes back to the straight line. Note
+    that the batch converter (see convert.h) always uses the straight
+    line. */
+void     ina219_set_soc_curve (INA219 *self, const SocCurve *curve);
+
+/** Get the battery properties used by _get_status() and 
+    _status_from_raw(). */
+void     ina219_get_battery (const INA219 *self, INA219Battery *battery);
+
 /** Tidy up this INA219 instance. Implicitly calls ina219_uninit(). */
 void     ina219_destroy (INA219 *ina219);
 
 /** Initialize this "object". Note that this method can fail, because it
-    initializes hardware. */
+    initializes hardware. The i2c_dev argument to _create() is a device
+    specification, as described in transport.h -- usually /dev/i2c-N,
+    but it can also name a simulated device. */
 BOOL     ina219_init (INA219 *self, char **error);
+BOOL     ina219_init_e (INA219 *self, INA219Error *e);
+
+/** Initialize this "object" to use a transport that the caller has 
+    already opened. Several INA219 objects on the same bus can share one
+    transport, and can be used from different threads. The transport is
+    not closed by _uninit(). */
+BOOL     ina219_init_transport (INA219 *self, INA219Transport *transport,
+               char **error);
+BOOL     ina219_init_transport_e (INA219 *self, 
+               INA219Transport *transport, INA219Error *e);
 
 /** Tidy up and free resources. There's no need to call this method if 
     _destroy() is called. _init() and _uninit() can be called repeatedly if
     necessary. Between calls to _init() and _uninit(), the "object" holds a
-    reference to an open file descriptor on /dev/i2c-N */
+    reference to an open transport, e.g., a file descriptor on /dev/i2c-N */
 void     ina219_uninit (INA219 *self);
 
+/** Fill in *config with the chip's power-on default settings. */
+void     ina219_config_default (INA219Config *config);
+
+/** Get the ADC setting that averages the given number of samples,
+    rounded down to a power of two. 1 (or less) gives a single 12-bit 
+    conversion, and anything over 128 gives 128. */
+INA219Adc ina219_adc_from_samples (int samples);
+
+/** Program the configuration register, and then the calibration 
+    register, with a value worked out from the shunt resistance and the
+    PGA setting. After this succeeds, _get_status() reads the current
+    from the chip's current register, and _get_current() and 
+    _get_power() can be used. Note that the chip loses its settings if
+    power is removed, so this will need to be called again after a 
+    power cycle. */
+BOOL     ina219_configure (INA219 *self, const INA219Config *config, 
+           char **error);
+BOOL     ina219_configure_e (INA219 *self, const INA219Config *config, 
+           INA219Error *e);
+
+/** Get the settings last given to _configure(), or the power-on 
+    defaults if it hasn't been called. Returns TRUE if it has. */
+BOOL     ina219_get_config (const INA219 *self, INA219Config *config);
+
+/** Get the time in microseconds that the chip takes to complete one
+    set of conversions, with the current configuration. */
+int      ina219_get_conversion_time_us (const INA219 *self);
+
+/** Wait for the next conversion to complete, and read it. In triggered
+    mode, this starts a conversion; in continuous mode it waits for the 
+    next one the chip makes. Either way, the calling thread sleeps until
+    the conversion is due, so calling this in a loop reads each 
+    conversion exactly once, at the rate the ADC produces them. 
+    Check sample->bus_reg & INA219_BUS_OVF for overflow. If the chip 
+    has not been configured, its power-on (continuous) mode is assumed. */
+BOOL     ina219_acquire (INA219 *self, INA219Sample *sample, char **error);
+BOOL     ina219_acquire_e (INA219 *self, INA219Sample *sample, 
+           INA219Error *e);
+
+/** Fill in *recovery with the defaults: two immediate retries, then
+    backoff from 100ms to 30s, and no bus hook. */
+void     ina219_recovery_default (INA219Recovery *recovery);
+
+/** Change how failures are handled. The settings are copied. This 
+    should be done before the object is shared between threads. */
+void     ina219_set_recovery (INA219 *self, const INA219Recovery *recovery);
+
+/** Try to bring a device that has stopped answering back into use. If
+    this object opened its own transport, a new one is opened, and 
+    replaces the old one only if the device can be probed through it;
+    a shared transport is left as it is, and just probed. Then, if 
+    _configure() has been called, the configuration and calibration 
+    are written again, since a device that lost power has lost them. */
+BOOL     ina219_recover_e (INA219 *self, INA219Error *e);
+
+/** Take a sample, in the manner of a long-running sampling loop. When
+    the device is working, this is _sample_e(), or _acquire_e() if
+    wait is TRUE, and returns INA219_READ_OK. When a read fails, the
+    time of the missed reading is returned as a gap marker, and the
+    device is left alone until its backoff (see INA219Recovery) is 
+    over; until then, this returns INA219_READ_BACKOFF at once, without
+    touching the bus, so other devices and the caller's schedule are 
+    not held up. When the backoff is over, the next call tries 
+    _recover_e(), then reads. With wait TRUE, a call during a backoff
+    sleeps for a short while first, so that an _acquire_e() loop 
+    doesn't spin. Like _acquire_e(), this changes the object, so a 
+    device must only be sampled this way from one thread. */
+INA219ReadResult ina219_sample_resilient_e (INA219 *self, BOOL wait,
+           INA219Sample *sample, INA219Error *e);
+
+/** Get the current in mA from the current register. Fails if 
+    _configure() has not been called. */
+BOOL     ina219_get_current (const INA219 *self, int *mA, char **error);
+BOOL     ina219_get_current_e (const INA219 *self, int *mA, 
+           INA219Error *e);
+
+/** Get the power in mW from the power register. Fails if 
+    _configure() has not been called. */
+BOOL     ina219_get_power (const INA219 *self, int *mW, char **error);
+BOOL     ina219_get_power_e (const INA219 *self, int *mW, INA219Error *e);
+
 /** Get the "bus voltage", that is, the voltage on pin IN-. The voltage in
-    millivolts is set in *mv. The range is 0-32000 mV. This method is 
-    called internall by _get_status(); there is no need to call both. */
+    millivolts is set in *mv. The range is 0-32000 mV. _get_status() reads
+    the same register itself; there is no need to call both. */
 BOOL     ina219_get_bus_voltage (const INA219 *self, int *mv, char **error);
+BOOL     ina219_get_bus_voltage_e (const INA219 *self, int *mv, 
+           INA219Error *e);
 
 /** Get the "shunt voltage", that is, the voltage between the IN- and IN+
     pins. In most installations, a +ve shunt voltage indicates that a
@@ -99,6 +420,73 @@ BOOL     ina219_get_bus_voltage (const INA219 *self, int *mv, char **error);
     +/- 320 mV. The charge current can be obtained by dividing this 
     value by the resistance between the IN- and IN+ pins. */
 BOOL     ina219_get_shunt_voltage (const INA219 *self, int *mv, char **error);
+BOOL     ina219_get_shunt_voltage_e (const INA219 *self, int *mv, 
+           INA219Error *e);
+
+/** Get the raw contents of the shunt voltage and bus voltage registers,
+    both read in a single I2C transaction. This is the cheapest way to
+    get a matched pair of readings; the values are unscaled, exactly as 
+    described on pages 20 and 23 of the datasheet. */
+BOOL     ina219_get_raw (const INA219 *self, int16_t *shunt_reg, 
+           uint16_t *bus_reg, char **error);
+BOOL     ina219_get_raw_e (const INA219 *self, int16_t *shunt_reg, 
+           uint16_t *bus_reg, INA219Error *e);
+
+/** Get the raw contents of the shunt voltage register alone. This is
+    one register read, so it is the fastest reading the chip allows;
+    in a shunt-only conversion mode it is the only register that 
+    changes. */
+BOOL     ina219_get_shunt_raw_e (const INA219 *self, int16_t *shunt_reg, 
+           INA219Error *e);
+
+/** Take a timestamped raw reading of the shunt and bus registers. */
+BOOL     ina219_sample (const INA219 *self, INA219Sample *sample, 
+           char **error);
+BOOL     ina219_sample_e (const INA219 *self, INA219Sample *sample, 
+           INA219Error *e);
+
+/** Work out the charge status from raw shunt and bus register values,
+    as returned by _get_raw() or _sample(). The arguments have the same
+    meanings as in _get_status(). This method does no I/O, and only
+    uses the battery properties given to _create(), so it can be 
+    called on an object that has not been initialized. */
+void     ina219_status_from_raw (const INA219 *self, int16_t shunt_reg,
+           uint16_t bus_reg, INA219ChargeStatus *charge_status, 
+           int *battery_voltage_mv, int *percent_charged, 
+           int *battery_current_mA, int *minutes);
+
+/** Work out the charge status from a battery voltage and current, using
+    the given battery properties. This is the calculation that all the 
+    _status methods use; it is a pure function, so it can be run on 
+    recorded samples, from any number of threads. */
+void     ina219_battery_status (const INA219Battery *battery, int mv, 
+           int mA, INA219ChargeStatus *charge_status, 
+           int *battery_voltage_mv, int *percent_charged, 
+           int *battery_current_mA, int *minutes);
+
+/** As ina219_battery_status(), but from raw shunt and bus register 
+    values. */
+void     ina219_battery_status_from_raw (const INA219Battery *battery, 
+           int16_t shunt_reg, uint16_t bus_reg, 
+           INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+           int *percent_charged, int *battery_current_mA, int *minutes);
+
+/** Work out the charge status from a battery voltage and current, 
+    which may have been filtered (see filter.h), or averaged. Otherwise 
+    the same as _status_from_raw(). */
+void     ina219_status_from_values (const INA219 *self, int mv, int mA,
+           INA219ChargeStatus *charge_status, int *battery_voltage_mv, 
+           int *percent_charged, int *battery_current_mA, int *minutes);
+
+/** Work out the current in microamps from a raw shunt register value.
+    Unlike the mA figure from _status_from_raw(), this keeps the full
+    resolution of the register. */
+int      ina219_current_ua_from_raw (const INA219 *self, int16_t shunt_reg);
+
+/** Set up a converter (see convert.h) for this device's shunt and 
+    battery, for converting raw samples in bulk. */
+BOOL     ina219_get_converter (const INA219 *self, INA219Converter *conv,
+           char **error);
 
 /** Get the overall status in the various arguments. 
     I hope that the meanings of the arguments is self-explanatory. 
@@ -108,6 +496,16 @@ BOOL     ina219_get_status (const INA219 *self,
            INA219ChargeStatus *charge_status, 
            int *battery_voltage_mv, int *percent_charged, 
            int *battery_current_mA, int *minutes, char **error);
+BOOL     ina219_get_status_e (const INA219 *self, 
+           INA219ChargeStatus *charge_status, 
+           int *battery_voltage_mv, int *percent_charged, 
+           int *battery_current_mA, int *minutes, INA219Error *e);
+
+/** Write a message describing *e into buf, truncating it if necessary,
+    in the manner of snprintf(). Returns the length of the whole 
+    message. Does not allocate memory, and is safe in any thread. */
+int      ina219_error_format (const INA219Error *e, char *buf, 
+           size_t size);
 
 END_DECLS
 
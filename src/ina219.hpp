@@ -0,0 +1,290 @@
+/*============================================================================
+
+  ina219.hpp
+
+  A C++17 front end to the INA219 "class", for boards whose shunt and
+  battery are fixed when the program is built -- as they are in
+  main.c. The board is described by a profile: a type with these
+  static constexpr int members, which have the same meanings as the
+  arguments to ina219_create():
+
+    struct MyBoard
+      {
+      static constexpr int shunt_milliohms = 100;
+      static constexpr int battery_voltage_0_percent = 6000;
+      static constexpr int battery_voltage_100_percent = 8260;
+      static constexpr int battery_capacity = 2400;
+      static constexpr int min_charging_current = 10;
+      };
+
+    ina219::Device<MyBoard> dev ("/dev/i2c-1", 0x42);
+    if (dev.init (&e))
+      if (auto s = dev.status (&e)) printf ("%d%%\n", s->percent);
+
+  ina219::Battery<Profile> does the conversions from raw register
+  values. Since every divisor is a compile-time constant, the compiler
+  turns the divisions into multiplications and shifts, and the
+  percentage charge for a raw bus voltage is a read from a table of
+  SOC_TABLE_SIZE entries, worked out at compile time. The results are
+  the same, to the last digit, as ina219_battery_status_from_raw()
+  gives for the same settings, and the charge is reported as fully
+  charged above INA_FULL_PERCENT, as it is by the C code.
+
+  ina219::Device<Profile> owns an INA219 object, created with the
+  profile's settings, and reads through it. Nothing here allocates
+  memory after the Device is constructed, and results are returned by
+  value. get() gives the underlying INA219 *, so any of the C API can
+  be used on the same device; the profile doesn't cover the
+  calibrated current register, or a discharge curve (see soc.h), so
+  for those, use the C API.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <array>
+#include <optional>
+#include <cstdint>
+#include "defs.h"
+#include "ina219.h"
+
+namespace ina219 {
+
+// The charge status, as ina219_get_status() reports it
+struct Status
+  {
+  INA219ChargeStatus charge_status;
+  int battery_voltage_mv;
+  int percent_charged;
+  int battery_current_mA;
+  int minutes;
+  };
+
+namespace detail {
+
+// The straight line from the 0% to the 100% voltage, as in 
+//  ina219_battery_status()
+constexpr int line_percent (int mv, int v0, int v100)
+  {
+  int p = 100 * (mv - v0) / (v100 - v0);
+  return p > 100 ? 100 : p < 0 ? 0 : p;
+  }
+
+// The bus voltage field is 13 bits, in steps of 4mV, so the table has
+//  an entry for every voltage that the register can hold
+template <int v0, int v100>
+constexpr std::array<int8_t, SOC_TABLE_SIZE> make_percent_table (void)
+  {
+  std::array<int8_t, SOC_TABLE_SIZE> table {};
+  for (int i = 0; i < SOC_TABLE_SIZE; i++)
+    table[i] = (int8_t)line_percent (i * 4, v0, v100);
+  return table;
+  }
+
+template <int v0, int v100>
+inline constexpr std::array<int8_t, SOC_TABLE_SIZE> percent_table
+  = make_percent_table<v0, v100> ();
+
+} // namespace detail
+
+/*============================================================================
+
+  Battery
+
+  Conversions for one board profile. Everything is static and
+  constexpr, and does no I/O.
+
+============================================================================*/
+template <typename Profile>
+class Battery
+  {
+  public:
+    static constexpr int shunt_milliohms = Profile::shunt_milliohms;
+    static constexpr int v0 = Profile::battery_voltage_0_percent;
+    static constexpr int v100 = Profile::battery_voltage_100_percent;
+    static constexpr int capacity = Profile::battery_capacity;
+    static constexpr int min_charging_current
+      = Profile::min_charging_current;
+
+    static_assert (shunt_milliohms > 0, "The shunt must have resistance");
+    static_assert (v100 > v0, "The 100% voltage must be above the 0% one");
+    static_assert (capacity > 0, "The battery must have a capacity");
+
+    /** Bus voltage in mV from the bus voltage register. */
+    static constexpr int bus_mv (uint16_t bus_reg)
+      {
+      // See ina219_bus_reg_to_mv()
+      return (bus_reg & 0xFFF8) >> 1;
+      }
+
+    /** Current in mA from the shunt register, as the C code works it
+        out: whole mV across the shunt, then divided by its
+        resistance. */
+    static constexpr int current_mA (int16_t shunt_reg)
+      {
+      return shunt_reg / 100 * 1000 / shunt_milliohms;
+      }
+
+    /** Current in uA from the shunt register, as
+        ina219_current_ua_from_raw(). */
+    static constexpr int current_ua (int16_t shunt_reg)
+      {
+      return shunt_reg * 10000 / shunt_milliohms;
+      }
+
+    /** Percentage charge for any voltage, on the straight line from
+        the 0% to the 100% voltage. */
+    static constexpr int percent (int mv)
+      {
+      return detail::line_percent (mv, v0, v100);
+      }
+
+    /** Percentage charge for a raw bus voltage, from the table. */
+    static constexpr int percent_from_raw (uint16_t bus_reg)
+      {
+      return detail::percent_table<v0, v100>[bus_reg >> 3];
+      }
+
+    /** The status for a voltage and current, as
+        ina219_battery_status(). */
+    static constexpr Status status (int mv, int mA)
+      {
+      return status_with_percent (mv, mA, percent (mv));
+      }
+
+    /** The status for raw register values, as
+        ina219_battery_status_from_raw(). */
+    static constexpr Status status_from_raw (int16_t shunt_reg,
+        uint16_t bus_reg)
+      {
+      return status_with_percent (bus_mv (bus_reg), current_mA (shunt_reg),
+        percent_from_raw (bus_reg));
+      }
+
+    /** The same settings, for the C functions that take them. */
+    static constexpr INA219Battery c_battery (void)
+      {
+      return INA219Battery { shunt_milliohms, v0, v100, capacity,
+        min_charging_current, INA_FULL_PERCENT, nullptr };
+      }
+
+  private:
+    static constexpr Status status_with_percent (int mv, int mA, int pct)
+      {
+      Status s {};
+      s.battery_voltage_mv = mv;
+      s.battery_current_mA = mA;
+      s.percent_charged = pct;
+      // See ina219_battery_status() for why these tests are as they are
+      if (pct >= INA_FULL_PERCENT || (mA >= 0 && mA < min_charging_current))
+        {
+        s.charge_status = INA219_FULLY_CHARGED;
+        s.minutes = 0;
+        }
+      else
+        {
+        s.charge_status = mA > 0 ? INA219_CHARGING : INA219_DISCHARGING;
+        int remaining = (mA >= 0 ? 100 - pct : pct) * capacity / 100;
+        int sec = 3600 * remaining / (double)(mA >= 0 ? mA : -mA);
+        s.minutes = sec / 60;
+        }
+      return s;
+      }
+  };
+
+/*============================================================================
+
+  Device
+
+  An INA219 with the settings of a board profile. Not copyable, since
+  it owns the INA219 object, but it can be moved.
+
+============================================================================*/
+template <typename Profile>
+class Device
+  {
+  public:
+    using Conversions = Battery<Profile>;
+
+    Device (const char *i2c_dev, int i2c_addr)
+      : self (ina219_create (i2c_dev, i2c_addr, Conversions::shunt_milliohms,
+          Conversions::v0, Conversions::v100, Conversions::capacity,
+          Conversions::min_charging_current))
+      {
+      }
+
+    ~Device ()
+      {
+      if (self) ina219_destroy (self);
+      }
+
+    Device (const Device &) = delete;
+    Device &operator= (const Device &) = delete;
+
+    Device (Device &&other) noexcept : self (other.self)
+      {
+      other.self = nullptr;
+      }
+
+    Device &operator= (Device &&other) noexcept
+      {
+      if (this != &other)
+        {
+        if (self) ina219_destroy (self);
+        self = other.self;
+        other.self = nullptr;
+        }
+      return *this;
+      }
+
+    /** The C object, for anything that this class doesn't cover. */
+    INA219 *get (void) const { return self; }
+
+    /** As ina219_init_e(). */
+    bool init (INA219Error *e = nullptr)
+      {
+      return ina219_init_e (self, e);
+      }
+
+    /** As ina219_init_transport_e(). */
+    bool init (INA219Transport *transport, INA219Error *e = nullptr)
+      {
+      return ina219_init_transport_e (self, transport, e);
+      }
+
+    /** Read both registers, or nothing if the read fails. */
+    std::optional<INA219Sample> sample (INA219Error *e = nullptr) const
+      {
+      INA219Sample s;
+      if (!ina219_sample_e (self, &s, e)) return std::nullopt;
+      return s;
+      }
+
+    /** The charge status, worked out from the shunt voltage. This is
+        what ina219_get_status() reports if the chip has not been
+        configured. */
+    std::optional<Status> status (INA219Error *e = nullptr) const
+      {
+      int16_t shunt_reg;
+      uint16_t bus_reg;
+      if (!ina219_get_raw_e (self, &shunt_reg, &bus_reg, e))
+        return std::nullopt;
+      return Conversions::status_from_raw (shunt_reg, bus_reg);
+      }
+
+    /** The current in uA, from one shunt register read. */
+    std::optional<int> current_ua (INA219Error *e = nullptr) const
+      {
+      int16_t shunt_reg;
+      if (!ina219_get_shunt_raw_e (self, &shunt_reg, e))
+        return std::nullopt;
+      return Conversions::current_ua (shunt_reg);
+      }
+
+  private:
+    INA219 *self;
+  };
+
+} // namespace ina219
+
@@ -7,6 +7,71 @@
     on a charging system that uses to 18650 batteries in series, with 
     a 0.1 ohm shunt resistor for measuring the battery current draw. 
 
+    By default, the program takes one reading, prints it, and exits. With
+    the -d switch, it runs until interrupted, sampling at a fixed rate
+    in a background thread. Consumer threads take the samples from a
+    ring buffer, and print a periodic status report and low-battery
+    alerts.
+
+    With -g, a list of devices, possibly on several I2C buses, is read 
+    from a file, and they are all sampled in parallel, one thread per
+    bus. The settings below are then not used.
+
+    In daemon mode, the charge is also estimated by integrating the
+    current over time. With -s, that estimate is saved to a file, and
+    picked up again when the program is restarted.
+
+    With -l, the daemon also writes every raw sample to a compact
+    binary log; -D prints such a log as CSV.
+
+    With -p, the daemon publishes the latest status in shared memory,
+    and -P reads and prints it, so other programs can get the battery 
+    status without using the I2C bus.
+
+    With -M, the daemon writes its I/O and timing figures (see stats.h)
+    to a file in the Prometheus text format at each report; with -m, it
+    serves them over HTTP on the given port.
+
+    With -c, the charge percentage is read from a measured discharge 
+    curve (see soc.h), rather than worked out from a straight line 
+    between the 0% and 100% voltages below. -C records such a curve:
+    charge the battery fully, run with -C, and let the battery run
+    down at a steady load; the curve is written when the voltage falls
+    to the 0% voltage, or when the program is interrupted.
+
+    With -F, the daemon passes the voltage and current through a filter
+    (see filter.h) before working out the charge status and times, so
+    that brief changes in load don't make the figures jump about.
+
+    With -A, the daemon samples at a rate that varies between two
+    limits (see adaptive.h): slowly while the battery is idle, and
+    quickly when the load or the charge status changes.
+
+    In daemon mode, changes of charge status and low battery are
+    raised as events (see events.h), after they have lasted for a
+    debounce time. They are printed, and with -e, a command is run for
+    each one. With -G, edges on a GPIO line are events too.
+
+    With -b, the program takes a burst of shunt readings as fast as 
+    the chip can convert them (see burst.h), optionally waiting for the
+    current to cross a level first, and prints them as CSV.
+
+    With -R, samples recorded with -l (or printed by -D) are run through
+    the charge status calculation, for each combination of the settings
+    given by -S, and a summary of how each one behaved is printed (see
+    replay.h). No INA219 is needed for this.
+
+    With -H, the daemon keeps a summary of the voltage, current, and
+    power over the last hour, week, and year in a file of fixed size
+    (see history.h); -Q prints the summary from such a file.
+
+    If the INA219 stops answering, sampling carries on without it, and
+    it is reopened and reprogrammed after a backoff. With -B, a command
+    is run when that keeps failing, to do something about the bus.
+
+    The -n switch programs the INA219 to average a number of samples
+    for each conversion, and to calculate the current itself. 
+
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
@@ -15,10 +80,34 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include "defs.h" 
 #include "ina219.h" 
+#include "ring.h" 
+#include "sampler.h" 
+#include "adaptive.h"
+#include "group.h" 
+#include "charge.h" 
+#include "samplelog.h" 
+#include "shmstatus.h" 
+#include "stats.h" 
+#include "soc.h" 
+#include "filter.h" 
+#include "events.h"
+#include "burst.h"
+#include "replay.h"
+#include "history.h"
+
+extern char **environ;
 
 // Set the I2C address of the INA219. This will be in the range
 //  0x40-0x4F, depending on how the address setting pins (7 and 8)
@@ -41,6 +130,11 @@
 // Capacity in mA.hr
 #define BATTERY_CAPACITY 2400
 
+// Internal resistance of the battery in milliohms. This is used to
+//  correct the voltages in a discharge curve recorded with -C, for the
+//  voltage drop at the load current. Zero for no correction.
+#define BATTERY_RESISTANCE_MOHM 0
+
 // Minimum charging current in mA
 #define MIN_CHARGING_CURRENT 10
 
@@ -49,6 +143,1329 @@
 //  designs.
 #define SHUNT_MILLIOHMS 100
 
+// Number of samples held in the ring buffer in daemon mode. At the
+//  default rate this is several minutes of history, which is far more
+//  than any consumer should need to catch up.
+#define RING_SIZE 1024
+
+// Defaults for the command-line settings
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_REPORT_MS 10000
+#define DEFAULT_ALERT_PERCENT 10
+
+// How long a change of status, or low battery, has to last before it
+//  is reported, in milliseconds
+#define EVENT_DEBOUNCE_MS 5000
+
+// How far, in percent, the charge has to fall from full before the 
+//  battery is no longer reported as fully charged; and how far it 
+//  has to rise above the alert level to re-arm the low-battery alert
+#define FULL_HYSTERESIS_PERCENT 2
+#define ALERT_HYSTERESIS_PERCENT 2
+
+// Initial size of a new binary log, in 4kB blocks
+#define LOG_INITIAL_BLOCKS 1024
+
+// Time constant of the smoothing applied to the current before working
+//  out the time to full or empty, in seconds
+#define CURRENT_SMOOTHING_S 60
+
+// SCHED_FIFO priority of the burst capture thread
+#define BURST_PRIORITY 50
+
+// A change of status that is undone within this time (ms) is counted 
+//  as a flap when replaying; and the most combinations of settings
+//  that a sweep can have
+#define REPLAY_FLAP_MS 300000
+#define REPLAY_MAX_SETTINGS 100000
+
+// How often the history file is flushed, in seconds
+#define HISTORY_SYNC_S 60
+
+// Number of samples converted at a time when dumping a log
+#define DUMP_BATCH 4096
+
+// Settings shared by the consumer threads in daemon mode
+typedef struct _Consumer
+  {
+  const INA219 *ina219; // Only used for status calculations -- no I/O
+  SampleRing *ring;
+  int report_ms;
+  EventEngine *events; // Fed by the event thread
+  ChargeCounter *counter; // Only used by the report thread
+  const char *state_file; // May be NULL
+  SampleLog *log; // May be NULL
+  StatusPublisher *publisher; // May be NULL; used by the report thread
+  const char *metrics_file; // May be NULL; used by the report thread
+  SampleFilter *filter; // May be NULL; used by the report thread
+  HistoryStore *history; // May be NULL
+  _Atomic BOOL *stop;
+  } Consumer;
+
+/*============================================================================
+
+  status_name
+
+============================================================================*/
+static const char *status_name (INA219ChargeStatus charge_status)
+  {
+  return charge_status == INA219_FULLY_CHARGED ? "full" : 
+    charge_status == INA219_CHARGING ? "charging" : "discharging";
+  }
+
+/*============================================================================
+
+  print_status
+
+============================================================================*/
+static void print_status (INA219ChargeStatus charge_status, int mV,
+              int percent_charged, int battery_current_mA, int minutes)
+  {
+  switch (charge_status)
+    {
+    case INA219_FULLY_CHARGED:
+      printf ("Fully charged\n");
+      break;
+    case INA219_CHARGING:
+      printf ("Charging, %d minutes until fully charged\n", minutes);
+      break;
+    case INA219_DISCHARGING:
+      printf ("Discharging, %d minutes left\n", minutes);
+      break;
+    }
+  printf ("Battery voltage: %.2f V\n", mV / 1000.0); // Convert to V
+  printf ("Battery current: %d mA\n", battery_current_mA); 
+  printf ("Battery charge: %.d %%\n", percent_charged); 
+  }
+
+/*============================================================================
+
+  report_thread
+
+  Consumer that averages the raw samples over each reporting period, 
+  and prints one status line per period. Averaging the raw register
+  values, rather than the derived figures, keeps all the arithmetic in 
+  integers, and gives a less noisy current reading.
+
+============================================================================*/
+static void *report_thread (void *arg)
+  {
+  Consumer *c = arg;
+  uint64_t cursor = sample_ring_cursor (c->ring);
+  uint64_t period_ns = (uint64_t)c->report_ms * 1000000ULL;
+  uint64_t period_start = 0;
+  int64_t shunt_sum = 0, bus_sum = 0;
+  int count = 0;
+  int overflows = 0;
+  uint64_t lost_total = 0;
+  int gaps = 0;
+  uint64_t samples = 0;
+  // The latest filtered figures, if there's a filter
+  int filtered_mv = 0, filtered_ua = 0;
+  INA219ChargeStatus filtered_status = INA219_DISCHARGING;
+  int filtered_percent = 0, filtered_minutes = 0;
+
+  while (!atomic_load (c->stop))
+    {
+    if (!sample_ring_wait (c->ring, cursor, 500)) continue;
+
+    INA219Sample sample;
+    uint64_t lost;
+    SampleRingResult r;
+    while ((r = sample_ring_read (c->ring, &cursor, &sample, &lost)) 
+         != SAMPLE_RING_EMPTY)
+      {
+      if (r == SAMPLE_RING_OVERRUN)
+        {
+        lost_total += lost;
+        continue;
+        }
+      if (INA219_SAMPLE_IS_GAP (&sample))
+        {
+        gaps++;
+        continue;
+        }
+      INA219ChargeStatus charge_status;
+      int mV, percent_charged, battery_current_mA, minutes;
+      ina219_status_from_raw (c->ina219, sample.shunt_reg, sample.bus_reg,
+        &charge_status, &mV, &percent_charged, &battery_current_mA, 
+        &minutes);
+      int current_ua = ina219_current_ua_from_raw (c->ina219, 
+        sample.shunt_reg);
+      filtered_mv = mV;
+      filtered_ua = current_ua;
+      if (c->filter)
+        {
+        // Work out the status again from the filtered values. The raw
+        //  voltage and current are still reported as they are
+        int unused_mv, unused_mA;
+        sample_filter_update (c->filter, sample.time_ns, mV, current_ua);
+        sample_filter_get (c->filter, &filtered_mv, &filtered_ua);
+        ina219_status_from_values (c->ina219, filtered_mv, 
+          filtered_ua / 1000, &charge_status, &unused_mv, 
+          &percent_charged, &unused_mA, &minutes);
+        filtered_status = charge_status;
+        filtered_percent = percent_charged;
+        filtered_minutes = minutes;
+        }
+      charge_counter_update (c->counter, sample.time_ns, current_ua, 
+        percent_charged);
+      samples++;
+
+      if (c->publisher)
+        {
+        INA219SharedStatus status;
+        status.time_ns = sample.time_ns;
+        status.shunt_reg = sample.shunt_reg;
+        status.bus_reg = sample.bus_reg;
+        status.charge_status = charge_status;
+        status.battery_voltage_mv = mV;
+        status.percent_charged = percent_charged;
+        status.battery_current_mA = battery_current_mA;
+        status.minutes = minutes;
+        status.filtered_voltage_mv = filtered_mv;
+        status.filtered_current_mA = filtered_ua / 1000;
+        int integrated_percent, integrated_minutes, smoothed_mA;
+        charge_counter_get (c->counter, &integrated_percent, 
+          &integrated_minutes, &smoothed_mA);
+        status.integrated_percent = integrated_percent;
+        status.integrated_minutes = integrated_minutes;
+        status.smoothed_current_mA = smoothed_mA;
+        status.samples = samples;
+        status_publisher_publish (c->publisher, &status);
+        }
+
+      if (count == 0) period_start = sample.time_ns;
+      shunt_sum += sample.shunt_reg;
+      bus_sum += sample.bus_reg;
+      if (sample.bus_reg & INA219_BUS_OVF) overflows++;
+      count++;
+
+      if (sample.time_ns - period_start >= period_ns)
+        {
+        ina219_status_from_raw (c->ina219, (int16_t)(shunt_sum / count),
+          (uint16_t)(bus_sum / count), &charge_status, &mV, 
+          &percent_charged, &battery_current_mA, &minutes);
+        time_t now = time (NULL);
+        struct tm tm;
+        char when[32];
+        strftime (when, sizeof (when), "%Y-%m-%d %H:%M:%S", 
+          localtime_r (&now, &tm));
+        printf ("%s %s %.2f V %d mA %d %% %d min (%d samples", when, 
+          status_name (charge_status), mV / 1000.0, battery_current_mA, 
+          percent_charged, minutes, count);
+        if (lost_total) printf (", %llu lost", 
+          (unsigned long long)lost_total);
+        if (overflows) printf (", %d overflowed", overflows);
+        if (gaps) printf (", %d gaps", gaps);
+        printf (")\n");
+        int soc_percent, soc_minutes, smoothed_mA;
+        charge_counter_get (c->counter, &soc_percent, &soc_minutes, 
+          &smoothed_mA);
+        printf ("%s integrated %d %% %d mAh, smoothed %d mA", when, 
+          soc_percent, charge_counter_get_mah (c->counter), smoothed_mA);
+        if (soc_minutes >= 0) printf (", %d min", soc_minutes);
+        printf ("\n");
+        if (c->filter)
+          printf ("%s filtered %s %.2f V %d mA %d %% %d min\n", when, 
+            status_name (filtered_status), filtered_mv / 1000.0, 
+            filtered_ua / 1000, filtered_percent, filtered_minutes);
+        fflush (stdout);
+        if (c->state_file) 
+          charge_counter_save (c->counter, c->state_file, NULL);
+        if (c->metrics_file) 
+          ina219_stats_export_file (c->metrics_file, NULL);
+        shunt_sum = bus_sum = 0;
+        count = 0;
+        overflows = 0;
+        lost_total = 0;
+        gaps = 0;
+        }
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  event_thread
+
+  Consumer that passes every sample to the event engine. The events
+  themselves are taken from the engine by run_daemon().
+
+============================================================================*/
+static void *event_thread (void *arg)
+  {
+  Consumer *c = arg;
+  uint64_t cursor = sample_ring_cursor (c->ring);
+
+  while (!atomic_load (c->stop))
+    {
+    if (!sample_ring_wait (c->ring, cursor, 500)) continue;
+
+    INA219Sample sample;
+    SampleRingResult r;
+    while ((r = sample_ring_read (c->ring, &cursor, &sample, NULL)) 
+         != SAMPLE_RING_EMPTY)
+      {
+      if (r == SAMPLE_RING_OVERRUN || INA219_SAMPLE_IS_GAP (&sample)) 
+        continue;
+      INA219ChargeStatus charge_status;
+      int mV, percent_charged, battery_current_mA, minutes;
+      ina219_status_from_raw (c->ina219, sample.shunt_reg, sample.bus_reg,
+        &charge_status, &mV, &percent_charged, &battery_current_mA, 
+        &minutes);
+      event_engine_update (c->events, sample.time_ns, charge_status, mV, 
+        percent_charged, battery_current_mA, minutes);
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  print_event
+
+============================================================================*/
+static void print_event (const EventEngine *events, 
+              const BatteryEvent *event)
+  {
+  switch (event->type)
+    {
+    case BATTERY_EVENT_STATUS:
+      printf ("Status: %s -> %s, %d %%\n", 
+        status_name (event->previous_status), status_name (event->status),
+        event->percent_charged);
+      break;
+    case BATTERY_EVENT_BELOW:
+      fprintf (stderr, "Low battery: %d %%, %d minutes left\n",
+        event->percent_charged, event->minutes);
+      break;
+    case BATTERY_EVENT_ABOVE:
+      printf ("Battery no longer %s: %d %%\n", 
+        event_engine_get_threshold_name (events, event->threshold),
+        event->percent_charged);
+      break;
+    case BATTERY_EVENT_PIN:
+      printf ("GPIO line %d %s\n", event->line, 
+        event->rising ? "rose" : "fell");
+      break;
+    }
+  fflush (stdout);
+  }
+
+/*============================================================================
+
+  log_thread
+
+  Consumer that appends every sample to the binary log, including gap
+  markers, so that the log shows when the device was not answering.
+
+============================================================================*/
+static void *log_thread (void *arg)
+  {
+  Consumer *c = arg;
+  uint64_t cursor = sample_ring_cursor (c->ring);
+  uint64_t last_sync = 0;
+  uint64_t sync_ns = (uint64_t)c->report_ms * 1000000ULL;
+
+  while (!atomic_load (c->stop))
+    {
+    if (!sample_ring_wait (c->ring, cursor, 500)) continue;
+
+    INA219Sample sample;
+    SampleRingResult r;
+    while ((r = sample_ring_read (c->ring, &cursor, &sample, NULL)) 
+         != SAMPLE_RING_EMPTY)
+      {
+      if (r == SAMPLE_RING_OVERRUN) continue;
+      char *error = NULL;
+      if (!sample_log_append (c->log, 0, &sample, &error))
+        {
+        fprintf (stderr, "Can't write log: %s\n", error);
+        free (error);
+        return NULL;
+        }
+      if (sample.time_ns - last_sync >= sync_ns)
+        {
+        sample_log_sync (c->log);
+        last_sync = sample.time_ns;
+        }
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  realtime_offset_ns
+
+  The difference between the wall clock and the monotonic clock, which
+  sample times are taken from.
+
+============================================================================*/
+static int64_t realtime_offset_ns (void)
+  {
+  struct timespec mono, real;
+  clock_gettime (CLOCK_MONOTONIC, &mono);
+  clock_gettime (CLOCK_REALTIME, &real);
+  return ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000LL
+    + (real.tv_nsec - mono.tv_nsec);
+  }
+
+/*============================================================================
+
+  history_thread
+
+  Consumer that adds every sample to the history. Sample times are
+  monotonic, but the history is kept in wall-clock time, so that it 
+  makes sense across restarts. The wall clock can be stepped, by NTP
+  for example, so the difference between the clocks is taken again
+  each time the history is synced; the syncs themselves are timed on
+  the monotonic clock, so that a step doesn't hold them up.
+
+============================================================================*/
+static void *history_thread (void *arg)
+  {
+  Consumer *c = arg;
+  uint64_t cursor = sample_ring_cursor (c->ring);
+  int64_t offset_ns = realtime_offset_ns ();
+  uint64_t last_sync_ns = 0;
+
+  while (!atomic_load (c->stop))
+    {
+    if (!sample_ring_wait (c->ring, cursor, 500)) continue;
+
+    INA219Sample sample;
+    SampleRingResult r;
+    while ((r = sample_ring_read (c->ring, &cursor, &sample, NULL)) 
+         != SAMPLE_RING_EMPTY)
+      {
+      if (r == SAMPLE_RING_OVERRUN || INA219_SAMPLE_IS_GAP (&sample)) 
+        continue;
+      INA219ChargeStatus charge_status;
+      int mV, percent_charged, battery_current_mA, minutes;
+      ina219_status_from_raw (c->ina219, sample.shunt_reg, sample.bus_reg,
+        &charge_status, &mV, &percent_charged, &battery_current_mA, 
+        &minutes);
+      time_t t = (time_t)(((int64_t)sample.time_ns + offset_ns) 
+        / 1000000000LL);
+      history_store_add (c->history, t, mV, 
+        ina219_current_ua_from_raw (c->ina219, sample.shunt_reg));
+      if (sample.time_ns - last_sync_ns >= HISTORY_SYNC_S * 1000000000ULL)
+        {
+        history_store_sync (c->history);
+        last_sync_ns = sample.time_ns;
+        offset_ns = realtime_offset_ns ();
+        }
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  run_bus_hook
+
+  The bus hook (see ina219.h) for -B: run the command, without waiting
+  for it, with the device and the number of failed attempts to recover
+  it in its environment. As with event hooks (see events.c), the 
+  environment is built before forking, and the command is left to 
+  init to reap, so the sampling thread is only held up for the fork.
+
+============================================================================*/
+static void run_bus_hook (void *arg, const char *device, int addr, 
+              int failures)
+  {
+  char device_var[256], addr_var[32], failures_var[32];
+  snprintf (device_var, sizeof (device_var), "INA219_DEVICE=%s", device);
+  snprintf (addr_var, sizeof (addr_var), "INA219_ADDR=0x%02x", addr);
+  snprintf (failures_var, sizeof (failures_var), "INA219_FAILURES=%d",
+    failures);
+  int nenv = 0;
+  while (environ[nenv]) nenv++;
+  char **env = malloc ((nenv + 4) * sizeof (char *));
+  memcpy (env, environ, nenv * sizeof (char *));
+  env[nenv] = device_var;
+  env[nenv + 1] = addr_var;
+  env[nenv + 2] = failures_var;
+  env[nenv + 3] = NULL;
+  char *const argv[] = { "sh", "-c", (char *)arg, NULL };
+
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+    if (fork () == 0)
+      {
+      execve ("/bin/sh", argv, env);
+      _exit (127);
+      }
+    _exit (0);
+    }
+  if (pid > 0) waitpid (pid, NULL, 0);
+  free (env);
+  }
+
+/*============================================================================
+
+  set_bus_hook
+
+  Have the INA219 run "command" when it can't be recovered, keeping 
+  the default retry and backoff settings.
+
+============================================================================*/
+static void set_bus_hook (INA219 *ina219, const char *command)
+  {
+  INA219Recovery recovery;
+  ina219_recovery_default (&recovery);
+  recovery.bus_hook = run_bus_hook;
+  recovery.hook_arg = (void *)command;
+  ina219_set_recovery (ina219, &recovery);
+  }
+
+/*============================================================================
+
+  run_daemon
+
+  Sample continuously until SIGINT or SIGTERM. The signals are blocked
+  in all threads, and collected here with a signalfd, so no thread has
+  to deal with interrupted system calls. This thread sleeps until there
+  is a signal or an event.
+
+============================================================================*/
+static int run_daemon (INA219 *ina219, int interval_ms, int report_ms,
+             int alert_percent, int battery_capacity, 
+             const char *state_file, const char *log_file, 
+             const char *shm_name, const char *metrics_file, 
+             int metrics_port, SampleFilter *filter, 
+             const AdaptiveConfig *adaptive, const char *hook, 
+             const char *gpio, const char *history_file, 
+             const char *argv0)
+  {
+  int ret = 0;
+  sigset_t sigs;
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+  char *error = NULL;
+  INA219Battery battery;
+  ina219_get_battery (ina219, &battery);
+  EventEngine *events = event_engine_create (EVENT_DEBOUNCE_MS, 
+    battery.full_percent, FULL_HYSTERESIS_PERCENT, &error);
+  if (!events)
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    return 1;
+    }
+  EventThreshold low = { "low", EVENT_PERCENT, alert_percent, 
+    ALERT_HYSTERESIS_PERCENT, TRUE };
+  event_engine_add_threshold (events, &low);
+  if (hook) event_engine_set_hook (events, hook);
+  if (gpio)
+    {
+    // CHIP:LINE
+    char *chip = strdup (gpio);
+    char *colon = strrchr (chip, ':');
+    if (colon) *colon = 0;
+    if (!colon || !event_engine_watch_gpio (events, chip, 
+         atoi (colon + 1), &error))
+      {
+      if (colon)
+        fprintf (stderr, "%s: %s\n", argv0, error);
+      else
+        fprintf (stderr, "%s: bad GPIO line: %s\n", argv0, gpio);
+      free (error);
+      error = NULL;
+      }
+    free (chip);
+    }
+
+  _Atomic BOOL stop = FALSE;
+  SampleRing *ring = sample_ring_create (RING_SIZE);
+  // Either a fixed-rate or an adaptive sampler
+  Sampler *sampler = NULL;
+  AdaptiveSampler *adaptive_sampler = NULL;
+  if (adaptive)
+    {
+    adaptive_sampler = adaptive_sampler_create (adaptive);
+    adaptive_sampler_add (adaptive_sampler, ina219, ring);
+    }
+  else
+    sampler = sampler_create (ina219, ring, interval_ms);
+  ChargeCounter *counter = charge_counter_create (battery_capacity, 
+    battery.full_percent, CURRENT_SMOOTHING_S);
+  // A missing state file is normal on the first run
+  if (state_file) charge_counter_load (counter, state_file, NULL);
+  SampleLog *log = NULL;
+  if (log_file && !(log = sample_log_create (log_file, LOG_INITIAL_BLOCKS,
+       &error)))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    error = NULL;
+    }
+  StatusPublisher *publisher = NULL;
+  if (shm_name && !(publisher = status_publisher_create (shm_name, &error)))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    error = NULL;
+    }
+  StatsServer *server = NULL;
+  if (metrics_port > 0 && !(server = stats_server_start (metrics_port, 
+       &error)))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    error = NULL;
+    }
+  HistoryStore *history = NULL;
+  if (history_file && !(history = history_store_open (history_file, NULL,
+       0, FALSE, &error)))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    error = NULL;
+    }
+  int sig_fd = signalfd (-1, &sigs, SFD_CLOEXEC);
+
+  Consumer consumer = { ina219, ring, report_ms, events, counter,
+    state_file, log, publisher, metrics_file, filter, history, &stop };
+
+  pthread_t reporter, eventer, logger, historian;
+  pthread_create (&reporter, NULL, report_thread, &consumer);
+  pthread_create (&eventer, NULL, event_thread, &consumer);
+  if (log) pthread_create (&logger, NULL, log_thread, &consumer);
+  if (history) pthread_create (&historian, NULL, history_thread, &consumer);
+
+  if (sampler ? sampler_start (sampler, &error)
+       : adaptive_sampler_start (adaptive_sampler, &error))
+    {
+    BOOL done = FALSE;
+    while (!done)
+      {
+      struct pollfd fds[2];
+      fds[0].fd = sig_fd;
+      fds[0].events = POLLIN;
+      fds[1].fd = event_engine_get_fd (events);
+      fds[1].events = POLLIN;
+      if (poll (fds, 2, -1) < 0) continue;
+      BatteryEvent event;
+      while (event_engine_read (events, &event))
+        print_event (events, &event);
+      if (fds[0].revents) done = TRUE;
+      }
+    if (sampler) 
+      sampler_stop (sampler);
+    else
+      adaptive_sampler_stop (adaptive_sampler);
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    ret = 1;
+    }
+
+  atomic_store (&stop, TRUE);
+  pthread_join (reporter, NULL);
+  pthread_join (eventer, NULL);
+  if (log) 
+    {
+    pthread_join (logger, NULL);
+    sample_log_close (log);
+    }
+  if (history)
+    {
+    pthread_join (historian, NULL);
+    history_store_close (history);
+    }
+
+  uint64_t samples, failures, wakeups;
+  INA219Error last_error;
+  BOOL failed;
+  if (sampler)
+    {
+    sampler_get_counts (sampler, &samples, &failures);
+    failed = sampler_get_last_error (sampler, &last_error);
+    }
+  else
+    {
+    adaptive_sampler_get_counts (adaptive_sampler, &samples, &failures, 
+      &wakeups);
+    failed = adaptive_sampler_get_last_error (adaptive_sampler, 
+      &last_error);
+    printf ("%llu samples in %llu wake-ups\n", 
+      (unsigned long long)(samples + failures), 
+      (unsigned long long)wakeups);
+    }
+  if (failed)
+    {
+    char message[256];
+    ina219_error_format (&last_error, message, sizeof (message));
+    fprintf (stderr, "%s: %llu of %llu reads failed; the last with: %s\n", 
+      argv0, (unsigned long long)failures, 
+      (unsigned long long)(samples + failures), message);
+    }
+
+  if (state_file && !charge_counter_save (counter, state_file, &error))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    }
+
+  if (sampler) sampler_destroy (sampler);
+  adaptive_sampler_destroy (adaptive_sampler);
+  sample_ring_destroy (ring);
+  status_publisher_destroy (publisher);
+  stats_server_stop (server);
+  event_engine_destroy (events);
+  close (sig_fd);
+  charge_counter_destroy (counter);
+  return ret;
+  }
+
+/*============================================================================
+
+  run_group
+
+  Sample all the devices listed in group_file, and print a status line
+  for each one every report_ms, until SIGINT or SIGTERM.
+
+============================================================================*/
+static int run_group (const char *group_file, int interval_ms, 
+             int report_ms, const char *bus_hook, const char *argv0)
+  {
+  int ret = 0;
+  char *error = NULL;
+  INA219Group *group = ina219_group_create ();
+  BOOL ok = ina219_group_load (group, group_file, &error);
+  if (ok && bus_hook)
+    {
+    for (int i = 0; i < ina219_group_count (group); i++)
+      set_bus_hook (ina219_group_get_device (group, i), bus_hook);
+    }
+  if (ok && ina219_group_start (group, interval_ms > 0 ? interval_ms : 
+       DEFAULT_INTERVAL_MS, &error))
+    {
+    sigset_t sigs;
+    sigemptyset (&sigs);
+    sigaddset (&sigs, SIGINT);
+    sigaddset (&sigs, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+    int n = ina219_group_count (group);
+    INA219GroupReading *readings = malloc (n * sizeof (INA219GroupReading));
+    struct timespec timeout;
+    timeout.tv_sec = report_ms / 1000;
+    timeout.tv_nsec = (report_ms % 1000) * 1000000L;
+    while (sigtimedwait (&sigs, NULL, &timeout) < 0)
+      {
+      uint64_t cycle = ina219_group_get_snapshot (group, readings);
+      if (cycle == 0) continue;
+      for (int i = 0; i < n; i++)
+        {
+        if (!readings[i].valid)
+          {
+          char message[256];
+          ina219_error_format (&readings[i].error, message, 
+            sizeof (message));
+          printf ("%llu %d read failed: %s\n", (unsigned long long)cycle, 
+            i, message);
+          continue;
+          }
+        INA219ChargeStatus charge_status;
+        int mV, percent_charged, battery_current_mA, minutes;
+        ina219_status_from_raw (ina219_group_get_device (group, i), 
+          readings[i].sample.shunt_reg, readings[i].sample.bus_reg, 
+          &charge_status, &mV, &percent_charged, &battery_current_mA, 
+          &minutes);
+        printf ("%llu %d %s %.2f V %d mA %d %% %d min\n", 
+          (unsigned long long)cycle, i, status_name (charge_status), 
+          mV / 1000.0, battery_current_mA, percent_charged, minutes);
+        }
+      fflush (stdout);
+      }
+    free (readings);
+    ina219_group_stop (group);
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    ret = 1;
+    }
+  ina219_group_destroy (group);
+  return ret;
+  }
+
+/*============================================================================
+
+  dump_log
+
+  Print the contents of a binary sample log as CSV, with the raw values
+  converted using the settings at the top of this file. The samples
+  are converted DUMP_BATCH at a time, so the vector kernels in 
+  convert.c can be used. Gap markers (see ina219.h) are kept, so that
+  the dump can still be replayed, but are flagged in the gap column,
+  and have no converted values.
+
+============================================================================*/
+static int dump_log (const char *log_file, const char *argv0)
+  {
+  int ret = 0;
+  char *error = NULL;
+  INA219Converter conv;
+  SampleLogReader *reader = NULL;
+  if (ina219_converter_init (&conv, SHUNT_MILLIOHMS, 
+       BATTERY_VOLTAGE_0_PERCENT, BATTERY_VOLTAGE_100_PERCENT, &error))
+    reader = sample_log_reader_open (log_file, &error);
+  if (reader)
+    {
+    static uint64_t times[DUMP_BATCH];
+    static int channels[DUMP_BATCH];
+    static int16_t shunt_regs[DUMP_BATCH];
+    static uint16_t bus_regs[DUMP_BATCH];
+    static int32_t bus_mv[DUMP_BATCH], current_ua[DUMP_BATCH];
+    static int32_t percent[DUMP_BATCH], power_mw[DUMP_BATCH];
+    INA219Converted out = { bus_mv, NULL, current_ua, percent, power_mw };
+    SampleLogIter iter;
+    INA219Sample sample;
+    BOOL more = TRUE;
+    sample_log_reader_seek (reader, &iter, -1, 0);
+    printf ("time_ns,channel,shunt_reg,bus_reg,bus_mv,current_ua,"
+      "percent,power_mw,gap\n");
+    while (more)
+      {
+      int n = 0;
+      while (n < DUMP_BATCH && (more = sample_log_reader_next (reader, 
+          &iter, &sample, &channels[n])))
+        {
+        times[n] = sample.time_ns;
+        shunt_regs[n] = sample.shunt_reg;
+        bus_regs[n] = sample.bus_reg;
+        n++;
+        }
+      ina219_convert_batch (&conv, shunt_regs, bus_regs, n, &out);
+      for (int i = 0; i < n; i++)
+        {
+        if (bus_regs[i] & INA219_BUS_GAP)
+          printf ("%llu,%d,%d,%u,,,,,1\n", (unsigned long long)times[i], 
+            channels[i], shunt_regs[i], bus_regs[i]);
+        else
+          printf ("%llu,%d,%d,%u,%d,%d,%d,%d,0\n", 
+            (unsigned long long)times[i], channels[i], shunt_regs[i],
+            bus_regs[i], bus_mv[i], current_ua[i], percent[i], 
+            power_mw[i]);
+        }
+      }
+    sample_log_reader_close (reader);
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    ret = 1;
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  print_history
+
+  Print the range and mean of each metric in a history file over the
+  last hour, day, week, and year, up to the most recent reading.
+
+============================================================================*/
+static int print_history (const char *history_file, const char *argv0)
+  {
+  static const struct { const char *name; time_t seconds; } windows[] =
+    {
+    { "hour", 3600 },
+    { "day", 86400 },
+    { "week", 7 * 86400 },
+    { "year", 366 * 86400 }
+    };
+  static const struct { const char *name; double scale; const char *unit; }
+     metrics[HISTORY_METRICS] =
+    {
+    { "Voltage", 0.001, "V" },
+    { "Current", 0.001, "mA" },
+    { "Power", 1.0, "mW" }
+    };
+
+  char *error = NULL;
+  HistoryStore *history = history_store_open (history_file, NULL, 0, TRUE,
+    &error);
+  if (!history)
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    return 1;
+    }
+
+  time_t latest = history_store_get_latest (history);
+  if (latest == 0)
+    printf ("No readings have been recorded\n");
+  for (int w = 0; latest != 0 && w < (int)(sizeof (windows) 
+       / sizeof (windows[0])); w++)
+    {
+    printf ("Last %s:\n", windows[w].name);
+    for (int m = 0; m < HISTORY_METRICS; m++)
+      {
+      HistoryStats stats;
+      double k = metrics[m].scale;
+      if (history_store_query (history, m, latest + 1 - windows[w].seconds,
+           latest + 1, &stats))
+        printf ("  %-8s min %.2f, max %.2f, mean %.2f, last %.2f %s\n", 
+          metrics[m].name, stats.min * k, stats.max * k, stats.mean * k, 
+          stats.last * k, metrics[m].unit);
+      else
+        printf ("  %-8s no readings\n", metrics[m].name);
+      }
+    }
+  history_store_close (history);
+  return 0;
+  }
+
+/*============================================================================
+
+  read_published
+
+  Print the status published in shared memory by another instance of 
+  this program running with -d -p.
+
+============================================================================*/
+static int read_published (const char *shm_name, const char *argv0)
+  {
+  int ret = 1;
+  char *error = NULL;
+  StatusReader *reader = status_reader_open (shm_name, &error);
+  if (reader)
+    {
+    INA219SharedStatus status;
+    if (status_reader_read (reader, &status))
+      {
+      print_status (status.charge_status, status.battery_voltage_mv,
+        status.percent_charged, status.battery_current_mA, status.minutes);
+      printf ("Filtered voltage: %.2f V\n", 
+        status.filtered_voltage_mv / 1000.0);
+      printf ("Filtered current: %d mA\n", status.filtered_current_mA);
+      printf ("Integrated charge: %d %%\n", status.integrated_percent);
+      if (status.integrated_minutes >= 0)
+        printf ("Integrated time: %d minutes\n", status.integrated_minutes);
+      ret = 0;
+      }
+    else
+      fprintf (stderr, "%s: no status has been published yet\n", argv0);
+    status_reader_close (reader);
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  run_once
+
+============================================================================*/
+static int run_once (INA219 *ina219, const char *argv0)
+  {
+  int ret = 1;
+  char *error = NULL;
+  // Get and print the charging status. Note that a -ve value for
+  //   the battery current indicates that the battery is discharging.
+  INA219ChargeStatus charge_status; // See ina219.h for values of this enum.
+  int mV;
+  int percent_charged;
+  int battery_current_mA;
+  int minutes;
+  if (ina219_get_status (ina219, &charge_status, &mV, &percent_charged,
+         &battery_current_mA, &minutes,
+         &error))
+    {
+    print_status (charge_status, mV, percent_charged, battery_current_mA,
+      minutes);
+    ret = 0;
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  run_characterize
+
+  Record a discharge, until the battery voltage falls to the 0% voltage,
+  or until SIGINT or SIGTERM, and write the discharge curve to 
+  profile_file.
+
+============================================================================*/
+static int run_characterize (INA219 *ina219, int interval_ms, 
+             int report_ms, const char *profile_file, const char *argv0)
+  {
+  int ret = 0;
+  sigset_t sigs;
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGINT);
+  sigaddset (&sigs, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &sigs, NULL);
+
+  if (interval_ms <= 0) interval_ms = DEFAULT_INTERVAL_MS;
+  struct timespec timeout;
+  timeout.tv_sec = interval_ms / 1000;
+  timeout.tv_nsec = (interval_ms % 1000) * 1000000L;
+  SocRecorder *recorder = soc_recorder_create ();
+  uint64_t last_report = 0;
+  BOOL empty = FALSE;
+  do
+    {
+    INA219Sample sample;
+    INA219Error e;
+    if (!ina219_sample_e (ina219, &sample, &e)) continue;
+    INA219ChargeStatus charge_status;
+    int mV, percent_charged, battery_current_mA, minutes;
+    ina219_status_from_raw (ina219, sample.shunt_reg, sample.bus_reg,
+      &charge_status, &mV, &percent_charged, &battery_current_mA, 
+      &minutes);
+    soc_recorder_add (recorder, sample.time_ns, mV, 
+      ina219_current_ua_from_raw (ina219, sample.shunt_reg));
+    if (sample.time_ns - last_report >= (uint64_t)report_ms * 1000000ULL)
+      {
+      printf ("%.2f V %d mA, %d mAh so far\n", mV / 1000.0, 
+        battery_current_mA, soc_recorder_get_mah (recorder));
+      fflush (stdout);
+      last_report = sample.time_ns;
+      }
+    empty = (mV <= BATTERY_VOLTAGE_0_PERCENT);
+    } while (!empty && sigtimedwait (&sigs, NULL, &timeout) < 0);
+
+  char *error = NULL;
+  if (soc_recorder_write_profile (recorder, profile_file, 
+       BATTERY_RESISTANCE_MOHM, &error))
+    {
+    printf ("Wrote %s: %d mAh%s\n", profile_file, 
+      soc_recorder_get_mah (recorder), 
+      empty ? "" : " (interrupted before the battery was empty)");
+    }
+  else
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    ret = 1;
+    }
+  soc_recorder_destroy (recorder);
+  return ret;
+  }
+
+/*============================================================================
+
+  burst_signal
+
+============================================================================*/
+static BurstCapture *burst_running;
+
+static void burst_signal (int sig)
+  {
+  (void)sig;
+  if (burst_running) burst_capture_abort (burst_running);
+  }
+
+/*============================================================================
+
+  run_burst
+
+  Take a burst of readings, and print them as CSV. The spec is 
+  N[,PRETRIGGER,TRIGGER_MA]: a positive trigger level waits for the 
+  current to rise to it, and a negative one for the current to fall to 
+  it (that is, for the battery to be discharging at least that hard).
+
+============================================================================*/
+static int run_burst (INA219 *ina219, const char *spec, const char *argv0)
+  {
+  BurstConfig config;
+  int samples, pretrigger, trigger_mA;
+  int n = sscanf (spec, "%d,%d,%d", &samples, &pretrigger, &trigger_mA);
+  if (n != 1 && n != 3)
+    {
+    fprintf (stderr, "%s: bad burst: %s\n", argv0, spec);
+    return 1;
+    }
+  burst_config_default (&config, samples);
+  config.priority = BURST_PRIORITY;
+  if (n == 3)
+    {
+    config.pretrigger = pretrigger;
+    config.trigger = trigger_mA >= 0 ? BURST_TRIGGER_RISING 
+      : BURST_TRIGGER_FALLING;
+    config.trigger_ua = trigger_mA * 1000;
+    }
+
+  char *error = NULL;
+  BurstCapture *burst = burst_capture_create (&config, &error);
+  if (!burst)
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    return 1;
+    }
+  if (!burst_capture_is_locked (burst))
+    fprintf (stderr, "%s: can't lock the burst in memory\n", argv0);
+
+  burst_running = burst;
+  signal (SIGINT, burst_signal);
+  signal (SIGTERM, burst_signal);
+  int ret = 0;
+  if (!burst_capture_run (burst, ina219, &error))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    error = NULL;
+    ret = 1;
+    }
+  signal (SIGINT, SIG_DFL);
+  signal (SIGTERM, SIG_DFL);
+  burst_running = NULL;
+
+  int count = burst_capture_get_count (burst);
+  if (count > 1)
+    {
+    uint64_t ns = burst_capture_get (burst, count - 1)->time_ns 
+      - burst_capture_get (burst, 0)->time_ns;
+    fprintf (stderr, "%d readings in %.3f ms, %.1f us apart%s\n", count, 
+      ns / 1e6, ns / 1e3 / (count - 1), 
+      burst_capture_is_realtime (burst) ? "" : " (not real-time)");
+    }
+  if (!burst_capture_write_csv (burst, ina219, stdout, &error))
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    ret = 1;
+    }
+  burst_capture_destroy (burst);
+  return ret;
+  }
+
+/*============================================================================
+
+  parse_sweep
+
+  Expand a sweep specification -- a comma-separated list of 
+  NAME=FROM:TO:STEP or NAME=VALUE -- into every combination of the 
+  settings it names, starting from *base. Returns the number of 
+  combinations, or -1 if the specification is bad.
+
+============================================================================*/
+static int parse_sweep (const char *spec, const INA219Battery *base,
+             INA219Battery **batteries)
+  {
+  static const struct { const char *name; size_t offset; } keys[] =
+    {
+    { "full", offsetof (INA219Battery, full_percent) },
+    { "min", offsetof (INA219Battery, min_charging_current) },
+    { "v0", offsetof (INA219Battery, battery_voltage_0_percent) },
+    { "v100", offsetof (INA219Battery, battery_voltage_100_percent) },
+    { "capacity", offsetof (INA219Battery, battery_capacity) },
+    { "shunt", offsetof (INA219Battery, shunt_milliohms) }
+    };
+  int n = 1;
+  *batteries = malloc (sizeof (INA219Battery));
+  (*batteries)[0] = *base;
+  char *copy = strdup (spec ? spec : "");
+  char *save = NULL;
+  for (char *tok = strtok_r (copy, ",", &save); tok && n > 0; 
+       tok = strtok_r (NULL, ",", &save))
+    {
+    char name[16];
+    int from, to, step = 1;
+    int fields = sscanf (tok, "%15[a-z0-9]=%d:%d:%d", name, &from, &to, 
+      &step);
+    if (fields == 2) to = from;
+    size_t k = 0;
+    while (k < sizeof (keys) / sizeof (keys[0]) 
+         && strcmp (keys[k].name, name) != 0) k++;
+    if ((fields != 2 && fields != 4) || k == sizeof (keys) / sizeof (keys[0])
+         || step <= 0 || to < from)
+      {
+      n = -1;
+      break;
+      }
+    int values = (to - from) / step + 1;
+    if ((long)n * values > REPLAY_MAX_SETTINGS)
+      {
+      n = -1;
+      break;
+      }
+    INA219Battery *out = malloc (n * values * sizeof (INA219Battery));
+    for (int i = 0; i < n; i++)
+      for (int v = 0; v < values; v++)
+        {
+        INA219Battery *b = &out[i * values + v];
+        *b = (*batteries)[i];
+        *(int *)((char *)b + keys[k].offset) = from + v * step;
+        }
+    free (*batteries);
+    *batteries = out;
+    n *= values;
+    }
+  free (copy);
+  if (n < 0)
+    {
+    free (*batteries);
+    *batteries = NULL;
+    }
+  return n;
+  }
+
+/*============================================================================
+
+  run_replay
+
+============================================================================*/
+static int run_replay (const INA219Battery *base, const char *replay_file,
+             const char *sweep, const char *argv0)
+  {
+  INA219Battery *batteries;
+  int n = parse_sweep (sweep, base, &batteries);
+  if (n < 0)
+    {
+    fprintf (stderr, "%s: bad sweep: %s\n", argv0, sweep);
+    return 1;
+    }
+  char *error = NULL;
+  ReplayTrace *trace = replay_trace_load (replay_file, 0, &error);
+  if (!trace)
+    {
+    fprintf (stderr, "%s: %s\n", argv0, error);
+    free (error);
+    free (batteries);
+    return 1;
+    }
+
+  ReplayResult *results = malloc (n * sizeof (ReplayResult));
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  replay_run (trace, batteries, n, REPLAY_FLAP_MS, 
+    (int)sysconf (_SC_NPROCESSORS_ONLN), results);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  double secs = (end.tv_sec - start.tv_sec) 
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf ("full,min,v0,v100,capacity,shunt,changes,flaps,full_h,"
+    "charging_h,discharging_h,estimates,mean_abs_error_min,"
+    "mean_error_min\n");
+  for (int i = 0; i < n; i++)
+    {
+    const INA219Battery *b = &batteries[i];
+    const ReplayResult *r = &results[i];
+    printf ("%d,%d,%d,%d,%d,%d,%llu,%llu,%.2f,%.2f,%.2f,%llu,%.1f,%.1f\n", 
+      b->full_percent, b->min_charging_current, 
+      b->battery_voltage_0_percent, b->battery_voltage_100_percent, 
+      b->battery_capacity, b->shunt_milliohms, 
+      (unsigned long long)r->changes, 
+      (unsigned long long)r->flaps, 
+      r->status_ns[INA219_FULLY_CHARGED] / 3.6e12,
+      r->status_ns[INA219_CHARGING] / 3.6e12,
+      r->status_ns[INA219_DISCHARGING] / 3.6e12,
+      (unsigned long long)r->estimates, r->mean_abs_error_min, 
+      r->mean_error_min);
+    }
+  double total = (double)replay_trace_get_count (trace) * n;
+  fprintf (stderr, "%d samples x %d settings in %.3f s, %.1f M samples/s\n",
+    replay_trace_get_count (trace), n, secs, 
+    secs > 0 ? total / secs / 1e6 : 0.0);
+
+  free (results);
+  free (batteries);
+  replay_trace_destroy (trace);
+  return 0;
+  }
+
+/*============================================================================
+
+  usage
+
+============================================================================*/
+static void usage (const char *argv0)
+  {
+  printf ("Usage: %s [options]\n", argv0);
+  printf ("  -a, --alert=PERCENT     low-battery alert level (daemon), "
+    "default %d\n", DEFAULT_ALERT_PERCENT);
+  printf ("  -A, --adaptive=MIN,MAX  sample every MIN to MAX ms, "
+    "depending on load (daemon)\n");
+  printf ("  -B, --bus-recovery=CMD  run CMD when the INA219 can't be "
+    "recovered after\n");
+  printf ("                          a failure\n");
+  printf ("  -b, --burst=N[,PRE,MA]  print N readings taken as fast as "
+    "possible; with\n");
+  printf ("                          MA, wait for the current to cross "
+    "MA, keeping PRE\n");
+  printf ("                          readings from before\n");
+  printf ("  -c, --curve=FILE        read the charge from a discharge curve "
+    "file,\n");
+  printf ("                          or 'li-ion' for a built-in curve\n");
+  printf ("  -C, --characterize=FILE record a discharge curve to FILE\n");
+  printf ("  -d, --daemon            sample continuously until "
+    "interrupted\n");
+  printf ("  -D, --dump=FILE         print a binary sample log as CSV\n");
+  printf ("  -e, --hook=COMMAND      run COMMAND for each battery event "
+    "(daemon)\n");
+  printf ("  -F, --filter=SPEC       filter readings (daemon): none, "
+    "ema[:MS],\n");
+  printf ("                          median[:N], trimmed[:N[,PERCENT]], "
+    "kalman\n");
+  printf ("  -g, --group=FILE        sample all the devices listed in "
+    "FILE\n");
+  printf ("  -G, --gpio=CHIP:LINE    report edges on a GPIO line, e.g. "
+    "/dev/gpiochip0:17\n");
+  printf ("                          (daemon)\n");
+  printf ("  -h, --help              show this message\n");
+  printf ("  -H, --history=FILE      keep a summary of readings over the "
+    "last year in\n");
+  printf ("                          FILE (daemon)\n");
+  printf ("  -i, --interval=MS       sampling interval (daemon), "
+    "default %d;\n", DEFAULT_INTERVAL_MS);
+  printf ("                          0 to read every conversion once\n");
+  printf ("  -l, --log=FILE          write samples to a binary log "
+    "(daemon)\n");
+  printf ("  -m, --metrics-port=PORT serve I/O statistics over HTTP "
+    "(daemon)\n");
+  printf ("  -M, --metrics=FILE      write I/O statistics to FILE at each "
+    "report (daemon)\n");
+  printf ("  -n, --average=N         average N (1-128) samples in the "
+    "INA219\n");
+  printf ("  -p, --publish=NAME      publish status in shared memory "
+    "(daemon)\n");
+  printf ("  -P, --published=NAME    print status published by a daemon\n");
+  printf ("  -Q, --query=FILE        print the summary kept with -H\n");
+  printf ("  -R, --replay=FILE       run a recorded log or CSV dump through "
+    "the status\n");
+  printf ("                          calculation, with the settings from "
+    "-S\n");
+  printf ("  -r, --report=MS         reporting interval (daemon), "
+    "default %d\n", DEFAULT_REPORT_MS);
+  printf ("  -S, --sweep=SPEC        settings to replay with: a list of "
+    "NAME=FROM:TO:STEP\n");
+  printf ("                          or NAME=VALUE, where NAME is full, "
+    "min, v0, v100,\n");
+  printf ("                          capacity or shunt\n");
+  printf ("  -s, --state=FILE        save integrated charge in FILE "
+    "(daemon)\n");
+  printf ("  -v, --version           show version\n");
+  }
+
 /*============================================================================
 
   main
@@ -56,7 +1473,137 @@
 ============================================================================*/
 int main (int argc, char **argv)
   {
-  argc = argc; argv = argv; // Suppress warnings
+  int ret = 0;
+  BOOL daemon_mode = FALSE;
+  int interval_ms = DEFAULT_INTERVAL_MS;
+  int report_ms = DEFAULT_REPORT_MS;
+  int alert_percent = DEFAULT_ALERT_PERCENT;
+  int average = 0;
+  const char *group_file = NULL;
+  const char *state_file = NULL;
+  const char *log_file = NULL;
+  const char *shm_name = NULL;
+  const char *metrics_file = NULL;
+  int metrics_port = 0;
+  const char *curve_file = NULL;
+  const char *characterize_file = NULL;
+  const char *filter_spec = NULL;
+  const char *hook = NULL;
+  const char *bus_hook = NULL;
+  const char *burst_spec = NULL;
+  const char *replay_file = NULL;
+  const char *sweep_spec = NULL;
+  const char *gpio = NULL;
+  const char *history_file = NULL;
+  AdaptiveConfig adaptive_config;
+  const AdaptiveConfig *adaptive = NULL;
+
+  static const struct option long_options[] = 
+    {
+    { "adaptive", required_argument, NULL, 'A' },
+    { "alert", required_argument, NULL, 'a' },
+    { "average", required_argument, NULL, 'n' },
+    { "burst", required_argument, NULL, 'b' },
+    { "bus-recovery", required_argument, NULL, 'B' },
+    { "characterize", required_argument, NULL, 'C' },
+    { "curve", required_argument, NULL, 'c' },
+    { "daemon", no_argument, NULL, 'd' },
+    { "dump", required_argument, NULL, 'D' },
+    { "filter", required_argument, NULL, 'F' },
+    { "gpio", required_argument, NULL, 'G' },
+    { "group", required_argument, NULL, 'g' },
+    { "help", no_argument, NULL, 'h' },
+    { "history", required_argument, NULL, 'H' },
+    { "hook", required_argument, NULL, 'e' },
+    { "interval", required_argument, NULL, 'i' },
+    { "log", required_argument, NULL, 'l' },
+    { "metrics", required_argument, NULL, 'M' },
+    { "metrics-port", required_argument, NULL, 'm' },
+    { "publish", required_argument, NULL, 'p' },
+    { "published", required_argument, NULL, 'P' },
+    { "query", required_argument, NULL, 'Q' },
+    { "replay", required_argument, NULL, 'R' },
+    { "report", required_argument, NULL, 'r' },
+    { "state", required_argument, NULL, 's' },
+    { "sweep", required_argument, NULL, 'S' },
+    { "version", no_argument, NULL, 'v' },
+    { NULL, 0, NULL, 0 }
+    };
+
+  int opt;
+  while ((opt = getopt_long (argc, argv, 
+       "a:A:b:B:c:C:dD:e:F:g:G:hH:i:l:m:M:n:p:P:Q:r:R:s:S:v", long_options, 
+       NULL)) != -1)
+    {
+    switch (opt)
+      {
+      case 'a': alert_percent = atoi (optarg); break;
+      case 'A':
+        {
+        int min_ms, max_ms;
+        if (sscanf (optarg, "%d,%d", &min_ms, &max_ms) != 2
+             || min_ms <= 0 || max_ms < min_ms)
+          {
+          fprintf (stderr, "%s: bad adaptive intervals: %s\n", argv[0], 
+            optarg);
+          return 1;
+          }
+        adaptive_config_default (&adaptive_config, min_ms, max_ms);
+        adaptive = &adaptive_config;
+        }
+        break;
+      case 'b': burst_spec = optarg; break;
+      case 'B': bus_hook = optarg; break;
+      case 'c': curve_file = optarg; break;
+      case 'C': characterize_file = optarg; break;
+      case 'd': daemon_mode = TRUE; break;
+      case 'D': return dump_log (optarg, argv[0]);
+      case 'e': hook = optarg; break;
+      case 'F': filter_spec = optarg; break;
+      case 'g': group_file = optarg; break;
+      case 'G': gpio = optarg; break;
+      case 'h': usage (argv[0]); return 0;
+      case 'H': history_file = optarg; break;
+      case 'i': interval_ms = atoi (optarg); break;
+      case 'l': log_file = optarg; break;
+      case 'm': metrics_port = atoi (optarg); break;
+      case 'M': metrics_file = optarg; break;
+      case 'n': average = atoi (optarg); break;
+      case 'p': shm_name = optarg; break;
+      case 'P': return read_published (optarg, argv[0]);
+      case 'Q': return print_history (optarg, argv[0]);
+      case 'r': report_ms = atoi (optarg); break;
+      case 'R': replay_file = optarg; break;
+      case 's': state_file = optarg; break;
+      case 'S': sweep_spec = optarg; break;
+      case 'v': printf ("%s version %s\n", argv[0], VERSION); return 0;
+      default: usage (argv[0]); return 1;
+      }
+    }
+
+  if (interval_ms < 0 || report_ms <= 0)
+    {
+    fprintf (stderr, "%s: intervals must be positive\n", argv[0]);
+    return 1;
+    }
+
+  if (group_file)
+    return run_group (group_file, interval_ms, report_ms, bus_hook, 
+      argv[0]);
+
+  SampleFilter *filter = NULL;
+  if (filter_spec)
+    {
+    char *error = NULL;
+    FilterConfig filter_config;
+    if (!sample_filter_parse (filter_spec, &filter_config, &error)
+         || !(filter = sample_filter_create (&filter_config, &error)))
+      {
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      return 1;
+      }
+    }
 
   // Create the INA219 object, passing the I2C settings, and shunt
   //  resistance, and the battery properties. Note that this 
@@ -64,48 +1611,88 @@ int main (int argc, char **argv)
   INA219 *ina219 = ina219_create (I2C_DEV, I2C_ADDR, SHUNT_MILLIOHMS,
                      BATTERY_VOLTAGE_0_PERCENT, BATTERY_VOLTAGE_100_PERCENT,
                      BATTERY_CAPACITY, MIN_CHARGING_CURRENT);
+  if (bus_hook) set_bus_hook (ina219, bus_hook);
 
-  // Initialse the INA219 "class". If this fails, *error will be initialized
-  //   to an error message
-  char *error = NULL;
-  if (ina219_init (ina219, &error))
-    {
-    // Get and print the charging status. Note that a -ve value for
-    //   the battery current indicates that the battery is discharging.
-    INA219ChargeStatus charge_status; // See ina219.h for values of this enum.
-    int mV;
-    int percent_charged;
-    int battery_current_mA;
-    int minutes;
-    if (ina219_get_status (ina219, &charge_status, &mV, &percent_charged,
-           &battery_current_mA, &minutes,
-           &error))
-      {
-      switch (charge_status)
-        {
-        case INA219_FULLY_CHARGED:
-          printf ("Fully charged\n");
-          break;
-        case INA219_CHARGING:
-          printf ("Charging, %d minutes until fully charged\n", minutes);
-          break;
-        case INA219_DISCHARGING:
-          printf ("Discharging, %d minutes left\n", minutes);
-          break;
-        }
-      printf ("Battery voltage: %.2f V\n", mV / 1000.0); // Convert to V
-      printf ("Battery current: %d mA\n", battery_current_mA); 
-      printf ("Battery charge: %.d %%\n", percent_charged); 
-      }
+  SocCurve *curve = NULL;
+  if (curve_file)
+    {
+    char *error = NULL;
+    // The built-in curve is for one cell, so guess the number of cells
+    //  from the full-charge voltage
+    if (strcmp (curve_file, "li-ion") == 0)
+      curve = soc_curve_create_builtin (curve_file, 
+        (BATTERY_VOLTAGE_100_PERCENT + 2100) / 4200, &error);
     else
+      curve = soc_curve_load (curve_file, &error);
+    if (!curve)
       {
       fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      ina219_destroy (ina219);
+      sample_filter_destroy (filter);
+      return 1;
       }
+    ina219_set_soc_curve (ina219, curve);
+    }
+
+  if (replay_file)
+    {
+    // The settings in this file are the starting point for the sweep
+    INA219Battery battery;
+    ina219_get_battery (ina219, &battery);
+    ret = run_replay (&battery, replay_file, sweep_spec, argv[0]);
+    ina219_destroy (ina219);
+    soc_curve_destroy (curve);
+    sample_filter_destroy (filter);
+    return ret;
+    }
+
+  // Initialse the INA219 "class". If this fails, *error will be initialized
+  //   to an error message
+  char *error = NULL;
+  BOOL ok = ina219_init (ina219, &error);
+  if (ok && average > 0)
+    {
+    // Have the chip average the readings. Its power-on settings are
+    //  otherwise fine for this application
+    INA219Config config;
+    ina219_config_default (&config);
+    config.bus_adc = ina219_adc_from_samples (average);
+    config.shunt_adc = config.bus_adc;
+    // For a single reading, there's no point having the chip convert
+    //  continuously. Trigger one conversion, and wait for it to 
+    //  complete, before reading the results
+    if (!daemon_mode) config.mode = INA219_MODE_SHUNT_BUS_TRIGGERED;
+    ok = ina219_configure (ina219, &config, &error);
+    INA219Sample sample;
+    if (ok && !daemon_mode) ok = ina219_acquire (ina219, &sample, &error);
+    }
+
+  if (ok)
+    {
+    if (burst_spec)
+      ret = run_burst (ina219, burst_spec, argv[0]);
+    else if (characterize_file)
+      ret = run_characterize (ina219, interval_ms, report_ms, 
+        characterize_file, argv[0]);
+    else if (daemon_mode)
+      ret = run_daemon (ina219, interval_ms, report_ms, alert_percent, 
+        BATTERY_CAPACITY, state_file, log_file, shm_name, metrics_file, 
+        metrics_port, filter, adaptive, hook, gpio, history_file, 
+        argv[0]);
+    else
+      ret = run_once (ina219, argv[0]);
     }
   else
     {
     fprintf (stderr, "Can't set up INA219: %s\n", error);
     free (error); 
+    ret = 1;
     }
+
+  ina219_destroy (ina219);
+  soc_curve_destroy (curve);
+  sample_filter_destroy (filter);
+  return ret;
   }
 
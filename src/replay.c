@@ -0,0 +1,361 @@
+/*==========================================================================
+
+    replay.c
+
+    Implementation of the "methods" in replay.h
+
+    Each thread takes the next set of settings that nobody has started
+    on, and makes one pass through the trace with it. The trace is only
+    read, so the threads share it without locking. The only per-sample
+    state that has to be kept is the estimated time to full or empty,
+    because whether an estimate can be checked, and against what, is
+    only known when the charge or discharge it belongs to ends; each
+    thread has a scratch array for those.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <math.h>
+#include "defs.h"
+#include "ina219.h"
+#include "samplelog.h"
+#include "replay.h"
+
+// Gaps between samples longer than this (ns) are not counted as time
+//  spent in any status -- the recorder was probably not running
+#define MAX_GAP_NS 60000000000ULL
+
+#define NSEC_PER_MIN 60000000000.0
+
+struct _ReplayTrace
+  {
+  INA219Sample *samples;
+  int count;
+  int size;
+  };
+
+// Work shared by the threads of one replay_run()
+typedef struct _ReplayJob
+  {
+  const ReplayTrace *trace;
+  const INA219Battery *batteries;
+  int n;
+  uint64_t flap_ns;
+  ReplayResult *results;
+  _Atomic int next;
+  } ReplayJob;
+
+/*============================================================================
+
+  replay_trace_add
+
+  Gap markers, logged while the device was not answering, are left 
+  out; the replay just sees a longer interval between readings.
+
+============================================================================*/
+static void replay_trace_add (ReplayTrace *self, const INA219Sample *sample)
+  {
+  if (INA219_SAMPLE_IS_GAP (sample)) return;
+  if (self->count == self->size)
+    {
+    self->size = self->size ? self->size * 2 : 65536;
+    self->samples = realloc (self->samples,
+      self->size * sizeof (INA219Sample));
+    }
+  self->samples[self->count++] = *sample;
+  }
+
+/*============================================================================
+
+  replay_sample_compare
+
+============================================================================*/
+static int replay_sample_compare (const void *a, const void *b)
+  {
+  const INA219Sample *sa = a, *sb = b;
+  return sa->time_ns < sb->time_ns ? -1 : sa->time_ns > sb->time_ns;
+  }
+
+/*============================================================================
+
+  replay_trace_load_log
+
+============================================================================*/
+static BOOL replay_trace_load_log (ReplayTrace *self, const char *filename,
+      int channel, char **error)
+  {
+  SampleLogReader *reader = sample_log_reader_open (filename, error);
+  if (!reader) return FALSE;
+  SampleLogIter iter;
+  INA219Sample sample;
+  int ch;
+  sample_log_reader_seek (reader, &iter, channel, 0);
+  while (sample_log_reader_next (reader, &iter, &sample, &ch))
+    replay_trace_add (self, &sample);
+  sample_log_reader_close (reader);
+  return TRUE;
+  }
+
+/*============================================================================
+
+  replay_trace_load_csv
+
+  Read lines of the form time_ns,channel,shunt_reg,bus_reg[,...], as
+  printed by "ina219 -D". Lines that don't start with a digit, such as
+  the heading, are skipped.
+
+============================================================================*/
+static BOOL replay_trace_load_csv (ReplayTrace *self, FILE *f,
+      const char *filename, int channel, char **error)
+  {
+  char line[256];
+  int lineno = 0;
+  while (fgets (line, sizeof (line), f))
+    {
+    lineno++;
+    if (line[0] < '0' || line[0] > '9') continue;
+    char *p = line, *end;
+    INA219Sample sample;
+    BOOL ok = TRUE;
+    sample.time_ns = strtoull (p, &end, 10);
+    ok = ok && *end == ','; p = end + 1;
+    int ch = (int)strtol (p, &end, 10);
+    ok = ok && *end == ','; p = end + 1;
+    sample.shunt_reg = (int16_t)strtol (p, &end, 10);
+    ok = ok && *end == ','; p = end + 1;
+    sample.bus_reg = (uint16_t)strtoul (p, &end, 10);
+    ok = ok && end != p;
+    if (!ok)
+      {
+      if (error) asprintf (error, "%s: line %d: bad sample", filename,
+        lineno);
+      return FALSE;
+      }
+    if (channel < 0 || ch == channel) replay_trace_add (self, &sample);
+    }
+  return TRUE;
+  }
+
+/*============================================================================
+
+  replay_trace_load
+
+============================================================================*/
+ReplayTrace *replay_trace_load (const char *filename, int channel,
+               char **error)
+  {
+  FILE *f = fopen (filename, "r");
+  if (!f)
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    return NULL;
+    }
+  char magic[8];
+  BOOL is_log = (fread (magic, 1, 8, f) == 8
+    && memcmp (magic, SAMPLE_LOG_MAGIC, 8) == 0);
+  rewind (f);
+
+  ReplayTrace *self = malloc (sizeof (ReplayTrace));
+  memset (self, 0, sizeof (ReplayTrace));
+  BOOL ok = is_log ? replay_trace_load_log (self, filename, channel, error)
+    : replay_trace_load_csv (self, f, filename, channel, error);
+  fclose (f);
+  if (ok && self->count == 0)
+    {
+    if (error) asprintf (error, "%s: no samples for channel %d", filename,
+      channel);
+    ok = FALSE;
+    }
+  if (!ok)
+    {
+    replay_trace_destroy (self);
+    return NULL;
+    }
+
+  // Logs are in time order for each channel, but a CSV file might not be
+  for (int i = 1; i < self->count; i++)
+    {
+    if (self->samples[i].time_ns < self->samples[i - 1].time_ns)
+      {
+      qsort (self->samples, self->count, sizeof (INA219Sample),
+        replay_sample_compare);
+      break;
+      }
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  replay_trace_destroy
+
+============================================================================*/
+void replay_trace_destroy (ReplayTrace *self)
+  {
+  if (self)
+    {
+    free (self->samples);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  replay_trace_get_count
+
+============================================================================*/
+int replay_trace_get_count (const ReplayTrace *self)
+  {
+  return self->count;
+  }
+
+/*============================================================================
+
+  replay_score
+
+  Compare the estimates for samples [from, to) with the time left
+  until end_ns.
+
+============================================================================*/
+static void replay_score (const ReplayTrace *trace, const int *minutes,
+      int from, int to, uint64_t end_ns, ReplayResult *r, double *sum,
+      double *sum_abs)
+  {
+  for (int i = from; i < to; i++)
+    {
+    double actual = (end_ns - trace->samples[i].time_ns) / NSEC_PER_MIN;
+    double err = minutes[i] - actual;
+    *sum += err;
+    *sum_abs += fabs (err);
+    r->estimates++;
+    }
+  }
+
+/*============================================================================
+
+  replay_one
+
+  One pass through the trace with one set of settings.
+
+============================================================================*/
+static void replay_one (const ReplayTrace *trace,
+      const INA219Battery *battery, uint64_t flap_ns, int *minutes,
+      ReplayResult *r)
+  {
+  memset (r, 0, sizeof (ReplayResult));
+  INA219ChargeStatus status = INA219_FULLY_CHARGED;
+  INA219ChargeStatus previous = INA219_FULLY_CHARGED;
+  uint64_t changed_ns = 0;
+  int run_start = 0;
+  BOOL run_scored = FALSE;
+  double sum = 0, sum_abs = 0;
+
+  for (int i = 0; i < trace->count; i++)
+    {
+    const INA219Sample *s = &trace->samples[i];
+    INA219ChargeStatus st;
+    int mv, percent, mA;
+    ina219_battery_status_from_raw (battery, s->shunt_reg, s->bus_reg,
+      &st, &mv, &percent, &mA, &minutes[i]);
+
+    if (i == 0)
+      status = previous = st;
+    else
+      {
+      uint64_t dt = s->time_ns - s[-1].time_ns;
+      if (dt <= MAX_GAP_NS) r->status_ns[status] += dt;
+      if (st != status)
+        {
+        if (r->changes > 0 && st == previous
+             && s->time_ns - changed_ns <= flap_ns)
+          r->flaps++;
+        r->changes++;
+        // A charge that ended with the battery full can be scored
+        if (status == INA219_CHARGING && st == INA219_FULLY_CHARGED
+             && !run_scored)
+          replay_score (trace, minutes, run_start, i, s->time_ns, r,
+            &sum, &sum_abs);
+        previous = status;
+        status = st;
+        changed_ns = s->time_ns;
+        run_start = i;
+        run_scored = FALSE;
+        }
+      }
+
+    // So can a discharge that got down to 0%
+    if (status == INA219_DISCHARGING && percent <= 0 && !run_scored)
+      {
+      replay_score (trace, minutes, run_start, i, s->time_ns, r, &sum,
+        &sum_abs);
+      run_scored = TRUE;
+      }
+    }
+
+  r->samples = trace->count;
+  if (r->estimates > 0)
+    {
+    r->mean_error_min = sum / r->estimates;
+    r->mean_abs_error_min = sum_abs / r->estimates;
+    }
+  }
+
+/*============================================================================
+
+  replay_thread
+
+============================================================================*/
+static void *replay_thread (void *arg)
+  {
+  ReplayJob *job = arg;
+  int *minutes = malloc (job->trace->count * sizeof (int));
+  int i;
+  while ((i = atomic_fetch_add (&job->next, 1)) < job->n)
+    replay_one (job->trace, &job->batteries[i], job->flap_ns, minutes,
+      &job->results[i]);
+  free (minutes);
+  return NULL;
+  }
+
+/*============================================================================
+
+  replay_run
+
+============================================================================*/
+void replay_run (const ReplayTrace *trace, const INA219Battery *batteries,
+       int n, int flap_ms, int threads, ReplayResult *results)
+  {
+  assert (trace != NULL);
+  ReplayJob job;
+  job.trace = trace;
+  job.batteries = batteries;
+  job.n = n;
+  job.flap_ns = (uint64_t)flap_ms * 1000000ULL;
+  job.results = results;
+  atomic_init (&job.next, 0);
+
+  if (threads > n) threads = n;
+  if (threads < 1) threads = 1;
+  pthread_t *tids = malloc (threads * sizeof (pthread_t));
+  int started = 0;
+  // This thread does its share too, so start one fewer
+  for (int i = 1; i < threads; i++)
+    if (pthread_create (&tids[started], NULL, replay_thread, &job) == 0)
+      started++;
+  replay_thread (&job);
+  for (int i = 0; i < started; i++)
+    pthread_join (tids[i], NULL);
+  free (tids);
+  }
+
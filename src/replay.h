@@ -0,0 +1,76 @@
+/*============================================================================
+
+  replay.h
+
+  Replay runs recorded samples through the charge status calculation
+  -- the same ina219_battery_status() that ina219_get_status() uses --
+  with any number of different battery settings, so that settings
+  like the full-charge percentage, the minimum charging current, and
+  the 0% and 100% voltages can be tuned against a recorded charge
+  cycle in seconds, rather than by waiting hours for another one.
+
+  A ReplayTrace holds the samples for one device, loaded into memory
+  from a binary log (see samplelog.h) or from CSV as printed by
+  "ina219 -D". replay_run() then works through the trace once for
+  each set of settings, spreading the sets across threads, and
+  summarizes how each one behaved:
+
+  - how long the battery was reported in each status
+  - how many times the status changed, and how many of those changes
+    were "flaps", that is, changes back to the status before, within
+    a short time
+  - how far out the time to full or empty was. This is only known for
+    charges that ended with the battery reported full, and discharges
+    that got down to 0%; for each sample in such a run, the estimate
+    is compared with the time that the run actually took to finish.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+struct _ReplayTrace;
+typedef struct _ReplayTrace ReplayTrace;
+
+typedef struct _ReplayResult
+  {
+  uint64_t samples;
+  // Time spent in each status, indexed by INA219ChargeStatus. Gaps of
+  //  more than a minute between samples are not counted
+  uint64_t status_ns[3];
+  uint64_t changes;
+  uint64_t flaps;
+  // Number of time-to-full or -empty estimates that could be checked,
+  //  and how wrong they were, in minutes. A positive bias means the
+  //  estimates were too long
+  uint64_t estimates;
+  double mean_abs_error_min;
+  double mean_error_min;
+  } ReplayResult;
+
+BEGIN_DECLS
+
+/** Load the samples for one channel from a binary log or a CSV file,
+    sorted into time order. */
+ReplayTrace *replay_trace_load (const char *filename, int channel,
+               char **error);
+
+/** Free the trace. */
+void         replay_trace_destroy (ReplayTrace *self);
+
+/** Get the number of samples in the trace. */
+int          replay_trace_get_count (const ReplayTrace *self);
+
+/** Run the trace through each of the n sets of battery settings,
+    using up to "threads" threads, and store a summary for each in
+    results[]. A change of status that is undone within flap_ms counts
+    as a flap. */
+void         replay_run (const ReplayTrace *trace,
+               const INA219Battery *batteries, int n, int flap_ms,
+               int threads, ReplayResult *results);
+
+END_DECLS
+
@@ -0,0 +1,187 @@
+/*==========================================================================
+
+    ring.c
+
+    Implementation of the "methods" in ring.h
+
+    Each slot in the ring carries a sequence number, which works like a
+    tiny seqlock. While the producer is writing a slot, its sequence
+    number is zero; when the write is complete, it is set to the
+    (1-based) position of the sample in the overall stream. A consumer
+    that wants sample N checks that the slot's sequence is N+1 both
+    before and after copying the data. If it is larger, the producer has
+    lapped the consumer.
+
+    Consumers that have nothing to read can sleep on a futex, which the
+    producer only wakes if somebody is actually waiting. So, in the
+    usual case, writing a sample costs no system calls at all.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "defs.h"
+#include "ring.h"
+
+typedef struct _SampleSlot
+  {
+  _Atomic uint64_t seq;
+  INA219Sample sample;
+  } SampleSlot;
+
+struct _SampleRing
+  {
+  SampleSlot *slots;
+  uint64_t mask; // Size minus one; size is always a power of two
+  _Atomic uint64_t head; // Total number of samples ever written
+  _Atomic uint32_t wake_seq; // Futex word, bumped on every write
+  _Atomic int waiters; // Number of consumers sleeping on wake_seq
+  };
+
+/*============================================================================
+
+  sample_ring_create
+
+============================================================================*/
+SampleRing *sample_ring_create (int size)
+  {
+  int real_size = 1;
+  while (real_size < size) real_size <<= 1;
+  SampleRing *self = malloc (sizeof (SampleRing));
+  memset (self, 0, sizeof (SampleRing));
+  self->slots = calloc (real_size, sizeof (SampleSlot));
+  self->mask = real_size - 1;
+  atomic_init (&self->head, 0);
+  atomic_init (&self->wake_seq, 0);
+  atomic_init (&self->waiters, 0);
+  return self;
+  }
+
+/*============================================================================
+
+  sample_ring_destroy
+
+============================================================================*/
+void sample_ring_destroy (SampleRing *self)
+  {
+  if (self)
+    {
+    free (self->slots);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  sample_ring_write
+
+============================================================================*/
+void sample_ring_write (SampleRing *self, const INA219Sample *sample)
+  {
+  uint64_t n = atomic_load_explicit (&self->head, memory_order_relaxed);
+  SampleSlot *slot = &self->slots[n & self->mask];
+
+  // Mark the slot as being written, and make sure that mark is visible
+  //  before any of the new data is
+  atomic_store_explicit (&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  slot->sample = *sample;
+  atomic_store_explicit (&slot->seq, n + 1, memory_order_release);
+  atomic_store_explicit (&self->head, n + 1, memory_order_release);
+
+  atomic_fetch_add_explicit (&self->wake_seq, 1, memory_order_release);
+  if (atomic_load_explicit (&self->waiters, memory_order_acquire) > 0)
+    syscall (SYS_futex, &self->wake_seq, FUTEX_WAKE_PRIVATE, INT32_MAX,
+      NULL, NULL, 0);
+  }
+
+/*============================================================================
+
+  sample_ring_cursor
+
+============================================================================*/
+uint64_t sample_ring_cursor (const SampleRing *self)
+  {
+  return atomic_load_explicit (&self->head, memory_order_acquire);
+  }
+
+/*============================================================================
+
+  sample_ring_read
+
+============================================================================*/
+SampleRingResult sample_ring_read (const SampleRing *self, uint64_t *cursor,
+                   INA219Sample *sample, uint64_t *lost)
+  {
+  uint64_t size = self->mask + 1;
+  for (;;)
+    {
+    uint64_t head = atomic_load_explicit (&self->head, memory_order_acquire);
+    uint64_t n = *cursor;
+    if (n >= head) return SAMPLE_RING_EMPTY;
+
+    if (head - n > size)
+      {
+      // Already overwritten, without even looking at the slot
+      uint64_t oldest = head - size;
+      if (lost) *lost = oldest - n;
+      *cursor = oldest;
+      return SAMPLE_RING_OVERRUN;
+      }
+
+    const SampleSlot *slot = &self->slots[n & self->mask];
+    uint64_t seq1 = atomic_load_explicit
+      ((_Atomic uint64_t *)&slot->seq, memory_order_acquire);
+    INA219Sample copy = slot->sample;
+    atomic_thread_fence (memory_order_acquire);
+    uint64_t seq2 = atomic_load_explicit
+      ((_Atomic uint64_t *)&slot->seq, memory_order_relaxed);
+
+    if (seq1 == n + 1 && seq2 == seq1)
+      {
+      *sample = copy;
+      *cursor = n + 1;
+      return SAMPLE_RING_OK;
+      }
+    // The producer got to this slot while we were copying it. Go round
+    //  again -- the head will now be far enough ahead to report an
+    //  overrun.
+    }
+  }
+
+/*============================================================================
+
+  sample_ring_wait
+
+============================================================================*/
+BOOL sample_ring_wait (const SampleRing *self, uint64_t cursor,
+       int timeout_ms)
+  {
+  SampleRing *ring = (SampleRing *)self; // The futex word isn't const
+  uint32_t w = atomic_load_explicit (&ring->wake_seq, memory_order_acquire);
+  if (atomic_load_explicit (&ring->head, memory_order_acquire) > cursor)
+    return TRUE;
+
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  atomic_fetch_add_explicit (&ring->waiters, 1, memory_order_acq_rel);
+  // If the producer bumped wake_seq since we loaded it, this returns
+  //  immediately with EAGAIN, so a wake-up can't be missed
+  syscall (SYS_futex, &ring->wake_seq, FUTEX_WAIT_PRIVATE, w, &ts, NULL, 0);
+  atomic_fetch_sub_explicit (&ring->waiters, 1, memory_order_acq_rel);
+
+  return atomic_load_explicit (&ring->head, memory_order_acquire) > cursor;
+  }
+
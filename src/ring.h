@@ -0,0 +1,70 @@
+/*============================================================================
+
+  ring.h
+
+  The SampleRing "class" is a fixed-size circular buffer of INA219Sample
+  values, shared between exactly one producer thread and any number of
+  consumer threads. It is lock-free: the producer never waits for a
+  consumer, and simply overwrites the oldest sample when the ring is
+  full. Each consumer keeps its own read position (a "cursor"), and
+  finds out if it has fallen so far behind that samples were
+  overwritten before it could read them.
+
+  All the memory used by the ring is allocated by _create(), so the
+  footprint does not change however long the program runs.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+struct _SampleRing;
+typedef struct _SampleRing SampleRing;
+
+// Values returned by sample_ring_read()
+typedef enum _SampleRingResult
+  {
+  // A sample was read, and the cursor advanced
+  SAMPLE_RING_OK = 0,
+  // The consumer is up to date -- there is nothing new to read
+  SAMPLE_RING_EMPTY = 1,
+  // The consumer fell behind, and some samples were lost. The cursor
+  //  has been moved forward to the oldest sample still in the ring
+  SAMPLE_RING_OVERRUN = 2
+  } SampleRingResult;
+
+BEGIN_DECLS
+
+/** Create a ring with space for "size" samples. The size is rounded up
+    to a power of two. */
+SampleRing  *sample_ring_create (int size);
+
+/** Free the ring. No thread may be using it when this is called. */
+void         sample_ring_destroy (SampleRing *self);
+
+/** Add a sample to the ring. Must only be called from a single thread.
+    This method never blocks. */
+void         sample_ring_write (SampleRing *self, const INA219Sample *sample);
+
+/** Get a cursor for a new consumer, positioned so that the next
+    _read() will return the next sample written. */
+uint64_t     sample_ring_cursor (const SampleRing *self);
+
+/** Read the sample at *cursor into *sample. On SAMPLE_RING_OVERRUN,
+    *lost (if not NULL) is set to the number of samples skipped, and
+    *cursor is moved forward; the caller should simply read again. */
+SampleRingResult sample_ring_read (const SampleRing *self, uint64_t *cursor,
+                   INA219Sample *sample, uint64_t *lost);
+
+/** Wait until there is a sample to read at *cursor, or until timeout_ms
+    milliseconds have passed. Returns TRUE if there is (probably)
+    something to read. */
+BOOL         sample_ring_wait (const SampleRing *self, uint64_t cursor,
+                   int timeout_ms);
+
+END_DECLS
+
+
@@ -0,0 +1,581 @@
+/*==========================================================================
+
+    samplelog.c
+
+    Implementation of the "methods" in samplelog.h
+
+    File layout:
+
+      File header, padded to BLOCK_SIZE
+      Block 0
+      Block 1
+      ...
+
+    Each block starts with a LogBlockHeader, followed by the encoded
+    samples. The first sample is held in the header itself. Each
+    following sample is three zigzag-encoded LEB128 varints:
+
+      change in time interval, in microseconds
+      change in shunt register value
+      change in bus register value
+
+    A block's header is only updated after the bytes of a new sample
+    have been written, so a reader that looks at a block while it is
+    being written sees a consistent (if slightly old) block.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "ina219.h"
+#include "samplelog.h"
+
+#define BLOCK_SIZE 4096
+#define FILE_VERSION 1
+#define BLOCK_MAGIC 0x4B4C4249 // "IBLK"
+#define MAX_CHANNELS 65536
+// Longest possible encoded sample: three 64-bit varints
+#define MAX_RECORD 30
+// Number of blocks to add when the file is full
+#define GROW_BLOCKS 256
+
+typedef struct _LogFileHeader
+  {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t blocks_used;
+  uint64_t blocks_allocated;
+  uint32_t channels; // One more than the highest channel number used
+  uint32_t reserved;
+  } LogFileHeader;
+
+typedef struct _LogBlockHeader
+  {
+  uint32_t magic;
+  uint16_t channel;
+  uint16_t reserved;
+  uint32_t count; // Number of samples, including the first
+  uint32_t used; // Bytes of encoded data after the header
+  uint64_t first_time_ns;
+  uint64_t last_time_ns;
+  int16_t first_shunt;
+  uint16_t first_bus;
+  uint32_t reserved2;
+  } LogBlockHeader;
+
+#define BLOCK_DATA (BLOCK_SIZE - sizeof (LogBlockHeader))
+
+// Encoder state for one channel
+typedef struct _ChannelState
+  {
+  int64_t block; // -1 if no block is open
+  int64_t t_us; // Time of last sample, relative to block start
+  int64_t dt_us; // Last sampling interval
+  int shunt;
+  int bus;
+  } ChannelState;
+
+struct _SampleLog
+  {
+  int fd;
+  BYTE *map;
+  size_t map_size;
+  LogFileHeader *header;
+  ChannelState *channels;
+  int nchannels;
+  };
+
+struct _SampleLogReader
+  {
+  int fd;
+  const BYTE *map;
+  size_t map_size;
+  uint64_t blocks; // Number of complete or partial blocks in the file
+  uint32_t channels;
+  };
+
+/*============================================================================
+
+  zigzag helpers
+
+  Map signed values onto unsigned ones so that small negative numbers
+  give small varints: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+
+============================================================================*/
+static inline uint64_t zigzag (int64_t v)
+  {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+  }
+
+static inline int64_t unzigzag (uint64_t v)
+  {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+
+/*============================================================================
+
+  varint_put
+
+============================================================================*/
+static inline int varint_put (BYTE *p, uint64_t v)
+  {
+  int n = 0;
+  while (v >= 0x80)
+    {
+    p[n++] = (BYTE)(v | 0x80);
+    v >>= 7;
+    }
+  p[n++] = (BYTE)v;
+  return n;
+  }
+
+/*============================================================================
+
+  varint_get
+
+============================================================================*/
+static inline const BYTE *varint_get (const BYTE *p, const BYTE *end,
+       uint64_t *v)
+  {
+  uint64_t result = 0;
+  int shift = 0;
+  while (p < end && shift < 64)
+    {
+    BYTE b = *p++;
+    result |= (uint64_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      {
+      *v = result;
+      return p;
+      }
+    shift += 7;
+    }
+  return NULL; // Truncated or corrupt
+  }
+
+/*============================================================================
+
+  sample_log_block
+
+============================================================================*/
+static inline LogBlockHeader *sample_log_block (BYTE *map, uint64_t block)
+  {
+  return (LogBlockHeader *)(map + BLOCK_SIZE * (block + 1));
+  }
+
+/*============================================================================
+
+  sample_log_map
+
+  Make the file big enough for "blocks" blocks, and map it.
+
+============================================================================*/
+static BOOL sample_log_map (SampleLog *self, uint64_t blocks, char **error)
+  {
+  size_t size = BLOCK_SIZE * (blocks + 1);
+  int err = posix_fallocate (self->fd, 0, size);
+  if (err != 0)
+    {
+    if (error) asprintf (error, "Can't allocate log space: %s",
+      strerror (err));
+    return FALSE;
+    }
+  BYTE *map;
+  if (self->map)
+    map = mremap (self->map, self->map_size, size, MREMAP_MAYMOVE);
+  else
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+  if (map == MAP_FAILED)
+    {
+    if (error) asprintf (error, "Can't map log file: %s", strerror (errno));
+    return FALSE;
+    }
+  self->map = map;
+  self->map_size = size;
+  self->header = (LogFileHeader *)map;
+  self->header->blocks_allocated = blocks;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  sample_log_create
+
+============================================================================*/
+SampleLog *sample_log_create (const char *filename, int initial_blocks,
+             char **error)
+  {
+  SampleLog *self = malloc (sizeof (SampleLog));
+  memset (self, 0, sizeof (SampleLog));
+  BOOL ok = FALSE;
+  self->fd = open (filename, O_RDWR | O_CREAT, 0644);
+  if (self->fd >= 0)
+    {
+    struct stat sb;
+    fstat (self->fd, &sb);
+    if (sb.st_size == 0)
+      {
+      // New file
+      if (sample_log_map (self, initial_blocks > 0 ? initial_blocks : 1,
+           error))
+        {
+        memcpy (self->header->magic, SAMPLE_LOG_MAGIC, 8);
+        self->header->version = FILE_VERSION;
+        self->header->block_size = BLOCK_SIZE;
+        self->header->blocks_used = 0;
+        self->header->channels = 0;
+        ok = TRUE;
+        }
+      }
+    else
+      {
+      // Existing file -- check it, then map all of it
+      LogFileHeader h;
+      if (pread (self->fd, &h, sizeof (h), 0) == sizeof (h)
+           && memcmp (h.magic, SAMPLE_LOG_MAGIC, 8) == 0
+           && h.version == FILE_VERSION && h.block_size == BLOCK_SIZE
+           && h.blocks_used <= h.blocks_allocated)
+        {
+        ok = sample_log_map (self, h.blocks_allocated, error);
+        }
+      else
+        {
+        if (error) asprintf (error, "%s is not a sample log", filename);
+        }
+      }
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    }
+
+  if (!ok)
+    {
+    sample_log_close (self);
+    self = NULL;
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  sample_log_close
+
+============================================================================*/
+void sample_log_close (SampleLog *self)
+  {
+  if (self)
+    {
+    if (self->map)
+      {
+      msync (self->map, self->map_size, MS_SYNC);
+      munmap (self->map, self->map_size);
+      }
+    if (self->fd >= 0) close (self->fd);
+    free (self->channels);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  sample_log_sync
+
+============================================================================*/
+void sample_log_sync (SampleLog *self)
+  {
+  assert (self != NULL);
+  msync (self->map, self->map_size, MS_ASYNC);
+  }
+
+/*============================================================================
+
+  sample_log_new_block
+
+============================================================================*/
+static BOOL sample_log_new_block (SampleLog *self, int channel,
+       const INA219Sample *sample, char **error)
+  {
+  if (self->header->blocks_used == self->header->blocks_allocated)
+    {
+    if (!sample_log_map (self, self->header->blocks_allocated + GROW_BLOCKS,
+         error))
+      return FALSE;
+    }
+  uint64_t n = self->header->blocks_used;
+  LogBlockHeader *b = sample_log_block (self->map, n);
+  b->magic = BLOCK_MAGIC;
+  b->channel = channel;
+  b->count = 1;
+  b->used = 0;
+  b->first_time_ns = sample->time_ns;
+  b->last_time_ns = sample->time_ns;
+  b->first_shunt = sample->shunt_reg;
+  b->first_bus = sample->bus_reg;
+  self->header->blocks_used = n + 1;
+  if ((uint32_t)channel >= self->header->channels)
+    self->header->channels = channel + 1;
+
+  ChannelState *cs = &self->channels[channel];
+  cs->block = n;
+  cs->t_us = 0;
+  cs->dt_us = 0;
+  cs->shunt = sample->shunt_reg;
+  cs->bus = sample->bus_reg;
+  return TRUE;
+  }
+
+/*============================================================================
+
+  sample_log_append
+
+============================================================================*/
+BOOL sample_log_append (SampleLog *self, int channel,
+       const INA219Sample *sample, char **error)
+  {
+  assert (self != NULL);
+  assert (channel >= 0 && channel < MAX_CHANNELS);
+  if (channel >= self->nchannels)
+    {
+    self->channels = realloc (self->channels,
+      (channel + 1) * sizeof (ChannelState));
+    for (int i = self->nchannels; i <= channel; i++)
+      self->channels[i].block = -1;
+    self->nchannels = channel + 1;
+    }
+
+  ChannelState *cs = &self->channels[channel];
+  if (cs->block >= 0)
+    {
+    LogBlockHeader *b = sample_log_block (self->map, cs->block);
+    int64_t t_us = (int64_t)(sample->time_ns - b->first_time_ns) / 1000;
+    if (b->used + MAX_RECORD <= BLOCK_DATA && t_us >= cs->t_us)
+      {
+      int64_t dt_us = t_us - cs->t_us;
+      BYTE *p = (BYTE *)(b + 1) + b->used;
+      int n = varint_put (p, zigzag (dt_us - cs->dt_us));
+      n += varint_put (p + n, zigzag (sample->shunt_reg - cs->shunt));
+      n += varint_put (p + n, zigzag (sample->bus_reg - cs->bus));
+      cs->t_us = t_us;
+      cs->dt_us = dt_us;
+      cs->shunt = sample->shunt_reg;
+      cs->bus = sample->bus_reg;
+      // Data first, then the header that makes it visible
+      __atomic_store_n (&b->used, b->used + n, __ATOMIC_RELEASE);
+      b->last_time_ns = sample->time_ns;
+      __atomic_store_n (&b->count, b->count + 1, __ATOMIC_RELEASE);
+      return TRUE;
+      }
+    }
+  return sample_log_new_block (self, channel, sample, error);
+  }
+
+/*============================================================================
+
+  sample_log_reader_open
+
+============================================================================*/
+SampleLogReader *sample_log_reader_open (const char *filename, char **error)
+  {
+  SampleLogReader *self = malloc (sizeof (SampleLogReader));
+  memset (self, 0, sizeof (SampleLogReader));
+  BOOL ok = FALSE;
+  self->fd = open (filename, O_RDONLY);
+  if (self->fd >= 0)
+    {
+    struct stat sb;
+    fstat (self->fd, &sb);
+    if (sb.st_size >= BLOCK_SIZE)
+      {
+      self->map = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED,
+        self->fd, 0);
+      if (self->map != MAP_FAILED)
+        {
+        self->map_size = sb.st_size;
+        const LogFileHeader *h = (const LogFileHeader *)self->map;
+        if (memcmp (h->magic, SAMPLE_LOG_MAGIC, 8) == 0
+             && h->version == FILE_VERSION && h->block_size == BLOCK_SIZE)
+          {
+          self->blocks = h->blocks_used;
+          // The writer may have extended the file since we mapped it
+          if (self->blocks > self->map_size / BLOCK_SIZE - 1)
+            self->blocks = self->map_size / BLOCK_SIZE - 1;
+          self->channels = h->channels;
+          madvise ((void *)self->map, self->map_size, MADV_SEQUENTIAL);
+          ok = TRUE;
+          }
+        }
+      else
+        self->map = NULL;
+      }
+    if (!ok && error) asprintf (error, "%s is not a sample log", filename);
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    }
+
+  if (!ok)
+    {
+    sample_log_reader_close (self);
+    self = NULL;
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  sample_log_reader_close
+
+============================================================================*/
+void sample_log_reader_close (SampleLogReader *self)
+  {
+  if (self)
+    {
+    if (self->map) munmap ((void *)self->map, self->map_size);
+    if (self->fd >= 0) close (self->fd);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  sample_log_reader_seek
+
+  Blocks are allocated in time order, so their start times increase
+  with their position in the file; a binary search finds the first
+  block that starts after from_ns. But a block for one channel can run
+  on past the start of later blocks for other channels, so we then
+  walk backwards until, for every channel we're interested in, we've
+  seen a block that ends before from_ns. Each channel's blocks follow
+  one another in time, so nothing earlier than that can be relevant.
+
+============================================================================*/
+void sample_log_reader_seek (const SampleLogReader *self,
+       SampleLogIter *iter, int channel, uint64_t from_ns)
+  {
+  memset (iter, 0, sizeof (SampleLogIter));
+  iter->channel = channel;
+  iter->from_ns = from_ns;
+  BYTE *map = (BYTE *)self->map;
+
+  uint64_t lo = 0, hi = self->blocks;
+  while (lo < hi)
+    {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (sample_log_block (map, mid)->first_time_ns <= from_ns)
+      lo = mid + 1;
+    else
+      hi = mid;
+    }
+
+  uint32_t open_channels = channel >= 0 ? 1 : self->channels;
+  BYTE *closed = calloc (self->channels + 1, 1);
+  uint64_t start = lo;
+  while (start > 0 && open_channels > 0)
+    {
+    const LogBlockHeader *b = sample_log_block (map, start - 1);
+    if (b->channel < self->channels && !closed[b->channel]
+         && (channel < 0 || b->channel == channel)
+         && b->last_time_ns < from_ns)
+      {
+      closed[b->channel] = 1;
+      open_channels--;
+      }
+    start--;
+    }
+  free (closed);
+
+  iter->block = start;
+  iter->remaining = 0;
+  }
+
+/*============================================================================
+
+  sample_log_reader_next
+
+============================================================================*/
+BOOL sample_log_reader_next (const SampleLogReader *self,
+       SampleLogIter *iter, INA219Sample *sample, int *channel)
+  {
+  BYTE *map = (BYTE *)self->map;
+  for (;;)
+    {
+    if (iter->remaining == 0)
+      {
+      // Find the next block of interest. Its first sample is in the
+      //  header, so return that straight away
+      for (;;)
+        {
+        if (iter->block >= self->blocks) return FALSE;
+        const LogBlockHeader *b = sample_log_block (map, iter->block);
+        uint32_t count = __atomic_load_n (&b->count, __ATOMIC_ACQUIRE);
+        if (b->magic == BLOCK_MAGIC && count > 0
+             && (iter->channel < 0 || b->channel == iter->channel)
+             && b->last_time_ns >= iter->from_ns)
+          {
+          iter->offset = 0;
+          iter->remaining = count - 1;
+          iter->t_us = 0;
+          iter->dt_us = 0;
+          iter->shunt = b->first_shunt;
+          iter->bus = b->first_bus;
+          iter->block++;
+          if (b->first_time_ns >= iter->from_ns)
+            {
+            sample->time_ns = b->first_time_ns;
+            sample->shunt_reg = b->first_shunt;
+            sample->bus_reg = b->first_bus;
+            if (channel) *channel = b->channel;
+            return TRUE;
+            }
+          break;
+          }
+        iter->block++;
+        }
+      }
+
+    const LogBlockHeader *b = sample_log_block (map, iter->block - 1);
+    const BYTE *data = (const BYTE *)(b + 1);
+    const BYTE *p = data + iter->offset;
+    const BYTE *end = data + BLOCK_DATA;
+    uint64_t ddt, dshunt, dbus;
+    if (!(p = varint_get (p, end, &ddt))
+         || !(p = varint_get (p, end, &dshunt))
+         || !(p = varint_get (p, end, &dbus)))
+      {
+      // Corrupt block -- skip the rest of it
+      iter->remaining = 0;
+      continue;
+      }
+    iter->offset = p - data;
+    iter->remaining--;
+    iter->dt_us += unzigzag (ddt);
+    iter->t_us += iter->dt_us;
+    iter->shunt += unzigzag (dshunt);
+    iter->bus += unzigzag (dbus);
+
+    uint64_t t = b->first_time_ns + iter->t_us * 1000;
+    if (t < iter->from_ns) continue;
+    sample->time_ns = t;
+    sample->shunt_reg = (int16_t)iter->shunt;
+    sample->bus_reg = (uint16_t)iter->bus;
+    if (channel) *channel = b->channel;
+    return TRUE;
+    }
+  }
+
@@ -0,0 +1,108 @@
+/*============================================================================
+
+  samplelog.h
+
+  The SampleLog "class" writes INA219Sample values to a compact binary
+  file, and the SampleLogReader "class" reads them back. A sample costs
+  three or four bytes in the file, rather than the hundred or so that
+  a line of text costs.
+
+  The file is a header followed by fixed-size blocks. Each block holds
+  samples for one channel (that is, one INA219 device). The first
+  sample in a block is stored in full; the others are stored as
+  differences from the sample before, as variable-length integers.
+  Timestamps are stored as the change in the sampling interval, which
+  is usually zero or close to it, so a regularly-sampled stream needs
+  only one byte per sample for the time. Apart from the first sample
+  in each block, timestamps are kept to the nearest microsecond.
+
+  Each block header records its channel and the times of its first and
+  last samples, so the block headers act as an index: a reader can find
+  the block containing a given time without decoding anything else.
+
+  The file is preallocated, and accessed through a shared memory
+  mapping, so appending a sample is just a few stores into memory; the
+  kernel writes the dirty pages back in large batches. If the file
+  fills up, it is extended. Integers are stored in native byte order,
+  so a log must be read on a machine of the same endianness that wrote
+  it.
+
+  The reader maps the file read-only, and decodes samples directly
+  from the mapping -- nothing is copied or allocated per sample.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+// The first eight bytes of a log file
+#define SAMPLE_LOG_MAGIC "INA219LG"
+
+struct _SampleLog;
+typedef struct _SampleLog SampleLog;
+
+struct _SampleLogReader;
+typedef struct _SampleLogReader SampleLogReader;
+
+// Position of an iteration over a log. The caller allocates this,
+//  usually on the stack, and initializes it with
+//  sample_log_reader_seek(). The fields are private.
+typedef struct _SampleLogIter
+  {
+  int channel; // -1 for all channels
+  uint64_t block;
+  uint32_t offset;
+  uint32_t remaining;
+  uint64_t from_ns;
+  int64_t t_us;
+  int64_t dt_us;
+  int shunt;
+  int bus;
+  } SampleLogIter;
+
+BEGIN_DECLS
+
+/** Open a log for writing, creating it with space for initial_blocks
+    blocks if it doesn't exist. If it does exist, new samples are added
+    after the ones already in it. */
+SampleLog   *sample_log_create (const char *filename, int initial_blocks,
+               char **error);
+
+/** Flush and close the log. */
+void         sample_log_close (SampleLog *self);
+
+/** Add a sample for the given channel (0-65535). Samples for each
+    channel must be added in time order. This only fails if the file
+    can't be extended when full. */
+BOOL         sample_log_append (SampleLog *self, int channel,
+               const INA219Sample *sample, char **error);
+
+/** Ask the kernel to start writing dirty pages to the file. This does
+    not wait for the writes to complete. */
+void         sample_log_sync (SampleLog *self);
+
+/** Open a log for reading. */
+SampleLogReader *sample_log_reader_open (const char *filename,
+               char **error);
+
+/** Close the reader. */
+void         sample_log_reader_close (SampleLogReader *self);
+
+/** Position an iteration at the first sample for "channel" (or any
+    channel, if -1) with a time not earlier than from_ns. Use 0 to
+    start at the beginning. Blocks that end before from_ns are skipped
+    without being decoded. */
+void         sample_log_reader_seek (const SampleLogReader *self,
+               SampleLogIter *iter, int channel, uint64_t from_ns);
+
+/** Get the next sample, and its channel. Returns FALSE at the end of
+    the log. When reading all channels, samples come out block by
+    block, which is not strictly time order. */
+BOOL         sample_log_reader_next (const SampleLogReader *self,
+               SampleLogIter *iter, INA219Sample *sample, int *channel);
+
+END_DECLS
+
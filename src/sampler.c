@@ -0,0 +1,288 @@
+/*==========================================================================
+
+    sampler.c
+
+    Implementation of the "methods" in sampler.h
+
+    The sampling thread sleeps until an absolute deadline on
+    CLOCK_MONOTONIC, rather than for a fixed interval, so the time taken
+    by the I2C transaction does not accumulate as drift. If the thread
+    oversleeps by more than one interval (e.g., because the system was
+    suspended), it skips the missed deadlines rather than trying to
+    catch up with a burst of readings.
+
+    Reads go through ina219_sample_resilient_e(), so while the device
+    is backing off after a failure, a deadline passes without any bus
+    traffic, and the schedule carries on as if the read had been made.
+
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "defs.h"
+#include "ina219.h"
+#include "ring.h"
+#include "sampler.h"
+#include "stats.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+struct _Sampler
+  {
+  INA219 *ina219;
+  SampleRing *ring;
+  int interval_ms;
+  pthread_t thread;
+  BOOL running;
+  _Atomic BOOL stop;
+  _Atomic uint64_t samples;
+  _Atomic uint64_t failures;
+  // The most recent failure. Only touched when a read fails, so the lock
+  //  costs nothing while the bus is healthy
+  pthread_mutex_t error_mutex;
+  INA219Error last_error;
+  };
+
+/*============================================================================
+
+  sampler_create
+
+============================================================================*/
+Sampler *sampler_create (INA219 *ina219, SampleRing *ring, int interval_ms)
+  {
+  Sampler *self = malloc (sizeof (Sampler));
+  memset (self, 0, sizeof (Sampler));
+  self->ina219 = ina219;
+  self->ring = ring;
+  self->interval_ms = interval_ms > 0 ? interval_ms : 0;
+  pthread_mutex_init (&self->error_mutex, NULL);
+  return self;
+  }
+
+/*============================================================================
+
+  sampler_destroy
+
+============================================================================*/
+void sampler_destroy (Sampler *self)
+  {
+  if (self)
+    {
+    sampler_stop (self);
+    pthread_mutex_destroy (&self->error_mutex);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  sampler_failed
+
+  Count a failed read, and keep its details for sampler_get_last_error().
+
+============================================================================*/
+static void sampler_failed (Sampler *self, const INA219Error *e)
+  {
+  pthread_mutex_lock (&self->error_mutex);
+  self->last_error = *e;
+  pthread_mutex_unlock (&self->error_mutex);
+  atomic_fetch_add (&self->failures, 1);
+  }
+
+/*============================================================================
+
+  sampler_acquire_thread
+
+  Conversion-driven sampling. ina219_acquire() does all the waiting,
+  and ina219_sample_resilient_e() naps while the device is backing off.
+
+============================================================================*/
+static void *sampler_acquire_thread (void *arg)
+  {
+  Sampler *self = arg;
+  while (!atomic_load (&self->stop))
+    {
+    INA219Sample sample;
+    INA219Error e;
+    switch (ina219_sample_resilient_e (self->ina219, TRUE, &sample, &e))
+      {
+      case INA219_READ_OK:
+        sample_ring_write (self->ring, &sample);
+        atomic_fetch_add (&self->samples, 1);
+        break;
+      case INA219_READ_GAP:
+        sample_ring_write (self->ring, &sample);
+        sampler_failed (self, &e);
+        break;
+      case INA219_READ_FAILED:
+        sampler_failed (self, &e);
+        break;
+      case INA219_READ_BACKOFF:
+        break;
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  sampler_thread
+
+============================================================================*/
+static void *sampler_thread (void *arg)
+  {
+  Sampler *self = arg;
+  long long interval_ns = (long long)self->interval_ms * 1000000LL;
+  struct timespec deadline;
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+#ifdef INA219_STATS
+  uint64_t last_ns = 0; // Time of the last sample, if it was on schedule
+#endif
+
+  while (!atomic_load (&self->stop))
+    {
+    INA219Sample sample;
+    INA219Error e;
+    // Use the _e method, so a flaky bus doesn't turn into a stream of
+    //  allocations
+    INA219ReadResult r = ina219_sample_resilient_e (self->ina219, FALSE,
+      &sample, &e);
+    if (r == INA219_READ_OK)
+      {
+      sample_ring_write (self->ring, &sample);
+      atomic_fetch_add (&self->samples, 1);
+#ifdef INA219_STATS
+      uint64_t deadline_ns = (uint64_t)deadline.tv_sec * NSEC_PER_SEC
+        + deadline.tv_nsec;
+      if (sample.time_ns > deadline_ns)
+        ina219_stats_record (INA219_HIST_LATENESS,
+          sample.time_ns - deadline_ns);
+      if (last_ns)
+        {
+        long long error = (long long)(sample.time_ns - last_ns)
+          - interval_ns;
+        ina219_stats_record (INA219_HIST_INTERVAL_ERROR, 
+          error < 0 ? -error : error);
+        }
+      last_ns = sample.time_ns;
+#endif
+      }
+    else if (r == INA219_READ_BACKOFF)
+      {
+      INA219_STATS_MISSED (1);
+      }
+    else
+      {
+      // A gap marker goes into the ring, so consumers know that the
+      //  readings either side of it are not consecutive
+      if (r == INA219_READ_GAP) sample_ring_write (self->ring, &sample);
+      sampler_failed (self, &e);
+#ifdef INA219_STATS
+      last_ns = 0;
+#endif
+      }
+
+    long long next = (long long)deadline.tv_sec * NSEC_PER_SEC
+      + deadline.tv_nsec + interval_ns;
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    long long now_ns = (long long)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+    if (next <= now_ns)
+      {
+      // We've missed at least one deadline. Skip forward to the next one
+      //  that's still in the future
+      long long missed = (now_ns - next) / interval_ns + 1;
+      next += missed * interval_ns;
+      INA219_STATS_MISSED (missed);
+#ifdef INA219_STATS
+      last_ns = 0;
+#endif
+      }
+    deadline.tv_sec = next / NSEC_PER_SEC;
+    deadline.tv_nsec = next % NSEC_PER_SEC;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+        NULL) == EINTR && !atomic_load (&self->stop))
+      ;
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  sampler_start
+
+============================================================================*/
+BOOL sampler_start (Sampler *self, char **error)
+  {
+  assert (self != NULL);
+  BOOL ret = FALSE;
+  if (self->running) return TRUE;
+  atomic_store (&self->stop, FALSE);
+  int err = pthread_create (&self->thread, NULL, self->interval_ms > 0 ?
+    sampler_thread : sampler_acquire_thread, self);
+  if (err == 0)
+    {
+    self->running = TRUE;
+    ret = TRUE;
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't start sampling thread: %s",
+      strerror (err));
+    }
+  return ret;
+  }
+
+/*============================================================================
+
+  sampler_stop
+
+============================================================================*/
+void sampler_stop (Sampler *self)
+  {
+  assert (self != NULL);
+  if (!self->running) return;
+  atomic_store (&self->stop, TRUE);
+  pthread_join (self->thread, NULL);
+  self->running = FALSE;
+  }
+
+/*============================================================================
+
+  sampler_get_counts
+
+============================================================================*/
+void sampler_get_counts (const Sampler *self, uint64_t *samples,
+       uint64_t *failures)
+  {
+  Sampler *s = (Sampler *)self;
+  if (samples) *samples = atomic_load (&s->samples);
+  if (failures) *failures = atomic_load (&s->failures);
+  }
+
+/*============================================================================
+
+  sampler_get_last_error
+
+============================================================================*/
+BOOL sampler_get_last_error (const Sampler *self, INA219Error *e)
+  {
+  Sampler *s = (Sampler *)self;
+  if (atomic_load (&s->failures) == 0) return FALSE;
+  pthread_mutex_lock (&s->error_mutex);
+  *e = s->last_error;
+  pthread_mutex_unlock (&s->error_mutex);
+  return TRUE;
+  }
+
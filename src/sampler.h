@@ -0,0 +1,71 @@
+/*============================================================================
+
+  sampler.h
+
+  The Sampler "class" runs a background thread that reads an INA219 at
+  a fixed rate, and writes timestamped raw samples into a SampleRing.
+  Any number of consumer threads can read from the ring, and work out
+  status, write logs, raise alerts, etc., at their own pace. Because the
+  ring never blocks its producer, a slow consumer cannot delay sampling;
+  it just misses samples.
+
+  The usual call sequence is
+
+    Sampler *sampler = sampler_create (ina219, ring, interval_ms);
+    sampler_start (sampler, ...);
+    ... consumers read from the ring ...
+    sampler_stop (sampler);
+    sampler_destroy (sampler);
+
+  The INA219 must have been initialized before _start() is called, and
+  must not be used by any other thread while the sampler is running.
+
+  Reads are made with ina219_sample_resilient_e(), so when the device 
+  stops answering, the sampler writes one gap marker (see 
+  INA219_SAMPLE_IS_GAP) into the ring, and then leaves the device 
+  alone until its backoff is over. Consumers should skip gap markers,
+  or use them to tell that the readings either side are not 
+  consecutive.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+#include "ring.h"
+
+struct _Sampler;
+typedef struct _Sampler Sampler;
+
+BEGIN_DECLS
+
+/** Create a sampler that will read "ina219" every interval_ms
+    milliseconds, and write the samples to "ring". If interval_ms is 
+    zero, the sampler instead reads every conversion the chip makes, 
+    exactly once, using ina219_acquire(). The sampler does not take 
+    ownership of either the INA219 or the ring. */
+Sampler   *sampler_create (INA219 *ina219, SampleRing *ring,
+             int interval_ms);
+
+/** Free the sampler, stopping it first if necessary. */
+void       sampler_destroy (Sampler *self);
+
+/** Start the sampling thread. */
+BOOL       sampler_start (Sampler *self, char **error);
+
+/** Stop the sampling thread, and wait for it to finish. */
+void       sampler_stop (Sampler *self);
+
+/** Get the number of samples taken, and the number of failed reads,
+    since the sampler was started. Either argument may be NULL. */
+void       sampler_get_counts (const Sampler *self, uint64_t *samples,
+             uint64_t *failures);
+
+/** Get the details of the most recent failed read, in *e. Returns 
+    FALSE, leaving *e alone, if no read has failed. */
+BOOL       sampler_get_last_error (const Sampler *self, INA219Error *e);
+
+END_DECLS
+
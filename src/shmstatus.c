@@ -0,0 +1,212 @@
+/*==========================================================================
+
+    shmstatus.c
+
+    Implementation of the "methods" in shmstatus.h
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h"
+#include "ina219.h"
+#include "shmstatus.h"
+
+#define SHM_MAGIC 0x494E4132 // "INA2"
+#define SHM_VERSION 2
+
+// A write takes well under a microsecond. If the sequence number stays
+//  odd for this many attempts, the publisher died part-way through one
+#define MAX_SPINS 1000000
+
+typedef struct _SharedSegment
+  {
+  uint32_t magic;
+  uint32_t version;
+  _Atomic uint32_t seq; // Odd while a write is in progress
+  uint32_t reserved;
+  INA219SharedStatus status;
+  } SharedSegment;
+
+struct _StatusPublisher
+  {
+  char *name;
+  SharedSegment *segment;
+  };
+
+struct _StatusReader
+  {
+  const SharedSegment *segment;
+  };
+
+/*============================================================================
+
+  status_publisher_create
+
+============================================================================*/
+StatusPublisher *status_publisher_create (const char *name, char **error)
+  {
+  StatusPublisher *self = NULL;
+  int fd = shm_open (name, O_RDWR | O_CREAT, 0644);
+  if (fd >= 0)
+    {
+    if (ftruncate (fd, sizeof (SharedSegment)) == 0)
+      {
+      SharedSegment *segment = mmap (NULL, sizeof (SharedSegment),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (segment != MAP_FAILED)
+        {
+        self = malloc (sizeof (StatusPublisher));
+        self->name = strdup (name);
+        self->segment = segment;
+        // Start from scratch, even if an old publisher left data here
+        atomic_store (&segment->seq, 0);
+        memset (&segment->status, 0, sizeof (INA219SharedStatus));
+        segment->version = SHM_VERSION;
+        segment->magic = SHM_MAGIC;
+        }
+      else
+        {
+        if (error) asprintf (error, "Can't map shared memory %s: %s",
+          name, strerror (errno));
+        }
+      }
+    else
+      {
+      if (error) asprintf (error, "Can't size shared memory %s: %s",
+        name, strerror (errno));
+      }
+    // The mapping stays valid after the descriptor is closed
+    close (fd);
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't create shared memory %s: %s",
+      name, strerror (errno));
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  status_publisher_destroy
+
+============================================================================*/
+void status_publisher_destroy (StatusPublisher *self)
+  {
+  if (self)
+    {
+    munmap (self->segment, sizeof (SharedSegment));
+    shm_unlink (self->name);
+    free (self->name);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  status_publisher_publish
+
+============================================================================*/
+void status_publisher_publish (StatusPublisher *self,
+       const INA219SharedStatus *status)
+  {
+  SharedSegment *segment = self->segment;
+  uint32_t seq = atomic_load_explicit (&segment->seq, memory_order_relaxed);
+  atomic_store_explicit (&segment->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+  segment->status = *status;
+  // Zero means "never written", so skip it when the count wraps round
+  uint32_t next = seq + 2;
+  if (next == 0) next = 2;
+  atomic_store_explicit (&segment->seq, next, memory_order_release);
+  }
+
+/*============================================================================
+
+  status_reader_open
+
+============================================================================*/
+StatusReader *status_reader_open (const char *name, char **error)
+  {
+  StatusReader *self = NULL;
+  int fd = shm_open (name, O_RDONLY, 0);
+  if (fd >= 0)
+    {
+    struct stat sb;
+    const SharedSegment *segment = MAP_FAILED;
+    if (fstat (fd, &sb) == 0 && sb.st_size >= (off_t)sizeof (SharedSegment))
+      segment = mmap (NULL, sizeof (SharedSegment), PROT_READ, MAP_SHARED,
+        fd, 0);
+    if (segment != MAP_FAILED && segment->magic == SHM_MAGIC
+         && segment->version == SHM_VERSION)
+      {
+      self = malloc (sizeof (StatusReader));
+      self->segment = segment;
+      }
+    else
+      {
+      if (segment != MAP_FAILED)
+        munmap ((void *)segment, sizeof (SharedSegment));
+      if (error) asprintf (error, "%s is not an INA219 status segment",
+        name);
+      }
+    close (fd);
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't open shared memory %s: %s",
+      name, strerror (errno));
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  status_reader_close
+
+============================================================================*/
+void status_reader_close (StatusReader *self)
+  {
+  if (self)
+    {
+    munmap ((void *)self->segment, sizeof (SharedSegment));
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  status_reader_read
+
+============================================================================*/
+BOOL status_reader_read (const StatusReader *self,
+       INA219SharedStatus *status)
+  {
+  SharedSegment *segment = (SharedSegment *)self->segment;
+  for (int spins = 0; spins < MAX_SPINS; spins++)
+    {
+    uint32_t seq1 = atomic_load_explicit (&segment->seq,
+      memory_order_acquire);
+    if (seq1 == 0) return FALSE; // Nothing published yet
+    if (seq1 & 1) continue; // Write in progress -- it won't take long
+    *status = segment->status;
+    atomic_thread_fence (memory_order_acquire);
+    uint32_t seq2 = atomic_load_explicit (&segment->seq,
+      memory_order_relaxed);
+    if (seq1 == seq2) return TRUE;
+    }
+  return FALSE;
+  }
+
@@ -0,0 +1,99 @@
+/*============================================================================
+
+  shmstatus.h
+
+  Publication of the latest battery status through POSIX shared memory,
+  so that any number of processes can read it without touching the I2C
+  bus. One process (the publisher) owns the INA219 and writes each new
+  status into a shared-memory segment; readers map the same segment,
+  and copy the status out of it.
+
+  The segment is protected by a seqlock. The publisher increments a
+  sequence number before and after each write, so the number is odd
+  while a write is in progress. A reader notes the sequence number,
+  copies the data, and then checks that the number is even and has not
+  changed; if it has, the copy may be torn, and the reader tries again.
+  Readers never write to the segment, never block the publisher, and
+  make no system calls once the segment is mapped.
+
+  The usual reader call sequence is
+
+    StatusReader *reader = status_reader_open ("/ina219", &error);
+    INA219SharedStatus status;
+    if (status_reader_read (reader, &status)) ...
+    status_reader_close (reader);
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include "ina219.h"
+
+// Default shared-memory segment name
+#define INA219_SHM_NAME "/ina219"
+
+// The status as published. The layout of this structure is part of the
+//  interface between processes -- SHM_VERSION in shmstatus.c must
+//  change if it does.
+typedef struct _INA219SharedStatus
+  {
+  // CLOCK_MONOTONIC time of the most recent sample, and its raw values
+  uint64_t time_ns;
+  int16_t shunt_reg;
+  uint16_t bus_reg;
+  // As returned by ina219_get_status(). The voltage and current are
+  //  from the most recent sample; the other figures are worked out from
+  //  the filtered values below
+  int32_t charge_status; // An INA219ChargeStatus
+  int32_t battery_voltage_mv;
+  int32_t percent_charged;
+  int32_t battery_current_mA;
+  int32_t minutes;
+  // Voltage and current after filtering (see filter.h); the same as the
+  //  raw figures if there is no filter
+  int32_t filtered_voltage_mv;
+  int32_t filtered_current_mA;
+  // Estimates from charge integration; minutes is -1 if unknown
+  int32_t integrated_percent;
+  int32_t integrated_minutes;
+  int32_t smoothed_current_mA;
+  // Total number of samples published
+  uint64_t samples;
+  } INA219SharedStatus;
+
+struct _StatusPublisher;
+typedef struct _StatusPublisher StatusPublisher;
+
+struct _StatusReader;
+typedef struct _StatusReader StatusReader;
+
+BEGIN_DECLS
+
+/** Create (or take over) the shared-memory segment "name", which must
+    start with a '/'. */
+StatusPublisher *status_publisher_create (const char *name,
+                   char **error);
+
+/** Unmap and remove the segment. Readers that have it mapped can carry
+    on reading the last status published. */
+void             status_publisher_destroy (StatusPublisher *self);
+
+/** Publish a new status. Must only be called from one thread. */
+void             status_publisher_publish (StatusPublisher *self,
+                   const INA219SharedStatus *status);
+
+/** Map an existing segment for reading. */
+StatusReader    *status_reader_open (const char *name, char **error);
+
+/** Unmap the segment. */
+void             status_reader_close (StatusReader *self);
+
+/** Copy the latest status. Returns FALSE if nothing has been published
+    yet. */
+BOOL             status_reader_read (const StatusReader *self,
+                   INA219SharedStatus *status);
+
+END_DECLS
+
@@ -0,0 +1,387 @@
+/*==========================================================================
+
+    soc.c
+
+    Implementation of the "methods" in soc.h
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include "defs.h"
+#include "soc.h"
+
+// The most points a profile file can hold
+#define MAX_POINTS 256
+
+// Microamp-microseconds in one mA-hour
+#define UAUS_PER_MAH 3600000000000LL
+
+struct _SocCurve
+  {
+  int resistance_mohm;
+  uint8_t table[SOC_TABLE_SIZE]; // Percent, indexed by mV / 4
+  };
+
+// One reading taken by a SocRecorder
+typedef struct _SocReading
+  {
+  uint64_t time_ns;
+  int mv;
+  int current_ua;
+  } SocReading;
+
+struct _SocRecorder
+  {
+  SocReading *readings;
+  int count;
+  int size;
+  int64_t removed; // Charge taken out so far, in uA-us
+  };
+
+// A typical open-circuit discharge curve for one lithium-ion cell
+static const SocPoint liion_points[] =
+  {
+  { 4200, 100 }, { 4150, 95 }, { 4110, 90 }, { 4080, 85 }, { 4020, 80 },
+  { 3980, 75 }, { 3950, 70 }, { 3910, 65 }, { 3870, 60 }, { 3850, 55 },
+  { 3840, 50 }, { 3820, 45 }, { 3800, 40 }, { 3790, 35 }, { 3770, 30 },
+  { 3750, 25 }, { 3730, 20 }, { 3710, 15 }, { 3690, 10 }, { 3610, 5 },
+  { 3270, 0 }
+  };
+
+/*============================================================================
+
+  soc_point_compare
+
+============================================================================*/
+static int soc_point_compare (const void *a, const void *b)
+  {
+  const SocPoint *pa = a, *pb = b;
+  return pa->mv - pb->mv;
+  }
+
+/*============================================================================
+
+  soc_curve_create
+
+  Sort the points by voltage, and fill in the table by linear
+  interpolation between them. Below the first point, and above the
+  last, the table holds the percentage at that point.
+
+============================================================================*/
+SocCurve *soc_curve_create (const SocPoint *points, int n, int cells,
+            int resistance_mohm, char **error)
+  {
+  if (n < 2 || n > MAX_POINTS)
+    {
+    if (error) asprintf (error, "A curve needs between 2 and %d points",
+      MAX_POINTS);
+    return NULL;
+    }
+  if (cells < 1 || resistance_mohm < 0)
+    {
+    if (error) asprintf (error, "Bad cell count or resistance");
+    return NULL;
+    }
+  SocPoint sorted[MAX_POINTS];
+  for (int i = 0; i < n; i++)
+    {
+    sorted[i].mv = points[i].mv * cells;
+    sorted[i].percent = points[i].percent;
+    }
+  qsort (sorted, n, sizeof (SocPoint), soc_point_compare);
+
+  for (int i = 0; i < n; i++)
+    {
+    const SocPoint *p = &sorted[i];
+    if (p->mv < 0 || p->mv >= SOC_TABLE_SIZE * 4
+         || p->percent < 0 || p->percent > 100)
+      {
+      if (error) asprintf (error, "Point %d mV %d%% is out of range",
+        p->mv, p->percent);
+      return NULL;
+      }
+    if (i > 0 && (p->mv == sorted[i - 1].mv
+         || p->percent < sorted[i - 1].percent))
+      {
+      if (error) asprintf (error, "Charge must rise with voltage, "
+        "but %d mV is %d%%, and %d mV is %d%%", sorted[i - 1].mv,
+        sorted[i - 1].percent, p->mv, p->percent);
+      return NULL;
+      }
+    }
+
+  SocCurve *self = malloc (sizeof (SocCurve));
+  self->resistance_mohm = resistance_mohm;
+  int seg = 0;
+  for (int i = 0; i < SOC_TABLE_SIZE; i++)
+    {
+    int mv = i * 4;
+    while (seg < n - 2 && mv >= sorted[seg + 1].mv) seg++;
+    const SocPoint *lo = &sorted[seg], *hi = &sorted[seg + 1];
+    int percent;
+    if (mv <= lo->mv)
+      percent = lo->percent;
+    else if (mv >= hi->mv)
+      percent = hi->percent;
+    else
+      {
+      int dv = hi->mv - lo->mv;
+      percent = lo->percent + ((hi->percent - lo->percent)
+        * (mv - lo->mv) + dv / 2) / dv;
+      }
+    self->table[i] = (uint8_t)percent;
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  soc_curve_load
+
+============================================================================*/
+SocCurve *soc_curve_load (const char *filename, char **error)
+  {
+  FILE *f = fopen (filename, "r");
+  if (!f)
+    {
+    if (error) asprintf (error, "Can't open %s: %s", filename,
+      strerror (errno));
+    return NULL;
+    }
+
+  SocPoint points[MAX_POINTS];
+  int n = 0, cells = 1, resistance = 0;
+  BOOL ok = TRUE;
+  char line[256];
+  int lineno = 0;
+  while (ok && fgets (line, sizeof (line), f))
+    {
+    lineno++;
+    char *hash = strchr (line, '#');
+    if (hash) *hash = 0;
+    char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\n' || *p == 0) continue;
+    if (sscanf (p, "resistance %d", &resistance) == 1 && resistance >= 0)
+      continue;
+    if (sscanf (p, "cells %d", &cells) == 1 && cells > 0)
+      continue;
+    if (n < MAX_POINTS && sscanf (p, "%d %d", &points[n].mv,
+         &points[n].percent) == 2)
+      {
+      n++;
+      continue;
+      }
+    if (error) asprintf (error, "%s: line %d: bad curve entry", filename,
+      lineno);
+    ok = FALSE;
+    }
+  fclose (f);
+
+  SocCurve *self = NULL;
+  if (ok)
+    {
+    char *e = NULL;
+    self = soc_curve_create (points, n, cells, resistance,
+      error ? &e : NULL);
+    if (!self && error)
+      {
+      asprintf (error, "%s: %s", filename, e);
+      free (e);
+      }
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  soc_curve_create_builtin
+
+============================================================================*/
+SocCurve *soc_curve_create_builtin (const char *name, int cells,
+            char **error)
+  {
+  if (strcmp (name, "li-ion") == 0)
+    return soc_curve_create (liion_points,
+      sizeof (liion_points) / sizeof (liion_points[0]), cells, 0, error);
+  if (error) asprintf (error, "No built-in curve called %s", name);
+  return NULL;
+  }
+
+/*============================================================================
+
+  soc_curve_destroy
+
+============================================================================*/
+void soc_curve_destroy (SocCurve *self)
+  {
+  if (self) free (self);
+  }
+
+/*============================================================================
+
+  soc_curve_percent
+
+============================================================================*/
+int soc_curve_percent (const SocCurve *self, int mv, int mA)
+  {
+  // mA * milliohms / 1000 is the I*R drop in mV. When discharging, mA
+  //  is -ve, and the open-circuit voltage is higher than we see
+  int open_mv = mv - mA * self->resistance_mohm / 1000;
+  int i = open_mv >> 2;
+  if (i < 0) i = 0;
+  if (i >= SOC_TABLE_SIZE) i = SOC_TABLE_SIZE - 1;
+  return self->table[i];
+  }
+
+/*============================================================================
+
+  soc_recorder_create
+
+============================================================================*/
+SocRecorder *soc_recorder_create (void)
+  {
+  SocRecorder *self = malloc (sizeof (SocRecorder));
+  memset (self, 0, sizeof (SocRecorder));
+  return self;
+  }
+
+/*============================================================================
+
+  soc_recorder_destroy
+
+============================================================================*/
+void soc_recorder_destroy (SocRecorder *self)
+  {
+  if (self)
+    {
+    free (self->readings);
+    free (self);
+    }
+  }
+
+/*============================================================================
+
+  soc_recorder_removed
+
+  Charge taken out between two readings, in uA-us, by the trapezium
+  rule. Charging current counts as negative.
+
+============================================================================*/
+static int64_t soc_recorder_removed (const SocReading *a,
+      const SocReading *b)
+  {
+  int64_t ua = -((int64_t)a->current_ua + b->current_ua) / 2;
+  return ua * (int64_t)(b->time_ns - a->time_ns) / 1000;
+  }
+
+/*============================================================================
+
+  soc_recorder_add
+
+============================================================================*/
+void soc_recorder_add (SocRecorder *self, uint64_t time_ns, int mv,
+       int current_ua)
+  {
+  assert (self != NULL);
+  if (self->count == self->size)
+    {
+    self->size = self->size ? self->size * 2 : 1024;
+    self->readings = realloc (self->readings,
+      self->size * sizeof (SocReading));
+    }
+  SocReading *r = &self->readings[self->count];
+  r->time_ns = time_ns;
+  r->mv = mv;
+  r->current_ua = current_ua;
+  if (self->count > 0)
+    self->removed += soc_recorder_removed (r - 1, r);
+  self->count++;
+  }
+
+/*============================================================================
+
+  soc_recorder_get_mah
+
+============================================================================*/
+int soc_recorder_get_mah (const SocRecorder *self)
+  {
+  return (int)(self->removed / UAUS_PER_MAH);
+  }
+
+/*============================================================================
+
+  soc_recorder_write_profile
+
+  The charge at each reading is the fraction of the total that had not
+  yet been taken out. The (corrected) voltages of all the readings
+  that round to the same percentage are averaged, to give one point
+  per percent. Noise could still make a point higher than the one
+  above it, so the voltages are forced to fall, going down the curve.
+
+============================================================================*/
+BOOL soc_recorder_write_profile (const SocRecorder *self,
+       const char *filename, int resistance_mohm, char **error)
+  {
+  assert (self != NULL);
+  if (self->removed <= 0)
+    {
+    if (error) asprintf (error, "No discharge has been recorded");
+    return FALSE;
+    }
+
+  int64_t mv_sum[101] = { 0 };
+  int count[101] = { 0 };
+  int64_t removed = 0;
+  for (int i = 0; i < self->count; i++)
+    {
+    const SocReading *r = &self->readings[i];
+    if (i > 0) removed += soc_recorder_removed (r - 1, r);
+    int percent = (int)(((self->removed - removed) * 100
+      + self->removed / 2) / self->removed);
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+    mv_sum[percent] += r->mv
+      - (int64_t)r->current_ua * resistance_mohm / 1000000;
+    count[percent]++;
+    }
+
+  char *tmp;
+  asprintf (&tmp, "%s.tmp", filename);
+  BOOL ret = FALSE;
+  FILE *f = fopen (tmp, "w");
+  if (f)
+    {
+    fprintf (f, "# Recorded discharge: %d readings, %d mAh\n",
+      self->count, soc_recorder_get_mah (self));
+    if (resistance_mohm) fprintf (f, "resistance %d\n", resistance_mohm);
+    int last_mv = -1;
+    for (int p = 100; p >= 0; p--)
+      {
+      if (count[p] == 0) continue;
+      int mv = (int)(mv_sum[p] / count[p]);
+      if (last_mv >= 0 && mv >= last_mv) mv = last_mv - 1;
+      fprintf (f, "%d %d\n", mv, p);
+      last_mv = mv;
+      }
+    if (fclose (f) == 0 && rename (tmp, filename) == 0)
+      ret = TRUE;
+    }
+  if (!ret)
+    {
+    if (error) asprintf (error, "Can't write %s: %s", filename,
+      strerror (errno));
+    unlink (tmp);
+    }
+  free (tmp);
+  return ret;
+  }
+
@@ -0,0 +1,108 @@
+/*============================================================================
+
+  soc.h
+
+  The SocCurve "class" maps battery voltage to state of charge using a
+  measured discharge curve, rather than the straight line between the
+  0% and 100% voltages that ina219_status_from_raw() uses by default.
+  A lithium-ion cell spends most of its discharge on a flat plateau
+  around 3.7V, so a straight line is badly wrong over most of the range.
+
+  A curve is a list of (voltage, percent) points, which may be compiled
+  in, or loaded from a profile file. The points are interpolated into a
+  dense table with one entry for each step of the INA219's bus voltage
+  register (4mV), so that working out the charge is a single array
+  read, with no floating-point arithmetic.
+
+  Under load, the terminal voltage of a battery is lower than its
+  open-circuit voltage by the current times the internal resistance
+  (and higher when charging). If the curve has a resistance, the
+  voltage is corrected by I*R before the lookup.
+
+  A profile file has one point per line, "millivolts percent", in any
+  order, with two optional settings:
+
+    # Comments and blank lines are ignored
+    resistance 120   # Internal resistance of the pack, in milliohms
+    cells 2          # Voltages in the points are per cell
+    4200 100
+    3700 50
+    ...
+
+  The SocRecorder "class" produces such a file from a recorded
+  discharge: the charge at each point is worked out by integrating
+  the current over the whole discharge.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+
+// One entry in the table for each value of the 13-bit voltage field of
+//  the bus voltage register, i.e., each 4mV step from 0 to 32.76V
+#define SOC_TABLE_SIZE 8192
+
+// One point on a discharge curve
+typedef struct _SocPoint
+  {
+  int mv;
+  int percent;
+  } SocPoint;
+
+struct _SocCurve;
+typedef struct _SocCurve SocCurve;
+
+struct _SocRecorder;
+typedef struct _SocRecorder SocRecorder;
+
+BEGIN_DECLS
+
+/** Create a curve from a list of points, in any order. The voltages
+    are multiplied by "cells", so the same table can describe packs of
+    any number of cells in series. resistance_mohm is the internal
+    resistance of the whole pack, or zero for no correction. Fails if
+    the charge does not rise with voltage. */
+SocCurve   *soc_curve_create (const SocPoint *points, int n, int cells,
+              int resistance_mohm, char **error);
+
+/** Create a curve from a profile file. */
+SocCurve   *soc_curve_load (const char *filename, char **error);
+
+/** Create a curve from a table compiled into the program. At present
+    the only name is "li-ion", a typical open-circuit curve for one
+    lithium-ion cell. */
+SocCurve   *soc_curve_create_builtin (const char *name, int cells,
+              char **error);
+
+/** Free the curve. */
+void        soc_curve_destroy (SocCurve *self);
+
+/** Get the charge in percent for a battery voltage in mV, and a
+    current in mA, +ve for charging. */
+int         soc_curve_percent (const SocCurve *self, int mv, int mA);
+
+/** Create a recorder for a discharge run. */
+SocRecorder *soc_recorder_create (void);
+
+/** Free the recorder. */
+void        soc_recorder_destroy (SocRecorder *self);
+
+/** Add a reading. The current is in uA, and should be -ve, since the
+    battery is discharging. time_ns is from CLOCK_MONOTONIC. */
+void        soc_recorder_add (SocRecorder *self, uint64_t time_ns, int mv,
+              int current_ua);
+
+/** The charge taken out of the battery so far, in mA-hours. */
+int         soc_recorder_get_mah (const SocRecorder *self);
+
+/** Work out the curve from the readings so far, assuming that the
+    battery went from full to empty, and write it as a profile file.
+    If resistance_mohm is not zero, the voltages are corrected for it,
+    and it is written to the file. */
+BOOL        soc_recorder_write_profile (const SocRecorder *self,
+              const char *filename, int resistance_mohm, char **error);
+
+END_DECLS
+
@@ -0,0 +1,531 @@
+/*==========================================================================
+
+    stats.c
+
+    Implementation of the "methods" in stats.h
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "defs.h"
+#include "stats.h"
+
+// Histogram layout: values below SUBS get a bucket each; above that,
+//  each power of two is divided into SUBS buckets. Values of 2^MAX_EXP
+//  ns (about 18 minutes) and more all go into the last bucket
+#define SUB_BITS 3
+#define SUBS (1 << SUB_BITS)
+#define MAX_EXP 40
+#define BUCKETS ((MAX_EXP - SUB_BITS + 2) * SUBS)
+
+// How often the HTTP server checks whether it has been asked to stop
+#define SERVER_POLL_MS 200
+
+typedef struct _Histogram
+  {
+  _Atomic uint64_t buckets[BUCKETS];
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  } Histogram;
+
+typedef struct _RegisterCounters
+  {
+  _Atomic uint64_t reads;
+  _Atomic uint64_t writes;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t failures;
+  _Atomic uint64_t retries;
+  } RegisterCounters;
+
+struct _StatsServer
+  {
+  int fd;
+  pthread_t thread;
+  _Atomic BOOL stop;
+  };
+
+static Histogram histograms[INA219_HIST_COUNT];
+static RegisterCounters registers[INA219_STATS_NREGS];
+static _Atomic uint64_t missed;
+
+static const char *histogram_names[INA219_HIST_COUNT] =
+  {
+  "ina219_read_seconds",
+  "ina219_write_seconds",
+  "ina219_get_status_seconds",
+  "ina219_sample_lateness_seconds",
+  "ina219_sample_interval_error_seconds"
+  };
+
+static const char *histogram_help[INA219_HIST_COUNT] =
+  {
+  "Time taken by one register read transaction",
+  "Time taken by one register write",
+  "Time taken by ina219_get_status()",
+  "How late the sampling loop woke, relative to its deadline",
+  "Difference between the sampling interval and the nominal interval"
+  };
+
+static const char *register_names[INA219_STATS_NREGS] =
+  {
+  "config", "shunt", "bus", "power", "current", "calibration"
+  };
+
+/*============================================================================
+
+  ina219_stats_now
+
+============================================================================*/
+uint64_t ina219_stats_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  stats_bucket
+
+============================================================================*/
+static int stats_bucket (uint64_t ns)
+  {
+  if (ns < SUBS) return (int)ns;
+  int e = 63 - __builtin_clzll (ns);
+  if (e > MAX_EXP) return BUCKETS - 1;
+  return (e - SUB_BITS + 1) * SUBS
+    + (int)((ns >> (e - SUB_BITS)) & (SUBS - 1));
+  }
+
+/*============================================================================
+
+  stats_bucket_limit
+
+  The largest value that falls into a bucket.
+
+============================================================================*/
+static uint64_t stats_bucket_limit (int bucket)
+  {
+  if (bucket < SUBS) return bucket;
+  int e = bucket / SUBS + SUB_BITS - 1;
+  uint64_t sub = bucket % SUBS;
+  return ((SUBS + sub + 1) << (e - SUB_BITS)) - 1;
+  }
+
+/*============================================================================
+
+  ina219_stats_record
+
+============================================================================*/
+void ina219_stats_record (INA219StatsHistogram hist, uint64_t ns)
+  {
+  Histogram *h = &histograms[hist];
+  atomic_fetch_add_explicit (&h->buckets[stats_bucket (ns)], 1,
+    memory_order_relaxed);
+  atomic_fetch_add_explicit (&h->sum, ns, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit (&h->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit (&h->max, &max,
+      ns, memory_order_relaxed, memory_order_relaxed))
+    ;
+  }
+
+/*============================================================================
+
+  ina219_stats_registers
+
+  Count a transaction on n registers. Each register costs a pointer
+  byte and two data bytes, whether it's read or written.
+
+============================================================================*/
+void ina219_stats_registers (const BYTE *regs, int n, BOOL write, BOOL ok)
+  {
+  for (int i = 0; i < n; i++)
+    {
+    if (regs[i] >= INA219_STATS_NREGS) continue;
+    RegisterCounters *r = &registers[regs[i]];
+    atomic_fetch_add_explicit (write ? &r->writes : &r->reads, 1,
+      memory_order_relaxed);
+    atomic_fetch_add_explicit (&r->bytes, 3, memory_order_relaxed);
+    if (!ok) atomic_fetch_add_explicit (&r->failures, 1,
+      memory_order_relaxed);
+    }
+  }
+
+/*============================================================================
+
+  ina219_stats_retry
+
+============================================================================*/
+void ina219_stats_retry (BYTE reg)
+  {
+  if (reg < INA219_STATS_NREGS)
+    atomic_fetch_add_explicit (&registers[reg].retries, 1,
+      memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  ina219_stats_missed
+
+============================================================================*/
+void ina219_stats_missed (uint64_t deadlines)
+  {
+  atomic_fetch_add_explicit (&missed, deadlines, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  ina219_stats_enabled
+
+============================================================================*/
+BOOL ina219_stats_enabled (void)
+  {
+#ifdef INA219_STATS
+  return TRUE;
+#else
+  return FALSE;
+#endif
+  }
+
+/*============================================================================
+
+  ina219_stats_get_register
+
+============================================================================*/
+void ina219_stats_get_register (int reg, INA219RegisterStats *stats)
+  {
+  memset (stats, 0, sizeof (INA219RegisterStats));
+  if (reg < 0 || reg >= INA219_STATS_NREGS) return;
+  RegisterCounters *r = &registers[reg];
+  stats->reads = atomic_load_explicit (&r->reads, memory_order_relaxed);
+  stats->writes = atomic_load_explicit (&r->writes, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit (&r->bytes, memory_order_relaxed);
+  stats->failures = atomic_load_explicit (&r->failures,
+    memory_order_relaxed);
+  stats->retries = atomic_load_explicit (&r->retries, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  ina219_stats_get_histogram
+
+  The buckets are read one at a time while other threads may be adding
+  to them, so the figures are not an exact snapshot, but they're close
+  enough for monitoring. The count is taken from the buckets, so the
+  percentiles are at least consistent with it.
+
+============================================================================*/
+void ina219_stats_get_histogram (INA219StatsHistogram hist,
+       INA219HistogramSummary *summary)
+  {
+  static uint64_t counts[BUCKETS];
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  Histogram *h = &histograms[hist];
+  memset (summary, 0, sizeof (INA219HistogramSummary));
+
+  // counts[] is too big for the stack of a small thread
+  pthread_mutex_lock (&mutex);
+  uint64_t total = 0;
+  for (int i = 0; i < BUCKETS; i++)
+    {
+    counts[i] = atomic_load_explicit (&h->buckets[i], memory_order_relaxed);
+    total += counts[i];
+    }
+  summary->count = total;
+  summary->sum_ns = atomic_load_explicit (&h->sum, memory_order_relaxed);
+  summary->max_ns = atomic_load_explicit (&h->max, memory_order_relaxed);
+
+  static const int percents[3] = { 50, 90, 99 };
+  uint64_t *results[3] =
+    { &summary->p50_ns, &summary->p90_ns, &summary->p99_ns };
+  for (int p = 0; p < 3 && total > 0; p++)
+    {
+    // The rank of the percentile, counting from 1
+    uint64_t rank = (total * percents[p] + 99) / 100;
+    uint64_t seen = 0;
+    int i = 0;
+    while (i < BUCKETS - 1 && seen + counts[i] < rank)
+      seen += counts[i++];
+    uint64_t value = stats_bucket_limit (i);
+    if (value > summary->max_ns) value = summary->max_ns;
+    *results[p] = value;
+    }
+  pthread_mutex_unlock (&mutex);
+  }
+
+/*============================================================================
+
+  ina219_stats_get_missed
+
+============================================================================*/
+uint64_t ina219_stats_get_missed (void)
+  {
+  return atomic_load_explicit (&missed, memory_order_relaxed);
+  }
+
+/*============================================================================
+
+  ina219_stats_reset
+
+============================================================================*/
+void ina219_stats_reset (void)
+  {
+  for (int h = 0; h < INA219_HIST_COUNT; h++)
+    {
+    for (int i = 0; i < BUCKETS; i++)
+      atomic_store (&histograms[h].buckets[i], 0);
+    atomic_store (&histograms[h].sum, 0);
+    atomic_store (&histograms[h].max, 0);
+    }
+  for (int r = 0; r < INA219_STATS_NREGS; r++)
+    {
+    atomic_store (&registers[r].reads, 0);
+    atomic_store (&registers[r].writes, 0);
+    atomic_store (&registers[r].bytes, 0);
+    atomic_store (&registers[r].failures, 0);
+    atomic_store (&registers[r].retries, 0);
+    }
+  atomic_store (&missed, 0);
+  }
+
+/*============================================================================
+
+  stats_write_counter
+
+============================================================================*/
+static void stats_write_counter (FILE *f, const char *name,
+       const char *help, int field)
+  {
+  fprintf (f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (int r = 0; r < INA219_STATS_NREGS; r++)
+    {
+    INA219RegisterStats stats;
+    ina219_stats_get_register (r, &stats);
+    uint64_t values[5] = { stats.reads, stats.writes, stats.bytes,
+      stats.failures, stats.retries };
+    fprintf (f, "%s{register=\"%s\"} %llu\n", name, register_names[r],
+      (unsigned long long)values[field]);
+    }
+  }
+
+/*============================================================================
+
+  ina219_stats_write_prometheus
+
+============================================================================*/
+void ina219_stats_write_prometheus (FILE *f)
+  {
+  if (!ina219_stats_enabled ())
+    fprintf (f, "# INA219 statistics were not compiled in\n");
+
+  stats_write_counter (f, "ina219_register_reads_total",
+    "Register reads", 0);
+  stats_write_counter (f, "ina219_register_writes_total",
+    "Register writes", 1);
+  stats_write_counter (f, "ina219_register_bytes_total",
+    "Bytes transferred, including register pointers", 2);
+  stats_write_counter (f, "ina219_register_failures_total",
+    "Register reads and writes that failed", 3);
+  stats_write_counter (f, "ina219_register_retries_total",
+    "Register reads and writes that were retried", 4);
+
+  for (int h = 0; h < INA219_HIST_COUNT; h++)
+    {
+    const char *name = histogram_names[h];
+    INA219HistogramSummary s;
+    ina219_stats_get_histogram (h, &s);
+    fprintf (f, "# HELP %s %s\n# TYPE %s summary\n", name,
+      histogram_help[h], name);
+    fprintf (f, "%s{quantile=\"0.5\"} %.9f\n", name, s.p50_ns / 1e9);
+    fprintf (f, "%s{quantile=\"0.9\"} %.9f\n", name, s.p90_ns / 1e9);
+    fprintf (f, "%s{quantile=\"0.99\"} %.9f\n", name, s.p99_ns / 1e9);
+    fprintf (f, "%s_sum %.9f\n", name, s.sum_ns / 1e9);
+    fprintf (f, "%s_count %llu\n", name, (unsigned long long)s.count);
+    fprintf (f, "# HELP %s_max Largest value of %s\n", name, name);
+    fprintf (f, "# TYPE %s_max gauge\n", name);
+    fprintf (f, "%s_max %.9f\n", name, s.max_ns / 1e9);
+    }
+
+  fprintf (f, "# HELP ina219_missed_deadlines_total Sampling deadlines "
+    "that were skipped\n");
+  fprintf (f, "# TYPE ina219_missed_deadlines_total counter\n");
+  fprintf (f, "ina219_missed_deadlines_total %llu\n",
+    (unsigned long long)ina219_stats_get_missed ());
+  }
+
+/*============================================================================
+
+  ina219_stats_export_file
+
+============================================================================*/
+BOOL ina219_stats_export_file (const char *file, char **error)
+  {
+  BOOL ret = FALSE;
+  char *tmp = NULL;
+  asprintf (&tmp, "%s.tmp", file);
+  FILE *f = fopen (tmp, "w");
+  if (f)
+    {
+    ina219_stats_write_prometheus (f);
+    if (fclose (f) == 0 && rename (tmp, file) == 0)
+      ret = TRUE;
+    else
+      {
+      if (error) asprintf (error, "Can't write %s: %s", file,
+        strerror (errno));
+      unlink (tmp);
+      }
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't create %s: %s", tmp,
+      strerror (errno));
+    }
+  free (tmp);
+  return ret;
+  }
+
+/*============================================================================
+
+  stats_server_respond
+
+  Whatever the request was, the answer is the metrics. We read (some
+  of) the request first, so the client doesn't see a reset.
+
+============================================================================*/
+static void stats_server_respond (int fd)
+  {
+  char request[1024];
+  struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+  if (poll (&pfd, 1, SERVER_POLL_MS) > 0)
+    {
+    ssize_t n = read (fd, request, sizeof (request));
+    (void)n;
+    }
+
+  char *body = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream (&body, &len);
+  if (!f) return;
+  ina219_stats_write_prometheus (f);
+  fclose (f);
+
+  char header[256];
+  int hlen = snprintf (header, sizeof (header), "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Content-Length: %zu\r\n\r\n", len);
+  if (write (fd, header, hlen) == hlen)
+    {
+    const char *p = body;
+    size_t left = len;
+    while (left > 0)
+      {
+      ssize_t n = write (fd, p, left);
+      if (n <= 0) break;
+      p += n;
+      left -= n;
+      }
+    }
+  free (body);
+  }
+
+/*============================================================================
+
+  stats_server_thread
+
+============================================================================*/
+static void *stats_server_thread (void *arg)
+  {
+  StatsServer *self = arg;
+  while (!atomic_load (&self->stop))
+    {
+    struct pollfd pfd = { .fd = self->fd, .events = POLLIN, .revents = 0 };
+    if (poll (&pfd, 1, SERVER_POLL_MS) <= 0) continue;
+    int client = accept4 (self->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client >= 0)
+      {
+      stats_server_respond (client);
+      close (client);
+      }
+    }
+  return NULL;
+  }
+
+/*============================================================================
+
+  stats_server_start
+
+============================================================================*/
+StatsServer *stats_server_start (int port, char **error)
+  {
+  StatsServer *self = NULL;
+  int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0)
+    {
+    int one = 1;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    struct sockaddr_in addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    addr.sin_port = htons (port);
+    if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) == 0
+         && listen (fd, 8) == 0)
+      {
+      self = malloc (sizeof (StatsServer));
+      self->fd = fd;
+      atomic_store (&self->stop, FALSE);
+      int err = pthread_create (&self->thread, NULL, stats_server_thread,
+        self);
+      if (err != 0)
+        {
+        if (error) asprintf (error, "Can't start statistics server: %s",
+          strerror (err));
+        free (self);
+        self = NULL;
+        close (fd);
+        }
+      }
+    else
+      {
+      if (error) asprintf (error, "Can't listen on port %d: %s", port,
+        strerror (errno));
+      close (fd);
+      }
+    }
+  else
+    {
+    if (error) asprintf (error, "Can't create socket: %s", strerror (errno));
+    }
+  return self;
+  }
+
+/*============================================================================
+
+  stats_server_stop
+
+============================================================================*/
+void stats_server_stop (StatsServer *self)
+  {
+  if (self)
+    {
+    atomic_store (&self->stop, TRUE);
+    pthread_join (self->thread, NULL);
+    close (self->fd);
+    free (self);
+    }
+  }
+
@@ -0,0 +1,137 @@
+/*============================================================================
+
+  stats.h
+
+  Process-wide instrumentation for the INA219 library: counters of
+  register transactions, bytes and failures, per register; latency
+  histograms for register reads and writes and for whole
+  ina219_get_status() calls; and the timing jitter of the sampling
+  loops. The figures can be read with ina219_stats_get_*(), or
+  exported in the Prometheus text format, to a file (for the node
+  exporter's textfile collector) or over HTTP.
+
+  Recording is lock-free -- a handful of relaxed atomic increments --
+  so it's safe from any thread, and cheap enough for the hot path.
+  The histograms are log-linear: each power of two is split into
+  eight linear sub-buckets, so a percentile is accurate to about 12%,
+  over a range from nanoseconds to minutes.
+
+  Instrumentation is compiled in only if INA219_STATS is defined (see
+  the Makefile). Otherwise the INA219_STATS_* macros below expand to
+  nothing, so the library code costs nothing extra, and the functions
+  here report no data.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+// The INA219 has six registers
+#define INA219_STATS_NREGS 6
+
+// The histograms
+typedef enum _INA219StatsHistogram
+  {
+  // Time taken by one transport read, which may cover several registers
+  INA219_HIST_READ = 0,
+  // Time taken by one register write
+  INA219_HIST_WRITE,
+  // Time taken by a whole ina219_get_status() call
+  INA219_HIST_STATUS,
+  // How late a sampling loop woke up, relative to its deadline
+  INA219_HIST_LATENESS,
+  // How far the interval between successive samples is from nominal
+  INA219_HIST_INTERVAL_ERROR,
+  INA219_HIST_COUNT
+  } INA219StatsHistogram;
+
+// Counters for one register
+typedef struct _INA219RegisterStats
+  {
+  uint64_t reads;
+  uint64_t writes;
+  // Including register pointer bytes, even those that the transport
+  //  didn't need to send (see transport.h)
+  uint64_t bytes;
+  uint64_t failures;
+  uint64_t retries;
+  } INA219RegisterStats;
+
+// Summary of one histogram. Times are in nanoseconds.
+typedef struct _INA219HistogramSummary
+  {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  } INA219HistogramSummary;
+
+typedef struct _StatsServer StatsServer;
+
+BEGIN_DECLS
+
+/** Functions used by the INA219_STATS_* macros. Don't call them
+    directly. */
+uint64_t ina219_stats_now (void);
+void     ina219_stats_record (INA219StatsHistogram hist, uint64_t ns);
+void     ina219_stats_registers (const BYTE *regs, int n, BOOL write,
+           BOOL ok);
+void     ina219_stats_retry (BYTE reg);
+void     ina219_stats_missed (uint64_t deadlines);
+
+/** TRUE if instrumentation was compiled in. */
+BOOL     ina219_stats_enabled (void);
+
+/** Get the counters for one register. */
+void     ina219_stats_get_register (int reg, INA219RegisterStats *stats);
+
+/** Get a summary of one histogram. */
+void     ina219_stats_get_histogram (INA219StatsHistogram hist,
+           INA219HistogramSummary *summary);
+
+/** The number of sampling deadlines that were missed completely. */
+uint64_t ina219_stats_get_missed (void);
+
+/** Set everything back to zero. Not atomic with respect to recording
+    in other threads, but nothing breaks if it happens. */
+void     ina219_stats_reset (void);
+
+/** Write all the figures in the Prometheus text exposition format. */
+void     ina219_stats_write_prometheus (FILE *f);
+
+/** Write the figures to a file, atomically, by writing a temporary
+    file and renaming it. */
+BOOL     ina219_stats_export_file (const char *file, char **error);
+
+/** Start a thread that serves the figures over HTTP, to any request,
+    on the given TCP port. */
+StatsServer *stats_server_start (int port, char **error);
+
+/** Stop the thread, and free the server. */
+void     stats_server_stop (StatsServer *self);
+
+END_DECLS
+
+#ifdef INA219_STATS
+#define INA219_STATS_START(t) uint64_t t = ina219_stats_now ()
+#define INA219_STATS_STOP(hist, t) \
+  ina219_stats_record ((hist), ina219_stats_now () - (t))
+#define INA219_STATS_RECORD(hist, ns) ina219_stats_record ((hist), (ns))
+#define INA219_STATS_REGISTERS(regs, n, write, ok) \
+  ina219_stats_registers ((regs), (n), (write), (ok))
+#define INA219_STATS_RETRY(reg) ina219_stats_retry (reg)
+#define INA219_STATS_MISSED(n) ina219_stats_missed (n)
+#else
+#define INA219_STATS_START(t)
+#define INA219_STATS_STOP(hist, t)
+#define INA219_STATS_RECORD(hist, ns)
+#define INA219_STATS_REGISTERS(regs, n, write, ok)
+#define INA219_STATS_RETRY(reg)
+#define INA219_STATS_MISSED(n)
+#endif
+
@@ -0,0 +1,141 @@
+/*==========================================================================
+
+    transport.c
+
+    Choose and open a transport implementation from a device
+    specification. See transport.h.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include "defs.h"
+#include "transport.h"
+
+/*============================================================================
+
+  ina219_transport_open
+
+============================================================================*/
+INA219Transport *ina219_transport_open (const char *spec, char **error)
+  {
+  if (strcmp (spec, "sim") == 0)
+    return ina219_transport_sim_create (NULL, error);
+  if (strncmp (spec, "sim:", 4) == 0)
+    return ina219_transport_sim_create (spec + 4, error);
+
+  if (strncmp (spec, "hwmon:", 6) == 0)
+    return ina219_transport_hwmon_create (spec + 6, FALSE, error);
+
+  // A plain /dev/i2c-N uses the kernel driver for any device that has
+  //  one, and i2c-dev for the rest
+  INA219Transport *self = ina219_transport_hwmon_create (spec, TRUE, NULL);
+  if (self) return self;
+
+  BOOL stub = (strncmp (spec, "stub:", 5) == 0);
+  const char *dev = spec;
+  if (stub) dev = spec + 5;
+  else if (strncmp (spec, "i2c-dev:", 8) == 0) dev = spec + 8;
+  int fd = open (dev, O_RDWR);
+  if (fd < 0)
+    {
+    if (error) asprintf (error, "Can't open I2C device %s: %s", dev,
+      strerror (errno));
+    return NULL;
+    }
+  return stub ? ina219_transport_stub_create (fd)
+    : ina219_transport_i2cdev_create (fd);
+  }
+
+/*============================================================================
+
+  ina219_transport_new
+
+============================================================================*/
+INA219Transport *ina219_transport_new (const INA219TransportOps *ops,
+                   void *ctx)
+  {
+  INA219Transport *self = malloc (sizeof (INA219Transport));
+  self->ops = ops;
+  self->ctx = ctx;
+  pthread_mutex_init (&self->lock, NULL);
+  return self;
+  }
+
+/*============================================================================
+
+  ina219_transport_close
+
+============================================================================*/
+void ina219_transport_close (INA219Transport *self)
+  {
+  if (self)
+    {
+    self->ops->close (self->ctx);
+    pthread_mutex_destroy (&self->lock);
+    free (self);
+    }
+  }
+
+
+/*============================================================================
+
+  ina219_transport_probe
+
+============================================================================*/
+int ina219_transport_probe (INA219Transport *self, int addr)
+  {
+  pthread_mutex_lock (&self->lock);
+  int err = self->ops->probe (self->ctx, addr);
+  pthread_mutex_unlock (&self->lock);
+  return err;
+  }
+
+/*============================================================================
+
+  ina219_transport_read_registers
+
+============================================================================*/
+int ina219_transport_read_registers (INA219Transport *self, int addr,
+      const BYTE *regs, uint16_t *values, int n)
+  {
+  pthread_mutex_lock (&self->lock);
+  int err = self->ops->read_registers (self->ctx, addr, regs, values, n);
+  pthread_mutex_unlock (&self->lock);
+  return err;
+  }
+
+/*============================================================================
+
+  ina219_transport_write_register
+
+============================================================================*/
+int ina219_transport_write_register (INA219Transport *self, int addr,
+      BYTE reg, uint16_t value)
+  {
+  pthread_mutex_lock (&self->lock);
+  int err = self->ops->write_register (self->ctx, addr, reg, value);
+  pthread_mutex_unlock (&self->lock);
+  return err;
+  }
+
+/*============================================================================
+
+  ina219_transport_forget
+
+============================================================================*/
+void ina219_transport_forget (INA219Transport *self, int addr)
+  {
+  if (!self->ops->forget) return;
+  pthread_mutex_lock (&self->lock);
+  self->ops->forget (self->ctx, addr);
+  pthread_mutex_unlock (&self->lock);
+  }
+
@@ -0,0 +1,162 @@
+/*============================================================================
+
+  transport.h
+
+  INA219Transport is the interface between the INA219 "class" and
+  whatever actually carries register reads and writes to a device. The
+  INA219 code never does I/O itself; it calls the functions in the
+  transport's ops table. There are four implementations:
+
+  - i2c-dev (transport_i2cdev.c): the real thing, using /dev/i2c-N and
+    combined I2C_RDWR transactions
+
+  - simulator (transport_sim.c): an in-process model of one or more
+    INA219s, with a register map, conversion timing that follows the
+    configuration register, and voltage and current waveforms that can
+    be scripted. This lets the library be tested and benchmarked on
+    any Linux machine
+
+  - hwmon (transport_hwmon.c): readings from the kernel's ina2xx
+    driver, for when that driver owns the chip. Addresses that have no
+    hwmon node are handed on to i2c-dev
+
+  - i2c-stub loopback (transport_stub.c): SMBus word transfers, for use
+    with the kernel's i2c-stub module, which emulates a bank of
+    registers on a fake I2C bus. This exercises the kernel's I2C stack,
+    but there is no conversion logic -- the registers just hold what
+    was written to them
+
+  ina219_transport_open() chooses an implementation from a "device
+  specification", which is what is passed as the i2c_dev argument to
+  ina219_create():
+
+    /dev/i2c-1             hwmon if the kernel driver has the device,
+                           otherwise i2c-dev
+    i2c-dev:/dev/i2c-1     i2c-dev only
+    hwmon:/dev/i2c-1       hwmon only
+    sim                    simulator, default settings
+    sim:key=value,...      simulator; see transport_sim.c for the keys
+    stub:/dev/i2c-5        i2c-stub loopback on the given bus
+
+  A transport stands for one bus, and can be shared by several INA219
+  objects with different addresses on it, and by any number of
+  threads. Each operation is carried out with the transport's lock
+  held, so the implementations need not be thread-safe themselves:
+  ina219.c calls them only through ina219_transport_read_registers()
+  and friends below, never through the ops table directly.
+
+  Because the lock is held across the whole of a read, a transport
+  can keep track of where each device's register pointer was left,
+  and the i2c-dev transport does: a read of the register that the
+  pointer is already on goes out without the pointer write, which
+  halves the bus traffic when one register is read over and over, as
+  in a burst capture. This relies on nothing else moving the pointer,
+  so a device must not be written to by another program, or another
+  transport, while it is being read through this one. A reset moves
+  it too: an INA219 that browns out, or is power-cycled, comes back
+  with its pointer on the configuration register, and says nothing
+  about it on the bus, so every read that relied on the pointer would
+  then return the configuration. The i2c-dev transport guards against
+  this by writing the pointer anyway every so often, and whenever a
+  read that relied on it returns what looks like the configuration;
+  and ina219.c tells the transport to forget the pointer (see
+  ina219_transport_forget()) when it configures or recovers a device.
+
+  Copyright (c)2020 Kevin Boone, GPL v3.0
+
+  ==========================================================================*/
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+// The most registers that a transport will be asked to read at once
+#define INA219_TRANSPORT_MAX_BATCH 8
+
+// Operations that a transport must provide. Those that can fail return
+//  zero for success, or an errno value.
+typedef struct _INA219TransportOps
+  {
+  // Name, for messages and benchmarks
+  const char *name;
+  // Check that a device can be used at this address. For i2c-dev, this
+  //  is where EBUSY shows up if a kernel driver owns the device
+  int  (*probe) (void *ctx, int addr);
+  // Read n (at most INA219_TRANSPORT_MAX_BATCH) 16-bit registers from
+  //  the device at addr, as close together in time as possible. Values
+  //  are in the chip's natural order, that is, with the most 
+  //  significant byte first on the wire
+  int  (*read_registers) (void *ctx, int addr, const BYTE *regs,
+         uint16_t *values, int n);
+  // Write one 16-bit register
+  int  (*write_register) (void *ctx, int addr, BYTE reg, uint16_t value);
+  // Free the transport's resources
+  void (*close) (void *ctx);
+  // Forget anything remembered about the state of the device at addr,
+  //  which may have been reset. NULL if the transport remembers nothing
+  void (*forget) (void *ctx, int addr);
+  } INA219TransportOps;
+
+typedef struct _INA219Transport
+  {
+  const INA219TransportOps *ops;
+  void *ctx;
+  pthread_mutex_t lock; // Held across each call to ops
+  } INA219Transport;
+
+// The simulator calls a waveform function every time a simulated
+//  conversion completes. It should set the bus voltage (in mV) and
+//  the shunt voltage (in uV) at time t_ns, which is measured in
+//  nanoseconds from the moment the simulator was created.
+typedef void (*INA219SimWaveform) (void *arg, int addr, uint64_t t_ns,
+               int *bus_mv, int *shunt_uv);
+
+BEGIN_DECLS
+
+/** Open a transport from a device specification, as described above. */
+INA219Transport *ina219_transport_open (const char *spec, char **error);
+
+/** Close the transport and free it. */
+void             ina219_transport_close (INA219Transport *self);
+
+/** Wrap an implementation's ops and context in a new transport. For
+    use by the implementations' _create() functions. */
+INA219Transport *ina219_transport_new (const INA219TransportOps *ops,
+                   void *ctx);
+
+/** Call the corresponding operation with the transport's lock held.
+    These return zero or an errno value, as the operations do. */
+int              ina219_transport_probe (INA219Transport *self, int addr);
+int              ina219_transport_read_registers (INA219Transport *self,
+                   int addr, const BYTE *regs, uint16_t *values, int n);
+int              ina219_transport_write_register (INA219Transport *self,
+                   int addr, BYTE reg, uint16_t value);
+void             ina219_transport_forget (INA219Transport *self,
+                   int addr);
+
+/** Create the i2c-dev transport on an open /dev/i2c-N descriptor, which
+    the transport then owns. */
+INA219Transport *ina219_transport_i2cdev_create (int fd);
+
+/** Create the hwmon transport for a bus, named as /dev/i2c-N. If 
+    fallback is TRUE, devices that the kernel driver doesn't have are 
+    accessed through i2c-dev. */
+INA219Transport *ina219_transport_hwmon_create (const char *i2c_dev,
+                   BOOL fallback, char **error);
+
+/** Create a simulator. "options" is the part of the specification
+    after "sim:", and may be NULL. */
+INA219Transport *ina219_transport_sim_create (const char *options,
+                   char **error);
+
+/** Replace the simulator's built-in waveform with a script. Returns
+    FALSE if the transport isn't a simulator. */
+BOOL             ina219_transport_sim_set_waveform (INA219Transport *self,
+                   INA219SimWaveform waveform, void *arg);
+
+/** Create the i2c-stub loopback transport on an open /dev/i2c-N
+    descriptor, which the transport then owns. */
+INA219Transport *ina219_transport_stub_create (int fd);
+
+END_DECLS
+
@@ -0,0 +1,451 @@
+/*==========================================================================
+
+    transport_hwmon.c
+
+    The hwmon transport: readings from the kernel's ina2xx hwmon driver,
+    for systems on which that driver has claimed the INA219. With the
+    driver loaded, the I2C_SLAVE ioctl fails with EBUSY, and we must
+    not talk to the chip behind the driver's back in any case. Instead,
+    the register values that the INA219 "class" asks for are made up
+    from the driver's sysfs attributes:
+
+      in0_input       shunt voltage, mV
+      in1_input       bus voltage, mV
+      curr1_input     current, mA
+      shunt_resistor  shunt resistance, uOhm (read once)
+
+    The shunt register is worked out from the current and the shunt
+    resistance, when the driver reports the resistance, because that
+    keeps more of the chip's resolution than the whole-millivolt
+    in0_input. The bus register gets the CNVR bit set on every read.
+    The attribute files are opened once, when the device is probed, and
+    read with pread() at offset zero, so each reading costs one system
+    call per attribute, and nothing else.
+
+    The kernel owns the chip's settings -- it programs the configuration
+    and calibration registers, and, on chips that have it, controls
+    averaging through update_interval -- so writes to those registers
+    are not passed on. Instead, the values written are remembered, and
+    the current and power registers are worked out from the calibration
+    value in the same way that the chip would, so the rest of the
+    library sees consistent results. The configuration register reads
+    back as the INA219's power-on value, which is also what the ina2xx
+    driver programs, until something else is written.
+
+    This transport is per-bus, like the others. Each address is looked
+    up in /sys/class/hwmon when it is probed; addresses that have no
+    hwmon node are passed on to an i2c-dev transport on the same bus,
+    which is opened the first time it is needed. So, by default, a
+    program uses the kernel driver where there is one, and the chip
+    directly where there isn't.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include "defs.h"
+#include "transport.h"
+
+#define HWMON_DIR "/sys/class/hwmon"
+
+// 7-bit I2C addresses
+#define HWMON_MAX_ADDR 128
+
+// Register numbers and bits, as in ina219.c
+#define CONFIG_REG  0
+#define SHUNT_REG   1
+#define BUS_REG     2
+#define POWER_REG   3
+#define CURRENT_REG 4
+#define CALIB_REG   5
+
+#define CONFIG_DEFAULT 0x399F
+#define BUS_CNVR       0x0002
+
+// One INA219 that is owned by the kernel driver
+typedef struct _HwmonDevice
+  {
+  int shunt_fd; // in0_input
+  int bus_fd; // in1_input
+  int current_fd; // curr1_input
+  int shunt_uohm; // From shunt_resistor, or 0 if not known
+  uint16_t config; // Values written, as described above
+  uint16_t calibration;
+  } HwmonDevice;
+
+typedef struct _Hwmon
+  {
+  int bus; // N in /dev/i2c-N
+  char *i2c_dev;
+  BOOL fallback_allowed; // FALSE to use hwmon only
+  HwmonDevice *devices[HWMON_MAX_ADDR];
+  INA219Transport *fallback; // i2c-dev, for devices not in hwmon
+  } Hwmon;
+
+/*============================================================================
+
+  hwmon_read_value
+
+  Read a decimal attribute from an open sysfs file. Returns 0 or an
+  errno value.
+
+============================================================================*/
+static int hwmon_read_value (int fd, long *value)
+  {
+  char buff[32];
+  ssize_t n = pread (fd, buff, sizeof (buff) - 1, 0);
+  if (n < 0) return errno;
+  if (n == 0) return EIO;
+  buff[n] = 0;
+  char *end;
+  *value = strtol (buff, &end, 10);
+  return end == buff ? EIO : 0;
+  }
+
+/*============================================================================
+
+  hwmon_open_attr
+
+============================================================================*/
+static int hwmon_open_attr (const char *dir, const char *attr)
+  {
+  char path[PATH_MAX];
+  snprintf (path, sizeof (path), "%s/%s", dir, attr);
+  return open (path, O_RDONLY | O_CLOEXEC);
+  }
+
+/*============================================================================
+
+  hwmon_find
+
+  Look for the hwmon node that belongs to the I2C client at bus-addr.
+  Its "device" link points to the client, e.g., .../i2c-1/1-0040.
+  Returns a new device, or NULL if there is no such node, or it isn't
+  an ina2xx.
+
+============================================================================*/
+static HwmonDevice *hwmon_find (int bus, int addr)
+  {
+  HwmonDevice *dev = NULL;
+  char client[32];
+  snprintf (client, sizeof (client), "%d-%04x", bus, addr);
+  DIR *d = opendir (HWMON_DIR);
+  if (!d) return NULL;
+  struct dirent *de;
+  while (!dev && (de = readdir (d)))
+    {
+    if (de->d_name[0] == '.') continue;
+    char dir[sizeof (HWMON_DIR) + sizeof (de->d_name)];
+    char path[PATH_MAX], link[PATH_MAX];
+    snprintf (dir, sizeof (dir), "%s/%s", HWMON_DIR, de->d_name);
+    snprintf (path, sizeof (path), "%s/device", dir);
+    ssize_t n = readlink (path, link, sizeof (link) - 1);
+    if (n <= 0) continue;
+    link[n] = 0;
+    const char *base = strrchr (link, '/');
+    base = base ? base + 1 : link;
+    if (strcmp (base, client) != 0) continue;
+
+    // The ina2xx driver names the node after the chip
+    int fd = hwmon_open_attr (dir, "name");
+    char name[32] = "";
+    if (fd >= 0)
+      {
+      ssize_t len = pread (fd, name, sizeof (name) - 1, 0);
+      name[len > 0 ? len : 0] = 0;
+      close (fd);
+      }
+    if (strncmp (name, "ina2", 4) != 0) continue;
+
+    HwmonDevice *found = malloc (sizeof (HwmonDevice));
+    found->shunt_fd = hwmon_open_attr (dir, "in0_input");
+    found->bus_fd = hwmon_open_attr (dir, "in1_input");
+    found->current_fd = hwmon_open_attr (dir, "curr1_input");
+    found->shunt_uohm = 0;
+    found->config = CONFIG_DEFAULT;
+    found->calibration = 0;
+    fd = hwmon_open_attr (dir, "shunt_resistor");
+    if (fd >= 0)
+      {
+      long value;
+      if (hwmon_read_value (fd, &value) == 0 && value > 0
+           && value <= INT_MAX)
+        found->shunt_uohm = (int)value;
+      close (fd);
+      }
+    if (found->shunt_fd >= 0 && found->bus_fd >= 0
+         && found->current_fd >= 0)
+      {
+      dev = found;
+      }
+    else
+      {
+      if (found->shunt_fd >= 0) close (found->shunt_fd);
+      if (found->bus_fd >= 0) close (found->bus_fd);
+      if (found->current_fd >= 0) close (found->current_fd);
+      free (found);
+      }
+    }
+  closedir (d);
+  return dev;
+  }
+
+/*============================================================================
+
+  hwmon_fallback
+
+  Get the i2c-dev transport for this bus, opening it if necessary.
+
+============================================================================*/
+static int hwmon_fallback (Hwmon *self, INA219Transport **fallback)
+  {
+  if (!self->fallback_allowed) return ENODEV;
+  if (!self->fallback)
+    {
+    int fd = open (self->i2c_dev, O_RDWR);
+    if (fd < 0) return errno;
+    self->fallback = ina219_transport_i2cdev_create (fd);
+    }
+  *fallback = self->fallback;
+  return 0;
+  }
+
+/*============================================================================
+
+  hwmon_probe
+
+============================================================================*/
+static int hwmon_probe (void *ctx, int addr)
+  {
+  Hwmon *self = ctx;
+  if (addr < 0 || addr >= HWMON_MAX_ADDR) return EINVAL;
+  if (self->devices[addr]) return 0;
+  self->devices[addr] = hwmon_find (self->bus, addr);
+  if (self->devices[addr]) return 0;
+  INA219Transport *fallback;
+  int err = hwmon_fallback (self, &fallback);
+  if (err == 0) err = fallback->ops->probe (fallback->ctx, addr);
+  return err;
+  }
+
+/*============================================================================
+
+  hwmon_read_shunt
+
+  The shunt register value, in units of 10uV.
+
+============================================================================*/
+static int hwmon_read_shunt (const HwmonDevice *dev, int32_t *shunt)
+  {
+  long value;
+  int err;
+  if (dev->shunt_uohm > 0)
+    {
+    // mA x uOhm = nV
+    err = hwmon_read_value (dev->current_fd, &value);
+    if (err == 0)
+      *shunt = (int32_t)((long long)value * dev->shunt_uohm / 10000);
+    }
+  else
+    {
+    err = hwmon_read_value (dev->shunt_fd, &value);
+    if (err == 0) *shunt = (int32_t)(value * 100);
+    }
+  if (err == 0)
+    {
+    if (*shunt > INT16_MAX) *shunt = INT16_MAX;
+    if (*shunt < INT16_MIN) *shunt = INT16_MIN;
+    }
+  return err;
+  }
+
+/*============================================================================
+
+  hwmon_read_bus
+
+  The bus register value, with CNVR set.
+
+============================================================================*/
+static int hwmon_read_bus (const HwmonDevice *dev, uint16_t *bus)
+  {
+  long mv;
+  int err = hwmon_read_value (dev->bus_fd, &mv);
+  if (err == 0)
+    {
+    if (mv < 0) mv = 0;
+    if (mv > 32767) mv = 32767;
+    *bus = (uint16_t)(((mv / 4) << 3) | BUS_CNVR);
+    }
+  return err;
+  }
+
+/*============================================================================
+
+  hwmon_read_registers
+
+  Each attribute is read at most once per batch, however many of the
+  requested registers depend on it.
+
+============================================================================*/
+static int hwmon_read_registers (void *ctx, int addr, const BYTE *regs,
+       uint16_t *values, int n)
+  {
+  Hwmon *self = ctx;
+  if (addr < 0 || addr >= HWMON_MAX_ADDR) return EINVAL;
+  const HwmonDevice *dev = self->devices[addr];
+  if (!dev)
+    {
+    INA219Transport *fallback;
+    int err = hwmon_fallback (self, &fallback);
+    if (err == 0)
+      err = fallback->ops->read_registers (fallback->ctx, addr, regs,
+        values, n);
+    return err;
+    }
+
+  int err = 0;
+  BOOL have_shunt = FALSE, have_bus = FALSE;
+  int32_t shunt = 0;
+  uint16_t bus = 0;
+  for (int i = 0; i < n && err == 0; i++)
+    {
+    BYTE reg = regs[i];
+    if ((reg == SHUNT_REG || reg == POWER_REG || reg == CURRENT_REG)
+         && !have_shunt)
+      {
+      err = hwmon_read_shunt (dev, &shunt);
+      have_shunt = TRUE;
+      }
+    if ((reg == BUS_REG || reg == POWER_REG) && !have_bus && err == 0)
+      {
+      err = hwmon_read_bus (dev, &bus);
+      have_bus = TRUE;
+      }
+    if (err) break;
+    int32_t current = shunt * dev->calibration / 4096;
+    if (current > INT16_MAX) current = INT16_MAX;
+    if (current < INT16_MIN) current = INT16_MIN;
+    switch (reg)
+      {
+      case CONFIG_REG: values[i] = dev->config; break;
+      case SHUNT_REG: values[i] = (uint16_t)(int16_t)shunt; break;
+      case BUS_REG: values[i] = bus; break;
+      case POWER_REG:
+        values[i] = (uint16_t)(abs (current) * (bus >> 3) / 5000);
+        break;
+      case CURRENT_REG: values[i] = (uint16_t)(int16_t)current; break;
+      case CALIB_REG: values[i] = dev->calibration; break;
+      default: err = EIO;
+      }
+    }
+  return err;
+  }
+
+/*============================================================================
+
+  hwmon_write_register
+
+============================================================================*/
+static int hwmon_write_register (void *ctx, int addr, BYTE reg,
+       uint16_t value)
+  {
+  Hwmon *self = ctx;
+  if (addr < 0 || addr >= HWMON_MAX_ADDR) return EINVAL;
+  HwmonDevice *dev = self->devices[addr];
+  if (!dev)
+    {
+    INA219Transport *fallback;
+    int err = hwmon_fallback (self, &fallback);
+    if (err == 0)
+      err = fallback->ops->write_register (fallback->ctx, addr, reg, value);
+    return err;
+    }
+  switch (reg)
+    {
+    case CONFIG_REG: dev->config = value & 0x7FFF; return 0;
+    case CALIB_REG: dev->calibration = value & 0xFFFE; return 0;
+    default: return EIO;
+    }
+  }
+
+/*============================================================================
+
+  hwmon_close
+
+============================================================================*/
+static void hwmon_close (void *ctx)
+  {
+  Hwmon *self = ctx;
+  for (int i = 0; i < HWMON_MAX_ADDR; i++)
+    {
+    HwmonDevice *dev = self->devices[i];
+    if (dev)
+      {
+      close (dev->shunt_fd);
+      close (dev->bus_fd);
+      close (dev->current_fd);
+      free (dev);
+      }
+    }
+  ina219_transport_close (self->fallback);
+  free (self->i2c_dev);
+  free (self);
+  }
+
+/*============================================================================
+
+  hwmon_forget
+
+  The kernel driver looks after the devices it has; only the fallback
+  can have anything to forget.
+
+============================================================================*/
+static void hwmon_forget (void *ctx, int addr)
+  {
+  Hwmon *self = ctx;
+  if (self->fallback && self->fallback->ops->forget)
+    self->fallback->ops->forget (self->fallback->ctx, addr);
+  }
+
+static const INA219TransportOps hwmon_ops =
+  {
+  "hwmon",
+  hwmon_probe,
+  hwmon_read_registers,
+  hwmon_write_register,
+  hwmon_close,
+  hwmon_forget
+  };
+
+/*============================================================================
+
+  ina219_transport_hwmon_create
+
+============================================================================*/
+INA219Transport *ina219_transport_hwmon_create (const char *i2c_dev,
+                   BOOL fallback, char **error)
+  {
+  int bus, len = 0;
+  if (sscanf (i2c_dev, "/dev/i2c-%d%n", &bus, &len) != 1
+       || i2c_dev[len] != 0)
+    {
+    if (error) asprintf (error, "Can't find the bus number in %s", i2c_dev);
+    return NULL;
+    }
+  Hwmon *hwmon = malloc (sizeof (Hwmon));
+  memset (hwmon, 0, sizeof (Hwmon));
+  hwmon->bus = bus;
+  hwmon->i2c_dev = strdup (i2c_dev);
+  hwmon->fallback_allowed = fallback;
+  return ina219_transport_new (&hwmon_ops, hwmon);
+  }
+
@@ -0,0 +1,259 @@
+/*==========================================================================
+
+    transport_i2cdev.c
+
+    The i2c-dev transport: register access through /dev/i2c-N.
+
+    Each register read is a pointer write followed by a two-byte read.
+    All the reads in a batch are sent as a single I2C_RDWR transaction,
+    in which the kernel issues a repeated start, rather than a stop,
+    between the messages. So a pointer write and its read can't be
+    split by another bus master, and the whole batch costs only one
+    system call. I2C_RDWR carries the slave address in each message,
+    so there is no I2C_SLAVE setting to switch between devices, and one
+    descriptor serves every device on the bus.
+
+    The INA219 reads whichever register its pointer was last set to,
+    so the pointer write is left out of a read when the pointer is
+    already on the register. The transport's lock (see transport.h)
+    keeps the record of each device's pointer in step with the bus.
+    The record for a device is forgotten when a transaction with it
+    fails, as there is no knowing how far the transaction got.
+
+    A device that resets puts its pointer back on the configuration
+    register without a word on the bus, so the record is not trusted
+    for more than POINTER_REFRESH reads in a row. And if a read that
+    relied on it returns the configuration -- the value last written
+    to it, or the power-on value -- the read is done again with the
+    pointer written. A genuine reading that happens to equal one of
+    those costs no more than the second read.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "defs.h"
+#include "transport.h"
+
+// 7-bit I2C addresses
+#define NUM_ADDRS 128
+
+// A device's pointer is not known
+#define NO_POINTER -1
+
+// The most reads in a row that rely on a device's recorded pointer,
+//  before the pointer is written again anyway
+#define POINTER_REFRESH 32
+
+// The configuration register, which the pointer is on after a reset,
+//  and its value after a reset (datasheet section 8.6.2.1)
+#define CONFIG_REG 0x00
+#define CONFIG_DEFAULT 0x399F
+
+typedef struct _I2cDev
+  {
+  int fd;
+  int pointer[NUM_ADDRS]; // Register each device's pointer is on
+  int reads[NUM_ADDRS]; // Reads that have relied on pointer[] since set
+  uint16_t config[NUM_ADDRS]; // Last value written to CONFIG_REG
+  } I2cDev;
+
+/*============================================================================
+
+  i2cdev_transfer
+
+============================================================================*/
+static int i2cdev_transfer (const I2cDev *self, struct i2c_msg *msgs,
+       int nmsgs)
+  {
+  struct i2c_rdwr_ioctl_data data;
+  data.msgs = msgs;
+  data.nmsgs = nmsgs;
+  int n = ioctl (self->fd, I2C_RDWR, &data);
+  if (n == nmsgs) return 0;
+  // A short count is a failure too, but errno hasn't been set for it
+  return n < 0 ? errno : EIO;
+  }
+
+/*============================================================================
+
+  i2cdev_probe
+
+  Setting I2C_SLAVE isn't needed for I2C_RDWR, but it's how we find out
+  whether a kernel driver has claimed the device (EBUSY).
+
+============================================================================*/
+static int i2cdev_probe (void *ctx, int addr)
+  {
+  I2cDev *self = ctx;
+  if (ioctl (self->fd, I2C_SLAVE, addr) >= 0) return 0;
+  return errno;
+  }
+
+/*============================================================================
+
+  i2cdev_read_once
+
+  One transaction, starting from the given pointer. Sets *relied to
+  the number of values, from the start, read without a pointer write.
+
+============================================================================*/
+static int i2cdev_read_once (I2cDev *self, int addr, int pointer,
+       const BYTE *regs, uint16_t *values, int n, int *relied)
+  {
+  BYTE ptrs[INA219_TRANSPORT_MAX_BATCH];
+  BYTE buffs[INA219_TRANSPORT_MAX_BATCH][2];
+  struct i2c_msg msgs[2 * INA219_TRANSPORT_MAX_BATCH];
+  int nmsgs = 0;
+  *relied = 0;
+  for (int i = 0; i < n; i++)
+    {
+    if (regs[i] != pointer)
+      {
+      ptrs[i] = regs[i];
+      msgs[nmsgs].addr = addr;
+      msgs[nmsgs].flags = 0;
+      msgs[nmsgs].len = 1;
+      msgs[nmsgs].buf = &ptrs[i];
+      nmsgs++;
+      pointer = regs[i];
+      }
+    else if (nmsgs == i)
+      (*relied)++;
+    msgs[nmsgs].addr = addr;
+    msgs[nmsgs].flags = I2C_M_RD;
+    msgs[nmsgs].len = 2;
+    msgs[nmsgs].buf = buffs[i];
+    nmsgs++;
+    }
+  int err = i2cdev_transfer (self, msgs, nmsgs);
+  if (err == 0)
+    {
+    for (int i = 0; i < n; i++)
+      values[i] = (buffs[i][0] << 8) | buffs[i][1];
+    self->pointer[addr] = pointer;
+    if (nmsgs > n)
+      self->reads[addr] = 0;
+    else
+      self->reads[addr] += n;
+    }
+  else
+    self->pointer[addr] = NO_POINTER;
+  return err;
+  }
+
+/*============================================================================
+
+  i2cdev_read_registers
+
+============================================================================*/
+static int i2cdev_read_registers (void *ctx, int addr, const BYTE *regs,
+       uint16_t *values, int n)
+  {
+  I2cDev *self = ctx;
+  assert (n > 0 && n <= INA219_TRANSPORT_MAX_BATCH);
+  assert (addr >= 0 && addr < NUM_ADDRS);
+  int pointer = self->reads[addr] < POINTER_REFRESH
+    ? self->pointer[addr] : NO_POINTER;
+  int relied;
+  int err = i2cdev_read_once (self, addr, pointer, regs, values, n,
+    &relied);
+  if (err != 0 || pointer == CONFIG_REG) return err;
+
+  // Did the device read out its configuration where it shouldn't have?
+  for (int i = 0; i < relied; i++)
+    {
+    if (values[i] == self->config[addr] || values[i] == CONFIG_DEFAULT)
+      return i2cdev_read_once (self, addr, NO_POINTER, regs, values, n,
+        &relied);
+    }
+  return 0;
+  }
+
+/*============================================================================
+
+  i2cdev_write_register
+
+  The register number, then the value, most significant byte first,
+  all in one message. This leaves the pointer on the register.
+
+============================================================================*/
+static int i2cdev_write_register (void *ctx, int addr, BYTE reg,
+       uint16_t value)
+  {
+  I2cDev *self = ctx;
+  assert (addr >= 0 && addr < NUM_ADDRS);
+  BYTE buff[3];
+  buff[0] = reg;
+  buff[1] = value >> 8;
+  buff[2] = value & 0xFF;
+  struct i2c_msg msg = { .addr = addr, .flags = 0, .len = 3, .buf = buff };
+  int err = i2cdev_transfer (self, &msg, 1);
+  self->pointer[addr] = err == 0 ? reg : NO_POINTER;
+  self->reads[addr] = 0;
+  if (err == 0 && reg == CONFIG_REG) self->config[addr] = value;
+  return err;
+  }
+
+/*============================================================================
+
+  i2cdev_forget
+
+============================================================================*/
+static void i2cdev_forget (void *ctx, int addr)
+  {
+  I2cDev *self = ctx;
+  assert (addr >= 0 && addr < NUM_ADDRS);
+  self->pointer[addr] = NO_POINTER;
+  }
+
+/*============================================================================
+
+  i2cdev_close
+
+============================================================================*/
+static void i2cdev_close (void *ctx)
+  {
+  I2cDev *self = ctx;
+  if (self->fd >= 0) close (self->fd);
+  free (self);
+  }
+
+static const INA219TransportOps i2cdev_ops =
+  {
+  "i2c-dev",
+  i2cdev_probe,
+  i2cdev_read_registers,
+  i2cdev_write_register,
+  i2cdev_close,
+  i2cdev_forget
+  };
+
+/*============================================================================
+
+  ina219_transport_i2cdev_create
+
+============================================================================*/
+INA219Transport *ina219_transport_i2cdev_create (int fd)
+  {
+  I2cDev *dev = malloc (sizeof (I2cDev));
+  dev->fd = fd;
+  for (int i = 0; i < NUM_ADDRS; i++)
+    {
+    dev->pointer[i] = NO_POINTER;
+    dev->reads[i] = 0;
+    dev->config[i] = CONFIG_DEFAULT;
+    }
+  return ina219_transport_new (&i2cdev_ops, dev);
+  }
+
@@ -0,0 +1,541 @@
+/*==========================================================================
+
+    transport_sim.c
+
+    A simulated INA219, or a whole bus of them. Each address that is
+    used gets its own register map, which behaves like the real chip's
+    as closely as matters to this library:
+
+    - the configuration register powers up as 0x399F, and setting bit
+      15 resets the device
+
+    - conversions take as long as the ADC settings in the configuration
+      register say they should (table 5, page 27 of the datasheet), in
+      continuous and triggered modes; in the power-down and ADC-off
+      modes the registers just keep their last values
+
+    - at the end of each conversion the shunt and bus registers are
+      updated, clipped to the PGA and bus ranges, the current and power
+      registers are worked out from the calibration register, and the
+      CNVR bit is set. Reading the power register clears CNVR; OVF is
+      set when the current or power calculation overflows
+
+    The voltages that are "measured" come from a waveform function,
+    which is called once per conversion. The built-in waveform is a
+    battery whose voltage falls (or rises) linearly, drawing a constant
+    current with optional sine-wave ripple and random noise. Its
+    parameters are given as a comma-separated list in the device
+    specification, e.g., "sim:bus=7400,current=-500,ripple=50":
+
+      bus=MV          initial bus voltage, default 7400
+      slope=MV        change in bus voltage per hour, default 0
+      current=MA      battery current (positive = charging), default 0
+      shunt=MOHM      shunt resistance, default 100
+      ripple=MA       amplitude of the current ripple, default 0
+      period=MS       period of the current ripple, default 1000
+      noise=MA        peak random noise on the current, default 0
+      latency=US      bus time taken by each transaction, default 0
+      errors=N        fail N transactions in 1000, at random, with 
+                      EREMOTEIO (no acknowledge), default 0
+      uptime=MS       with outage, answer for this long ...
+      outage=MS       ... then fail everything with ENXIO for this 
+                      long, and so on; default 0, for no outages
+
+    Outages are timed from CLOCK_MONOTONIC, not from when the simulator
+    was created, so a simulator that is opened again during an outage
+    is still in it. After an outage, the devices come back with their
+    power-on settings, as a chip does after a brown-out.
+
+    A program can replace the built-in waveform with its own by calling
+    ina219_transport_sim_set_waveform().
+
+    The latency is spent busy-waiting, because sleeping for a few tens
+    of microseconds is much less precise, and the point of it is to
+    make benchmarks on the simulator reflect the cost of bus time.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include "defs.h"
+#include "transport.h"
+
+// 7-bit I2C addresses
+#define SIM_MAX_ADDR 128
+
+// Register numbers and bits, as in ina219.c
+#define CONFIG_REG  0
+#define SHUNT_REG   1
+#define BUS_REG     2
+#define POWER_REG   3
+#define CURRENT_REG 4
+#define CALIB_REG   5
+#define NUM_REGS    6
+
+#define CONFIG_DEFAULT 0x399F
+#define CONFIG_RESET   0x8000
+#define BUS_CNVR       0x0002
+#define BUS_OVF        0x0001
+
+typedef struct _SimDevice
+  {
+  uint16_t regs[NUM_REGS];
+  BOOL converting; // A triggered conversion is in progress
+  uint64_t next_done_ns; // When the next conversion will complete
+  } SimDevice;
+
+typedef struct _Sim
+  {
+  SimDevice *devices[SIM_MAX_ADDR];
+  uint64_t epoch_ns; // Waveform time is measured from here
+  INA219SimWaveform waveform;
+  void *arg;
+  // Parameters of the built-in waveform
+  int bus_mv;
+  int slope_mv;
+  int current_ma;
+  int shunt_mohm;
+  int ripple_ma;
+  int period_ms;
+  int noise_ma;
+  int latency_us;
+  uint32_t random; // State of the noise generator
+  // Fault injection
+  int errors; // Per thousand transactions
+  int uptime_ms;
+  int outage_ms;
+  BOOL was_out; // The last transaction was in an outage
+  uint32_t fault_random;
+  } Sim;
+
+/*============================================================================
+
+  sim_now_ns
+
+============================================================================*/
+static uint64_t sim_now_ns (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+/*============================================================================
+
+  sim_builtin_waveform
+
+============================================================================*/
+static void sim_builtin_waveform (void *arg, int addr, uint64_t t_ns,
+       int *bus_mv, int *shunt_uv)
+  {
+  (void)addr;
+  Sim *self = arg;
+  double t = t_ns / 1e9;
+  double ma = self->current_ma;
+  if (self->ripple_ma && self->period_ms > 0)
+    ma += self->ripple_ma * sin (2 * M_PI * t * 1000 / self->period_ms);
+  if (self->noise_ma)
+    {
+    // xorshift32 -- we want cheap, repeatable noise, not good randomness
+    uint32_t x = self->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->random = x;
+    ma += self->noise_ma * ((double)x / UINT32_MAX * 2 - 1);
+    }
+  *bus_mv = self->bus_mv + (int)(self->slope_mv * t / 3600);
+  *shunt_uv = (int)lrint (ma * self->shunt_mohm);
+  }
+
+/*============================================================================
+
+  sim_conversion_time_ns
+
+  Conversion time for the settings in a configuration register value,
+  or zero if the mode doesn't do conversions.
+
+============================================================================*/
+static uint64_t sim_conversion_time_ns (uint16_t config)
+  {
+  static const int times[16] =
+    {
+    84, 148, 276, 532, 84, 148, 276, 532,
+    532, 1060, 2130, 4260, 8510, 17020, 34050, 68100
+    };
+  int us = 0;
+  if (config & 1) us += times[(config >> 3) & 0x0F];
+  if (config & 2) us += times[(config >> 7) & 0x0F];
+  return us * 1000ULL;
+  }
+
+/*============================================================================
+
+  sim_convert
+
+  Complete a conversion that finished at time t_ns.
+
+============================================================================*/
+static void sim_convert (Sim *self, SimDevice *dev, int addr, uint64_t t_ns)
+  {
+  uint16_t config = dev->regs[CONFIG_REG];
+  int bus_mv = 0, shunt_uv = 0;
+  self->waveform (self->arg, addr, t_ns - self->epoch_ns, &bus_mv,
+    &shunt_uv);
+
+  if (config & 1)
+    {
+    int limit = 4000 << ((config >> 11) & 3); // PGA range, in 10uV units
+    int shunt = shunt_uv / 10;
+    if (shunt > limit) shunt = limit;
+    if (shunt < -limit) shunt = -limit;
+    dev->regs[SHUNT_REG] = (uint16_t)(int16_t)shunt;
+    }
+
+  uint16_t bus = dev->regs[BUS_REG] & 0xFFF8;
+  if (config & 2)
+    {
+    int max_mv = (config & 0x2000) ? 32000 : 16000;
+    if (bus_mv > max_mv) bus_mv = max_mv;
+    if (bus_mv < 0) bus_mv = 0;
+    bus = (uint16_t)((bus_mv / 4) << 3);
+    }
+
+  BOOL ovf = FALSE;
+  int32_t current = (int32_t)(int16_t)dev->regs[SHUNT_REG]
+    * dev->regs[CALIB_REG] / 4096;
+  if (current > INT16_MAX) { current = INT16_MAX; ovf = TRUE; }
+  if (current < INT16_MIN) { current = INT16_MIN; ovf = TRUE; }
+  int32_t power = abs (current) * (bus >> 3) / 5000;
+  if (power > 0xFFFF) { power = 0xFFFF; ovf = TRUE; }
+  dev->regs[CURRENT_REG] = (uint16_t)(int16_t)current;
+  dev->regs[POWER_REG] = (uint16_t)power;
+  dev->regs[BUS_REG] = bus | BUS_CNVR | (ovf ? BUS_OVF : 0);
+  }
+
+/*============================================================================
+
+  sim_update
+
+  Bring a device's registers up to date, by completing any conversion
+  that would have finished by now. In continuous mode, conversions
+  that nobody read are skipped, as they are on the chip.
+
+============================================================================*/
+static void sim_update (Sim *self, SimDevice *dev, int addr, uint64_t now)
+  {
+  uint16_t config = dev->regs[CONFIG_REG];
+  uint64_t conv = sim_conversion_time_ns (config);
+  if (conv == 0 || now < dev->next_done_ns) return;
+  if (config & 4)
+    {
+    uint64_t t = dev->next_done_ns
+      + (now - dev->next_done_ns) / conv * conv;
+    sim_convert (self, dev, addr, t);
+    dev->next_done_ns = t + conv;
+    }
+  else if (dev->converting)
+    {
+    sim_convert (self, dev, addr, dev->next_done_ns);
+    dev->converting = FALSE;
+    }
+  }
+
+/*============================================================================
+
+  sim_reset
+
+============================================================================*/
+static void sim_reset (SimDevice *dev, uint64_t now)
+  {
+  memset (dev, 0, sizeof (SimDevice));
+  dev->regs[CONFIG_REG] = CONFIG_DEFAULT;
+  dev->next_done_ns = now + sim_conversion_time_ns (CONFIG_DEFAULT);
+  }
+
+/*============================================================================
+
+  sim_device
+
+  Get the device at an address, creating it if this is the first time
+  it has been used. A new device has done one conversion, like a chip
+  that has been powered up for a while.
+
+============================================================================*/
+static SimDevice *sim_device (Sim *self, int addr, uint64_t now)
+  {
+  if (addr < 0 || addr >= SIM_MAX_ADDR) return NULL;
+  SimDevice *dev = self->devices[addr];
+  if (!dev)
+    {
+    dev = malloc (sizeof (SimDevice));
+    sim_reset (dev, now);
+    sim_convert (self, dev, addr, now);
+    self->devices[addr] = dev;
+    }
+  return dev;
+  }
+
+/*============================================================================
+
+  sim_bus_time
+
+  Spend the simulated bus time for one transaction, and return the
+  time at which the transaction happened.
+
+============================================================================*/
+static uint64_t sim_bus_time (const Sim *self)
+  {
+  uint64_t now = sim_now_ns ();
+  if (self->latency_us > 0)
+    {
+    uint64_t until = now + self->latency_us * 1000ULL;
+    while ((now = sim_now_ns ()) < until)
+      ;
+    }
+  return now;
+  }
+
+/*============================================================================
+
+  sim_fault
+
+  Decide whether a transaction at time "now" fails, as set by the 
+  errors, uptime, and outage options. Returns zero or an errno value.
+
+============================================================================*/
+static int sim_fault (Sim *self, uint64_t now)
+  {
+  if (self->uptime_ms > 0 && self->outage_ms > 0)
+    {
+    uint64_t up_ns = self->uptime_ms * 1000000ULL;
+    uint64_t cycle_ns = up_ns + self->outage_ms * 1000000ULL;
+    if (now % cycle_ns >= up_ns)
+      {
+      self->was_out = TRUE;
+      return ENXIO;
+      }
+    if (self->was_out)
+      {
+      for (int i = 0; i < SIM_MAX_ADDR; i++)
+        if (self->devices[i]) sim_reset (self->devices[i], now);
+      self->was_out = FALSE;
+      }
+    }
+  if (self->errors > 0)
+    {
+    // xorshift32, as for the noise, but with its own state
+    uint32_t x = self->fault_random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->fault_random = x;
+    if ((int)(x % 1000) < self->errors) return EREMOTEIO;
+    }
+  return 0;
+  }
+
+/*============================================================================
+
+  sim_probe
+
+============================================================================*/
+static int sim_probe (void *ctx, int addr)
+  {
+  Sim *self = ctx;
+  uint64_t now = sim_now_ns ();
+  int err = sim_fault (self, now);
+  if (err) return err;
+  return sim_device (self, addr, now) ? 0 : ENXIO;
+  }
+
+/*============================================================================
+
+  sim_read_registers
+
+============================================================================*/
+static int sim_read_registers (void *ctx, int addr, const BYTE *regs,
+       uint16_t *values, int n)
+  {
+  Sim *self = ctx;
+  uint64_t now = sim_bus_time (self);
+  int err = sim_fault (self, now);
+  if (err) return err;
+  SimDevice *dev = sim_device (self, addr, now);
+  if (!dev) return ENXIO;
+  sim_update (self, dev, addr, now);
+  for (int i = 0; i < n; i++)
+    {
+    if (regs[i] >= NUM_REGS) return EIO;
+    values[i] = dev->regs[regs[i]];
+    if (regs[i] == POWER_REG) dev->regs[BUS_REG] &= ~BUS_CNVR;
+    }
+  return 0;
+  }
+
+/*============================================================================
+
+  sim_write_register
+
+  Writing the configuration register starts a new conversion, in
+  either mode.
+
+============================================================================*/
+static int sim_write_register (void *ctx, int addr, BYTE reg,
+       uint16_t value)
+  {
+  Sim *self = ctx;
+  uint64_t now = sim_bus_time (self);
+  int err = sim_fault (self, now);
+  if (err) return err;
+  SimDevice *dev = sim_device (self, addr, now);
+  if (!dev) return ENXIO;
+  sim_update (self, dev, addr, now);
+  switch (reg)
+    {
+    case CONFIG_REG:
+      if (value & CONFIG_RESET)
+        {
+        sim_reset (dev, now);
+        }
+      else
+        {
+        dev->regs[CONFIG_REG] = value;
+        dev->next_done_ns = now + sim_conversion_time_ns (value);
+        dev->converting = (value & 4) == 0
+          && sim_conversion_time_ns (value) > 0;
+        }
+      break;
+    case CALIB_REG:
+      dev->regs[CALIB_REG] = value & 0xFFFE;
+      break;
+    default:
+      return EIO; // The measurement registers are read-only
+    }
+  return 0;
+  }
+
+/*============================================================================
+
+  sim_close
+
+============================================================================*/
+static void sim_close (void *ctx)
+  {
+  Sim *self = ctx;
+  for (int i = 0; i < SIM_MAX_ADDR; i++)
+    free (self->devices[i]);
+  free (self);
+  }
+
+static const INA219TransportOps sim_ops =
+  {
+  "sim",
+  sim_probe,
+  sim_read_registers,
+  sim_write_register,
+  sim_close,
+  NULL
+  };
+
+/*============================================================================
+
+  sim_parse_options
+
+============================================================================*/
+static BOOL sim_parse_options (Sim *self, const char *options, char **error)
+  {
+  static const struct { const char *key; size_t offset; } keys[] =
+    {
+    { "bus", offsetof (Sim, bus_mv) },
+    { "slope", offsetof (Sim, slope_mv) },
+    { "current", offsetof (Sim, current_ma) },
+    { "shunt", offsetof (Sim, shunt_mohm) },
+    { "ripple", offsetof (Sim, ripple_ma) },
+    { "period", offsetof (Sim, period_ms) },
+    { "noise", offsetof (Sim, noise_ma) },
+    { "latency", offsetof (Sim, latency_us) },
+    { "errors", offsetof (Sim, errors) },
+    { "uptime", offsetof (Sim, uptime_ms) },
+    { "outage", offsetof (Sim, outage_ms) },
+    };
+  BOOL ret = TRUE;
+  char *copy = strdup (options);
+  char *save = NULL;
+  for (char *tok = strtok_r (copy, ",", &save); tok && ret;
+        tok = strtok_r (NULL, ",", &save))
+    {
+    char *eq = strchr (tok, '=');
+    BOOL found = FALSE;
+    if (eq)
+      {
+      *eq = 0;
+      for (size_t i = 0; i < sizeof (keys) / sizeof (keys[0]); i++)
+        {
+        if (strcmp (tok, keys[i].key) == 0)
+          {
+          *(int *)((char *)self + keys[i].offset) = atoi (eq + 1);
+          found = TRUE;
+          }
+        }
+      }
+    if (!found)
+      {
+      if (error) asprintf (error, "Bad simulator option: %s", tok);
+      ret = FALSE;
+      }
+    }
+  free (copy);
+  return ret;
+  }
+
+/*============================================================================
+
+  ina219_transport_sim_create
+
+============================================================================*/
+INA219Transport *ina219_transport_sim_create (const char *options,
+                   char **error)
+  {
+  Sim *sim = malloc (sizeof (Sim));
+  memset (sim, 0, sizeof (Sim));
+  sim->epoch_ns = sim_now_ns ();
+  sim->waveform = sim_builtin_waveform;
+  sim->arg = sim;
+  sim->bus_mv = 7400;
+  sim->shunt_mohm = 100;
+  sim->period_ms = 1000;
+  sim->random = 2463534242U;
+  sim->fault_random = 88675123U;
+  if (options && !sim_parse_options (sim, options, error))
+    {
+    sim_close (sim);
+    return NULL;
+    }
+  return ina219_transport_new (&sim_ops, sim);
+  }
+
+/*============================================================================
+
+  ina219_transport_sim_set_waveform
+
+============================================================================*/
+BOOL ina219_transport_sim_set_waveform (INA219Transport *self,
+       INA219SimWaveform waveform, void *arg)
+  {
+  if (self->ops != &sim_ops) return FALSE;
+  Sim *sim = self->ctx;
+  sim->waveform = waveform;
+  sim->arg = arg;
+  return TRUE;
+  }
+
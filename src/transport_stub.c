@@ -0,0 +1,158 @@
+/*==========================================================================
+
+    transport_stub.c
+
+    The i2c-stub loopback transport. The kernel's i2c-stub module
+    creates a fake I2C bus with a bank of registers at chosen addresses,
+    e.g.,
+
+      modprobe i2c-stub chip_addr=0x40
+
+    It only understands SMBus transfers, not the plain I2C messages
+    that the i2c-dev transport uses, so this transport reads and writes
+    one register at a time with SMBus word transfers. SMBus sends words
+    least significant byte first, while the INA219 sends them most
+    significant byte first, so the bytes are swapped on the way in and
+    out; a real INA219 on a real bus would read correctly through this
+    transport too, albeit without batching.
+
+    The stub has no conversion logic, so the registers just hold what
+    was written to them -- a test has to write (e.g., with i2cset)
+    whatever shunt and bus values it wants the library to see.
+
+    Copyright (c)2020 Kevin Boone, GPL v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "defs.h"
+#include "transport.h"
+
+typedef struct _Stub
+  {
+  int fd;
+  int addr; // Address currently set with I2C_SLAVE, or -1
+  } Stub;
+
+/*============================================================================
+
+  stub_set_addr
+
+============================================================================*/
+static int stub_set_addr (Stub *self, int addr)
+  {
+  if (self->addr == addr) return 0;
+  if (ioctl (self->fd, I2C_SLAVE, addr) < 0) return errno;
+  self->addr = addr;
+  return 0;
+  }
+
+/*============================================================================
+
+  stub_smbus
+
+============================================================================*/
+static int stub_smbus (Stub *self, char read_write, BYTE command,
+       union i2c_smbus_data *data)
+  {
+  struct i2c_smbus_ioctl_data args;
+  args.read_write = read_write;
+  args.command = command;
+  args.size = I2C_SMBUS_WORD_DATA;
+  args.data = data;
+  if (ioctl (self->fd, I2C_SMBUS, &args) < 0) return errno;
+  return 0;
+  }
+
+/*============================================================================
+
+  stub_probe
+
+============================================================================*/
+static int stub_probe (void *ctx, int addr)
+  {
+  return stub_set_addr (ctx, addr);
+  }
+
+/*============================================================================
+
+  stub_read_registers
+
+============================================================================*/
+static int stub_read_registers (void *ctx, int addr, const BYTE *regs,
+       uint16_t *values, int n)
+  {
+  Stub *self = ctx;
+  int err = stub_set_addr (self, addr);
+  for (int i = 0; i < n && err == 0; i++)
+    {
+    union i2c_smbus_data data;
+    err = stub_smbus (self, I2C_SMBUS_READ, regs[i], &data);
+    if (err == 0)
+      values[i] = (uint16_t)((data.word >> 8) | (data.word << 8));
+    }
+  return err;
+  }
+
+/*============================================================================
+
+  stub_write_register
+
+============================================================================*/
+static int stub_write_register (void *ctx, int addr, BYTE reg,
+       uint16_t value)
+  {
+  Stub *self = ctx;
+  int err = stub_set_addr (self, addr);
+  if (err == 0)
+    {
+    union i2c_smbus_data data;
+    data.word = (uint16_t)((value >> 8) | (value << 8));
+    err = stub_smbus (self, I2C_SMBUS_WRITE, reg, &data);
+    }
+  return err;
+  }
+
+/*============================================================================
+
+  stub_close
+
+============================================================================*/
+static void stub_close (void *ctx)
+  {
+  Stub *self = ctx;
+  if (self->fd >= 0) close (self->fd);
+  free (self);
+  }
+
+static const INA219TransportOps stub_ops =
+  {
+  "i2c-stub",
+  stub_probe,
+  stub_read_registers,
+  stub_write_register,
+  stub_close,
+  NULL
+  };
+
+/*============================================================================
+
+  ina219_transport_stub_create
+
+============================================================================*/
+INA219Transport *ina219_transport_stub_create (int fd)
+  {
+  Stub *stub = malloc (sizeof (Stub));
+  stub->fd = fd;
+  stub->addr = -1;
+  return ina219_transport_new (&stub_ops, stub);
+  }
+